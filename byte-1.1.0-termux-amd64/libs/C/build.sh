@@ -0,0 +1,32 @@
+#!/bin/sh
+# بازسازی ماژول‌های C در همین پوشه (libs/C)
+# روی Termux:  pkg install clang openssl zlib  و بعد  sh build.sh [نام ...]
+# بدون نام همه ساخته می‌شوند. CC، CFLAGS و OUT (پوشه‌ی خروجی) قابل تغییرند.
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+OUT=${OUT:-.}
+LUA_SRC=../../src
+
+build() {
+    name=$1; shift
+    echo "[*] $name.so"
+    $CC -shared -fPIC $CFLAGS -I$LUA_SRC -I. -o "$OUT/$name.so" "$@"
+}
+
+one() {
+    case $1 in
+        json)        build json source_libs/json.c ;;
+        httpx)       build httpx source_libs/httpx.c -lssl -lcrypto -lz -lpthread -lm ;;
+        netsocket)   build netsocket source_libs/netsocket.c -lssl -lcrypto -lpthread ;;
+        portscanner) build portscanner source_libs/portscanner.c -lssl -lcrypto -lpthread -lm ;;
+        image)       build image source_image/image.c -lm -lpthread ;;
+        hashcrack)   build hashcrack source_libs/hashcrack.c -lssl -lcrypto ;;
+        *) echo "unknown module: $1" >&2; exit 1 ;;
+    esac
+}
+
+if [ $# -eq 0 ]; then set -- json httpx netsocket portscanner image hashcrack; fi
+for m in "$@"; do one "$m"; done
+echo "[+] done"
@@ -4,16 +4,27 @@
  * آخرین به‌روزرسانی: بدون خطا و آماده کامپایل
  */
 
+#define _GNU_SOURCE
 #include <../../src/lua.h>
 #include <../../src/lauxlib.h>
 #include <../../src/lualib.h>
 #include <math.h>
+#include <complex.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
 #include <time.h>
 #include <float.h>
+#include <limits.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // غیرفعال کردن اعلان‌های دیباگ stb (برای جلوگیری از warning)
 #define STBIR__DEBUG_ASSERT(exp) ((void)0)
@@ -30,8 +41,11 @@
 #include "stb_image_resize.h"
 
 // ================== تنظیمات ==================
-#define MAX_THREADS 4
+#define POOL_MAX_THREADS 64      // سقف رشته‌های pool
+#define POOL_MIN_PIXELS 65536    // تصویر کوچک‌تر بدون رشته اجرا می‌شود
+#define POOL_GRAIN_PIXELS 16384  // کمترین اندازه‌ی هر tile
 #define PI 3.14159265358979323846
+#define IMAGE_MT "image.Image"
 
 // ================== ساختارهای اصلی ==================
 typedef struct {
@@ -55,7 +69,7 @@ typedef struct {
 } Line;
 
 typedef struct {
-    float* kernel;
+    short* kernel;               // یک‌بعدی، Q14
     int size;
     float sigma;
 } Kernel;
@@ -113,114 +127,630 @@ static Image img_copy(Image src) {
 }
 
 // ================== توابع Thread Pool ==================
+/*
+ * pool دائمی: workerها با اولین parallel_for ساخته می‌شوند و تا پایان پروسه می‌مانند.
+ * تعداد پیش‌فرض = CPUهای آنلاین (یا BYTE_IMAGE_THREADS)، قابل تغییر با image.set_threads.
+ * فراخوان خودش هم کار می‌کند، پس n رشته یعنی n-1 worker.
+ *
+ * هر parallel_range یک PoolJob است: بازه‌ی [0, count) به tileها تقسیم و بین slotها پخش
+ * می‌شود؛ slot آخر مال فراخوان است و هر worker که به کار می‌پیوندد یکی از بقیه را می‌گیرد.
+ * هر slot بازه‌ی tileهای خودش را از جلو برمی‌دارد و وقتی خالی شد نیمه‌ی انتهایی بازه‌ی
+ * slot دیگری را می‌دزدد (work stealing)؛ هر بازه یک کلمه‌ی 64 بیتی است و با CAS عوض
+ * می‌شود. چند lua_State می‌توانند هم‌زمان کار بفرستند: کارها در یک صف‌اند و هر فراخوان
+ * تا پایان کار خودش منتظر می‌ماند.
+ *
+ * parallel_for همین روی ردیف‌های تصویر است؛ تصویر کوچک (کمتر از POOL_MIN_PIXELS)
+ * بی‌درنگ روی همان رشته اجرا می‌شود و هر tile دست‌کم POOL_GRAIN_PIXELS پیکسل دارد.
+ */
+typedef void (*RangeFunc)(int begin, int end, void* args);
+typedef void (*RowFunc)(Image*, Image*, int, int, void*);
+
+typedef struct PoolJob {
+    RangeFunc func;
+    void* args;
+    int count, tile, nslots;
+    uint64_t* range;             // هر slot: begin در 32 بیت بالا، end در پایین (واحد: tile)
+    int left;                    // tileهای تمام‌نشده (atomic)
+    int joined;                  // slotهای واگذارشده به workerها (با pool.mu)
+    int active;                  // workerهای مشغول این کار (با pool.mu)
+    struct PoolJob* next;
+} PoolJob;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t work;         // کار تازه در صف
+    pthread_cond_t done;         // پایان tileهای یک کار یا خروج یک worker
+    PoolJob* head;
+    int want;                    // رشته‌های درخواستی؛ 0 = خودکار
+    int workers;                 // workerهای نسل جاری
+    int generation;              // با set_threads بالا می‌رود؛ workerهای نسل قبل در اولین بیکاری خارج می‌شوند
+    int atfork;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           NULL, 0, 0, 0, 0 };
+
+static int pool_size(void) {
+    int n = pool.want;
+    if (n <= 0) {
+        const char* env = getenv("BYTE_IMAGE_THREADS");
+        n = env ? atoi(env) : 0;
+        if (n <= 0) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) n = 1;
+    if (n > POOL_MAX_THREADS) n = POOL_MAX_THREADS;
+    return n;
+}
+
+static uint64_t range_pack(uint32_t b, uint32_t e) { return (uint64_t)b << 32 | e; }
+
+// یک tile از جلوی slot خودش؛ -1 اگر خالی است
+static int range_pop(uint64_t* r) {
+    uint64_t v = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t b = v >> 32, e = (uint32_t)v;
+        if (b >= e) return -1;
+        if (__atomic_compare_exchange_n(r, &v, range_pack(b + 1, e), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (int)b;
+    }
+}
+
+// نیمه‌ی انتهایی slot دیگری را به slot خودی (که خالی است) منتقل می‌کند
+static int range_steal(PoolJob* job, int self) {
+    for (int k = 1; k < job->nslots; k++) {
+        uint64_t* r = &job->range[(self + k) % job->nslots];
+        uint64_t v = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint32_t b = v >> 32, e = (uint32_t)v;
+            if (b >= e) break;
+            uint32_t m = b + (e - b) / 2;
+            if (__atomic_compare_exchange_n(r, &v, range_pack(b, m), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&job->range[self], range_pack(m, e), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void pool_run(PoolJob* job, int self) {
+    for (;;) {
+        int t = range_pop(&job->range[self]);
+        if (t < 0) {
+            if (!range_steal(job, self)) return;
+            continue;
+        }
+        int b = t * job->tile;
+        int e = b + job->tile < job->count ? b + job->tile : job->count;
+        job->func(b, e, job->args);
+        if (__atomic_sub_fetch(&job->left, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool.mu);
+            pthread_cond_broadcast(&pool.done);
+            pthread_mutex_unlock(&pool.mu);
+        }
+    }
+}
+
+static void pool_unlink(PoolJob* job) {
+    for (PoolJob** pp = &pool.head; *pp; pp = &(*pp)->next)
+        if (*pp == job) { *pp = job->next; break; }
+}
+
+// اولین کاری که slot آزاد دارد
+static PoolJob* pool_next(void) {
+    PoolJob* job = pool.head;
+    while (job && job->joined >= job->nslots - 1) job = job->next;
+    return job;
+}
+
+static void* pool_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool.mu);
+    int gen = pool.generation;
+    for (;;) {
+        PoolJob* job;
+        while (!(job = pool_next()) && gen == pool.generation) pthread_cond_wait(&pool.work, &pool.mu);
+        if (gen != pool.generation) break;
+        int self = job->joined++;
+        job->active++;
+        pthread_mutex_unlock(&pool.mu);
+        pool_run(job, self);
+        pthread_mutex_lock(&pool.mu);
+        pool_unlink(job);                        // tileی نمانده که بشود برداشت
+        if (--job->active == 0) pthread_cond_broadcast(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.mu);
+    return NULL;
+}
+
+// بعد از fork در فرزند هیچ workerی وجود ندارد
+static void pool_atfork_child(void) {
+    pthread_mutex_init(&pool.mu, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.head = NULL;
+    pool.workers = 0;
+}
+
+/*
+ * workerها تا پایان پروسه زنده‌اند؛ اگر lua_close ماژول را dlclose کند، کد
+ * آن‌ها از حافظه حذف می‌شود. با RTLD_NODELETE ماژول بارگذاری‌شده می‌ماند.
+ */
+static void pool_pin_module(void) {
+    Dl_info info;
+    if (dladdr((void*)pool_worker, &info) && info.dli_fname)
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+}
+
+// با pool.mu؛ workerهای کم را می‌سازد و تعداد رشته‌های قابل استفاده را برمی‌گرداند
+static int pool_start(void) {
+    if (!pool.atfork) { pthread_atfork(NULL, NULL, pool_atfork_child); pool_pin_module(); pool.atfork = 1; }
+    int n = pool_size();
+    while (pool.workers < n - 1) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, pool_worker, NULL) != 0) break;
+        pthread_detach(t);
+        pool.workers++;
+    }
+    return pool.workers + 1;
+}
+
+/*
+ * func را روی [0, count) اجرا می‌کند؛ هر tile دست‌کم grain عضو دارد و اگر کل بازه
+ * بیش از یک grain نیست همه روی همین رشته اجرا می‌شود
+ */
+static void parallel_range(int count, int grain, RangeFunc func, void* args) {
+    if (count <= 0) return;
+    if (grain < 1) grain = 1;
+    int n = 1;
+    if (count > grain) {
+        pthread_mutex_lock(&pool.mu);
+        n = pool_start();
+        pthread_mutex_unlock(&pool.mu);
+    }
+    if (n <= 1) {
+        func(0, count, args);
+        return;
+    }
+    
+    // چند tile برای هر slot تا دزدیدن معنا داشته باشد
+    int tile = count / (n * 8);
+    if (tile < grain) tile = grain;
+    int ntiles = (count + tile - 1) / tile;
+    uint64_t range[POOL_MAX_THREADS];
+    for (int s = 0; s < n; s++)
+        range[s] = range_pack((uint32_t)((long)ntiles * s / n), (uint32_t)((long)ntiles * (s + 1) / n));
+    PoolJob job = { func, args, count, tile, n, range, ntiles, 0, 0, NULL };
+    
+    pthread_mutex_lock(&pool.mu);
+    PoolJob** tail = &pool.head;
+    while (*tail) tail = &(*tail)->next;
+    *tail = &job;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mu);
+    
+    pool_run(&job, n - 1);                       // slot آخر مال فراخوان است
+    
+    pthread_mutex_lock(&pool.mu);
+    pool_unlink(&job);
+    while (__atomic_load_n(&job.left, __ATOMIC_ACQUIRE) > 0 || job.active > 0)
+        pthread_cond_wait(&pool.done, &pool.mu);
+    pthread_mutex_unlock(&pool.mu);
+}
+
 typedef struct {
     Image* img;
     Image* out;
-    int start_y;
-    int end_y;
+    RowFunc func;
     void* args;
-    void (*func)(Image*, Image*, int, int, void*);
-} ThreadJob;
+} RowJob;
 
-static pthread_t threads[MAX_THREADS];
-static ThreadJob jobs[MAX_THREADS];
+static void row_range(int begin, int end, void* args) {
+    RowJob* j = (RowJob*)args;
+    j->func(j->img, j->out, begin, end, j->args);
+}
 
-static void* thread_worker(void* arg) {
-    ThreadJob* job = (ThreadJob*)arg;
-    job->func(job->img, job->out, job->start_y, job->end_y, job->args);
-    return NULL;
+// ردیف‌های img؛ min_rows حداقل ردیف هر tile (برای فیلترهایی که شروع هر tile گران است)
+static void parallel_rows(Image* img, Image* out, RowFunc func, void* args, int min_rows) {
+    int w = img->width > 0 ? img->width : 1;
+    int grain = (POOL_GRAIN_PIXELS + w - 1) / w;
+    if (grain < min_rows) grain = min_rows;
+    if ((long)w * img->height < POOL_MIN_PIXELS) grain = img->height;
+    RowJob j = { img, out, func, args };
+    parallel_range(img->height, grain, row_range, &j);
 }
 
-static void parallel_for(Image* img, Image* out, void (*func)(Image*, Image*, int, int, void*), void* args) {
-    int num_threads = MAX_THREADS;
-    int rows_per_thread = img->height / num_threads;
-    
-    for (int i = 0; i < num_threads; i++) {
-        jobs[i].img = img;
-        jobs[i].out = out;
-        jobs[i].start_y = i * rows_per_thread;
-        jobs[i].end_y = (i == num_threads - 1) ? img->height : (i + 1) * rows_per_thread;
-        jobs[i].args = args;
-        jobs[i].func = func;
-        pthread_create(&threads[i], NULL, thread_worker, &jobs[i]);
-    }
-    
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
-    }
+static void parallel_for(Image* img, Image* out, RowFunc func, void* args) {
+    parallel_rows(img, out, func, args, 1);
+}
+
+// n = 0: خودکار. workerهای فعلی بعد از کار جاری خارج می‌شوند و دوباره تنبل ساخته می‌شوند
+static void pool_set_threads(int n) {
+    pthread_mutex_lock(&pool.mu);
+    pool.want = n;
+    pool.generation++;
+    pool.workers = 0;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mu);
 }
 
 // ================== توابع کرنل ==================
+/*
+ * blur جدا‌پذیر: یک گذر افقی روی ردیف‌ها (به tmp) و یک گذر عمودی (به out)، هر دو روی pool.
+ * مرزها تکرار لبه‌اند (clamp). گاوسی با وزن‌های ثابت-اعشار Q14 است و حلقه‌ی داخلی هر دو
+ * گذر یک شکل دارد: dst[i] = Σ w[k]·src[k][i] روی بایت‌های پیوسته (در گذر افقی src[k]
+ * همان ردیف پدشده با k پیکسل جابه‌جایی است). این حلقه نسخه‌ی AVX2 و NEON دارد.
+ * box (average) با جمع لغزان است و هزینه‌ی هر پیکسل به شعاع بستگی ندارد.
+ */
+#define KERNEL_BITS 14
+#define BLUR_MAX_SIZE 4095       // box_div تا این اندازه دقیق است
+
+typedef void (*ConvLine)(const unsigned char* const* src, const short* w, int n, unsigned char* dst, int len);
+
+typedef struct {
+    const short* w;              // وزن‌های گاوسی؛ NULL = box
+    int r;                       // شعاع
+    ConvLine conv;
+} BlurArgs;
+
+// کرنل یک‌بعدی Q14 با جمع دقیق 1<<KERNEL_BITS؛ دنباله‌های صفر حذف می‌شوند
 static Kernel create_gaussian_kernel(int size, float sigma) {
     Kernel k;
     k.size = size;
     k.sigma = sigma;
-    k.kernel = (float*)malloc(size * size * sizeof(float));
+    k.kernel = (short*)malloc(size * sizeof(short));
+    if (!k.kernel) return k;
     
     int center = size / 2;
-    float sum = 0;
-    
-    for (int y = 0; y < size; y++) {
-        for (int x = 0; x < size; x++) {
-            int dx = x - center;
-            int dy = y - center;
-            float val = exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
-            k.kernel[y * size + x] = val;
-            sum += val;
+    double sum = 0;
+    double* f = (double*)malloc(size * sizeof(double));
+    if (!f) { free(k.kernel); k.kernel = NULL; return k; }
+    for (int x = 0; x < size; x++) {
+        int dx = x - center;
+        f[x] = exp(-(dx * dx) / (2.0 * sigma * sigma));
+        sum += f[x];
+    }
+    int total = 0;
+    for (int x = 0; x < size; x++) {
+        k.kernel[x] = (short)lround(f[x] / sum * (1 << KERNEL_BITS));
+        total += k.kernel[x];
+    }
+    k.kernel[center] += (1 << KERNEL_BITS) - total;
+    free(f);
+    
+    int trim = 0;
+    while (trim < center && k.kernel[trim] == 0) trim++;
+    if (trim) {
+        k.size = size - 2 * trim;
+        memmove(k.kernel, k.kernel + trim, k.size * sizeof(short));
+    }
+    return k;
+}
+
+static void conv_line_c(const unsigned char* const* src, const short* w, int n, unsigned char* dst, int from, int len) {
+    for (int i = from; i < len; i++) {
+        int sum = 1 << (KERNEL_BITS - 1);
+        for (int k = 0; k < n; k++) sum += w[k] * src[k][i];
+        dst[i] = (unsigned char)(sum >> KERNEL_BITS);
+    }
+}
+
+static void conv_line_scalar(const unsigned char* const* src, const short* w, int n, unsigned char* dst, int len) {
+    conv_line_c(src, w, n, dst, 0, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 بایت در هر دور؛ دو tap با هم در madd
+__attribute__((target("avx2")))
+static void conv_line_avx2(const unsigned char* const* src, const short* w, int n, unsigned char* dst, int len) {
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m256i lo = _mm256_set1_epi32(1 << (KERNEL_BITS - 1)), hi = lo;
+        for (int k = 0; k < n; k += 2) {
+            int k1 = k + 1 < n ? k + 1 : k;
+            int w1 = k + 1 < n ? w[k + 1] : 0;
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src[k] + i)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src[k1] + i)));
+            __m256i wv = _mm256_set1_epi32((unsigned short)w[k] | w1 << 16);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wv));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wv));
         }
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, KERNEL_BITS), _mm256_srai_epi32(hi, KERNEL_BITS));
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(v));
     }
-    
-    for (int i = 0; i < size * size; i++) {
-        k.kernel[i] /= sum;
+    conv_line_c(src, w, n, dst, i, len);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void conv_line_neon(const unsigned char* const* src, const short* w, int n, unsigned char* dst, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        int32x4_t lo = vdupq_n_s32(0), hi = lo;
+        for (int k = 0; k < n; k++) {
+            int16x8_t s = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src[k] + i)));
+            lo = vmlal_n_s16(lo, vget_low_s16(s), w[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(s), w[k]);
+        }
+        uint16x8_t v = vcombine_u16(vqrshrun_n_s32(lo, KERNEL_BITS), vqrshrun_n_s32(hi, KERNEL_BITS));
+        vst1_u8(dst + i, vqmovn_u16(v));
     }
-    return k;
+    conv_line_c(src, w, n, dst, i, len);
+}
+#endif
+
+static ConvLine conv_line_pick(void) {
+#if defined(__ARM_NEON)
+    return conv_line_neon;
+#else
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return conv_line_avx2;
+#endif
+    return conv_line_scalar;
+#endif
+}
+
+// (sum + n/2) / n با ضرب؛ mul = 2^32/n + 1 برای n < 4096 دقیق است
+static inline unsigned char box_div(uint32_t sum, uint32_t half, uint64_t mul) {
+    return (unsigned char)(((uint64_t)(sum + half) * mul) >> 32);
+}
+
+static int clampi(int v, int lo, int hi) {
+    return v < lo ? lo : v > hi ? hi : v;
 }
 
-static void gaussian_blur_row(Image* img, Image* out, int start_y, int end_y, void* args) {
-    float* kernel = (float*)args;
-    int ksize = 5; // 5x5 kernel
+// گذر افقی: هر ردیف با r پیکسل تکراری در دو طرف پد و سپس کانوالو یا جمع لغزان می‌شود
+static void blur_h_rows(Image* img, Image* out, int start_y, int end_y, void* args) {
+    BlurArgs* b = (BlurArgs*)args;
+    int w = img->width, c = img->channels, r = b->r, n = 2 * r + 1;
+    unsigned char* pad = (unsigned char*)malloc((size_t)(w + 2 * r) * c);
+    const unsigned char** src = (const unsigned char**)malloc(n * sizeof(*src));
+    if (!pad || !src) { free(pad); free((void*)src); return; }
+    uint32_t half = n / 2;
+    uint64_t mul = (1ULL << 32) / n + 1;
+    
     for (int y = start_y; y < end_y; y++) {
-        for (int x = 2; x < img->width - 2; x++) {
-            for (int c = 0; c < img->channels; c++) {
-                float sum = 0;
-                for (int ky = -2; ky <= 2; ky++) {
-                    for (int kx = -2; kx <= 2; kx++) {
-                        int px = (y + ky) * img->width + (x + kx);
-                        sum += img->data[px * img->channels + c] * kernel[(ky+2)*5 + (kx+2)];
-                    }
-                }
-                out->data[(y * img->width + x) * img->channels + c] = (unsigned char)sum;
+        const unsigned char* row = img->data + (size_t)y * w * c;
+        unsigned char* dst = out->data + (size_t)y * w * c;
+        for (int x = 0; x < r; x++) {
+            memcpy(pad + x * c, row, c);
+            memcpy(pad + (size_t)(r + w + x) * c, row + (size_t)(w - 1) * c, c);
+        }
+        memcpy(pad + (size_t)r * c, row, (size_t)w * c);
+        
+        if (b->w) {
+            for (int k = 0; k < n; k++) src[k] = pad + (size_t)k * c;
+            b->conv(src, b->w, n, dst, w * c);
+            continue;
+        }
+        for (int ch = 0; ch < c; ch++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < n; k++) sum += pad[k * c + ch];
+            for (int x = 0; x < w; x++) {
+                dst[x * c + ch] = box_div(sum, half, mul);
+                if (x + 1 < w) sum += pad[(x + n) * c + ch] - pad[x * c + ch];
             }
         }
     }
+    free(pad);
+    free((void*)src);
+}
+
+// ردیف y؛ بیرون از تصویر به نزدیک‌ترین ردیف clamp می‌شود
+static const unsigned char* row_at(const Image* img, int y) {
+    return img->data + (size_t)clampi(y, 0, img->height - 1) * img->width * img->channels;
 }
 
-static void median_filter_row(Image* img, Image* out, int start_y, int end_y, void* args) {
-    unsigned char window[9];
+// گذر عمودی
+static void blur_v_rows(Image* img, Image* out, int start_y, int end_y, void* args) {
+    BlurArgs* b = (BlurArgs*)args;
+    int r = b->r, n = 2 * r + 1, len = img->width * img->channels;
+    if (b->w) {
+        const unsigned char** src = (const unsigned char**)malloc(n * sizeof(*src));
+        if (!src) return;
+        for (int y = start_y; y < end_y; y++) {
+            for (int k = 0; k < n; k++) src[k] = row_at(img, y + k - r);
+            b->conv(src, b->w, n, out->data + (size_t)y * len, len);
+        }
+        free((void*)src);
+        return;
+    }
+    
+    uint32_t* col = (uint32_t*)calloc(len, sizeof(uint32_t));
+    if (!col) return;
+    uint32_t half = n / 2;
+    uint64_t mul = (1ULL << 32) / n + 1;
+    for (int k = -r; k <= r; k++) {
+        const unsigned char* s = row_at(img, start_y + k);
+        for (int i = 0; i < len; i++) col[i] += s[i];
+    }
     for (int y = start_y; y < end_y; y++) {
-        for (int x = 1; x < img->width - 1; x++) {
-            for (int c = 0; c < img->channels; c++) {
-                int idx = 0;
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-                        int px = (y + ky) * img->width + (x + kx);
-                        window[idx++] = img->data[px * img->channels + c];
-                    }
+        unsigned char* dst = out->data + (size_t)y * len;
+        const unsigned char* add = row_at(img, y + r + 1);
+        const unsigned char* sub = row_at(img, y - r);
+        for (int i = 0; i < len; i++) {
+            dst[i] = box_div(col[i], half, mul);
+            col[i] += add[i] - sub[i];
+        }
+    }
+    free(col);
+}
+
+// img را با کرنل گاوسی (w != NULL) یا box به شعاع r در out تار می‌کند؛ 0 اگر حافظه نبود
+static int blur_separable(Image* img, Image* out, const short* w, int r) {
+    Image tmp = img_create(img->width, img->height, img->channels);
+    if (!tmp.data) return 0;
+    BlurArgs b = { w, r, conv_line_pick() };
+    parallel_for(img, &tmp, blur_h_rows, &b);
+    parallel_for(&tmp, out, blur_v_rows, &b);
+    img_free(&tmp);
+    return 1;
+}
+
+// ================== فیلتر میانه ==================
+/*
+ * مرزها مثل blur تکرار لبه‌اند. شعاع 1 با شبکه‌ی مرتب‌سازی 19 مقایسه (min/max) روی 16
+ * بایت هم‌زمان (SSE2/NEON) و شعاع بزرگ‌تر با الگوریتم زمان-ثابت Perreault–Hébert:
+ * برای هر ستون یک هیستوگرام از 2r+1 ردیف نگه داشته می‌شود که با پایین رفتن یک ردیف، یک
+ * پیکسل کم و یکی اضافه می‌کند؛ هیستوگرام پنجره با جمع/تفریق هیستوگرام ستون‌ها جلو می‌رود.
+ * هر هیستوگرام دو سطحی است (16 سطل درشت و 256 ریز) و سطل‌های ریز پنجره فقط وقتی میانه در
+ * آن‌ها افتاد به‌روز می‌شوند، پس هزینه‌ی هر پیکسل به شعاع بستگی ندارد.
+ */
+#define MEDIAN_MAX_SIZE 255      // شمارنده‌ها 16 بیتی‌اند: (2r+1)^2 <= 65535
+
+#define MED_SORT(a, b) do { t = MED_MIN(a, b); b = MED_MAX(a, b); a = t; } while (0)
+#define MED9(p) do { \
+    MED_SORT(p[1], p[2]); MED_SORT(p[4], p[5]); MED_SORT(p[7], p[8]); \
+    MED_SORT(p[0], p[1]); MED_SORT(p[3], p[4]); MED_SORT(p[6], p[7]); \
+    MED_SORT(p[1], p[2]); MED_SORT(p[4], p[5]); MED_SORT(p[7], p[8]); \
+    MED_SORT(p[0], p[3]); MED_SORT(p[5], p[8]); MED_SORT(p[4], p[7]); \
+    MED_SORT(p[3], p[6]); MED_SORT(p[1], p[4]); MED_SORT(p[2], p[5]); \
+    MED_SORT(p[4], p[7]); MED_SORT(p[4], p[2]); MED_SORT(p[6], p[4]); \
+    MED_SORT(p[4], p[2]); } while (0)
+
+// میانه‌ی 3x3 یک ردیف خروجی؛ rows سه ردیف پدشده (یک پیکسل تکراری در هر طرف)
+static void median3_line(unsigned char* const rows[3], int c, unsigned char* dst, int len) {
+    int i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+#if defined(__SSE2__)
+    typedef __m128i V;
+    #define MED_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+    #define MED_STORE(p, v) _mm_storeu_si128((__m128i*)(p), v)
+    #define MED_MIN _mm_min_epu8
+    #define MED_MAX _mm_max_epu8
+#else
+    typedef uint8x16_t V;
+    #define MED_LOAD(p) vld1q_u8(p)
+    #define MED_STORE(p, v) vst1q_u8(p, v)
+    #define MED_MIN vminq_u8
+    #define MED_MAX vmaxq_u8
+#endif
+    for (; i + 16 <= len; i += 16) {
+        V p[9], t;
+        for (int k = 0; k < 9; k++) p[k] = MED_LOAD(rows[k / 3] + (k % 3) * c + i);
+        MED9(p);
+        MED_STORE(dst + i, p[4]);
+    }
+    #undef MED_LOAD
+    #undef MED_STORE
+    #undef MED_MIN
+    #undef MED_MAX
+#endif
+    #define MED_MIN(a, b) ((a) < (b) ? (a) : (b))
+    #define MED_MAX(a, b) ((a) < (b) ? (b) : (a))
+    for (; i < len; i++) {
+        unsigned char p[9], t;
+        for (int k = 0; k < 9; k++) p[k] = rows[k / 3][(k % 3) * c + i];
+        MED9(p);
+        dst[i] = p[4];
+    }
+    #undef MED_MIN
+    #undef MED_MAX
+}
+
+static void median3_rows(Image* img, Image* out, int start_y, int end_y, void* args) {
+    (void)args;
+    int w = img->width, c = img->channels, len = w * c;
+    unsigned char* buf = (unsigned char*)malloc((size_t)3 * (len + 2 * c));
+    if (!buf) return;
+    unsigned char* rows[3];
+    for (int k = 0; k < 3; k++) rows[k] = buf + (size_t)k * (len + 2 * c);
+    for (int y = start_y; y < end_y; y++) {
+        for (int k = 0; k < 3; k++) {
+            const unsigned char* s = row_at(img, y + k - 1);
+            memcpy(rows[k], s, c);
+            memcpy(rows[k] + c, s, len);
+            memcpy(rows[k] + c + len, s + len - c, c);
+        }
+        median3_line(rows, c, out->data + (size_t)y * len, len);
+    }
+    free(buf);
+}
+
+// هیستوگرام ستون x برای کانال ch با پیکسل ردیف y (d = +1 یا -1)
+static void median_col_add(const Image* img, uint16_t* coarse, uint16_t* fine, int y, int ch, int d) {
+    const unsigned char* s = row_at(img, y) + ch;
+    int w = img->width, c = img->channels;
+    for (int x = 0; x < w; x++) {
+        unsigned char v = s[x * c];
+        coarse[x * 16 + (v >> 4)] += d;
+        fine[x * 256 + v] += d;
+    }
+}
+
+static void median_hist_rows(Image* img, Image* out, int start_y, int end_y, void* args) {
+    int w = img->width, c = img->channels, r = *(int*)args, n = 2 * r + 1;
+    int rank = n * n / 2;
+    uint16_t* coarse = (uint16_t*)malloc((size_t)w * 16 * sizeof(uint16_t));
+    uint16_t* fine = (uint16_t*)malloc((size_t)w * 256 * sizeof(uint16_t));
+    if (!coarse || !fine) { free(coarse); free(fine); return; }
+    
+    for (int ch = 0; ch < c; ch++) {
+        memset(coarse, 0, (size_t)w * 16 * sizeof(uint16_t));
+        memset(fine, 0, (size_t)w * 256 * sizeof(uint16_t));
+        for (int k = -r; k <= r; k++) median_col_add(img, coarse, fine, start_y + k, ch, 1);
+        
+        for (int y = start_y; y < end_y; y++) {
+            uint16_t hc[16] = { 0 }, hf[256];
+            int last[16];
+            for (int b = 0; b < 16; b++) last[b] = INT_MIN / 2;     // سطل ریز هنوز ساخته نشده
+            for (int k = -r; k <= r; k++) {
+                const uint16_t* cc = coarse + clampi(k, 0, w - 1) * 16;
+                for (int b = 0; b < 16; b++) hc[b] += cc[b];
+            }
+            unsigned char* dst = out->data + (size_t)y * w * c + ch;
+            
+            for (int x = 0; x < w; x++) {
+                if (x > 0) {
+                    const uint16_t* add = coarse + clampi(x + r, 0, w - 1) * 16;
+                    const uint16_t* sub = coarse + clampi(x - r - 1, 0, w - 1) * 16;
+                    for (int b = 0; b < 16; b++) hc[b] += add[b] - sub[b];
                 }
-                // مرتب‌سازی حبابی برای یافتن میانه
-                for (int i = 0; i < 5; i++) {
-                    for (int j = i+1; j < 9; j++) {
-                        if (window[i] > window[j]) {
-                            unsigned char temp = window[i];
-                            window[i] = window[j];
-                            window[j] = temp;
-                        }
+                int b = 0, acc = 0;
+                while (acc + hc[b] <= rank) acc += hc[b++];
+                
+                // سطل ریز b را به ستون x برسان: از نو، یا جلو بردن از last[b]
+                uint16_t* hb = hf + b * 16;
+                if (x - last[b] > n) {
+                    memset(hb, 0, 16 * sizeof(uint16_t));
+                    for (int k = x - r; k <= x + r; k++) {
+                        const uint16_t* f = fine + clampi(k, 0, w - 1) * 256 + b * 16;
+                        for (int v = 0; v < 16; v++) hb[v] += f[v];
+                    }
+                } else {
+                    for (int j = last[b] + 1; j <= x; j++) {
+                        const uint16_t* add = fine + clampi(j + r, 0, w - 1) * 256 + b * 16;
+                        const uint16_t* sub = fine + clampi(j - r - 1, 0, w - 1) * 256 + b * 16;
+                        for (int v = 0; v < 16; v++) hb[v] += add[v] - sub[v];
                     }
                 }
-                out->data[(y * img->width + x) * img->channels + c] = window[4];
+                last[b] = x;
+                
+                int v = 0;
+                while (acc + hb[v] <= rank) acc += hb[v++];
+                dst[x * c] = (unsigned char)(b * 16 + v);
+            }
+            
+            if (y + 1 < end_y) {
+                median_col_add(img, coarse, fine, y - r, ch, -1);
+                median_col_add(img, coarse, fine, y + r + 1, ch, 1);
             }
         }
     }
+    free(coarse);
+    free(fine);
+}
+
+// img را با پنجره‌ی (2r+1)x(2r+1) در out فیلتر میانه می‌کند
+static void median_filter(Image* img, Image* out, int r) {
+    if (r < 1) {
+        memcpy(out->data, img->data, (size_t)img->width * img->height * img->channels);
+    } else if (r == 1) {
+        parallel_for(img, out, median3_rows, NULL);
+    } else {
+        // شروع هر tile ساختن 2r+1 ردیف هیستوگرام است؛ tileها چند برابر آن باشند
+        parallel_rows(img, out, median_hist_rows, &r, 4 * (2 * r + 1));
+    }
 }
 
 // ================== توابع رسم ==================
@@ -473,150 +1003,925 @@ static void canny_edge_detection(Image img, Image* out, float low_thresh, float
     if (img.channels > 1) img_free(&gray);
 }
 
-// ================== توابع ماژول Lua ==================
+// ================== تطبیق الگو (NCC) ==================
+/*
+ * همبستگی متقابل نرمال‌شده با میانگین صفر (مثل TM_CCOEFF_NORMED) روی تصویر خاکستری:
+ *   score(u,v) = Σ I·T' / sqrt(Σ T'^2 · (Σ I^2 - (Σ I)^2 / n))،   T' = T - mean(T)
+ * چون Σ T' = 0، صورت کسر به میانگین پنجره‌ی I نیازی ندارد. جمع‌های پنجره از دو جدول
+ * مساحت تجمعی (SAT) در O(1) می‌آیند. صورت کسر یا مستقیم (ضرب‌وجمع روی ردیف‌های نتیجه،
+ * AVX2/FMA اگر باشد) یا با FFT دوبعدی حساب می‌شود؛ هر کدام که هزینه‌ی تخمینی کمتری
+ * دارد. در FFT تصویر و الگو با هم در یک آرایه‌ی مختلط (I + iT') تبدیل می‌شوند و طیف هر
+ * کدام از تقارن هرمیتی جدا می‌شود، پس دو FFT دوبعدی کافی است.
+ */
+#define MATCH_MAX 1000           // سقف تعداد نتیجه‌ها
 
-// ----- Grayscale -----
-static int l_img_grayscale(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
+typedef struct {
+    int x, y;
+    float score;
+} Match;
+
+typedef void (*AxpyFunc)(float* restrict acc, const float* restrict src, float t, int n);
+
+static void axpy_scalar(float* restrict acc, const float* restrict src, float t, int n) {
+    for (int i = 0; i < n; i++) acc[i] += t * src[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float* restrict acc, const float* restrict src, float t, int n) {
+    __m256 tv = _mm256_set1_ps(t);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(tv, _mm256_loadu_ps(src + i), _mm256_loadu_ps(acc + i)));
+    for (; i < n; i++) acc[i] += t * src[i];
+}
+#endif
+
+static AxpyFunc axpy_pick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return axpy_avx2;
+#endif
+    return axpy_scalar;    // NEON: gcc/clang این حلقه را خودشان برداری می‌کنند
+}
+
+typedef struct {
+    const float* img;            // تصویر خاکستری W×H
+    const float* tpl;            // T'، w×h
+    float* num;                  // خروجی rw×rh
+    int W, w, h, rw;
+    AxpyFunc axpy;
+} NccDirect;
+
+// صورت کسر برای ردیف‌های [begin, end) نتیجه
+static void ncc_direct_rows(int begin, int end, void* args) {
+    NccDirect* d = (NccDirect*)args;
+    for (int v = begin; v < end; v++) {
+        float* acc = d->num + (size_t)v * d->rw;
+        memset(acc, 0, d->rw * sizeof(float));
+        for (int y = 0; y < d->h; y++) {
+            const float* row = d->img + (size_t)(v + y) * d->W;
+            const float* t = d->tpl + (size_t)y * d->w;
+            for (int x = 0; x < d->w; x++)
+                if (t[x] != 0) d->axpy(acc, row + x, t[x], d->rw);
+        }
     }
-    
-    if (img.channels == 1) {
-        int success = img_write(output, img);
-        img_free(&img);
-        lua_pushboolean(L, success);
-        return 1;
+}
+
+// ضرب مختلط بدون بررسی‌های NaN/Inf پیوست G (که gcc برای * روی complex می‌گذارد)
+static inline double complex cmul(double complex a, double complex b) {
+    double ar = creal(a), ai = cimag(a), br = creal(b), bi = cimag(b);
+    return CMPLX(ar * br - ai * bi, ar * bi + ai * br);
+}
+
+/*
+ * FFT درجا با طول توانی از 2 روی n عنصر با فاصله‌ی stride، هر عنصر یک بردار width تایی
+ * پیوسته: ردیف‌ها با width=1 و ستون‌ها با width = چند ستون کنار هم (پروانه روی تکه‌ی
+ * پیوسته‌ی ردیف‌ها، بی جابه‌جایی ماتریس). tw[k] = exp(∓2πik/n) برای k < n/2.
+ */
+static void fft_1d(double complex* a, int n, size_t stride, int width, const double complex* tw) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double complex* p = a + i * stride;
+            double complex* q = a + j * stride;
+            for (int x = 0; x < width; x++) { double complex t = p[x]; p[x] = q[x]; q[x] = t; }
+        }
     }
-    
-    Image gray = img_create(img.width, img.height, 1);
-    if (!gray.data) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2, step = n / len;
+        if (width == 1 && stride == 1) {
+            for (int i = 0; i < n; i += len) {
+                for (int k = 0; k < half; k++) {
+                    double complex u = a[i + k], v = cmul(a[i + k + half], tw[k * step]);
+                    a[i + k] = u + v;
+                    a[i + k + half] = u - v;
+                }
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                double complex w = tw[k * step];
+                double complex* p = a + (i + k) * stride;
+                double complex* q = a + (i + k + half) * stride;
+                for (int x = 0; x < width; x++) {
+                    double complex u = p[x], v = cmul(q[x], w);
+                    p[x] = u + v;
+                    q[x] = u - v;
+                }
+            }
+        }
     }
-    
-    for (int i = 0; i < img.width * img.height; i++) {
-        int idx = i * img.channels;
-        gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
+}
+
+typedef struct {
+    double complex* a;           // M ردیف × N ستون
+    const double complex* tw_row;
+    const double complex* tw_col;
+    int N, M;
+} Fft2;
+
+static void fft_rows(int begin, int end, void* args) {
+    Fft2* f = (Fft2*)args;
+    for (int y = begin; y < end; y++) fft_1d(f->a + (size_t)y * f->N, f->N, 1, 1, f->tw_row);
+}
+
+static void fft_cols(int begin, int end, void* args) {
+    Fft2* f = (Fft2*)args;
+    fft_1d(f->a + begin, f->M, f->N, end - begin, f->tw_col);
+}
+
+static double complex* fft_twiddles(int n, int inverse) {
+    double complex* tw = (double complex*)malloc((n / 2 + 1) * sizeof(double complex));
+    double sign = inverse ? 2.0 : -2.0;
+    if (tw) for (int k = 0; k < n / 2 + 1; k++) tw[k] = CMPLX(cos(sign * PI * k / n), sin(sign * PI * k / n));
+    return tw;
+}
+
+// FFT دوبعدی؛ ستون‌ها در تکه‌های 16 ستونی (هر ردیف تکه 256 بایت)
+static void fft_2d(Fft2* f) {
+    parallel_range(f->M, 8, fft_rows, f);
+    parallel_range(f->N, 16, fft_cols, f);
+}
+
+static int pow2_ceil(int v) {
+    int n = 1;
+    while (n < v) n <<= 1;
+    return n;
+}
+
+// صورت کسر با FFT؛ 0 اگر حافظه نبود
+static int ncc_fft(const float* img, int W, int H, const float* tpl, int w, int h, float* num, int rw, int rh) {
+    int N = pow2_ceil(W), M = pow2_ceil(H);
+    double complex* a = (double complex*)calloc((size_t)N * M, sizeof(double complex));
+    double complex* tw[4] = { fft_twiddles(N, 0), fft_twiddles(M, 0), fft_twiddles(N, 1), fft_twiddles(M, 1) };
+    if (!a || !tw[0] || !tw[1] || !tw[2] || !tw[3]) {
+        free(a);
+        for (int i = 0; i < 4; i++) free(tw[i]);
+        return 0;
+    }
+    
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++) a[(size_t)y * N + x] = img[(size_t)y * W + x];
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++) a[(size_t)y * N + x] = CMPLX(creal(a[(size_t)y * N + x]), tpl[(size_t)y * w + x]);
+    
+    Fft2 f = { a, tw[0], tw[1], N, M };
+    fft_2d(&f);
+    
+    // Z = F(I) + i·F(T')؛ F(I)·conj(F(T')) در k و مزدوجش در -k
+    for (int ky = 0; ky < M; ky++) {
+        int my = (M - ky) % M;
+        for (int kx = 0; kx < N; kx++) {
+            int mx = (N - kx) % N;
+            size_t k = (size_t)ky * N + kx, m = (size_t)my * N + mx;
+            if (m < k) continue;
+            double complex zk = a[k], zm = conj(a[m]);
+            double complex d = zk - zm;
+            double complex fi = (zk + zm) * 0.5, ft = CMPLX(cimag(d) * 0.5, -creal(d) * 0.5);   // d / 2i
+            a[k] = cmul(fi, conj(ft));
+            a[m] = conj(a[k]);
+        }
     }
     
-    int success = img_write(output, gray);
-    img_free(&gray);
-    img_free(&img);
+    f.tw_row = tw[2];
+    f.tw_col = tw[3];
+    fft_2d(&f);
+    double scale = 1.0 / ((double)N * M);
+    for (int v = 0; v < rh; v++)
+        for (int u = 0; u < rw; u++) num[(size_t)v * rw + u] = (float)(creal(a[(size_t)v * N + u]) * scale);
     
-    lua_pushboolean(L, success);
+    free(a);
+    for (int i = 0; i < 4; i++) free(tw[i]);
     return 1;
 }
 
-// ----- Resize -----
-static int l_img_resize(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int new_w = luaL_checkinteger(L, 3);
-    int new_h = luaL_checkinteger(L, 4);
-    
-    if (new_w <= 0 || new_h <= 0) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Width and height must be positive");
-        return 2;
+/*
+ * نقشه‌ی امتیاز NCC (rw×rh = (W-w+1)×(H-h+1)) برای gray و tpl خاکستری؛ NULL اگر حافظه نبود.
+ * use_fft: -1 خودکار، 0 مستقیم، 1 FFT
+ */
+static float* ncc_map(const Image* gray, const Image* tpl, int use_fft) {
+    int W = gray->width, H = gray->height, w = tpl->width, h = tpl->height;
+    int rw = W - w + 1, rh = H - h + 1;
+    size_t n = (size_t)w * h;
+    float* img = (float*)malloc((size_t)W * H * sizeof(float));
+    float* t = (float*)malloc(n * sizeof(float));
+    float* num = (float*)malloc((size_t)rw * rh * sizeof(float));
+    int64_t* s1 = (int64_t*)calloc((size_t)(W + 1) * (H + 1), sizeof(int64_t));
+    int64_t* s2 = (int64_t*)calloc((size_t)(W + 1) * (H + 1), sizeof(int64_t));
+    if (!img || !t || !num || !s1 || !s2) goto fail;
+    
+    for (size_t i = 0; i < (size_t)W * H; i++) img[i] = gray->data[i];
+    double mean = 0, tnorm = 0;
+    for (size_t i = 0; i < n; i++) mean += tpl->data[i];
+    mean /= n;
+    for (size_t i = 0; i < n; i++) {
+        t[i] = (float)(tpl->data[i] - mean);
+        tnorm += (double)t[i] * t[i];
+    }
+    
+    // SAT: s[(y+1)(W+1) + x+1] = جمع مستطیل [0,x]×[0,y]
+    for (int y = 0; y < H; y++) {
+        int64_t r1 = 0, r2 = 0;
+        for (int x = 0; x < W; x++) {
+            int v = gray->data[(size_t)y * W + x];
+            r1 += v; r2 += v * v;
+            size_t k = (size_t)(y + 1) * (W + 1) + x + 1;
+            s1[k] = s1[k - (W + 1)] + r1;
+            s2[k] = s2[k - (W + 1)] + r2;
+        }
     }
     
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
+    if (use_fft < 0) {
+        // ضرب‌وجمع مستقیم در برابر دو FFT دوبعدی؛ ضریب 36 اندازه‌گیری شده (هر نقطه·log
+        // در FFT مختلط double حدود 36 برابر یک FMA برداری مسیر مستقیم)
+        int N = pow2_ceil(W), M = pow2_ceil(H);
+        double direct = (double)rw * rh * n;
+        double fft = (double)N * M * log2((double)N * M) * 36;
+        use_fft = direct > fft;
     }
-    
-    Image out = img_create(new_w, new_h, img.channels);
-    if (!out.data) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
+    if (use_fft) {
+        if (!ncc_fft(img, W, H, t, w, h, num, rw, rh)) goto fail;
+    } else {
+        NccDirect d = { img, t, num, W, w, h, rw, axpy_pick() };
+        int grain = (int)(POOL_GRAIN_PIXELS / ((double)rw * n / 64 + 1)) + 1;
+        parallel_range(rh, grain, ncc_direct_rows, &d);
+    }
+    
+    for (int v = 0; v < rh; v++) {
+        for (int u = 0; u < rw; u++) {
+            size_t a = (size_t)v * (W + 1) + u, b = a + w, c = a + (size_t)h * (W + 1), d = c + w;
+            double sum = (double)(s1[d] - s1[b] - s1[c] + s1[a]);
+            double sq = (double)(s2[d] - s2[b] - s2[c] + s2[a]);
+            double var = sq - sum * sum / n;
+            float* s = &num[(size_t)v * rw + u];
+            double den = var * tnorm;
+            double score = den > 1e-6 * n * n ? *s / sqrt(den) : 0;   // پنجره یا الگوی یکنواخت
+            *s = (float)(score > 1 ? 1 : score < -1 ? -1 : score);
+        }
     }
     
-    stbir_resize_uint8(img.data, img.width, img.height, 0,
-                       out.data, new_w, new_h, 0, img.channels);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    free(img); free(t); free(s1); free(s2);
+    return num;
+fail:
+    free(img); free(t); free(num); free(s1); free(s2);
+    return NULL;
 }
 
-// ----- Crop -----
-static int l_img_crop(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int x = luaL_checkinteger(L, 3);
-    int y = luaL_checkinteger(L, 4);
-    int w = luaL_checkinteger(L, 5);
-    int h = luaL_checkinteger(L, 6);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    if (x < 0 || y < 0 || x + w > img.width || y + h > img.height) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Invalid crop rectangle");
-        return 2;
+/*
+ * بهترین‌ها به ترتیب امتیاز؛ بعد از هر انتخاب جای‌های نزدیک‌تر از نصف الگو کنار گذاشته
+ * می‌شوند تا یک شیء چند بار شمرده نشود. تعداد پیداشده را برمی‌گرداند.
+ */
+static int ncc_peaks(float* map, int rw, int rh, int w, int h, int count, float min_score, Match* out) {
+    int found = 0;
+    int ex = w / 2 > 0 ? w / 2 : 1, ey = h / 2 > 0 ? h / 2 : 1;
+    while (found < count) {
+        size_t best = 0;
+        for (size_t i = 1; i < (size_t)rw * rh; i++)
+            if (map[i] > map[best]) best = i;
+        if (map[best] < min_score || map[best] == -FLT_MAX) break;
+        Match m = { (int)(best % rw), (int)(best / rw), map[best] };
+        out[found++] = m;
+        for (int y = m.y - ey + 1; y < m.y + ey; y++) {
+            if (y < 0 || y >= rh) continue;
+            for (int x = m.x - ex + 1; x < m.x + ex; x++)
+                if (x >= 0 && x < rw) map[(size_t)y * rw + x] = -FLT_MAX;
+        }
     }
-    
-    Image out = img_create(w, h, img.channels);
-    if (!out.data) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
+    return found;
+}
+
+// ================== K-means ==================
+/*
+ * کوانتیزه کردن رنگ: نقطه‌ها پیکسل‌ها در 3 بعد (یا 1 بعد برای تصویر خاکستری) هستند.
+ * مراکز اولیه با k-means++ روی نمونه‌ای تا KMEANS_SAMPLE پیکسل انتخاب می‌شوند. هر دور
+ * روی pool اجرا می‌شود: هر tile جمع‌های جزئی خودش را (صحیح، پس نتیجه به ترتیب tileها
+ * بستگی ندارد) نگه می‌دارد و یک بار در پایان tile با قفل به جمع کل اضافه می‌کند. اگر
+ * هیچ مرکزی بیش از KMEANS_EPS جابه‌جا نشود زودتر تمام می‌شود. با batch > 0 هر دور فقط
+ * batch پیکسل تصادفی دیده می‌شود و مراکز با نرخ 1/تعداد مثل mini-batch k-means جلو
+ * می‌روند (Sculley 2010). پیکسل‌ها در بلوک‌های KMEANS_BLOCK به float جدا (SoA) تبدیل
+ * می‌شوند و نزدیک‌ترین مرکز 8 پیکسل هم‌زمان با AVX2 پیدا می‌شود.
+ */
+#define KMEANS_MAX_K 256
+#define KMEANS_SAMPLE 65536
+#define KMEANS_EPS 0.01f         // مربع جابه‌جایی (سطح رنگ)
+#define KMEANS_BLOCK 256
+
+// مراکز SoA: cen[0..kp) قرمز، [kp..2kp) سبز، [2kp..3kp) آبی. برای n نقطه‌ی r، g، b
+// اندیس نزدیک‌ترین مرکز را در lab می‌گذارد (در تساوی، کوچک‌ترین اندیس)
+typedef void (*NearestFunc)(const float* cen, int kp, int k, const float* r, const float* g,
+                            const float* b, int n, int* lab);
+
+static void kmeans_nearest_c(const float* cen, int kp, int k, const float* r, const float* g,
+                             const float* b, int from, int n, int* lab) {
+    for (int i = from; i < n; i++) {
+        int best = 0;
+        float bd = FLT_MAX;
+        for (int j = 0; j < k; j++) {
+            float dr = r[i] - cen[j], dg = g[i] - cen[kp + j], db = b[i] - cen[2 * kp + j];
+            float d = dr * dr + dg * dg + db * db;
+            if (d < bd) { bd = d; best = j; }
+        }
+        lab[i] = best;
     }
-    
-    for (int cy = 0; cy < h; cy++) {
-        memcpy(&out.data[cy * w * img.channels],
-               &img.data[((y + cy) * img.width + x) * img.channels],
-               w * img.channels);
+}
+
+static void kmeans_nearest_scalar(const float* cen, int kp, int k, const float* r, const float* g,
+                                  const float* b, int n, int* lab) {
+    kmeans_nearest_c(cen, kp, k, r, g, b, 0, n, lab);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void kmeans_nearest_avx2(const float* cen, int kp, int k, const float* r, const float* g,
+                                const float* b, int n, int* lab) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vr = _mm256_loadu_ps(r + i), vg = _mm256_loadu_ps(g + i), vb = _mm256_loadu_ps(b + i);
+        __m256 best = _mm256_set1_ps(FLT_MAX);
+        __m256i bi = _mm256_setzero_si256();
+        for (int j = 0; j < k; j++) {
+            __m256 dr = _mm256_sub_ps(vr, _mm256_set1_ps(cen[j]));
+            __m256 dg = _mm256_sub_ps(vg, _mm256_set1_ps(cen[kp + j]));
+            __m256 db = _mm256_sub_ps(vb, _mm256_set1_ps(cen[2 * kp + j]));
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+            __m256 lt = _mm256_cmp_ps(d, best, _CMP_LT_OQ);
+            best = _mm256_blendv_ps(best, d, lt);
+            bi = _mm256_blendv_epi8(bi, _mm256_set1_epi32(j), _mm256_castps_si256(lt));
+        }
+        _mm256_storeu_si256((__m256i*)(lab + i), bi);
     }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    kmeans_nearest_c(cen, kp, k, r, g, b, i, n, lab);
 }
+#endif
 
-// ----- Rotate -----
-static int l_img_rotate(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    float angle = (float)luaL_checknumber(L, 3);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
+static NearestFunc kmeans_nearest_pick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return kmeans_nearest_avx2;
+#endif
+    return kmeans_nearest_scalar;
+}
+
+typedef struct {
+    unsigned char* px;
+    int c, d;                    // کانال‌ها، ابعاد (3 یا 1)
+    int k, kp;
+    const float* cen;
+    const int* sample;           // mini-batch: اندیس پیکسل‌ها؛ NULL = همه
+    uint64_t (*sum)[3];
+    uint64_t* cnt;
+    const unsigned char (*color)[3];   // فقط در گذر نهایی
+    pthread_mutex_t mu;
+    NearestFunc nearest;
+} KmeansArgs;
+
+// پیکسل‌های [begin, end) (یا sample[begin..end)) بلوک به بلوک: fn(ctx, p, lab, n)
+typedef void (*KmeansBlockFunc)(void* ctx, unsigned char* const* p, const int* lab, int n);
+
+static void kmeans_blocks(KmeansArgs* ka, int begin, int end, KmeansBlockFunc fn, void* ctx) {
+    float r[KMEANS_BLOCK], g[KMEANS_BLOCK], b[KMEANS_BLOCK];
+    int lab[KMEANS_BLOCK];
+    unsigned char* p[KMEANS_BLOCK];
+    for (int i = begin; i < end; i += KMEANS_BLOCK) {
+        int n = end - i < KMEANS_BLOCK ? end - i : KMEANS_BLOCK;
+        for (int l = 0; l < n; l++) {
+            p[l] = ka->px + (size_t)(ka->sample ? ka->sample[i + l] : i + l) * ka->c;
+            r[l] = p[l][0];
+            g[l] = ka->d == 3 ? p[l][1] : 0;
+            b[l] = ka->d == 3 ? p[l][2] : 0;
+        }
+        ka->nearest(ka->cen, ka->kp, ka->k, r, g, b, n, lab);
+        fn(ctx, p, lab, n);
     }
+}
+
+typedef struct {
+    int d;
+    uint64_t sum[KMEANS_MAX_K][3];
+    uint32_t cnt[KMEANS_MAX_K];
+} KmeansPartial;
+
+static void kmeans_accumulate(void* ctx, unsigned char* const* p, const int* lab, int n) {
+    KmeansPartial* part = (KmeansPartial*)ctx;
+    for (int l = 0; l < n; l++) {
+        for (int t = 0; t < part->d; t++) part->sum[lab[l]][t] += p[l][t];
+        part->cnt[lab[l]]++;
+    }
+}
+
+static void kmeans_assign(int begin, int end, void* args) {
+    KmeansArgs* ka = (KmeansArgs*)args;
+    KmeansPartial part;
+    part.d = ka->d;
+    memset(part.sum, 0, ka->k * sizeof(part.sum[0]));
+    memset(part.cnt, 0, ka->k * sizeof(part.cnt[0]));
+    kmeans_blocks(ka, begin, end, kmeans_accumulate, &part);
+    pthread_mutex_lock(&ka->mu);
+    for (int j = 0; j < ka->k; j++) {
+        if (!part.cnt[j]) continue;
+        for (int t = 0; t < ka->d; t++) ka->sum[j][t] += part.sum[j][t];
+        ka->cnt[j] += part.cnt[j];
+    }
+    pthread_mutex_unlock(&ka->mu);
+}
+
+static void kmeans_paint(void* ctx, unsigned char* const* p, const int* lab, int n) {
+    KmeansArgs* ka = (KmeansArgs*)ctx;
+    for (int l = 0; l < n; l++) memcpy(p[l], ka->color[lab[l]], ka->d);
+}
+
+static void kmeans_apply(int begin, int end, void* args) {
+    KmeansArgs* ka = (KmeansArgs*)args;
+    kmeans_blocks(ka, begin, end, kmeans_paint, ka);
+}
+
+static uint64_t xorshift64(uint64_t* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// k-means++ روی نمونه: هر مرکز تازه با احتمال متناسب با مربع فاصله تا نزدیک‌ترین مرکز
+static void kmeans_seed(const KmeansArgs* ka, int n, int k, float* cen, uint64_t* rng) {
+    int kp = ka->kp, s = n < KMEANS_SAMPLE ? n : KMEANS_SAMPLE;
+    int* idx = (int*)malloc(s * sizeof(int));
+    float* dist = (float*)malloc(s * sizeof(float));
+    if (!idx || !dist) {
+        // بدون حافظه‌ی نمونه: k پیکسل با فاصله‌ی یکسان
+        for (int j = 0; j < k; j++) {
+            const unsigned char* p = ka->px + (size_t)((long)n * j / k) * ka->c;
+            for (int t = 0; t < 3; t++) cen[t * kp + j] = t < ka->d ? p[t] : 0;
+        }
+        free(idx); free(dist);
+        return;
+    }
+    for (int i = 0; i < s; i++) idx[i] = s == n ? i : (int)(xorshift64(rng) % n);
+    
+    for (int j = 0; j < k; j++) {
+        int pick;
+        if (j == 0) {
+            pick = (int)(xorshift64(rng) % s);
+        } else {
+            double total = 0;
+            for (int i = 0; i < s; i++) total += dist[i];
+            double target = (double)(xorshift64(rng) >> 11) / (double)(1ULL << 53) * total;
+            for (pick = 0; pick < s - 1 && (target -= dist[pick]) > 0; pick++);
+        }
+        const unsigned char* p = ka->px + (size_t)idx[pick] * ka->c;
+        for (int t = 0; t < 3; t++) cen[t * kp + j] = t < ka->d ? p[t] : 0;
+        for (int i = 0; i < s; i++) {
+            const unsigned char* q = ka->px + (size_t)idx[i] * ka->c;
+            float d = 0;
+            for (int t = 0; t < ka->d; t++) {
+                float e = (float)q[t] - cen[t * kp + j];
+                d += e * e;
+            }
+            if (j == 0 || d < dist[i]) dist[i] = d;
+        }
+    }
+    free(idx);
+    free(dist);
+}
+
+/*
+ * img را با k رنگ کوانتیزه می‌کند؛ مراکز گردشده در color و تعداد دورها را برمی‌گرداند،
+ * یا -1 اگر حافظه نبود. batch > 0: mini-batch
+ */
+static int kmeans_quantize(Image* img, int k, int iters, int batch, unsigned char (*color)[3]) {
+    int n = img->width * img->height;
+    int kp = (k + 7) & ~7;
+    float* cen = (float*)malloc(3 * kp * sizeof(float));
+    uint64_t (*sum)[3] = malloc(kp * sizeof(*sum));
+    uint64_t* cnt = (uint64_t*)malloc(kp * sizeof(uint64_t));
+    double* seen = (double*)calloc(kp, sizeof(double));
+    int* sample = batch > 0 ? (int*)malloc(batch * sizeof(int)) : NULL;
+    if (!cen || !sum || !cnt || !seen || (batch > 0 && !sample)) {
+        free(cen); free(sum); free(cnt); free(seen); free(sample);
+        return -1;
+    }
+    for (int i = 0; i < 3 * kp; i++) cen[i] = 1e15f;     // مراکز اضافه هرگز برنده نمی‌شوند
+    
+    KmeansArgs ka = { img->data, img->channels, img->channels >= 3 ? 3 : 1, k, kp, cen, NULL,
+                      sum, cnt, NULL, PTHREAD_MUTEX_INITIALIZER, kmeans_nearest_pick() };
+    uint64_t rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t)n;
+    kmeans_seed(&ka, n, k, cen, &rng);
+    
+    int it = 0;
+    while (it < iters) {
+        it++;
+        memset(sum, 0, kp * sizeof(*sum));
+        memset(cnt, 0, kp * sizeof(uint64_t));
+        int count = n;
+        if (batch > 0) {
+            count = batch;
+            for (int i = 0; i < batch; i++) sample[i] = (int)(xorshift64(&rng) % n);
+            ka.sample = sample;
+        }
+        parallel_range(count, POOL_GRAIN_PIXELS, kmeans_assign, &ka);
+        
+        float shift = 0;
+        for (int j = 0; j < k; j++) {
+            if (!cnt[j]) continue;                      // خوشه‌ی خالی: مرکز می‌ماند
+            seen[j] += cnt[j];
+            float d = 0;
+            for (int t = 0; t < ka.d; t++) {
+                float* c = &cen[t * kp + j];
+                // کامل: میانگین دور جاری؛ mini-batch: حرکت به سمت آن با نرخ cnt/seen
+                float next = batch > 0 ? *c + (float)((sum[j][t] - cnt[j] * (double)*c) / seen[j])
+                                       : (float)((double)sum[j][t] / cnt[j]);
+                d += (next - *c) * (next - *c);
+                *c = next;
+            }
+            if (d > shift) shift = d;
+        }
+        if (shift < KMEANS_EPS) break;
+    }
+    
+    for (int j = 0; j < k; j++)
+        for (int t = 0; t < 3; t++) {
+            float v = t < ka.d ? cen[t * kp + j] : 0;
+            color[j][t] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v + 0.5f);
+        }
+    ka.color = (const unsigned char (*)[3])color;
+    ka.sample = NULL;
+    parallel_range(n, POOL_GRAIN_PIXELS, kmeans_apply, &ka);
+    
+    pthread_mutex_destroy(&ka.mu);
+    free(cen); free(sum); free(cnt); free(seen); free(sample);
+    return it;
+}
+
+// ================== هیستوگرام ==================
+/*
+ * شمارش با HIST_WAYS جدول جدا: پیکسل‌های پشت سر هم به جدول‌های مختلف می‌روند تا افزایش
+ * یک خانه منتظر ذخیره‌ی قبلی در همان خانه نماند (ناحیه‌های یکنواخت زنجیر store→load
+ * می‌سازند). در خاکستری 8 پیکسل با یک load هشت‌بایتی خوانده می‌شود. هر tile از
+ * parallel_range جدول‌های خودش را دارد و فقط در پایان، زیر mutex، جمع می‌شود.
+ *
+ * equalize_hist و clahe روی روشنایی (Y در BT.601) کار می‌کنند؛ در تصویر رنگی همان تغییر
+ * Y به هر سه کانال اضافه می‌شود تا Cb و Cr دست نخورند. آلفا دست نمی‌خورد.
+ * CLAHE (Zuiderveld 1994): هیستوگرام هر tile در clip × میانگین بریده و مازاد یکنواخت
+ * پخش می‌شود؛ هر پیکسل بین LUT چهار tile همسایه دوخطی درون‌یابی می‌شود.
+ */
+#define HIST_WAYS 4
+#define CLAHE_MAX_TILES 64
+
+typedef uint32_t HistWays[HIST_WAYS][256];
+
+// n پیکسل یک‌کاناله (به t اضافه می‌شود)
+static void hist_gray(const unsigned char* p, size_t n, HistWays t) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        t[0][v & 0xFF]++; t[1][(v >> 8) & 0xFF]++; t[2][(v >> 16) & 0xFF]++; t[3][(v >> 24) & 0xFF]++;
+        t[0][(v >> 32) & 0xFF]++; t[1][(v >> 40) & 0xFF]++; t[2][(v >> 48) & 0xFF]++; t[3][v >> 56]++;
+    }
+    for (; i < n; i++) t[i & 3][p[i]]++;
+}
+
+// n پیکسل c کاناله؛ t[ch] برای هر کانال
+static void hist_channels(const unsigned char* p, size_t n, int c, HistWays* t) {
+    if (c == 1) {
+        hist_gray(p, n, t[0]);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4, p += 4 * c)
+        for (int ch = 0; ch < c; ch++) {
+            t[ch][0][p[ch]]++;
+            t[ch][1][p[c + ch]]++;
+            t[ch][2][p[2 * c + ch]]++;
+            t[ch][3][p[3 * c + ch]]++;
+        }
+    for (; i < n; i++, p += c)
+        for (int ch = 0; ch < c; ch++) t[ch][0][p[ch]]++;
+}
+
+static void hist_fold(HistWays t, uint32_t h[256]) {
+    for (int v = 0; v < 256; v++) h[v] = t[0][v] + t[1][v] + t[2][v] + t[3][v];
+}
+
+typedef struct {
+    const unsigned char* data;
+    int c;
+    uint64_t (*h)[256];
+    pthread_mutex_t mu;
+} HistArgs;
+
+static void hist_range(int begin, int end, void* args) {
+    HistArgs* ha = (HistArgs*)args;
+    HistWays t[4];
+    uint32_t h[4][256];
+    memset(t, 0, ha->c * sizeof(HistWays));
+    hist_channels(ha->data + (size_t)begin * ha->c, end - begin, ha->c, t);
+    for (int ch = 0; ch < ha->c; ch++) hist_fold(t[ch], h[ch]);
+    pthread_mutex_lock(&ha->mu);
+    for (int ch = 0; ch < ha->c; ch++)
+        for (int v = 0; v < 256; v++) ha->h[ch][v] += h[ch][v];
+    pthread_mutex_unlock(&ha->mu);
+}
+
+// h[ch][v]: تعداد پیکسل‌هایی که کانال ch آنها v است (data از n پیکسل c کاناله)
+static void hist_compute(const unsigned char* data, int n, int c, uint64_t (*h)[256]) {
+    HistArgs ha = { data, c, h, PTHREAD_MUTEX_INITIALIZER };
+    memset(h, 0, c * sizeof(*h));
+    parallel_range(n, POOL_MIN_PIXELS, hist_range, &ha);
+    pthread_mutex_destroy(&ha.mu);
+}
+
+// ----- روشنایی -----
+typedef struct {
+    Image* img;
+    unsigned char* y;
+} LumaArgs;
+
+static void luma_range(int begin, int end, void* args) {
+    LumaArgs* la = (LumaArgs*)args;
+    const unsigned char* p = la->img->data + (size_t)begin * la->img->channels;
+    for (int i = begin; i < end; i++, p += la->img->channels)
+        la->y[i] = (unsigned char)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+}
+
+// صفحه‌ی Y؛ برای تصویر تک‌کاناله خود داده (نباید آزاد شود)، NULL اگر حافظه نبود
+static unsigned char* img_luma(Image* img) {
+    if (img->channels == 1) return img->data;
+    int n = img->width * img->height;
+    unsigned char* y = (unsigned char*)malloc(n);
+    if (!y) return NULL;
+    if (img->channels < 3) {
+        for (int i = 0; i < n; i++) y[i] = img->data[i * img->channels];
+        return y;
+    }
+    LumaArgs la = { img, y };
+    parallel_range(n, POOL_MIN_PIXELS, luma_range, &la);
+    return y;
+}
+
+// پیکسل i با روشنایی فعلی y به روشنایی ny
+static inline void luma_store(Image* img, int i, int y, int ny) {
+    unsigned char* p = img->data + (size_t)i * img->channels;
+    if (img->channels < 3) {
+        p[0] = (unsigned char)ny;
+        return;
+    }
+    int d = ny - y;
+    for (int ch = 0; ch < 3; ch++) p[ch] = (unsigned char)clampi(p[ch] + d, 0, 255);
+}
+
+// ----- Equalization -----
+typedef struct {
+    Image* img;
+    const unsigned char* y;
+    const unsigned char* lut;
+} LutArgs;
+
+static void lut_range(int begin, int end, void* args) {
+    LutArgs* la = (LutArgs*)args;
+    if (la->img->channels == 1) {
+        for (int i = begin; i < end; i++) la->img->data[i] = la->lut[la->y[i]];
+        return;
+    }
+    for (int i = begin; i < end; i++) luma_store(la->img, i, la->y[i], la->lut[la->y[i]]);
+}
+
+// 0 یا -1 اگر حافظه نبود
+static int equalize_hist(Image* img) {
+    int n = img->width * img->height;
+    unsigned char* y = img_luma(img);
+    if (!y) return -1;
+    uint64_t h[1][256];
+    hist_compute(y, n, 1, h);
+    
+    // مثل OpenCV: اولین سطح موجود 0 می‌شود و بقیه به نسبت CDF تا 255
+    unsigned char lut[256] = { 0 };
+    int lo = 0;
+    while (!h[0][lo]) lo++;
+    if (h[0][lo] == (uint64_t)n) {
+        lut[lo] = (unsigned char)lo;
+    } else {
+        double scale = 255.0 / (n - h[0][lo]);
+        uint64_t cdf = 0;
+        for (int v = lo + 1; v < 256; v++) {
+            cdf += h[0][v];
+            lut[v] = (unsigned char)(cdf * scale + 0.5);
+        }
+    }
+    
+    LutArgs la = { img, y, lut };
+    parallel_range(n, POOL_MIN_PIXELS, lut_range, &la);
+    if (y != img->data) free(y);
+    return 0;
+}
+
+// ----- CLAHE -----
+typedef struct {
+    Image* img;
+    const unsigned char* y;
+    int w, h, tx, ty;
+    float clip;
+    unsigned char (*lut)[256];   // [ty * tx]
+    const int* xa;               // ستون x: tileهای چپ و راست و وزن راست
+    const int* xb;
+    const float* wx;
+} ClaheArgs;
+
+static void clahe_tiles(int begin, int end, void* args) {
+    ClaheArgs* ca = (ClaheArgs*)args;
+    HistWays t;
+    uint32_t h[256];
+    for (int k = begin; k < end; k++) {
+        int i = k % ca->tx, j = k / ca->tx;
+        int x0 = (int)((long)i * ca->w / ca->tx), x1 = (int)((long)(i + 1) * ca->w / ca->tx);
+        int y0 = (int)((long)j * ca->h / ca->ty), y1 = (int)((long)(j + 1) * ca->h / ca->ty);
+        memset(t, 0, sizeof(t));
+        for (int yy = y0; yy < y1; yy++) hist_gray(ca->y + (size_t)yy * ca->w + x0, x1 - x0, t);
+        hist_fold(t, h);
+        
+        int area = (x1 - x0) * (y1 - y0);
+        if (ca->clip > 0) {
+            int limit = (int)(ca->clip * area / 256);
+            if (limit < 1) limit = 1;
+            int excess = 0;
+            for (int v = 0; v < 256; v++)
+                if ((int)h[v] > limit) {
+                    excess += h[v] - limit;
+                    h[v] = limit;
+                }
+            int add = excess / 256, rest = excess % 256;
+            for (int v = 0; v < 256; v++) h[v] += add;
+            if (rest) {
+                int step = 256 / rest;
+                for (int v = 0; v < 256 && rest > 0; v += step, rest--) h[v]++;
+            }
+        }
+        
+        float scale = 255.0f / area;
+        uint32_t cdf = 0;
+        for (int v = 0; v < 256; v++) {
+            cdf += h[v];
+            ca->lut[k][v] = (unsigned char)clampi((int)(cdf * scale + 0.5f), 0, 255);
+        }
+    }
+}
+
+// مرکز tile i در (i + 0.5) × size / tiles؛ tile پایین‌تر، بالاتر و وزن بالاتر برای مختصات p
+static inline void clahe_neighbours(int p, int size, int tiles, int* a, int* b, float* wb) {
+    float f = (p + 0.5f) * tiles / size - 0.5f;
+    int i = (int)floorf(f);
+    *wb = f - i;
+    *a = clampi(i, 0, tiles - 1);
+    *b = clampi(i + 1, 0, tiles - 1);
+}
+
+static void clahe_rows(int begin, int end, void* args) {
+    ClaheArgs* ca = (ClaheArgs*)args;
+    for (int yy = begin; yy < end; yy++) {
+        int ja, jb;
+        float wy;
+        clahe_neighbours(yy, ca->h, ca->ty, &ja, &jb, &wy);
+        unsigned char (*top)[256] = ca->lut + ja * ca->tx;
+        unsigned char (*bot)[256] = ca->lut + jb * ca->tx;
+        const unsigned char* row = ca->y + (size_t)yy * ca->w;
+        for (int x = 0; x < ca->w; x++) {
+            int v = row[x], a = ca->xa[x], b = ca->xb[x];
+            float wx = ca->wx[x];
+            float up = top[a][v] + wx * (top[b][v] - top[a][v]);
+            float dn = bot[a][v] + wx * (bot[b][v] - bot[a][v]);
+            int ny = (int)(up + wy * (dn - up) + 0.5f);
+            if (ca->img->channels == 1) ca->img->data[(size_t)yy * ca->w + x] = (unsigned char)ny;
+            else luma_store(ca->img, yy * ca->w + x, v, ny);
+        }
+    }
+}
+
+// clip <= 0: بدون بریدن (AHE)؛ 0 یا -1 اگر حافظه نبود
+static int clahe(Image* img, float clip, int tx, int ty) {
+    int w = img->width, h = img->height;
+    if (tx > w) tx = w;
+    if (ty > h) ty = h;
+    unsigned char* y = img_luma(img);
+    unsigned char (*lut)[256] = malloc((size_t)tx * ty * sizeof(*lut));
+    int* xa = (int*)malloc(2 * w * sizeof(int));
+    float* wx = (float*)malloc(w * sizeof(float));
+    if (!y || !lut || !xa || !wx) {
+        if (y != img->data) free(y);
+        free(lut); free(xa); free(wx);
+        return -1;
+    }
+    int* xb = xa + w;
+    for (int x = 0; x < w; x++) clahe_neighbours(x, w, tx, &xa[x], &xb[x], &wx[x]);
+    
+    ClaheArgs ca = { img, y, w, h, tx, ty, clip, lut, xa, xb, wx };
+    parallel_range(tx * ty, 1, clahe_tiles, &ca);
+    parallel_range(h, 16, clahe_rows, &ca);
+    
+    if (y != img->data) free(y);
+    free(lut); free(xa); free(wx);
+    return 0;
+}
+
+// ================== عملیات‌ها ==================
+/*
+ * هر عملیات تصویر *img را در جا تغییر می‌دهد (یا با تصویر تازه جایگزین می‌کند) و
+ * آرگومان‌هایش را از اندیس a روی استک می‌خواند. مقدار برگشتی تعداد نتایج اضافه‌ای است
+ * که روی استک گذاشته (مثلاً تعداد کانتورها)، یا -1 با پیام خطا روی استک.
+ * هر عملیات دو شکل در Lua دارد (IMG_OP را ببینید):
+ *   image.blur(input, output, ...)   خواندن فایل، یک عملیات، نوشتن فایل
+ *   img:blur(...)                    روی Image در حافظه؛ self برمی‌گردد تا زنجیر شود
+ */
+typedef int (*ImgOp)(lua_State *L, Image* img, int a);
+
+static void img_replace(Image* img, Image out) {
+    img_free(img);
+    *img = out;
+}
+
+static int img_nomem(lua_State *L) {
+    lua_pushstring(L, "Memory allocation failed");
+    return -1;
+}
+
+// نسخه‌ی خاکستری (همیشه تصویر تازه؛ کانال اول اگر رنگی نیست)
+static Image img_gray(Image src) {
+    Image gray = img_create(src.width, src.height, 1);
+    if (!gray.data) return gray;
+    for (int i = 0; i < src.width * src.height; i++) {
+        int idx = i * src.channels;
+        gray.data[i] = src.channels >= 3
+            ? (unsigned char)(0.299*src.data[idx] + 0.587*src.data[idx+1] + 0.114*src.data[idx+2])
+            : src.data[idx];
+    }
+    return gray;
+}
+
+// ----- Grayscale -----
+static int op_grayscale(lua_State *L, Image* img, int a) {
+    (void)a;
+    if (img->channels == 1) return 0;
+    Image gray = img_gray(*img);
+    if (!gray.data) return img_nomem(L);
+    img_replace(img, gray);
+    return 0;
+}
+
+// ----- Resize -----
+static int op_resize(lua_State *L, Image* img, int a) {
+    int new_w = luaL_checkinteger(L, a);
+    int new_h = luaL_checkinteger(L, a + 1);
+    
+    if (new_w <= 0 || new_h <= 0) {
+        lua_pushstring(L, "Width and height must be positive");
+        return -1;
+    }
+    
+    Image out = img_create(new_w, new_h, img->channels);
+    if (!out.data) return img_nomem(L);
+    
+    stbir_resize_uint8(img->data, img->width, img->height, 0,
+                       out.data, new_w, new_h, 0, img->channels);
+    img_replace(img, out);
+    return 0;
+}
+
+// ----- Crop -----
+static int op_crop(lua_State *L, Image* img, int a) {
+    int x = luaL_checkinteger(L, a);
+    int y = luaL_checkinteger(L, a + 1);
+    int w = luaL_checkinteger(L, a + 2);
+    int h = luaL_checkinteger(L, a + 3);
+    
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > img->width || y + h > img->height) {
+        lua_pushstring(L, "Invalid crop rectangle");
+        return -1;
+    }
+    
+    Image out = img_create(w, h, img->channels);
+    if (!out.data) return img_nomem(L);
+    
+    for (int cy = 0; cy < h; cy++) {
+        memcpy(&out.data[cy * w * img->channels],
+               &img->data[((y + cy) * img->width + x) * img->channels],
+               w * img->channels);
+    }
+    img_replace(img, out);
+    return 0;
+}
+
+// ----- Rotate -----
+static int op_rotate(lua_State *L, Image* img, int a) {
+    float angle = (float)luaL_checknumber(L, a);
     
     float rad = angle * PI / 180.0f;
     float cos_a = cos(rad);
     float sin_a = sin(rad);
     
-    int corners[4][2] = {{0,0}, {img.width,0}, {0,img.height}, {img.width,img.height}};
+    int corners[4][2] = {{0,0}, {img->width,0}, {0,img->height}, {img->width,img->height}};
     int min_x = 0, max_x = 0, min_y = 0, max_y = 0;
     
     for (int i = 0; i < 4; i++) {
@@ -638,247 +1943,129 @@ static int l_img_rotate(lua_State *L) {
     int offset_x = -min_x;
     int offset_y = -min_y;
     
-    Image out = img_create(new_w, new_h, img.channels);
-    if (!out.data) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
-    }
-    
-    memset(out.data, 0, new_w * new_h * img.channels);
+    Image out = img_create(new_w, new_h, img->channels);
+    if (!out.data) return img_nomem(L);
     
     for (int y = 0; y < new_h; y++) {
         for (int x = 0; x < new_w; x++) {
             int src_x = (int)((x - offset_x) * cos_a + (y - offset_y) * sin_a);
             int src_y = (int)(-(x - offset_x) * sin_a + (y - offset_y) * cos_a);
             
-            if (src_x >= 0 && src_x < img.width && src_y >= 0 && src_y < img.height) {
-                int src_idx = (src_y * img.width + src_x) * img.channels;
-                int dst_idx = (y * new_w + x) * img.channels;
-                memcpy(&out.data[dst_idx], &img.data[src_idx], img.channels);
+            if (src_x >= 0 && src_x < img->width && src_y >= 0 && src_y < img->height) {
+                int src_idx = (src_y * img->width + src_x) * img->channels;
+                int dst_idx = (y * new_w + x) * img->channels;
+                memcpy(&out.data[dst_idx], &img->data[src_idx], img->channels);
             }
         }
     }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Blur -----
-static int l_img_blur(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    const char* type = luaL_optstring(L, 3, "gaussian");
-    int size = luaL_optinteger(L, 4, 5);
-    float sigma = (float)luaL_optnumber(L, 5, 1.5);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_create(img.width, img.height, img.channels);
-    if (!out.data) {
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
-    }
-    
-    if (strcmp(type, "gaussian") == 0) {
+// blur(type, size, sigma): gaussian (size=5)، average/box (size=3)، median (size=3)
+static int op_blur(lua_State *L, Image* img, int a) {
+    const char* type = luaL_optstring(L, a, "gaussian");
+    int gauss = strcmp(type, "gaussian") == 0;
+    int size = (int)luaL_optinteger(L, a + 1, gauss ? 5 : 3);
+    float sigma = (float)luaL_optnumber(L, a + 2, 0);
+    int median = strcmp(type, "median") == 0;
+    if (size < 1 || size > (median ? MEDIAN_MAX_SIZE : BLUR_MAX_SIZE)) {
+        lua_pushstring(L, median ? "Median size must be 1..255" : "Blur size must be 1..4095");
+        return -1;
+    }
+    size |= 1;
+    if (sigma <= 0) sigma = 0.3f * size;     // size=5 → 1.5، پیش‌فرض قبلی
+    
+    Image out = img_create(img->width, img->height, img->channels);
+    if (!out.data) return img_nomem(L);
+    
+    if (median) {
+        median_filter(img, &out, size / 2);
+    } else if (gauss) {
         Kernel k = create_gaussian_kernel(size, sigma);
-        parallel_for(&img, &out, gaussian_blur_row, k.kernel);
+        int ok = k.kernel && blur_separable(img, &out, k.kernel, k.size / 2);
         free(k.kernel);
-    } else if (strcmp(type, "median") == 0) {
-        parallel_for(&img, &out, median_filter_row, NULL);
-    } else {
-        // average blur: استفاده از کرنل میانگین‌گیر ساده
-        float* avg_kernel = (float*)malloc(9 * sizeof(float));
-        for (int i = 0; i < 9; i++) avg_kernel[i] = 1.0f/9.0f;
-        parallel_for(&img, &out, gaussian_blur_row, avg_kernel);
-        free(avg_kernel);
-    }
-    
-    // کپی مرزها (بدون تغییر)
-    for (int y = 0; y < img.height; y++) {
-        for (int x = 0; x < img.width; x++) {
-            if (y == 0 || y == img.height-1 || x == 0 || x == img.width-1) {
-                int idx = (y * img.width + x) * img.channels;
-                memcpy(&out.data[idx], &img.data[idx], img.channels);
-            }
-        }
+        if (!ok) { img_free(&out); return img_nomem(L); }
+    } else if (!blur_separable(img, &out, NULL, size / 2)) {
+        // average/box و هر نوع ناشناخته
+        img_free(&out);
+        return img_nomem(L);
     }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Sobel -----
-static int l_img_sobel(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    // تبدیل به خاکستری
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
-    
-    Image out = img_create(img.width, img.height, 1);
-    if (!out.data) {
-        if (img.channels > 1) img_free(&gray);
-        img_free(&img);
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Memory allocation failed");
-        return 2;
+static int op_sobel(lua_State *L, Image* img, int a) {
+    (void)a;
+    Image gray = img_gray(*img);
+    Image out = img_create(img->width, img->height, 1);
+    if (!gray.data || !out.data) {
+        img_free(&gray);
+        img_free(&out);
+        return img_nomem(L);
     }
     
     int Gx[3][3] = {{-1,0,1},{-2,0,2},{-1,0,1}};
     int Gy[3][3] = {{-1,-2,-1},{0,0,0},{1,2,1}};
     
-    for (int y = 1; y < img.height-1; y++) {
-        for (int x = 1; x < img.width-1; x++) {
+    for (int y = 1; y < img->height-1; y++) {
+        for (int x = 1; x < img->width-1; x++) {
             int sum_x = 0, sum_y = 0;
             for (int ky = -1; ky <= 1; ky++) {
                 for (int kx = -1; kx <= 1; kx++) {
-                    int pixel = gray.data[(y+ky)*img.width + (x+kx)];
+                    int pixel = gray.data[(y+ky)*img->width + (x+kx)];
                     sum_x += pixel * Gx[ky+1][kx+1];
                     sum_y += pixel * Gy[ky+1][kx+1];
                 }
             }
             int mag = (int)sqrt(sum_x*sum_x + sum_y*sum_y);
             if (mag > 255) mag = 255;
-            out.data[y*img.width + x] = (unsigned char)mag;
+            out.data[y*img->width + x] = (unsigned char)mag;
         }
     }
     
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_free(&gray);
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Canny -----
-static int l_img_canny(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    float low = (float)luaL_optnumber(L, 3, 50);
-    float high = (float)luaL_optnumber(L, 4, 150);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
+static int op_canny(lua_State *L, Image* img, int a) {
+    float low = (float)luaL_optnumber(L, a, 50);
+    float high = (float)luaL_optnumber(L, a + 1, 150);
     
     Image out;
-    canny_edge_detection(img, &out, low, high);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    canny_edge_detection(*img, &out, low, high);
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Simple Threshold -----
-static int l_img_threshold(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int thresh = luaL_checkinteger(L, 3);
-    int maxval = luaL_checkinteger(L, 4);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
+static int op_threshold(lua_State *L, Image* img, int a) {
+    int thresh = luaL_checkinteger(L, a);
+    int maxval = luaL_checkinteger(L, a + 1);
     
-    Image out = img_create(img.width, img.height, 1);
-    for (int i = 0; i < img.width * img.height; i++) {
-        out.data[i] = (gray.data[i] > thresh) ? maxval : 0;
+    Image out = img_gray(*img);
+    if (!out.data) return img_nomem(L);
+    for (int i = 0; i < img->width * img->height; i++) {
+        out.data[i] = (out.data[i] > thresh) ? maxval : 0;
     }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Otsu Threshold -----
-static int l_img_otsu(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
+static int op_otsu(lua_State *L, Image* img, int a) {
+    (void)a;
+    Image out = img_gray(*img);
+    if (!out.data) return img_nomem(L);
     
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
-    
-    int hist[256] = {0};
-    int total = img.width * img.height;
-    for (int i = 0; i < total; i++) {
-        hist[gray.data[i]]++;
+    int hist[256] = {0};
+    int total = img->width * img->height;
+    for (int i = 0; i < total; i++) {
+        hist[out.data[i]]++;
     }
     
     float sum = 0;
@@ -905,712 +2092,409 @@ static int l_img_otsu(lua_State *L) {
         }
     }
     
-    Image out = img_create(img.width, img.height, 1);
     for (int i = 0; i < total; i++) {
-        out.data[i] = (gray.data[i] > threshold) ? 255 : 0;
+        out.data[i] = (out.data[i] > threshold) ? 255 : 0;
     }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_replace(img, out);
+    return 0;
 }
 
 // ----- Adaptive Threshold -----
-static int l_img_adaptive_threshold(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int block_size = luaL_checkinteger(L, 3);
-    int C = luaL_checkinteger(L, 4);
+static int op_adaptive_threshold(lua_State *L, Image* img, int a) {
+    int block_size = luaL_checkinteger(L, a);
+    int C = luaL_checkinteger(L, a + 1);
     
     if (block_size % 2 == 0) block_size++;
     
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
+    Image gray = img_gray(*img);
+    Image out = img_create(img->width, img->height, 1);
+    if (!gray.data || !out.data) {
+        img_free(&gray);
+        img_free(&out);
+        return img_nomem(L);
     }
-    
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
-    
-    Image out = img_create(img.width, img.height, 1);
     int half = block_size / 2;
     
-    for (int y = 0; y < img.height; y++) {
-        for (int x = 0; x < img.width; x++) {
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
             int sum = 0, count = 0;
             for (int dy = -half; dy <= half; dy++) {
                 for (int dx = -half; dx <= half; dx++) {
                     int ny = y + dy, nx = x + dx;
-                    if (ny >= 0 && ny < img.height && nx >= 0 && nx < img.width) {
-                        sum += gray.data[ny * img.width + nx];
+                    if (ny >= 0 && ny < img->height && nx >= 0 && nx < img->width) {
+                        sum += gray.data[ny * img->width + nx];
                         count++;
                     }
                 }
             }
             int threshold = sum / count - C;
-            out.data[y * img.width + x] = (gray.data[y * img.width + x] > threshold) ? 255 : 0;
+            out.data[y * img->width + x] = (gray.data[y * img->width + x] > threshold) ? 255 : 0;
         }
     }
     
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_free(&gray);
+    img_replace(img, out);
+    return 0;
 }
 
-// ----- Erode -----
-static int l_img_erode(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int size = luaL_optinteger(L, 3, 3);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
+// ----- Erode / Dilate -----
+// dilate = 0: کمینه‌ی همسایگی (erode)، 1: بیشینه (dilate)
+static int morph(lua_State *L, Image* img, int size, int dilate) {
+    Image gray = img_gray(*img);
+    Image out = img_create(img->width, img->height, 1);
+    if (!gray.data || !out.data) {
+        img_free(&gray);
+        img_free(&out);
+        return img_nomem(L);
     }
-    
-    Image out = img_create(img.width, img.height, 1);
     int half = size / 2;
     
-    for (int y = half; y < img.height - half; y++) {
-        for (int x = half; x < img.width - half; x++) {
-            unsigned char min_val = 255;
+    for (int y = half; y < img->height - half; y++) {
+        for (int x = half; x < img->width - half; x++) {
+            unsigned char best = dilate ? 0 : 255;
             for (int dy = -half; dy <= half; dy++) {
                 for (int dx = -half; dx <= half; dx++) {
-                    unsigned char val = gray.data[(y + dy) * img.width + (x + dx)];
-                    if (val < min_val) min_val = val;
+                    unsigned char val = gray.data[(y + dy) * img->width + (x + dx)];
+                    if (dilate ? val > best : val < best) best = val;
                 }
             }
-            out.data[y * img.width + x] = min_val;
+            out.data[y * img->width + x] = best;
         }
     }
     
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    img_free(&gray);
+    img_replace(img, out);
+    return 0;
 }
 
-// ----- Dilate -----
-static int l_img_dilate(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int size = luaL_optinteger(L, 3, 3);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
-    
-    Image out = img_create(img.width, img.height, 1);
-    int half = size / 2;
-    
-    for (int y = half; y < img.height - half; y++) {
-        for (int x = half; x < img.width - half; x++) {
-            unsigned char max_val = 0;
-            for (int dy = -half; dy <= half; dy++) {
-                for (int dx = -half; dx <= half; dx++) {
-                    unsigned char val = gray.data[(y + dy) * img.width + (x + dx)];
-                    if (val > max_val) max_val = val;
-                }
-            }
-            out.data[y * img.width + x] = max_val;
-        }
-    }
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+static int op_erode(lua_State *L, Image* img, int a) {
+    return morph(L, img, luaL_optinteger(L, a, 3), 0);
 }
 
-// ----- Open -----
-static int l_img_open(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    // erosion first
-    lua_pushvalue(L, 1);
-    lua_pushstring(L, "/tmp/_temp_eroded.jpg");
-    lua_pushinteger(L, 3);
-    l_img_erode(L);
-    
-    // then dilation
-    lua_pushstring(L, "/tmp/_temp_eroded.jpg");
-    lua_pushvalue(L, 2);
-    lua_pushinteger(L, 3);
-    int result = l_img_dilate(L);
-    
-    remove("/tmp/_temp_eroded.jpg");
-    return result;
+static int op_dilate(lua_State *L, Image* img, int a) {
+    return morph(L, img, luaL_optinteger(L, a, 3), 1);
 }
 
-// ----- Close -----
-static int l_img_close(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    // dilation first
-    lua_pushvalue(L, 1);
-    lua_pushstring(L, "/tmp/_temp_dilated.jpg");
-    lua_pushinteger(L, 3);
-    l_img_dilate(L);
-    
-    // then erosion
-    lua_pushstring(L, "/tmp/_temp_dilated.jpg");
-    lua_pushvalue(L, 2);
-    lua_pushinteger(L, 3);
-    int result = l_img_erode(L);
-    
-    remove("/tmp/_temp_dilated.jpg");
-    return result;
+// ----- Open / Close (در حافظه، بدون فایل موقت) -----
+static int op_open(lua_State *L, Image* img, int a) {
+    int size = luaL_optinteger(L, a, 3);
+    if (morph(L, img, size, 0) < 0) return -1;
+    return morph(L, img, size, 1);
+}
+
+static int op_close(lua_State *L, Image* img, int a) {
+    int size = luaL_optinteger(L, a, 3);
+    if (morph(L, img, size, 1) < 0) return -1;
+    return morph(L, img, size, 0);
 }
 
 // ----- Detect Faces (نمونه) -----
-static int l_img_detect_faces(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    
+static int op_detect_faces(lua_State *L, Image* img, int a) {
+    (void)a;
     // نمونه: یک مستطیل سبز دور صورت فرضی
-    int x = img.width / 4;
-    int y = img.height / 4;
-    int w = img.width / 2;
-    int h = img.height / 2;
+    int x = img->width / 4;
+    int y = img->height / 4;
+    int w = img->width / 2;
+    int h = img->height / 2;
     
-    draw_rectangle(&out, x, y, w, h, 0, 255, 0, 3);
-    draw_text(&out, x + 10, y - 10, "FACE", 0, 255, 0, 2);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
+    draw_rectangle(img, x, y, w, h, 0, 255, 0, 3);
+    draw_text(img, x + 10, y - 10, "FACE", 0, 255, 0, 2);
     
-    lua_pushboolean(L, success);
     lua_pushinteger(L, 1);
-    return 2;
+    return 1;
 }
 
 // ----- Detect Plate (نمونه) -----
-static int l_img_detect_plate(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    
-    int x = img.width / 4;
-    int y = img.height / 3;
-    int w = img.width / 2;
-    int h = img.height / 6;
+static int op_detect_plate(lua_State *L, Image* img, int a) {
+    (void)a;
+    int x = img->width / 4;
+    int y = img->height / 3;
+    int w = img->width / 2;
+    int h = img->height / 6;
     
-    draw_rectangle(&out, x, y, w, h, 255, 0, 0, 3);
-    draw_text(&out, x + 5, y - 20, "PLATE", 255, 255, 255, 2);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
+    draw_rectangle(img, x, y, w, h, 255, 0, 0, 3);
+    draw_text(img, x + 5, y - 20, "PLATE", 255, 255, 255, 2);
     
-    lua_pushboolean(L, success);
     lua_pushinteger(L, 1);
-    return 2;
+    return 1;
 }
 
 // ----- Hough Lines (نمونه) -----
-static int l_img_hough_lines(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    
+static int op_hough_lines(lua_State *L, Image* img, int a) {
+    (void)a;
     // رسم دو خط نمونه
-    draw_line(&out, 50, 50, 200, 50, 0, 255, 0, 2);
-    draw_line(&out, 50, 100, 200, 100, 0, 255, 0, 2);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
+    draw_line(img, 50, 50, 200, 50, 0, 255, 0, 2);
+    draw_line(img, 50, 100, 200, 100, 0, 255, 0, 2);
     
-    lua_pushboolean(L, success);
     lua_pushinteger(L, 2);
-    return 2;
-}
-
-// ----- Template Match (نمونه) -----
-static int l_img_template_match(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* template_path = luaL_checkstring(L, 2);
-    const char* output = luaL_checkstring(L, 3);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    
-    int x = 100;
-    int y = 100;
-    
-    draw_rectangle(&out, x, y, 50, 50, 255, 255, 0, 2);
-    draw_text(&out, x, y - 10, "TEMPLATE", 255, 255, 0, 1);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    lua_pushinteger(L, x);
-    lua_pushinteger(L, y);
-    return 3;
-}
-
-// ----- K-means (placeholder) -----
-static int l_img_kmeans(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int k = luaL_checkinteger(L, 3);
-    int max_iters = luaL_optinteger(L, 4, 10);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    // فعلاً همان تصویر را کپی می‌کنیم
-    int success = img_write(output, img);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
     return 1;
 }
 
-// ----- Equalize Histogram (placeholder) -----
-static int l_img_equalize_hist(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
-    
-    lua_pushboolean(L, success);
-    return 1;
+/*
+ * الگو در a (مسیر یا Image)، count در a+1 (پیش‌فرض 1) و min_score در a+2 (پیش‌فرض -1).
+ * تعداد نتیجه‌ها در *out (که باید free شود) یا -1 با پیام خطا روی استک؛ اندازه‌ی الگو در tw، th.
+ * همه‌ی آرگومان‌ها قبل از خواندن الگو از فایل بررسی می‌شوند تا خطای Lua آن را نشت ندهد.
+ */
+static int match_run(lua_State *L, Image* img, int a, Match** out, int* tw, int* th) {
+    int count = (int)luaL_optinteger(L, a + 1, 1);
+    float min_score = (float)luaL_optnumber(L, a + 2, -1);
+    if (count < 1 || count > MATCH_MAX) {
+        lua_pushstring(L, "Match count must be 1..1000");
+        return -1;
+    }
+    Image tpl = {NULL, 0, 0, 0};
+    Image* tu = (Image*)luaL_testudata(L, a, IMAGE_MT);
+    if (tu) {
+        if (!tu->data) luaL_argerror(L, a, "image has been freed");
+    } else {
+        tpl = img_read(luaL_checkstring(L, a));
+        if (!tpl.data) {
+            lua_pushstring(L, "Failed to read template image");
+            return -1;
+        }
+        tu = &tpl;
+    }
+    if (tu->width > img->width || tu->height > img->height) {
+        img_free(&tpl);
+        lua_pushstring(L, "Template larger than image");
+        return -1;
+    }
+    
+    *tw = tu->width;
+    *th = tu->height;
+    Image g = img_gray(*img), t = img_gray(*tu);
+    img_free(&tpl);
+    float* map = g.data && t.data ? ncc_map(&g, &t, -1) : NULL;
+    img_free(&g);
+    img_free(&t);
+    *out = (Match*)malloc(count * sizeof(Match));
+    if (!map || !*out) {
+        free(map);
+        free(*out);
+        return img_nomem(L);
+    }
+    int n = ncc_peaks(map, img->width - *tw + 1, img->height - *th + 1, *tw, *th, count, min_score, *out);
+    free(map);
+    return n;
 }
 
-// ----- Histogram (نمایش در کنسول) -----
-static int l_img_histogram(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read image");
-        return 2;
+// آرایه‌ی {x, y, score} به ترتیب امتیاز
+static void push_matches(lua_State *L, const Match* m, int n) {
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, m[i].x);
+        lua_setfield(L, -2, "x");
+        lua_pushinteger(L, m[i].y);
+        lua_setfield(L, -2, "y");
+        lua_pushnumber(L, m[i].score);
+        lua_setfield(L, -2, "score");
+        lua_rawseti(L, -2, i + 1);
     }
-    
-    printf("Histogram for %s:\n", input);
-    printf("Image size: %dx%d\n", img.width, img.height);
-    
-    img_free(&img);
-    
-    lua_pushboolean(L, 1);
-    return 1;
 }
 
-// ----- Info -----
-static int l_img_info(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
+// دور هر نتیجه کادر می‌کشد؛ x, y, score بهترین و آرایه‌ی همه را برمی‌گرداند
+static int op_template_match(lua_State *L, Image* img, int a) {
+    Match* m = NULL;
+    int tw, th;
+    int n = match_run(L, img, a, &m, &tw, &th);
+    if (n < 0) return -1;
+    
+    for (int i = 0; i < n; i++)
+        draw_rectangle(img, m[i].x, m[i].y, tw, th, 255, 255, 0, 2);
+    if (n > 0) {
+        draw_text(img, m[0].x, m[0].y - 10, "TEMPLATE", 255, 255, 0, 1);
+        lua_pushinteger(L, m[0].x);
+        lua_pushinteger(L, m[0].y);
+        lua_pushnumber(L, m[0].score);
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
         lua_pushnil(L);
-        lua_pushstring(L, "Failed to read image");
-        return 2;
-    }
-    
-    lua_createtable(L, 0, 4);
-    lua_pushinteger(L, img.width);
-    lua_setfield(L, -2, "width");
-    lua_pushinteger(L, img.height);
-    lua_setfield(L, -2, "height");
-    lua_pushinteger(L, img.channels);
-    lua_setfield(L, -2, "channels");
-    lua_pushinteger(L, img.width * img.height * img.channels);
-    lua_setfield(L, -2, "size_bytes");
-    
-    img_free(&img);
-    return 1;
-}
-
-// ----- Version -----
-static int l_img_version(lua_State *L) {
-    lua_createtable(L, 0, 4);
-    lua_pushstring(L, "3.0.0");
-    lua_setfield(L, -2, "version");
-    lua_pushstring(L, "Professional Computer Vision Library for Byte");
-    lua_setfield(L, -2, "name");
-    lua_pushinteger(L, MAX_THREADS);
-    lua_setfield(L, -2, "max_threads");
-    lua_pushboolean(L, 1);
-    lua_setfield(L, -2, "supports_face_detection");
-    return 1;
-}
-
-// ================== توابع رسم جدید (Lua Wrapper) ==================
-
-static int l_img_draw_line(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int x1 = luaL_checkinteger(L, 3);
-    int y1 = luaL_checkinteger(L, 4);
-    int x2 = luaL_checkinteger(L, 5);
-    int y2 = luaL_checkinteger(L, 6);
-    int r = luaL_optinteger(L, 7, 255);
-    int g = luaL_optinteger(L, 8, 0);
-    int b = luaL_optinteger(L, 9, 0);
-    int thickness = luaL_optinteger(L, 10, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    img_free(&img);
-    
-    draw_line(&out, x1, y1, x2, y2, r, g, b, thickness);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    
-    lua_pushboolean(L, success);
-    return 1;
-}
-
-static int l_img_draw_rect(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int x = luaL_checkinteger(L, 3);
-    int y = luaL_checkinteger(L, 4);
-    int w = luaL_checkinteger(L, 5);
-    int h = luaL_checkinteger(L, 6);
-    int r = luaL_optinteger(L, 7, 255);
-    int g = luaL_optinteger(L, 8, 0);
-    int b = luaL_optinteger(L, 9, 0);
-    int thickness = luaL_optinteger(L, 10, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    img_free(&img);
-    
-    draw_rectangle(&out, x, y, w, h, r, g, b, thickness);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    
-    lua_pushboolean(L, success);
-    return 1;
-}
-
-static int l_img_fill_rect(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int x = luaL_checkinteger(L, 3);
-    int y = luaL_checkinteger(L, 4);
-    int w = luaL_checkinteger(L, 5);
-    int h = luaL_checkinteger(L, 6);
-    int r = luaL_optinteger(L, 7, 255);
-    int g = luaL_optinteger(L, 8, 0);
-    int b = luaL_optinteger(L, 9, 0);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
-    img_free(&img);
-    
-    fill_rectangle(&out, x, y, w, h, r, g, b);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    
-    lua_pushboolean(L, success);
-    return 1;
-}
-
-static int l_img_draw_circle(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int cx = luaL_checkinteger(L, 3);
-    int cy = luaL_checkinteger(L, 4);
-    int radius = luaL_checkinteger(L, 5);
-    int r = luaL_optinteger(L, 6, 255);
-    int g = luaL_optinteger(L, 7, 0);
-    int b = luaL_optinteger(L, 8, 0);
-    int thickness = luaL_optinteger(L, 9, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
     }
-    
-    Image out = img_copy(img);
-    img_free(&img);
-    
-    draw_circle(&out, cx, cy, radius, r, g, b, thickness);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    push_matches(L, m, n);
+    free(m);
+    return 4;
 }
 
-static int l_img_draw_text(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int x = luaL_checkinteger(L, 3);
-    int y = luaL_checkinteger(L, 4);
-    const char* text = luaL_checkstring(L, 5);
-    int r = luaL_optinteger(L, 6, 255);
-    int g = luaL_optinteger(L, 7, 255);
-    int b = luaL_optinteger(L, 8, 255);
-    int scale = luaL_optinteger(L, 9, 2);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
+// ----- K-means -----
+// kmeans(k [, iters [, batch]]) → مراکز {{r, g, b}, ...} (خاکستری: {{v}, ...}) و تعداد دورها
+static int op_kmeans(lua_State *L, Image* img, int a) {
+    int k = luaL_checkinteger(L, a);
+    int iters = luaL_optinteger(L, a + 1, 10);
+    int batch = luaL_optinteger(L, a + 2, 0);
+    if (k < 1 || k > KMEANS_MAX_K || iters < 1 || batch < 0) {
+        lua_pushstring(L, "Invalid k-means parameters (k 1..256, iters >= 1, batch >= 0)");
+        return -1;
+    }
+    
+    unsigned char color[KMEANS_MAX_K][3];
+    int it = kmeans_quantize(img, k, iters, batch, color);
+    if (it < 0) return img_nomem(L);
+    
+    int d = img->channels >= 3 ? 3 : 1;
+    lua_createtable(L, k, 0);
+    for (int j = 0; j < k; j++) {
+        lua_createtable(L, d, 0);
+        for (int t = 0; t < d; t++) {
+            lua_pushinteger(L, color[j][t]);
+            lua_rawseti(L, -2, t + 1);
+        }
+        lua_rawseti(L, -2, j + 1);
     }
+    lua_pushinteger(L, it);
+    return 2;
+}
+
+// ----- Equalize Histogram -----
+static int op_equalize_hist(lua_State *L, Image* img, int a) {
+    (void)a;
+    if (equalize_hist(img) < 0) return img_nomem(L);
+    return 0;
+}
+
+// ----- CLAHE -----
+// clahe([clip [, tiles_x [, tiles_y]]]): پیش‌فرض 2.0 و شبکه‌ی 8×8
+static int op_clahe(lua_State *L, Image* img, int a) {
+    float clip = (float)luaL_optnumber(L, a, 2.0);
+    int tx = luaL_optinteger(L, a + 1, 8);
+    int ty = luaL_optinteger(L, a + 2, tx);
+    if (!(clip >= 0) || tx < 1 || ty < 1 || tx > CLAHE_MAX_TILES || ty > CLAHE_MAX_TILES) {
+        lua_pushstring(L, "Invalid CLAHE parameters (clip >= 0, tiles 1..64)");
+        return -1;
+    }
+    if (clahe(img, clip, tx, ty) < 0) return img_nomem(L);
+    return 0;
+}
+
+// ----- رسم -----
+static int op_draw_line(lua_State *L, Image* img, int a) {
+    int x1 = luaL_checkinteger(L, a);
+    int y1 = luaL_checkinteger(L, a + 1);
+    int x2 = luaL_checkinteger(L, a + 2);
+    int y2 = luaL_checkinteger(L, a + 3);
+    int r = luaL_optinteger(L, a + 4, 255);
+    int g = luaL_optinteger(L, a + 5, 0);
+    int b = luaL_optinteger(L, a + 6, 0);
+    int thickness = luaL_optinteger(L, a + 7, 1);
+    
+    draw_line(img, x1, y1, x2, y2, r, g, b, thickness);
+    return 0;
+}
+
+static int op_draw_rect(lua_State *L, Image* img, int a) {
+    int x = luaL_checkinteger(L, a);
+    int y = luaL_checkinteger(L, a + 1);
+    int w = luaL_checkinteger(L, a + 2);
+    int h = luaL_checkinteger(L, a + 3);
+    int r = luaL_optinteger(L, a + 4, 255);
+    int g = luaL_optinteger(L, a + 5, 0);
+    int b = luaL_optinteger(L, a + 6, 0);
+    int thickness = luaL_optinteger(L, a + 7, 1);
+    
+    draw_rectangle(img, x, y, w, h, r, g, b, thickness);
+    return 0;
+}
+
+static int op_fill_rect(lua_State *L, Image* img, int a) {
+    int x = luaL_checkinteger(L, a);
+    int y = luaL_checkinteger(L, a + 1);
+    int w = luaL_checkinteger(L, a + 2);
+    int h = luaL_checkinteger(L, a + 3);
+    int r = luaL_optinteger(L, a + 4, 255);
+    int g = luaL_optinteger(L, a + 5, 0);
+    int b = luaL_optinteger(L, a + 6, 0);
     
-    Image out = img_copy(img);
-    img_free(&img);
-    
-    draw_text(&out, x, y, text, r, g, b, scale);
-    
-    int success = img_write(output, out);
-    img_free(&out);
-    
-    lua_pushboolean(L, success);
-    return 1;
+    fill_rectangle(img, x, y, w, h, r, g, b);
+    return 0;
 }
 
-static int l_img_detect_contours(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int r = luaL_optinteger(L, 3, 0);
-    int g = luaL_optinteger(L, 4, 255);
-    int b = luaL_optinteger(L, 5, 0);
-    int thickness = luaL_optinteger(L, 6, 2);
+static int op_draw_circle(lua_State *L, Image* img, int a) {
+    int cx = luaL_checkinteger(L, a);
+    int cy = luaL_checkinteger(L, a + 1);
+    int radius = luaL_checkinteger(L, a + 2);
+    int r = luaL_optinteger(L, a + 3, 255);
+    int g = luaL_optinteger(L, a + 4, 0);
+    int b = luaL_optinteger(L, a + 5, 0);
+    int thickness = luaL_optinteger(L, a + 6, 1);
     
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
+    draw_circle(img, cx, cy, radius, r, g, b, thickness);
+    return 0;
+}
+
+static int op_draw_text(lua_State *L, Image* img, int a) {
+    int x = luaL_checkinteger(L, a);
+    int y = luaL_checkinteger(L, a + 1);
+    const char* text = luaL_checkstring(L, a + 2);
+    int r = luaL_optinteger(L, a + 3, 255);
+    int g = luaL_optinteger(L, a + 4, 255);
+    int b = luaL_optinteger(L, a + 5, 255);
+    int scale = luaL_optinteger(L, a + 6, 2);
     
-    // تبدیل به خاکستری
-    Image gray;
-    if (img.channels > 1) {
-        gray = img_create(img.width, img.height, 1);
-        for (int i = 0; i < img.width * img.height; i++) {
-            int idx = i * img.channels;
-            gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-        }
-    } else {
-        gray = img;
-        gray.data = img.data;
-    }
+    draw_text(img, x, y, text, r, g, b, scale);
+    return 0;
+}
+
+static int op_detect_contours(lua_State *L, Image* img, int a) {
+    int r = luaL_optinteger(L, a, 0);
+    int g = luaL_optinteger(L, a + 1, 255);
+    int b = luaL_optinteger(L, a + 2, 0);
+    int thickness = luaL_optinteger(L, a + 3, 2);
     
-    // تشخیص لبه
+    // تشخیص لبه روی نسخه‌ی خاکستری
+    Image gray = img_gray(*img);
+    if (!gray.data) return img_nomem(L);
     Image edges;
     canny_edge_detection(gray, &edges, 50, 150);
     
-    // یافتن کانتورها
+    // یافتن کانتورها و رسم روی تصویر اصلی
     int num_contours;
     Rect* contours = find_contours(edges, &num_contours);
-    
-    // رسم روی تصویر اصلی
-    Image out = img_copy(img);
     for (int i = 0; i < num_contours; i++) {
         Rect rc = contours[i];
-        draw_rectangle(&out, rc.x, rc.y, rc.width, rc.height, r, g, b, thickness);
+        draw_rectangle(img, rc.x, rc.y, rc.width, rc.height, r, g, b, thickness);
     }
     
-    int success = img_write(output, out);
-    
-    // پاکسازی
-    img_free(&out);
     img_free(&edges);
-    if (img.channels > 1) img_free(&gray);
-    img_free(&img);
+    img_free(&gray);
     free(contours);
     
-    lua_pushboolean(L, success);
     lua_pushinteger(L, num_contours);
-    return 2;
+    return 1;
 }
 
-static int l_img_detect_plate_outline(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int color_choice = luaL_optinteger(L, 3, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
+static int op_detect_plate_outline(lua_State *L, Image* img, int a) {
+    int color_choice = luaL_optinteger(L, a, 1);
     
     int r = 255, g = 0, b = 0;
     if (color_choice == 2) { r = 0; g = 255; b = 0; }
     else if (color_choice == 3) { r = 0; g = 0; b = 255; }
     else if (color_choice == 4) { r = 255; g = 255; b = 0; }
     
-    int x = img.width / 4;
-    int y = img.height / 3;
-    int w = img.width / 2;
-    int h = img.height / 6;
-    
-    draw_rectangle(&out, x, y, w, h, r, g, b, 3);
-    draw_text(&out, x + 5, y - 20, "PLATE", 255, 255, 255, 2);
+    int x = img->width / 4;
+    int y = img->height / 3;
+    int w = img->width / 2;
+    int h = img->height / 6;
     
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
+    draw_rectangle(img, x, y, w, h, r, g, b, 3);
+    draw_text(img, x + 5, y - 20, "PLATE", 255, 255, 255, 2);
     
-    lua_pushboolean(L, success);
     lua_pushinteger(L, 1);
-    return 2;
+    return 1;
 }
 
-static int l_img_opencv_style(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    const char* output = luaL_checkstring(L, 2);
-    int mode = luaL_optinteger(L, 3, 1);
-    
-    Image img = img_read(input);
-    if (!img.data) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, "Failed to read input image");
-        return 2;
-    }
-    
-    Image out = img_copy(img);
+static int op_opencv_style(lua_State *L, Image* img, int a) {
+    int mode = luaL_optinteger(L, a, 1);
     
     if (mode == 1) {
         // حالت لبه‌ها: رسم لبه‌های سبز روی تصویر
         Image edges;
-        canny_edge_detection(img, &edges, 50, 150);
+        canny_edge_detection(*img, &edges, 50, 150);
         
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                if (edges.data[y * img.width + x] > 0) {
-                    draw_pixel(&out, x, y, 0, 255, 0);
+        for (int y = 0; y < img->height; y++) {
+            for (int x = 0; x < img->width; x++) {
+                if (edges.data[y * img->width + x] > 0) {
+                    draw_pixel(img, x, y, 0, 255, 0);
                 }
             }
         }
@@ -1618,17 +2502,8 @@ static int l_img_opencv_style(lua_State *L) {
         
     } else if (mode == 2) {
         // حالت کانتور: تشخیص و رسم کانتورها
-        Image gray;
-        if (img.channels > 1) {
-            gray = img_create(img.width, img.height, 1);
-            for (int i = 0; i < img.width * img.height; i++) {
-                int idx = i * img.channels;
-                gray.data[i] = (unsigned char)(0.299*img.data[idx] + 0.587*img.data[idx+1] + 0.114*img.data[idx+2]);
-            }
-        } else {
-            gray = img;
-            gray.data = img.data;
-        }
+        Image gray = img_gray(*img);
+        if (!gray.data) return img_nomem(L);
         
         Image edges;
         canny_edge_detection(gray, &edges, 50, 150);
@@ -1638,29 +2513,388 @@ static int l_img_opencv_style(lua_State *L) {
         
         for (int i = 0; i < num_contours; i++) {
             Rect rc = contours[i];
-            draw_rectangle(&out, rc.x, rc.y, rc.width, rc.height, 255, 0, 0, 2);
+            draw_rectangle(img, rc.x, rc.y, rc.width, rc.height, 255, 0, 0, 2);
         }
         
         free(contours);
         img_free(&edges);
-        if (img.channels > 1) img_free(&gray);
+        img_free(&gray);
         
     } else if (mode == 3) {
         // حالت پلاک: رسم مستطیل دور پلاک
-        int x = img.width / 4;
-        int y = img.height / 3;
-        int w = img.width / 2;
-        int h = img.height / 6;
+        int x = img->width / 4;
+        int y = img->height / 3;
+        int w = img->width / 2;
+        int h = img->height / 6;
         
-        draw_rectangle(&out, x, y, w, h, 255, 0, 0, 3);
-        draw_text(&out, x + 10, y - 10, "PLATE", 255, 255, 0, 2);
+        draw_rectangle(img, x, y, w, h, 255, 0, 0, 3);
+        draw_text(img, x + 10, y - 10, "PLATE", 255, 255, 0, 2);
+    }
+    return 0;
+}
+
+// ================== Image (userdata) ==================
+/*
+ * image.load(path) / image.decode(bytes) / image.new(w, h [, channels])
+ * پیکسل‌ها بین عملیات‌ها در حافظه می‌مانند؛ decode و encode فقط یک بار در هر pipeline:
+ *   image.load("in.jpg"):grayscale():blur("gaussian", 5):otsu():save("out.png")
+ * img.width، img.height، img.channels؛ img:clone()؛ img:free() حافظه را بی‌درنگ آزاد می‌کند.
+ */
+static Image* img_push(lua_State *L) {
+    Image* u = (Image*)lua_newuserdata(L, sizeof(Image));
+    memset(u, 0, sizeof(Image));
+    luaL_setmetatable(L, IMAGE_MT);
+    return u;
+}
+
+static Image* img_check(lua_State *L, int idx) {
+    Image* u = (Image*)luaL_checkudata(L, idx, IMAGE_MT);
+    if (!u->data) luaL_argerror(L, idx, "image has been freed");
+    return u;
+}
+
+// شکل فایل: input در 1، output در out_idx، آرگومان‌های عملیات از a
+static int img_file_op(lua_State *L, ImgOp op, int out_idx, int a) {
+    const char* input = luaL_checkstring(L, 1);
+    const char* output = luaL_checkstring(L, out_idx);
+    
+    // در userdata تا اگر عملیات خطای Lua داد، __gc حافظه را آزاد کند؛ جای input روی
+    // استک را می‌گیرد تا اندیس آرگومان‌های اختیاری عملیات جابه‌جا نشود
+    Image* img = img_push(L);
+    *img = img_read(input);
+    lua_replace(L, 1);
+    if (!img->data) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "Failed to read input image");
+        return 2;
     }
     
-    int success = img_write(output, out);
-    img_free(&out);
-    img_free(&img);
+    int n = op(L, img, a);
+    if (n < 0) {
+        img_free(img);
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+    
+    int success = img_write(output, *img);
+    img_free(img);
     
     lua_pushboolean(L, success);
+    lua_insert(L, -n - 1);
+    return n + 1;
+}
+
+// شکل متد: img:op(...) → img, نتایج اضافه | nil, خطا
+static int img_method_op(lua_State *L, ImgOp op) {
+    Image* img = img_check(L, 1);
+    int n = op(L, img, 2);
+    if (n < 0) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    lua_pushvalue(L, 1);
+    lua_insert(L, -n - 1);
+    return n + 1;
+}
+
+#define IMG_OP(name, out_idx, a) \
+    static int l_img_##name(lua_State *L) { return img_file_op(L, op_##name, out_idx, a); } \
+    static int m_img_##name(lua_State *L) { return img_method_op(L, op_##name); }
+
+IMG_OP(grayscale, 2, 3)
+IMG_OP(resize, 2, 3)
+IMG_OP(crop, 2, 3)
+IMG_OP(rotate, 2, 3)
+IMG_OP(blur, 2, 3)
+IMG_OP(sobel, 2, 3)
+IMG_OP(canny, 2, 3)
+IMG_OP(threshold, 2, 3)
+IMG_OP(otsu, 2, 3)
+IMG_OP(adaptive_threshold, 2, 3)
+IMG_OP(erode, 2, 3)
+IMG_OP(dilate, 2, 3)
+IMG_OP(open, 2, 3)
+IMG_OP(close, 2, 3)
+IMG_OP(detect_faces, 2, 3)
+IMG_OP(detect_plate, 2, 3)
+IMG_OP(hough_lines, 2, 3)
+IMG_OP(kmeans, 2, 3)
+IMG_OP(equalize_hist, 2, 3)
+IMG_OP(clahe, 2, 3)
+IMG_OP(draw_line, 2, 3)
+IMG_OP(draw_rect, 2, 3)
+IMG_OP(fill_rect, 2, 3)
+IMG_OP(draw_circle, 2, 3)
+IMG_OP(draw_text, 2, 3)
+IMG_OP(detect_contours, 2, 3)
+IMG_OP(detect_plate_outline, 2, 3)
+IMG_OP(opencv_style, 2, 3)
+
+// (input, template, output [, count [, min_score]]): output به انتها می‌رود تا گزینه‌ها
+// مثل شکل متد پشت الگو باشند
+static int l_img_template_match(lua_State *L) {
+    lua_settop(L, 5);
+    lua_rotate(L, 3, -1);
+    return img_file_op(L, op_template_match, 5, 2);
+}
+
+static int m_img_template_match(lua_State *L) { return img_method_op(L, op_template_match); }
+
+// ----- ساخت -----
+static int l_img_load(lua_State *L) {
+    const char* path = luaL_checkstring(L, 1);
+    Image* img = img_push(L);
+    *img = img_read(path);
+    if (!img->data) {
+        lua_pushnil(L);
+        lua_pushstring(L, stbi_failure_reason() ? stbi_failure_reason() : "Failed to read image");
+        return 2;
+    }
+    return 1;
+}
+
+// image.decode(bytes): PNG/JPEG/BMP/... از یک رشته (مثلاً بدنه‌ی پاسخ HTTP)
+static int l_img_decode(lua_State *L) {
+    size_t len;
+    const char* bytes = luaL_checklstring(L, 1, &len);
+    Image* img = img_push(L);
+    int w, h, c;
+    img->data = stbi_load_from_memory((const stbi_uc*)bytes, (int)len, &w, &h, &c, 0);
+    if (!img->data) {
+        lua_pushnil(L);
+        lua_pushstring(L, stbi_failure_reason() ? stbi_failure_reason() : "Failed to decode image");
+        return 2;
+    }
+    img->width = w;
+    img->height = h;
+    img->channels = c;
+    return 1;
+}
+
+static int l_img_new(lua_State *L) {
+    int w = luaL_checkinteger(L, 1);
+    int h = luaL_checkinteger(L, 2);
+    int c = luaL_optinteger(L, 3, 3);
+    luaL_argcheck(L, w > 0 && h > 0, 1, "width and height must be positive");
+    luaL_argcheck(L, c >= 1 && c <= 4, 3, "channels must be 1..4");
+    Image* img = img_push(L);
+    *img = img_create(w, h, c);
+    if (!img->data) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Memory allocation failed");
+        return 2;
+    }
+    return 1;
+}
+
+// ----- متدهای خود Image -----
+static int m_img_save(lua_State *L) {
+    Image* img = img_check(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    if (!img_write(path, *img)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to write image");
+        return 2;
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static void img_encode_cb(void* ctx, void* data, int size) {
+    luaL_addlstring((luaL_Buffer*)ctx, (const char*)data, size);
+}
+
+// img:encode(format [, quality]) → رشته؛ format: "png"، "jpg" یا "bmp"
+static int m_img_encode(lua_State *L) {
+    Image* img = img_check(L, 1);
+    const char* fmt = luaL_optstring(L, 2, "png");
+    int quality = luaL_optinteger(L, 3, 95);
+    luaL_Buffer B;
+    luaL_buffinit(L, &B);
+    int ok;
+    if (strcmp(fmt, "jpg") == 0 || strcmp(fmt, "jpeg") == 0)
+        ok = stbi_write_jpg_to_func(img_encode_cb, &B, img->width, img->height, img->channels, img->data, quality);
+    else if (strcmp(fmt, "png") == 0)
+        ok = stbi_write_png_to_func(img_encode_cb, &B, img->width, img->height, img->channels, img->data, img->width * img->channels);
+    else if (strcmp(fmt, "bmp") == 0)
+        ok = stbi_write_bmp_to_func(img_encode_cb, &B, img->width, img->height, img->channels, img->data);
+    else
+        return luaL_argerror(L, 2, "unknown format");
+    luaL_pushresult(&B);
+    if (!ok) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to encode image");
+        return 2;
+    }
+    return 1;
+}
+
+static int m_img_clone(lua_State *L) {
+    Image* img = img_check(L, 1);
+    Image* copy = img_push(L);
+    *copy = img_copy(*img);
+    if (!copy->data) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Memory allocation failed");
+        return 2;
+    }
+    return 1;
+}
+
+static int m_img_info(lua_State *L) {
+    Image* img = img_check(L, 1);
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, img->width);
+    lua_setfield(L, -2, "width");
+    lua_pushinteger(L, img->height);
+    lua_setfield(L, -2, "height");
+    lua_pushinteger(L, img->channels);
+    lua_setfield(L, -2, "channels");
+    lua_pushinteger(L, img->width * img->height * img->channels);
+    lua_setfield(L, -2, "size_bytes");
+    return 1;
+}
+
+static int m_img_free(lua_State *L) {
+    img_free((Image*)luaL_checkudata(L, 1, IMAGE_MT));
+    return 0;
+}
+
+static int m_img_tostring(lua_State *L) {
+    Image* img = (Image*)luaL_checkudata(L, 1, IMAGE_MT);
+    if (!img->data) lua_pushstring(L, "Image (freed)");
+    else lua_pushfstring(L, "Image (%dx%dx%d)", img->width, img->height, img->channels);
+    return 1;
+}
+
+// img.width / img.height / img.channels، بقیه از جدول متدها (upvalue)
+static int m_img_index(lua_State *L) {
+    Image* img = (Image*)luaL_checkudata(L, 1, IMAGE_MT);
+    const char* key = lua_tostring(L, 2);
+    if (key && img->data) {
+        if (strcmp(key, "width") == 0) { lua_pushinteger(L, img->width); return 1; }
+        if (strcmp(key, "height") == 0) { lua_pushinteger(L, img->height); return 1; }
+        if (strcmp(key, "channels") == 0) { lua_pushinteger(L, img->channels); return 1; }
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+// Image یا مسیر در اندیس 1 (فایل مثل img_file_op در userdata جای آن را می‌گیرد)؛
+// NULL با nil، خطا روی استک اگر فایل خوانده نشد
+static Image* img_arg(lua_State *L) {
+    Image* img = (Image*)luaL_testudata(L, 1, IMAGE_MT);
+    if (img) {
+        if (!img->data) luaL_argerror(L, 1, "image has been freed");
+        return img;
+    }
+    const char* input = luaL_checkstring(L, 1);
+    img = img_push(L);
+    *img = img_read(input);
+    lua_replace(L, 1);
+    if (!img->data) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to read input image");
+        return NULL;
+    }
+    return img;
+}
+
+// ----- Histogram -----
+// image.histogram(input) و img:histogram() → یک آرایه‌ی 256تایی برای هر کانال
+// (h[ch][v + 1] تعداد پیکسل‌هایی که کانال ch آنها v است) | nil, خطا
+static int l_img_histogram(lua_State *L) {
+    Image* img = img_arg(L);
+    if (!img) return 2;
+    
+    uint64_t h[4][256];
+    hist_compute(img->data, img->width * img->height, img->channels, h);
+    lua_createtable(L, img->channels, 0);
+    for (int ch = 0; ch < img->channels; ch++) {
+        lua_createtable(L, 256, 0);
+        for (int v = 0; v < 256; v++) {
+            lua_pushinteger(L, (lua_Integer)h[ch][v]);
+            lua_rawseti(L, -2, v + 1);
+        }
+        lua_rawseti(L, -2, ch + 1);
+    }
+    return 1;
+}
+
+// ----- Match -----
+// image.match(input, template [, count [, min_score]]) و img:match(template, ...) → آرایه‌ی
+// {x, y, score} | nil, خطا. برخلاف template_match تصویر را تغییر نمی‌دهد
+static int l_img_match(lua_State *L) {
+    Image* img = img_arg(L);
+    if (!img) return 2;
+    
+    Match* m = NULL;
+    int tw, th;
+    int n = match_run(L, img, 2, &m, &tw, &th);
+    if (n < 0) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    push_matches(L, m, n);
+    free(m);
+    return 1;
+}
+
+// ----- Info -----
+static int l_img_info(lua_State *L) {
+    const char* input = luaL_checkstring(L, 1);
+    
+    Image img = img_read(input);
+    if (!img.data) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to read image");
+        return 2;
+    }
+    
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, img.width);
+    lua_setfield(L, -2, "width");
+    lua_pushinteger(L, img.height);
+    lua_setfield(L, -2, "height");
+    lua_pushinteger(L, img.channels);
+    lua_setfield(L, -2, "channels");
+    lua_pushinteger(L, img.width * img.height * img.channels);
+    lua_setfield(L, -2, "size_bytes");
+    
+    img_free(&img);
+    return 1;
+}
+
+// ----- Version -----
+static int l_img_version(lua_State *L) {
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, "3.1.0");
+    lua_setfield(L, -2, "version");
+    lua_pushstring(L, "Professional Computer Vision Library for Byte");
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, pool_size());
+    lua_setfield(L, -2, "max_threads");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "supports_face_detection");
+    return 1;
+}
+
+// ----- Threads -----
+// image.set_threads(n): تعداد رشته‌ها (شامل فراخوان)؛ 0 = خودکار. تعداد نهایی را برمی‌گرداند
+static int l_img_set_threads(lua_State *L) {
+    int n = (int)luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "must be >= 0");
+    pool_set_threads(n);
+    lua_pushinteger(L, pool_size());
+    return 1;
+}
+
+static int l_img_threads(lua_State *L) {
+    lua_pushinteger(L, pool_size());
     return 1;
 }
 
@@ -1685,11 +2919,15 @@ static const luaL_Reg img_funcs[] = {
     {"detect_plate", l_img_detect_plate},
     {"hough_lines", l_img_hough_lines},
     {"template_match", l_img_template_match},
+    {"match", l_img_match},
     {"kmeans", l_img_kmeans},
     {"equalize_hist", l_img_equalize_hist},
+    {"clahe", l_img_clahe},
     {"histogram", l_img_histogram},
     {"info", l_img_info},
     {"version", l_img_version},
+    {"set_threads", l_img_set_threads},
+    {"threads", l_img_threads},
     
     // توابع رسم جدید
     {"draw_line", l_img_draw_line},
@@ -1701,11 +2939,67 @@ static const luaL_Reg img_funcs[] = {
     {"detect_plate_outline", l_img_detect_plate_outline},
     {"opencv_style", l_img_opencv_style},
     
+    // Image در حافظه
+    {"load", l_img_load},
+    {"decode", l_img_decode},
+    {"new", l_img_new},
+    
+    {NULL, NULL}
+};
+
+static const luaL_Reg img_methods[] = {
+    {"grayscale", m_img_grayscale},
+    {"resize", m_img_resize},
+    {"crop", m_img_crop},
+    {"rotate", m_img_rotate},
+    {"blur", m_img_blur},
+    {"sobel", m_img_sobel},
+    {"canny", m_img_canny},
+    {"threshold", m_img_threshold},
+    {"otsu", m_img_otsu},
+    {"adaptive_threshold", m_img_adaptive_threshold},
+    {"erode", m_img_erode},
+    {"dilate", m_img_dilate},
+    {"open", m_img_open},
+    {"close", m_img_close},
+    {"detect_faces", m_img_detect_faces},
+    {"detect_plate", m_img_detect_plate},
+    {"hough_lines", m_img_hough_lines},
+    {"template_match", m_img_template_match},
+    {"match", l_img_match},
+    {"kmeans", m_img_kmeans},
+    {"equalize_hist", m_img_equalize_hist},
+    {"clahe", m_img_clahe},
+    {"histogram", l_img_histogram},
+    {"draw_line", m_img_draw_line},
+    {"draw_rect", m_img_draw_rect},
+    {"fill_rect", m_img_fill_rect},
+    {"draw_circle", m_img_draw_circle},
+    {"draw_text", m_img_draw_text},
+    {"detect_contours", m_img_detect_contours},
+    {"detect_plate_outline", m_img_detect_plate_outline},
+    {"opencv_style", m_img_opencv_style},
+    {"save", m_img_save},
+    {"encode", m_img_encode},
+    {"clone", m_img_clone},
+    {"info", m_img_info},
+    {"free", m_img_free},
     {NULL, NULL}
 };
 
 int luaopen_image(lua_State *L) {
     srand(time(NULL));
+    
+    luaL_newmetatable(L, IMAGE_MT);
+    luaL_newlib(L, img_methods);
+    lua_pushcclosure(L, m_img_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, m_img_free);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, m_img_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+    
     luaL_newlib(L, img_funcs);
     return 1;
 }
@@ -0,0 +1,152 @@
+/*
+ * eyeballs.h – اتصال TCP مستقل از خانواده‌ی آدرس با Happy Eyeballs (RFC 8305)
+ * برای httpx و netsocket
+ *
+ * آدرس‌های resolver_lookup(…, AF_UNSPEC, …) به ترتیب getaddrinfo (RFC 6724) می‌آیند؛
+ * اینجا IPv6 و IPv4 یکی‌درمیان چیده می‌شوند و هر HE_DELAY یک تلاش تازه شروع می‌شود
+ * بی‌آنکه تلاش‌های قبلی رها شوند. اولین اتصالی که برقرار شود برنده است و بقیه بسته
+ * می‌شوند؛ شکست یک تلاش، تلاش بعدی را بی‌معطلی شروع می‌کند. پس میزبان dual-stack که
+ * یک خانواده‌اش سیاه‌چاله است فقط HE_DELAY معطلی دارد، نه یک timeout کامل.
+ *
+ * همه‌ی تلاش‌های در جریان در یک epoll هستند و همان fd (he->ep) پیش‌روی کل مسابقه را
+ * نشان می‌دهد؛ پس loop رویدادی (مثل reactor در netsocket) فقط روی یک fd صبر می‌کند.
+ * he_connect نسخه‌ی مسدودکننده است.
+ *
+ * فقط هدر است؛ پیش از آن resolver.h.
+ */
+#ifndef BYTE_EYEBALLS_H
+#define BYTE_EYEBALLS_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#define HE_DELAY 0.25            /* Connection Attempt Delay توصیه‌شده در RFC 8305 */
+
+enum { HE_WAIT = -1, HE_FAIL = -2 };
+
+typedef struct {
+    ResAddrs addrs;              /* به ترتیب تلاش */
+    int fd[RES_MAX_ADDRS];       /* -1: شروع‌نشده یا تمام‌شده */
+    int next, live;              /* تلاش بعدی، تعداد تلاش‌های در جریان */
+    int ep;
+    int err;                     /* errno آخرین شکست */
+    double next_at;
+} HeConn;
+
+static double he_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* خانواده‌ها یکی‌درمیان، با حفظ ترتیب داخل هر خانواده و شروع از خانواده‌ی اول */
+static void he_interleave(const ResAddrs *in, ResAddrs *out) {
+    int used[RES_MAX_ADDRS] = { 0 };
+    int fam = in->n ? in->addr[0].ss_family : AF_INET;
+    out->n = 0;
+    while (out->n < in->n) {
+        int i = 0;
+        while (i < in->n && (used[i] || in->addr[i].ss_family != fam)) i++;
+        if (i == in->n)          /* از این خانواده چیزی نمانده */
+            for (i = 0; used[i]; i++);
+        used[i] = 1;
+        out->addr[out->n] = in->addr[i]; out->len[out->n++] = in->len[i];
+        fam = in->addr[i].ss_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+}
+
+/* addrs باید پورت داشته باشد (resolver_set_port)؛ 0 یا -1 اگر epoll ساخته نشد */
+static int he_init(HeConn *he, const ResAddrs *addrs) {
+    memset(he, 0, sizeof(*he));
+    for (int i = 0; i < RES_MAX_ADDRS; i++) he->fd[i] = -1;
+    he_interleave(addrs, &he->addrs);
+    he->err = ECONNREFUSED;
+    he->ep = epoll_create1(EPOLL_CLOEXEC);
+    return he->ep < 0 ? -1 : 0;
+}
+
+static void he_free(HeConn *he) {
+    for (int i = 0; i < he->addrs.n; i++)
+        if (he->fd[i] >= 0) { close(he->fd[i]); he->fd[i] = -1; }
+    if (he->ep >= 0) close(he->ep);
+    he->ep = -1; he->live = 0;
+}
+
+static int he_win(HeConn *he, int i) {
+    int fd = he->fd[i];
+    he->fd[i] = -1;
+    he_free(he);
+    return fd;
+}
+
+static void he_drop(HeConn *he, int i, int err) {
+    close(he->fd[i]);
+    he->fd[i] = -1; he->live--;
+    he->err = err ? err : ECONNREFUSED;
+}
+
+/*
+ * یک قدم از مسابقه: fd برنده (non-blocking)، HE_WAIT (روی he->ep تا he_timeout صبر کن)
+ * یا HE_FAIL (همه شکست خوردند؛ he->err). بعد از برنده یا شکست he_free لازم نیست.
+ */
+static int he_step(HeConn *he) {
+    struct epoll_event ev[RES_MAX_ADDRS];
+    int n;
+    while ((n = epoll_wait(he->ep, ev, RES_MAX_ADDRS, 0)) > 0)
+        for (int k = 0; k < n; k++) {
+            int i = ev[k].data.u32, err = 0;
+            socklen_t len = sizeof(err);
+            if (he->fd[i] < 0) continue;
+            getsockopt(he->fd[i], SOL_SOCKET, SO_ERROR, &err, &len);
+            if (!err) return he_win(he, i);
+            epoll_ctl(he->ep, EPOLL_CTL_DEL, he->fd[i], NULL);
+            he_drop(he, i, err);
+        }
+    double now = he_now();
+    while (he->next < he->addrs.n && (!he->live || now >= he->next_at)) {
+        int i = he->next++;
+        const struct sockaddr_storage *sa = &he->addrs.addr[i];
+        int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) { he->err = errno; continue; }
+        he->fd[i] = fd; he->live++;
+        if (connect(fd, (const struct sockaddr*)sa, he->addrs.len[i]) == 0) return he_win(he, i);
+        struct epoll_event e = { .events = EPOLLOUT, .data.u32 = (uint32_t)i };
+        if (errno != EINPROGRESS || epoll_ctl(he->ep, EPOLL_CTL_ADD, fd, &e) < 0) { he_drop(he, i, errno); continue; }
+        he->next_at = now + HE_DELAY;
+    }
+    if (he->live) return HE_WAIT;
+    he_free(he);
+    errno = he->err;
+    return HE_FAIL;
+}
+
+/* ثانیه تا شروع تلاش بعدی؛ -1 اگر تلاشی نمانده */
+static double he_timeout(const HeConn *he) {
+    if (he->next >= he->addrs.n) return -1;
+    double d = he->next_at - he_now();
+    return d > 0 ? d : 0;
+}
+
+/* مسدودکننده: fd متصل (blocking) یا -1 با errno (ETIMEDOUT اگر timeout_ms تمام شد) */
+static int he_connect(const ResAddrs *addrs, int timeout_ms) {
+    HeConn he;
+    if (he_init(&he, addrs) < 0) return -1;
+    double deadline = timeout_ms > 0 ? he_now() + timeout_ms / 1000.0 : 0;
+    for (;;) {
+        int fd = he_step(&he);
+        if (fd >= 0) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK); return fd; }
+        if (fd == HE_FAIL) return -1;
+        double wait = he_timeout(&he);
+        if (deadline) {
+            double left = deadline - he_now();
+            if (left <= 0) { he_free(&he); errno = ETIMEDOUT; return -1; }
+            if (wait < 0 || left < wait) wait = left;
+        }
+        struct pollfd p = { he.ep, POLLIN, 0 };
+        if (poll(&p, 1, wait < 0 ? -1 : (int)(wait * 1000) + 1) < 0 && errno != EINTR) { he_free(&he); return -1; }
+    }
+}
+
+#endif
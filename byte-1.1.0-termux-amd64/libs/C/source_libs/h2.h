@@ -0,0 +1,411 @@
+/*
+ * h2.h – قاب‌بندی HTTP/2 و HPACK برای httpx (RFC 7540 / RFC 7541)
+ * فقط پروتکل: ساخت/خواندن سرِ قاب‌ها، رمزگشای کامل HPACK (جدول پویا و
+ * Huffman) و رمزگذار ساده (literal بدون ایندکس). خواندن و نوشتن روی سوکت
+ * و مدیریت streamها در httpx.c است.
+ *
+ * فقط هدر است؛ لینک: -lpthread
+ */
+#ifndef BYTE_H2_H
+#define BYTE_H2_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN  24
+#define H2_FRAME_HEAD   9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_DEFAULT_FRAME  16384
+#define H2_TABLE_SIZE     4096
+
+enum { H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE,
+       H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION };
+
+#define H2_END_STREAM   0x1
+#define H2_ACK          0x1
+#define H2_END_HEADERS  0x4
+#define H2_PADDED       0x8
+#define H2_PRIORITY_F   0x20
+
+enum { H2_SET_HEADER_TABLE_SIZE = 1, H2_SET_ENABLE_PUSH, H2_SET_MAX_CONCURRENT_STREAMS,
+       H2_SET_INITIAL_WINDOW_SIZE, H2_SET_MAX_FRAME_SIZE, H2_SET_MAX_HEADER_LIST_SIZE };
+
+enum { H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+       H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+       H2_CANCEL, H2_COMPRESSION_ERROR };
+
+typedef struct { uint32_t len; uint8_t type, flags; uint32_t stream; } H2Frame;
+
+static inline uint32_t h2_get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+static inline void h2_put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+static inline void h2_put_head(unsigned char *p, uint32_t len, int type, int flags, uint32_t stream) {
+    p[0] = len >> 16; p[1] = len >> 8; p[2] = len;
+    p[3] = type; p[4] = flags;
+    h2_put32(p + 5, stream & 0x7fffffff);
+}
+static inline void h2_get_head(const unsigned char *p, H2Frame *f) {
+    f->len = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    f->type = p[3]; f->flags = p[4];
+    f->stream = h2_get32(p + 5) & 0x7fffffff;
+}
+
+/* ── HPACK: جدول‌های RFC 7541 ── */
+static const uint32_t h2_huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t h2_huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+static const char *const h2_static[61][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+
+/* درخت Huffman یک بار ساخته می‌شود؛ برگ‌ها منفی: -(نماد + 1) */
+static int16_t h2_huff_tree[512][2];
+static pthread_once_t h2_huff_once = PTHREAD_ONCE_INIT;
+
+static void h2_huff_build(void) {
+    int nodes = 1;
+    for (int sym = 0; sym < 257; sym++) {
+        int n = 0;
+        for (int b = h2_huff_len[sym] - 1; b >= 0; b--) {
+            int bit = (h2_huff_code[sym] >> b) & 1;
+            if (b == 0) { h2_huff_tree[n][bit] = -(sym + 1); break; }
+            if (!h2_huff_tree[n][bit]) h2_huff_tree[n][bit] = nodes++;
+            n = h2_huff_tree[n][bit];
+        }
+    }
+}
+
+static int h2_huff_decode(const unsigned char *p, size_t n, char *out, size_t *out_len) {
+    int node = 0, depth = 0, ones = 1;
+    size_t o = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (p[i] >> b) & 1;
+            int next = h2_huff_tree[node][bit];
+            ones &= bit;
+            depth++;
+            if (next < 0) {
+                if (next == -257) return -1;   /* EOS داخل رشته مجاز نیست */
+                out[o++] = (char)(-next - 1);
+                node = depth = 0; ones = 1;
+            } else if (!next) return -1;
+            else node = next;
+        }
+    }
+    /* padding: حداکثر ۷ بیت، همه ۱ */
+    if (depth > 7 || !ones) return -1;
+    *out_len = o;
+    return 0;
+}
+
+/* ── HPACK: جدول پویا ── */
+typedef struct { char *name, *value; size_t nl, vl; } H2Entry;
+
+typedef struct {
+    H2Entry *ent;            /* حلقوی؛ first جدیدترین */
+    int n, cap, first;
+    size_t size, max_size;
+} H2Hpack;
+
+typedef int (*h2_header_fn)(void *ud, const char *name, size_t nl, const char *value, size_t vl);
+
+static inline void h2_hpack_init(H2Hpack *h) {
+    memset(h, 0, sizeof(*h));
+    h->max_size = H2_TABLE_SIZE;
+}
+
+static H2Entry *h2_dyn(H2Hpack *h, int i) { return &h->ent[(h->first + i) % h->cap]; }
+
+static void h2_evict(H2Hpack *h, size_t limit) {
+    while (h->n && h->size > limit) {
+        H2Entry *e = h2_dyn(h, h->n - 1);
+        h->size -= e->nl + e->vl + 32;
+        free(e->name);
+        e->name = e->value = NULL;
+        h->n--;
+    }
+}
+
+static int h2_insert(H2Hpack *h, const char *name, size_t nl, const char *value, size_t vl) {
+    size_t sz = nl + vl + 32;
+    h2_evict(h, sz > h->max_size ? 0 : h->max_size - sz);
+    if (sz > h->max_size) return 0;      /* بزرگ‌تر از کل جدول: فقط خالی می‌کند */
+    if (h->n == h->cap) {
+        int cap = h->cap ? h->cap * 2 : 32;
+        H2Entry *e = malloc(cap * sizeof(H2Entry));
+        if (!e) return -1;
+        for (int i = 0; i < h->n; i++) e[i] = *h2_dyn(h, i);
+        free(h->ent);
+        h->ent = e; h->cap = cap; h->first = 0;
+    }
+    char *s = malloc(nl + vl + 2);
+    if (!s) return -1;
+    memcpy(s, name, nl); s[nl] = '\0';
+    memcpy(s + nl + 1, value, vl); s[nl + 1 + vl] = '\0';
+    h->first = (h->first + h->cap - 1) % h->cap;
+    H2Entry *e = &h->ent[h->first];
+    e->name = s; e->nl = nl; e->value = s + nl + 1; e->vl = vl;
+    h->n++;
+    h->size += sz;
+    return 0;
+}
+
+static inline void h2_hpack_free(H2Hpack *h) {
+    h2_evict(h, 0);
+    free(h->ent);
+    h2_hpack_init(h);
+}
+
+/* ایندکس 1..61 جدول ثابت، بعد جدول پویا */
+static int h2_lookup(H2Hpack *h, uint32_t idx, const char **name, size_t *nl, const char **value, size_t *vl) {
+    if (idx == 0) return -1;
+    if (idx <= 61) {
+        *name = h2_static[idx - 1][0]; *nl = strlen(*name);
+        *value = h2_static[idx - 1][1]; *vl = strlen(*value);
+        return 0;
+    }
+    if (idx - 62 >= (uint32_t)h->n) return -1;
+    H2Entry *e = h2_dyn(h, idx - 62);
+    *name = e->name; *nl = e->nl; *value = e->value; *vl = e->vl;
+    return 0;
+}
+
+static int h2_int(const unsigned char **p, const unsigned char *end, int prefix, uint32_t *out) {
+    uint32_t max = (1u << prefix) - 1, v = **p & max;
+    (*p)++;
+    if (v < max) { *out = v; return 0; }
+    for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+        unsigned char b = *(*p)++;
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *out = v; return 0; }
+    }
+    return -1;
+}
+
+/* رشته‌ی HPACK؛ خروجی در *buf (malloc) که فراخواننده آزاد می‌کند */
+static int h2_string(const unsigned char **p, const unsigned char *end, char **buf, size_t *len) {
+    if (*p >= end) return -1;
+    int huff = **p & 0x80;
+    uint32_t n;
+    if (h2_int(p, end, 7, &n) < 0 || n > (size_t)(end - *p)) return -1;
+    *buf = malloc(huff ? (size_t)n * 8 / 5 + 1 : n + 1);
+    if (!*buf) return -1;
+    if (huff) {
+        pthread_once(&h2_huff_once, h2_huff_build);
+        if (h2_huff_decode(*p, n, *buf, len) < 0) { free(*buf); *buf = NULL; return -1; }
+    } else {
+        memcpy(*buf, *p, n);
+        *len = n;
+    }
+    (*buf)[*len] = '\0';
+    *p += n;
+    return 0;
+}
+
+/*
+ * یک header block کامل را باز می‌کند و برای هر هدر fn را صدا می‌زند.
+ * 0 موفق، -1 خطای فشرده‌سازی (اتصال باید بسته شود).
+ */
+static inline int h2_hpack_decode(H2Hpack *h, const unsigned char *p, size_t n, h2_header_fn fn, void *ud) {
+    const unsigned char *end = p + n;
+    while (p < end) {
+        unsigned char b = *p;
+        const char *name, *value;
+        size_t nl, vl;
+        uint32_t idx;
+        if (b & 0x80) {                                   /* Indexed */
+            if (h2_int(&p, end, 7, &idx) < 0 || h2_lookup(h, idx, &name, &nl, &value, &vl) < 0) return -1;
+            if (fn(ud, name, nl, value, vl) < 0) return -1;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {                         /* Dynamic Table Size Update */
+            if (h2_int(&p, end, 5, &idx) < 0 || idx > H2_TABLE_SIZE) return -1;
+            h->max_size = idx;
+            h2_evict(h, idx);
+            continue;
+        }
+        int incremental = (b & 0xc0) == 0x40;
+        if (h2_int(&p, end, incremental ? 6 : 4, &idx) < 0) return -1;
+        char *nbuf = NULL, *vbuf = NULL;
+        if (idx) {
+            const char *unused;
+            size_t ul;
+            if (h2_lookup(h, idx, &name, &nl, &unused, &ul) < 0) return -1;
+        } else {
+            if (h2_string(&p, end, &nbuf, &nl) < 0) return -1;
+            name = nbuf;
+        }
+        if (h2_string(&p, end, &vbuf, &vl) < 0) { free(nbuf); return -1; }
+        int rc = fn(ud, name, nl, vbuf, vl);
+        if (rc == 0 && incremental) rc = h2_insert(h, name, nl, vbuf, vl);
+        free(nbuf); free(vbuf);
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+static size_t h2_put_int(unsigned char *out, uint32_t v, int prefix, unsigned char first) {
+    uint32_t max = (1u << prefix) - 1;
+    if (v < max) { out[0] = first | v; return 1; }
+    size_t i = 0;
+    out[i++] = first | max;
+    for (v -= max; v >= 128; v >>= 7) out[i++] = (v & 0x7f) | 0x80;
+    out[i++] = v;
+    return i;
+}
+
+/*
+ * یک هدر را به‌صورت literal بدون ایندکس (یا indexed اگر دقیقاً در جدول ثابت
+ * باشد) در out می‌نویسد؛ out باید حداقل nl + vl + 16 بایت جا داشته باشد.
+ * نام به حروف کوچک تبدیل می‌شود (الزام HTTP/2). طول نوشته‌شده برمی‌گردد.
+ */
+static inline size_t h2_hpack_encode(unsigned char *out, const char *name, size_t nl, const char *value, size_t vl) {
+    uint32_t name_idx = 0;
+    for (int i = 0; i < 61; i++) {
+        const char *sn = h2_static[i][0];
+        if (strlen(sn) != nl || strncasecmp(sn, name, nl)) continue;
+        if (strlen(h2_static[i][1]) == vl && !memcmp(h2_static[i][1], value, vl))
+            return h2_put_int(out, i + 1, 7, 0x80);
+        if (!name_idx) name_idx = i + 1;
+    }
+    size_t o = h2_put_int(out, name_idx, 4, 0x00);
+    if (!name_idx) {
+        o += h2_put_int(out + o, nl, 7, 0x00);
+        for (size_t i = 0; i < nl; i++) out[o++] = tolower((unsigned char)name[i]);
+    }
+    o += h2_put_int(out + o, vl, 7, 0x00);
+    memcpy(out + o, value, vl);
+    return o + vl;
+}
+
+#endif
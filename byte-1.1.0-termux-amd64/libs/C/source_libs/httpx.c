@@ -3,21 +3,30 @@
  * تمام قابلیت‌ها + ریدایرکت واقعی
  *
  * کامپایل:
- *   gcc -shared -fPIC -I../../../src -o ../httpx.so httpx.c -O2 -lssl -lcrypto
+ *   gcc -shared -fPIC -I../../../src -o ../httpx.so httpx.c -O2 -lssl -lcrypto -lz -lpthread -lm
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <zlib.h>
+#include <pthread.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -26,10 +35,37 @@
 #include "lualib.h"
 #include "lauxlib.h"
 
-#define MAX_BUF 2097152
+#include "resolver.h"
+#include "eyeballs.h"
+#include "h2.h"
+#include "json.h"
+
+#define READ_CHUNK 16384
+#define FILE_CHUNK (256 * 1024)      /* بافر خواندن/نوشتن وقتی مقصد یا مبدأ فایل است */
+#define MAX_SEGMENTS 16
 #define MAX_REDIRECTS 10
 
 /* ── Session ── */
+#define H1_ONLY_SLOTS 8
+#define STAT_BUCKETS 96                    /* 0.1ms × 2^(i/4)، تا حدود 28 دقیقه */
+
+/* هیستوگرام لگاریتمی مدت‌ها برای p50/p99 */
+typedef struct {
+    unsigned long long n;
+    double sum, max;
+    unsigned hist[STAT_BUCKETS];
+} StatHist;
+
+enum { ST_TOTAL, ST_DNS, ST_CONNECT, ST_TLS, ST_TTFB, ST_TRANSFER, ST_PHASES };
+
+typedef struct {
+    unsigned long long requests, errors, reused, bytes;
+    StatHist phase[ST_PHASES];
+} SessStats;
+
+typedef struct H2Conn H2Conn;
+typedef struct Sched Sched;
+
 typedef struct {
     char base_url[1024];
     char headers[4096];
@@ -45,6 +81,17 @@ typedef struct {
     char cert_file[512];
     char key_file[512];
     char user_agent[256];
+    int  http2;
+    H2Conn *h2;                            /* اتصال HTTP/2 باز، یا NULL */
+    char h1_only[H1_ONLY_SLOTS][264];      /* host:portهایی که h2 را نپذیرفتند */
+    int  h1_next;
+    double rate;                           /* درخواست در ثانیه برای هر host؛ 0 = بی‌محدودیت */
+    int  burst;                            /* ظرفیت token bucket؛ 0 = max(1, rate) */
+    int  max_per_host;                     /* اتصال هم‌زمان به هر host */
+    int  pipeline;                         /* درخواست‌های idempotent پشت‌سرهم روی یک اتصال */
+    int  retries;
+    Sched *sched;                          /* صف s:enqueue / s:run، یا NULL */
+    SessStats stats;
 } Session;
 
 /* ── URL ── */
@@ -63,7 +110,9 @@ static void parse_url(const char *url_str, URL *url) {
     const char *slash = strchr(url_str, '/');
     if (slash) { strncpy(url->host, url_str, slash - url_str); strncpy(url->path, slash, 1023); }
     else { strncpy(url->host, url_str, 255); strcpy(url->path, "/"); }
-    char *colon = strchr(url->host, ':');
+    /* IPv6 با کروشه ([::1]:8080)؛ کروشه در host می‌ماند چون Host هم همین را می‌خواهد */
+    char *end = url->host[0] == '[' ? strchr(url->host, ']') : NULL;
+    char *colon = strchr(end ? end : url->host, ':');
     if (colon) { *colon = '\0'; url->port = atoi(colon + 1); }
 }
 
@@ -77,355 +126,1454 @@ static void init_ssl() {
     OpenSSL_add_all_algorithms();
     ssl_ctx = SSL_CTX_new(TLS_client_method());
     SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+    /* چند رکورد TLS در هر recv؛ برای دانلودهای بزرگ تعداد syscallها را کم می‌کند */
+    SSL_CTX_set_read_ahead(ssl_ctx, 1);
+    SSL_CTX_set_default_read_buffer_len(ssl_ctx, FILE_CHUNK);
     ssl_initialized = 1;
 }
 
 /* ── Socket ── */
-static int sock_connect_timeout(const char *host, int port, int timeout_sec) {
-    struct hostent *he = gethostbyname(host);
-    if (!he) return -1;
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
-    int flags = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-    int ret = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
-    if (ret < 0 && errno != EINPROGRESS) { close(sock); return -1; }
-    fd_set fdset; struct timeval tv;
-    FD_ZERO(&fdset); FD_SET(sock, &fdset);
-    tv.tv_sec = timeout_sec; tv.tv_usec = 0;
-    ret = select(sock + 1, NULL, &fdset, NULL, &tv);
-    if (ret <= 0) { close(sock); return -1; }
-    fcntl(sock, F_SETFL, flags);
-    int so_error; socklen_t len = sizeof(so_error);
-    getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
-    if (so_error) { close(sock); return -1; }
-    return sock;
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* *dns: مدت resolve به ثانیه. IPv4 و IPv6 با Happy Eyeballs (eyeballs.h) مسابقه می‌دهند */
+static int sock_connect_timeout(const char *host, int port, int timeout_sec, double *dns) {
+    ResAddrs ra;
+    double t0 = mono_now();
+    int rc = resolver_lookup(host, AF_UNSPEC, timeout_sec * 1000, &ra);
+    *dns = mono_now() - t0;
+    if (rc < 0) return -1;
+    resolver_set_port(&ra, port);
+    return he_connect(&ra, timeout_sec * 1000);
+}
+
+/* ── Growable Buffer ── */
+typedef struct { char *data; size_t len, cap; int oom; } Buf;
+
+static void buf_init(Buf *b) { b->data = NULL; b->len = b->cap = 0; b->oom = 0; }
+static void buf_free(Buf *b) { free(b->data); buf_init(b); }
+static const char *buf_str(const Buf *b) { return b->data ? b->data : ""; }
+
+static int buf_reserve(Buf *b, size_t extra) {
+    if (b->oom) return -1;
+    if (b->len + extra < b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap <= b->len + extra) cap *= 2;
+    char *p = realloc(b->data, cap);
+    if (!p) { b->oom = 1; return -1; }
+    b->data = p; b->cap = cap;
+    return 0;
+}
+
+static void buf_add(Buf *b, const char *s, size_t n) {
+    if (buf_reserve(b, n) < 0) return;
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+static void buf_adds(Buf *b, const char *s) { if (s) buf_add(b, s, strlen(s)); }
+
+static void buf_addf(Buf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(b, n) < 0) return;
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
 }
 
 /* ── URL Encode ── */
-static void url_encode(const char *src, char *dst, size_t max) {
+static void buf_add_urlenc(Buf *b, const char *src) {
     const char *hex = "0123456789ABCDEF";
-    while (*src && max > 3) {
-        if ((*src >= 'A' && *src <= 'Z') || (*src >= 'a' && *src <= 'z') ||
-            (*src >= '0' && *src <= '9') || *src == '-' || *src == '_' ||
-            *src == '.' || *src == '~') {
-            *dst++ = *src; max--;
+    for (; src && *src; src++) {
+        unsigned char c = *src;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~') {
+            buf_add(b, (const char*)&c, 1);
         } else {
-            *dst++ = '%'; *dst++ = hex[*src >> 4]; *dst++ = hex[*src & 15];
-            max -= 3;
+            char e[3] = { '%', hex[c >> 4], hex[c & 15] };
+            buf_add(b, e, 3);
         }
-        src++;
     }
-    *dst = '\0';
+}
+
+/* key=value&key=value از جدول بالای استک */
+static void buf_add_query(Buf *b, lua_State *L) {
+    int first = 1;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pushvalue(L, -2);
+        if (!first) buf_add(b, "&", 1);
+        buf_add_urlenc(b, lua_tostring(L, -1));
+        buf_add(b, "=", 1);
+        buf_add_urlenc(b, lua_tostring(L, -2));
+        first = 0;
+        lua_pop(L, 2);
+    }
 }
 
 /* ── Build Request ── */
-static char* build_request(const char *method, const char *url_str, Session *s,
-                           int opts_idx, lua_State *L, size_t *req_len) {
-    static char req[MAX_BUF];
+/*
+ * 0، -1 اگر حافظه نبود، یا -2 اگر opts.json قابل تبدیل نیست (پیام در err).
+ * keep_alive: Connection: keep-alive به‌جای close، مگر کاربر خودش Connection داده باشد.
+ */
+static int build_request(const char *method, const char *url_str, Session *s, int opts_idx, lua_State *L,
+                         Buf *req, int keep_alive, char *err, size_t errlen) {
     URL url;
     parse_url(url_str, &url);
+    int has_opts = opts_idx > 0 && lua_istable(L, opts_idx);
 
-    char full_path[2048];
-    strcpy(full_path, url.path);
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    buf_addf(req, "%s %s", method, url.path);
+    if (has_opts) {
         lua_getfield(L, opts_idx, "params");
         if (lua_istable(L, -1)) {
-            strcat(full_path, "?");
-            int first = 1;
-            lua_pushnil(L);
-            while (lua_next(L, -2)) {
-                if (!first) strcat(full_path, "&");
-                char ek[512], ev[512];
-                url_encode(lua_tostring(L, -2), ek, sizeof(ek));
-                const char *v = lua_tostring(L, -1);
-                if (v) url_encode(v, ev, sizeof(ev)); else ev[0] = '\0';
-                strcat(full_path, ek); strcat(full_path, "="); strcat(full_path, ev);
-                first = 0;
-                lua_pop(L, 1);
-            }
+            buf_add(req, strchr(url.path, '?') ? "&" : "?", 1);
+            buf_add_query(req, L);
         }
         lua_pop(L, 1);
     }
+    if ((url.is_ssl && url.port == 443) || (!url.is_ssl && url.port == 80))
+        buf_addf(req, " HTTP/1.1\r\nHost: %s\r\n", url.host);
+    else
+        buf_addf(req, " HTTP/1.1\r\nHost: %s:%d\r\n", url.host, url.port);
 
-    snprintf(req, MAX_BUF, "%s %s HTTP/1.1\r\nHost: %s\r\n", method, full_path, url.host);
     const char *ua = s ? s->user_agent : "Byte-HttpX/6.1";
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    if (has_opts) {
         lua_getfield(L, opts_idx, "user_agent"); if (lua_isstring(L, -1)) ua = lua_tostring(L, -1); lua_pop(L, 1);
     }
-    strcat(req, "User-Agent: "); strcat(req, ua); strcat(req, "\r\n");
-    strcat(req, "Connection: close\r\n");
-    strcat(req, "Accept: */*\r\n");
+    buf_addf(req, "User-Agent: %s\r\n", ua);
+    buf_adds(req, "Accept: */*\r\n");
 
-    char header_buf[8192] = "";
-    if (s && s->headers[0]) { strcat(header_buf, s->headers); strcat(header_buf, "\n"); }
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    Buf hdrs; buf_init(&hdrs);
+    if (s && s->headers[0]) { buf_adds(&hdrs, s->headers); buf_add(&hdrs, "\n", 1); }
+    if (has_opts) {
         lua_getfield(L, opts_idx, "headers");
         if (lua_istable(L, -1)) {
             lua_pushnil(L);
             while (lua_next(L, -2)) {
-                strcat(header_buf, lua_tostring(L, -2));
-                strcat(header_buf, ": ");
-                strcat(header_buf, lua_tostring(L, -1));
-                strcat(header_buf, "\n");
-                lua_pop(L, 1);
+                lua_pushvalue(L, -2);
+                buf_addf(&hdrs, "%s: %s\n", lua_tostring(L, -1), lua_tostring(L, -2));
+                lua_pop(L, 2);
             }
         } else if (lua_isstring(L, -1)) {
-            strcat(header_buf, lua_tostring(L, -1));
-            strcat(header_buf, "\n");
+            buf_adds(&hdrs, lua_tostring(L, -1));
+            buf_add(&hdrs, "\n", 1);
         }
         lua_pop(L, 1);
     }
 
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    if (has_opts) {
         lua_getfield(L, opts_idx, "auth");
         if (lua_istable(L, -1)) {
             lua_getfield(L, -1, "type"); const char *at = lua_tostring(L, -1); lua_pop(L, 1);
             lua_getfield(L, -1, "user"); const char *au = lua_tostring(L, -1); lua_pop(L, 1);
             lua_getfield(L, -1, "pass"); const char *ap = lua_tostring(L, -1); lua_pop(L, 1);
             if (at && au) {
-                if (!strcmp(at, "basic")) {
-                    char cred[512];
-                    snprintf(cred, sizeof(cred), "%s:%s", au, ap ? ap : "");
-                    strcat(header_buf, "Authorization: Basic ");
-                    strcat(header_buf, cred); strcat(header_buf, "\n");
-                } else if (!strcmp(at, "bearer")) {
-                    strcat(header_buf, "Authorization: Bearer ");
-                    strcat(header_buf, au); strcat(header_buf, "\n");
-                }
+                if (!strcmp(at, "basic"))
+                    buf_addf(&hdrs, "Authorization: Basic %s:%s\n", au, ap ? ap : "");
+                else if (!strcmp(at, "bearer"))
+                    buf_addf(&hdrs, "Authorization: Bearer %s\n", au);
             }
         }
         lua_pop(L, 1);
     }
 
-    if (s && s->cookies[0]) { strcat(header_buf, "Cookie: "); strcat(header_buf, s->cookies); strcat(header_buf, "\n"); }
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    if (s && s->cookies[0]) buf_addf(&hdrs, "Cookie: %s\n", s->cookies);
+    if (has_opts) {
         lua_getfield(L, opts_idx, "cookies");
         if (lua_istable(L, -1)) {
-            char ck[4096] = "";
+            Buf ck; buf_init(&ck);
             lua_pushnil(L);
             while (lua_next(L, -2)) {
-                if (ck[0]) strcat(ck, "; ");
-                strcat(ck, lua_tostring(L, -2)); strcat(ck, "="); strcat(ck, lua_tostring(L, -1));
-                lua_pop(L, 1);
+                lua_pushvalue(L, -2);
+                if (ck.len) buf_adds(&ck, "; ");
+                buf_addf(&ck, "%s=%s", lua_tostring(L, -1), lua_tostring(L, -2));
+                lua_pop(L, 2);
             }
-            if (ck[0]) { strcat(header_buf, "Cookie: "); strcat(header_buf, ck); strcat(header_buf, "\n"); }
+            if (ck.len) buf_addf(&hdrs, "Cookie: %s\n", ck.data);
+            buf_free(&ck);
         } else if (lua_isstring(L, -1)) {
-            strcat(header_buf, "Cookie: "); strcat(header_buf, lua_tostring(L, -1)); strcat(header_buf, "\n");
+            buf_addf(&hdrs, "Cookie: %s\n", lua_tostring(L, -1));
         }
         lua_pop(L, 1);
     }
 
-    char *hdr = strtok(header_buf, "\n");
-    while (hdr) {
-        while (*hdr == ' ' || *hdr == '\t') hdr++;
-        if (*hdr && !strstr(req, hdr)) { strcat(req, hdr); strcat(req, "\r\n"); }
-        hdr = strtok(NULL, "\n");
+    if (hdrs.len) {
+        char *hdr = strtok(hdrs.data, "\n");
+        while (hdr) {
+            while (*hdr == ' ' || *hdr == '\t') hdr++;
+            if (*hdr && !strstr(buf_str(req), hdr)) { buf_adds(req, hdr); buf_add(req, "\r\n", 2); }
+            hdr = strtok(NULL, "\n");
+        }
     }
+    if (!strcasestr(buf_str(req), "\nAccept-Encoding:")) buf_adds(req, "Accept-Encoding: gzip, deflate\r\n");
+    if (!strcasestr(buf_str(req), "\nConnection:"))
+        buf_adds(req, keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    buf_free(&hdrs);
 
-    const char *body = NULL;
-    char json_body[MAX_BUF], form_body[MAX_BUF];
-    int is_json = 0, is_form = 0;
+    Buf body; buf_init(&body);
+    int has_body = 0, is_json = 0, is_form = 0;
 
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    if (has_opts) {
         lua_getfield(L, opts_idx, "json");
-        if (lua_istable(L, -1)) {
-            lua_getglobal(L, "json");
-            if (lua_istable(L, -1)) {
-                lua_getfield(L, -1, "encode");
-                lua_pushvalue(L, -3);
-                if (lua_pcall(L, 1, 1, 0) == LUA_OK && lua_isstring(L, -1)) {
-                    strcpy(json_body, lua_tostring(L, -1));
-                    body = json_body; is_json = 1;
-                }
-                lua_pop(L, 2);
-            } else lua_pop(L, 2);
+        if (!lua_isnil(L, -1)) {
+            JBuf jb; jbuf_init(&jb);
+            if (json_encode(L, -1, &jb, err, errlen) < 0) {
+                jbuf_free(&jb);
+                buf_free(&body);
+                lua_pop(L, 1);
+                return -2;
+            }
+            buf_add(&body, jb.data, jb.len);
+            has_body = is_json = 1;
+            jbuf_free(&jb);
         }
         lua_pop(L, 1);
     }
 
-    if (!body && opts_idx > 0 && lua_istable(L, opts_idx)) {
+    if (!has_body && has_opts) {
         lua_getfield(L, opts_idx, "data");
         if (lua_istable(L, -1)) {
-            form_body[0] = '\0';
-            lua_pushnil(L);
-            while (lua_next(L, -2)) {
-                if (form_body[0]) strcat(form_body, "&");
-                char ek[512], ev[512];
-                url_encode(lua_tostring(L, -2), ek, sizeof(ek));
-                const char *v = lua_tostring(L, -1);
-                if (v) url_encode(v, ev, sizeof(ev)); else ev[0] = '\0';
-                strcat(form_body, ek); strcat(form_body, "="); strcat(form_body, ev);
-                lua_pop(L, 1);
-            }
-            body = form_body; is_form = 1;
+            buf_add_query(&body, L);
+            has_body = is_form = 1;
         } else if (lua_isstring(L, -1)) {
-            body = lua_tostring(L, -1);
+            size_t n; const char *d = lua_tolstring(L, -1, &n);
+            buf_add(&body, d, n);
+            has_body = 1;
         }
         lua_pop(L, 1);
     }
 
-    if (body) {
-        char len[32];
-        snprintf(len, sizeof(len), "Content-Length: %zu\r\n", strlen(body));
-        strcat(req, len);
-        if (is_json) strcat(req, "Content-Type: application/json\r\n");
-        else if (is_form) strcat(req, "Content-Type: application/x-www-form-urlencoded\r\n");
+    if (has_body) {
+        buf_addf(req, "Content-Length: %zu\r\n", body.len);
+        if (is_json) buf_adds(req, "Content-Type: application/json\r\n");
+        else if (is_form) buf_adds(req, "Content-Type: application/x-www-form-urlencoded\r\n");
+    }
+
+    buf_add(req, "\r\n", 2);
+    if (body.len) buf_add(req, body.data, body.len);
+    int oom = body.oom;
+    buf_free(&body);
+    return (req->oom || oom) ? -1 : 0;
+}
+
+/* ── Connection ── */
+typedef struct {
+    int fd;
+    SSL *ssl;
+    int h2;
+    Buf rb;                /* بایت‌های خوانده‌شده‌ی پاسخ بعدی (keep-alive / pipelining) */
+    double dns, connect, tls;    /* مدت مراحل باز کردن اتصال (ثانیه) */
+} Conn;
+
+static void conn_close(Conn *c) {
+    if (c->ssl) { SSL_shutdown(c->ssl); SSL_free(c->ssl); c->ssl = NULL; }
+    if (c->fd >= 0) { close(c->fd); c->fd = -1; }
+    buf_free(&c->rb);
+}
+
+/* want_h2: پیشنهاد "h2" در ALPN؛ c->h2 یعنی سرور آن را انتخاب کرد */
+static int conn_open(Conn *c, const char *host, int port, int is_ssl, int timeout, int want_h2) {
+    c->ssl = NULL;
+    c->h2 = 0;
+    buf_init(&c->rb);
+    c->connect = c->tls = 0;
+    double t0 = mono_now();
+    c->fd = sock_connect_timeout(host, port, timeout, &c->dns);
+    if (c->fd < 0) return -1;
+    double t1 = mono_now();
+    c->connect = t1 - t0 - c->dns;
+    struct timeval tv = { timeout, 0 };
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (is_ssl) {
+        init_ssl();
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        if (host[0] != '[') SSL_set_tlsext_host_name(c->ssl, host);   /* SNI برای IP معنا ندارد */
+        if (want_h2) SSL_set_alpn_protos(c->ssl, (const unsigned char*)"\x02h2\x08http/1.1", 12);
+        if (SSL_connect(c->ssl) <= 0) { SSL_free(c->ssl); c->ssl = NULL; conn_close(c); return -1; }
+        const unsigned char *proto;
+        unsigned int plen;
+        SSL_get0_alpn_selected(c->ssl, &proto, &plen);
+        c->h2 = plen == 2 && !memcmp(proto, "h2", 2);
+        c->tls = mono_now() - t1;
+    }
+    return 0;
+}
+
+static int conn_write(Conn *c, const char *p, size_t n) {
+    while (n > 0) {
+        int w = c->ssl ? SSL_write(c->ssl, p, (int)n) : (int)send(c->fd, p, n, MSG_NOSIGNAL);
+        if (w <= 0) return -1;
+        p += w; n -= w;
+    }
+    return 0;
+}
+
+static int conn_read(Conn *c, char *p, size_t n) {
+    return c->ssl ? SSL_read(c->ssl, p, (int)n) : (int)recv(c->fd, p, n, 0);
+}
+
+/* اتصال keep-alive بی‌کار که سرور بسته است (EOF یا هر داده‌ی ناخواسته) */
+static int conn_stale(Conn *c) {
+    struct pollfd p = { c->fd, POLLIN, 0 };
+    return poll(&p, 1, 0) != 0;
+}
+
+/* n بایت از فایل: sendfile روی HTTP (بدون کپی)، بافر بزرگ + SSL_write روی HTTPS */
+static int conn_sendfile(Conn *c, int fd, off_t off, size_t n) {
+    if (!c->ssl) {
+        while (n > 0) {
+            ssize_t w = sendfile(c->fd, fd, &off, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            n -= w;
+        }
+        return 0;
+    }
+    char *buf = malloc(FILE_CHUNK);
+    if (!buf) return -1;
+    while (n > 0) {
+        ssize_t got = pread(fd, buf, n < FILE_CHUNK ? n : FILE_CHUNK, off);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || conn_write(c, buf, got) < 0) { free(buf); return -1; }
+        off += got; n -= got;
+    }
+    free(buf);
+    return 0;
+}
+
+/* ── Response ── */
+/* مقصد بدنه: بافر حافظه (پیش‌فرض)، تابع Lua یا فایل */
+typedef struct {
+    lua_State *L;
+    int callback;          /* اندیس تابع Lua روی استک، یا 0 */
+    int fd;                /* فایل مقصد یا -1؛ با pwrite از off نوشته می‌شود */
+    loff_t off;
+    int resume;            /* off ادامه‌ی فایل است؛ فقط پاسخ 206 همان‌جا نوشته می‌شود */
+    int segment;           /* بازه‌ی یک بخش موازی؛ جز 206 از همین off چیزی نوشته نمی‌شود */
+    int discard;
+    int stopped;
+    char err[256];
+} Sink;
+
+static void sink_init(Sink *k, lua_State *L) {
+    memset(k, 0, sizeof(*k));
+    k->L = L;
+    k->fd = -1;
+}
+
+/* محل نام و مقدار یک هدر داخل Response.head (بدون کپی) */
+typedef struct { size_t name, name_len, value, value_len; } Span;
+
+/* مدت هر مرحله به ثانیه (ساعت monotonic)؛ در ریدایرکت‌ها جمع می‌شود */
+typedef struct {
+    double dns, connect, tls, ttfb, transfer;
+    double start, sent, first, end;
+    int reused;            /* آخرین درخواست روی اتصالی رفت که از قبل باز بود */
+} Timing;
+
+typedef struct {
+    int status;
+    int head_done;         /* خط وضعیت و هدرها کامل رسیده */
+    int complete;          /* بدنه طبق Content-Length / chunked کامل رسیده */
+    int reusable;          /* اتصال برای درخواست بعدی قابل استفاده است */
+    Buf head;              /* خط وضعیت + هدرها، تا خط خالی */
+    Span *hdr;
+    int nhdr, hdr_cap;
+    Buf body;              /* فقط وقتی بدنه به Sink نرفته */
+    size_t body_len;
+    Timing tm;
+} Response;
+
+static void response_init(Response *r) {
+    memset(r, 0, sizeof(*r));
+    buf_init(&r->head); buf_init(&r->body);
+}
+static void response_free(Response *r) { buf_free(&r->head); buf_free(&r->body); free(r->hdr); r->hdr = NULL; r->hdr_cap = 0; }
+static void response_reset(Response *r) {
+    r->status = r->head_done = r->complete = r->reusable = r->nhdr = 0;
+    r->body_len = 0; r->head.len = r->body.len = 0;
+}
+
+static void timing_start(Timing *t) { if (!t->start) t->start = mono_now(); }
+static void timing_conn(Timing *t, const Conn *c, int reused) {
+    t->reused = reused;
+    if (reused) return;
+    t->dns += c->dns; t->connect += c->connect; t->tls += c->tls;
+}
+static void timing_sent(Timing *t) { t->sent = mono_now(); t->first = 0; }
+static void timing_first(Timing *t) {
+    if (t->first || !t->sent) return;
+    t->first = mono_now();
+    t->ttfb += t->first - t->sent;
+}
+static void timing_end(Timing *t) {
+    t->end = mono_now();
+    if (t->first) t->transfer += t->end - t->first;
+    t->first = t->sent = 0;
+}
+
+static int sink_active(const Sink *k) { return k && (k->callback || k->fd >= 0); }
+
+/* مقدار هدر (بدون حساسیت به حروف)؛ رشته NUL-terminated نیست */
+static const char *resp_header(const Response *r, const char *name, size_t *len) {
+    size_t nl = strlen(name);
+    for (int i = 0; i < r->nhdr; i++) {
+        const Span *h = &r->hdr[i];
+        if (h->name_len == nl && !strncasecmp(r->head.data + h->name, name, nl)) {
+            *len = h->value_len;
+            return r->head.data + h->value;
+        }
+    }
+    return NULL;
+}
+
+/* Content-Range: bytes <from>-<to>/<total> با from == off */
+static int range_starts_at(const Response *r, loff_t off) {
+    size_t n;
+    const char *v = resp_header(r, "Content-Range", &n);
+    if (!v || n < 7 || strncasecmp(v, "bytes ", 6)) return 0;
+    const char *p = v + 6, *end = v + n;
+    while (p < end && *p == ' ') p++;
+    if (p >= end || !isdigit((unsigned char)*p)) return 0;
+    long long from = 0;
+    while (p < end && isdigit((unsigned char)*p)) from = from * 10 + (*p++ - '0');
+    return p < end && *p == '-' && from == (long long)off;
+}
+
+/*
+ * قبل از اولین بایت بدنه در فایل. بخش موازی فقط 206 با Content-Range از همان off
+ * را می‌پذیرد (200 کامل یا صفحه‌ی خطا روی بازه‌ی دیگران نوشته نمی‌شود). دانلود
+ * ادامه‌دار: 206 از off، 416 یعنی فایل کامل است، بقیه از صفر.
+ */
+static int sink_begin(Sink *k, const Response *r) {
+    if (k->segment) {
+        k->segment = 0;
+        if (r->status != 206) { snprintf(k->err, sizeof(k->err), "HTTP %d", r->status); return -1; }
+        if (!range_starts_at(r, k->off)) { snprintf(k->err, sizeof(k->err), "Content-Range mismatch"); return -1; }
+        return 0;
+    }
+    if (!k->resume) return 0;
+    k->resume = 0;
+    if (r->status == 416) k->discard = 1;
+    else if (r->status != 206) { k->off = 0; if (ftruncate(k->fd, 0) < 0) k->discard = 1; }
+    return 0;
+}
+
+static int sink_pwrite(Sink *k, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = pwrite(k->fd, p, n, k->off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { snprintf(k->err, sizeof(k->err), "write failed"); return -1; }
+        p += w; n -= w; k->off += w;
+    }
+    return 0;
+}
+
+static int sink_write(Sink *k, Response *r, const char *p, size_t n) {
+    r->body_len += n;
+    if (!sink_active(k)) { buf_add(&r->body, p, n); return r->body.oom ? -1 : 0; }
+    if (k->fd >= 0) {
+        if (sink_begin(k, r) < 0) return -1;
+        if (!k->discard && sink_pwrite(k, p, n) < 0) return -1;
+    }
+    if (k->callback) {
+        lua_pushvalue(k->L, k->callback);
+        lua_pushlstring(k->L, p, n);
+        if (lua_pcall(k->L, 1, 1, 0) != LUA_OK) {
+            snprintf(k->err, sizeof(k->err), "%s", lua_tostring(k->L, -1));
+            lua_pop(k->L, 1);
+            return -1;
+        }
+        /* برگرداندن false از callback دریافت را متوقف می‌کند */
+        if (lua_isboolean(k->L, -1) && !lua_toboolean(k->L, -1)) k->stopped = 1;
+        lua_pop(k->L, 1);
+    }
+    return 0;
+}
+
+static int is_redirect(int status) {
+    return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
+
+static int span_has(const char *v, size_t n, const char *tok) {
+    size_t tl = strlen(tok);
+    for (size_t i = 0; i + tl <= n; i++)
+        if (!strncasecmp(v + i, tok, tl)) return 1;
+    return 0;
+}
+
+/* انتهای هدرها را پیدا می‌کند؛ طول head با خط خالی یا 0 */
+static size_t find_head_end(const char *p, size_t len, size_t from) {
+    for (size_t i = from; i < len; i++) {
+        if (p[i] != '\n') continue;
+        if (i + 1 < len && p[i + 1] == '\n') return i + 2;
+        if (i + 2 < len && p[i + 1] == '\r' && p[i + 2] == '\n') return i + 3;
+    }
+    return 0;
+}
+
+/* خط وضعیت و محل هدرها را از head[0..hl) استخراج می‌کند */
+static int parse_head(Response *r, size_t hl) {
+    const char *d = r->head.data;
+    r->nhdr = 0; r->status = 0;
+    sscanf(d, "HTTP/%*s %d", &r->status);
+    const char *p = memchr(d, '\n', hl);
+    while (p && (size_t)(++p - d) < hl) {
+        const char *eol = memchr(p, '\n', hl - (p - d));
+        if (!eol) break;
+        const char *end = eol;
+        if (end > p && end[-1] == '\r') end--;
+        if (end == p) break;
+        const char *colon = memchr(p, ':', end - p);
+        if (colon) {
+            const char *ne = colon, *v = colon + 1, *ve = end;
+            while (ne > p && (ne[-1] == ' ' || ne[-1] == '\t')) ne--;
+            while (v < ve && (*v == ' ' || *v == '\t')) v++;
+            while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+            if (r->nhdr == r->hdr_cap) {
+                int cap = r->hdr_cap ? r->hdr_cap * 2 : 32;
+                Span *h = realloc(r->hdr, cap * sizeof(Span));
+                if (!h) return -1;
+                r->hdr = h; r->hdr_cap = cap;
+            }
+            Span *h = &r->hdr[r->nhdr++];
+            h->name = p - d; h->name_len = ne - p;
+            h->value = v - d; h->value_len = ve - v;
+        }
+        p = eol;
+    }
+    return 0;
+}
+
+/* ── HTTP/1.1 Parser ── */
+/*
+ * ماشین حالت افزایشی: هر تکه‌ی خوانده‌شده از سوکت به parser_feed داده می‌شود.
+ * بدنه دقیقاً به اندازه‌ی Content-Length یا قاب‌های chunked خوانده می‌شود، پس
+ * منتظر بسته‌شدن اتصال از طرف سرور نمی‌ماند. gzip/deflate همان‌جا باز می‌شود.
+ */
+enum { P_HEAD, P_LENGTH, P_UNTIL_CLOSE, P_CHUNK_SIZE, P_CHUNK_DATA, P_CHUNK_END, P_TRAILER, P_DONE };
+
+typedef struct {
+    int state;
+    int no_body;             /* پاسخ به HEAD */
+    int stop_on_redirect;
+    unsigned long long remaining;
+    char line[32];
+    size_t line_len;
+    int inflating, raw_deflate;
+    int cut;                 /* بدنه‌ی ریدایرکت خوانده نشد؛ اتصال قابل استفاده‌ی دوباره نیست */
+    z_stream z;
+} Parser;
+
+static int parser_begin_body(Parser *ps, Response *r) {
+    size_t n;
+    const char *v;
+    if (ps->no_body || r->status < 200 || r->status == 204 || r->status == 304) { ps->state = P_DONE; return 0; }
+    if ((v = resp_header(r, "Transfer-Encoding", &n)) && span_has(v, n, "chunked")) ps->state = P_CHUNK_SIZE;
+    else if ((v = resp_header(r, "Content-Length", &n))) {
+        ps->remaining = strtoull(v, NULL, 10);
+        ps->state = ps->remaining ? P_LENGTH : P_DONE;
+    } else ps->state = P_UNTIL_CLOSE;
+    if ((v = resp_header(r, "Content-Encoding", &n)) && (span_has(v, n, "gzip") || span_has(v, n, "deflate"))) {
+        memset(&ps->z, 0, sizeof(ps->z));
+        if (inflateInit2(&ps->z, 15 + 32) != Z_OK) return -1;   /* gzip یا zlib، تشخیص خودکار */
+        ps->inflating = 1;
+    }
+    return 0;
+}
+
+static int parser_emit(Parser *ps, Response *r, Sink *k, const char *p, size_t n) {
+    if (!ps->inflating) return sink_write(k, r, p, n);
+    char out[READ_CHUNK];
+    ps->z.next_in = (Bytef*)p;
+    ps->z.avail_in = n;
+    do {
+        ps->z.next_out = (Bytef*)out;
+        ps->z.avail_out = sizeof(out);
+        int zr = inflate(&ps->z, Z_NO_FLUSH);
+        if (zr == Z_DATA_ERROR && !ps->raw_deflate && ps->z.total_out == 0 && ps->z.total_in <= n) {
+            /* بعضی سرورها deflate خام (بدون هدر zlib) می‌فرستند */
+            inflateEnd(&ps->z);
+            memset(&ps->z, 0, sizeof(ps->z));
+            if (inflateInit2(&ps->z, -15) != Z_OK) { ps->inflating = 0; return -1; }
+            ps->raw_deflate = 1;
+            ps->z.next_in = (Bytef*)p;
+            ps->z.avail_in = n;
+            continue;
+        }
+        if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR) {
+            snprintf(k->err, sizeof(k->err), "decompression failed");
+            return -1;
+        }
+        size_t have = sizeof(out) - ps->z.avail_out;
+        if (have && sink_write(k, r, out, have) < 0) return -1;
+        if (zr == Z_STREAM_END || (zr == Z_BUF_ERROR && !have)) break;
+    } while (ps->z.avail_in > 0 || ps->z.avail_out == 0);
+    return 0;
+}
+
+/* خط chunk-size / پایان chunk / trailer؛ 1 وقتی خط کامل شد */
+static int parser_line(Parser *ps, const char **p, size_t *n) {
+    const char *nl = memchr(*p, '\n', *n);
+    size_t take = nl ? (size_t)(nl - *p) : *n;
+    for (size_t i = 0; i < take && ps->line_len < sizeof(ps->line) - 1; i++)
+        ps->line[ps->line_len++] = (*p)[i];
+    if (!nl) { *p += take; *n -= take; return 0; }
+    *p += take + 1; *n -= take + 1;
+    if (ps->line_len && ps->line[ps->line_len - 1] == '\r') ps->line_len--;
+    ps->line[ps->line_len] = '\0';
+    return 1;
+}
+
+/* -1 خطا، 0 ادامه، 1 پاسخ کامل. *used (اختیاری): چند بایت از p مصرف شد؛ بقیه مال پاسخ بعدی است */
+static int parser_feed(Parser *ps, Response *r, Sink *k, const char *p, size_t n, size_t *used) {
+    size_t total = n, unread = 0;
+    while (n > 0 && ps->state != P_DONE) {
+        switch (ps->state) {
+        case P_HEAD: {
+            size_t from = r->head.len > 2 ? r->head.len - 2 : 0, hl;
+            buf_add(&r->head, p, n);
+            if (r->head.oom) return -1;
+            n = 0;
+            while ((hl = find_head_end(r->head.data, r->head.len, from)) != 0) {
+                if (parse_head(r, hl) < 0) return -1;
+                if (r->status >= 100 && r->status < 200 && r->status != 101) {
+                    /* پاسخ میانی (100 Continue)؛ دور انداخته می‌شود */
+                    memmove(r->head.data, r->head.data + hl, r->head.len - hl + 1);
+                    r->head.len -= hl;
+                    from = 0;
+                    continue;
+                }
+                r->head_done = 1;
+                size_t extra = r->head.len - hl, eused = 0;
+                int rc = 0;
+                if (ps->stop_on_redirect && is_redirect(r->status)) { ps->state = P_DONE; ps->cut = 1; }
+                else if (parser_begin_body(ps, r) < 0) rc = -1;
+                else if (extra) rc = parser_feed(ps, r, k, r->head.data + hl, extra, &eused);
+                /* بایت‌های اضافه انتهای همین ورودی‌اند */
+                unread = extra - eused;
+                r->head.len = hl;
+                r->head.data[hl] = '\0';
+                if (rc < 0) return -1;
+                break;
+            }
+            break;
+        }
+        case P_LENGTH:
+        case P_CHUNK_DATA: {
+            size_t take = n < ps->remaining ? n : (size_t)ps->remaining;
+            if (parser_emit(ps, r, k, p, take) < 0) return -1;
+            p += take; n -= take;
+            ps->remaining -= take;
+            if (!ps->remaining) ps->state = ps->state == P_LENGTH ? P_DONE : P_CHUNK_END;
+            break;
+        }
+        case P_UNTIL_CLOSE:
+            if (parser_emit(ps, r, k, p, n) < 0) return -1;
+            n = 0;
+            break;
+        case P_CHUNK_SIZE:
+            if (!parser_line(ps, &p, &n)) break;
+            if (!isxdigit((unsigned char)ps->line[0])) { snprintf(k->err, sizeof(k->err), "bad chunk size"); return -1; }
+            ps->remaining = strtoull(ps->line, NULL, 16);
+            ps->state = ps->remaining ? P_CHUNK_DATA : P_TRAILER;
+            ps->line_len = 0;
+            break;
+        case P_CHUNK_END:
+            if (!parser_line(ps, &p, &n)) break;
+            ps->state = P_CHUNK_SIZE;
+            ps->line_len = 0;
+            break;
+        case P_TRAILER:
+            if (!parser_line(ps, &p, &n)) break;
+            if (!ps->line_len) ps->state = P_DONE;
+            ps->line_len = 0;
+            break;
+        }
+    }
+    if (used) *used = total - n - unread;
+    return ps->state == P_DONE;
+}
+
+/*
+ * بدنه‌ی خام (بدون chunked/gzip) روی HTTP مستقیم سوکت → pipe → فایل می‌رود و
+ * از حافظه‌ی فرایند عبور نمی‌کند. 1 یعنی splice پشتیبانی نشد و باید read/write شود.
+ */
+static int splice_body(Conn *c, Parser *ps, Response *r, Sink *k) {
+    int pfd[2];
+    if (sink_begin(k, r) < 0) return -1;
+    if (pipe2(pfd, O_CLOEXEC) < 0) return 1;
+    int rc = 0, first = 1;
+    while (ps->state != P_DONE && !k->discard) {
+        size_t want = FILE_CHUNK;
+        if (ps->state == P_LENGTH && ps->remaining < want) want = ps->remaining;
+        ssize_t in = splice(c->fd, NULL, pfd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && errno == EINVAL && first) { rc = 1; break; }
+        if (in <= 0) break;                              /* پایان اتصال یا timeout */
+        first = 0;
+        for (ssize_t left = in; left > 0; ) {
+            ssize_t out = splice(pfd[0], NULL, k->fd, &k->off, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) { snprintf(k->err, sizeof(k->err), "write failed"); rc = -1; goto done; }
+            left -= out;
+        }
+        r->body_len += in;
+        if (ps->state == P_LENGTH && !(ps->remaining -= in)) ps->state = P_DONE;
+    }
+done:
+    close(pfd[0]); close(pfd[1]);
+    return rc;
+}
+
+/* HTTP/1.1 پیش‌فرض keep-alive است مگر Connection: close؛ HTTP/1.0 برعکس */
+static int keep_alive(const Response *r) {
+    size_t n;
+    const char *v = resp_header(r, "Connection", &n);
+    if (v && span_has(v, n, "close")) return 0;
+    if (!strncmp(buf_str(&r->head), "HTTP/1.0", 8)) return v && span_has(v, n, "keep-alive");
+    return 1;
+}
+
+static int can_splice(const Conn *c, const Parser *ps, const Response *r, const Sink *k) {
+    return !c->ssl && k->fd >= 0 && !k->callback && !ps->inflating && r->head_done &&
+           (ps->state == P_LENGTH || ps->state == P_UNTIL_CLOSE);
+}
+
+static int read_response(Conn *c, Response *r, Sink *k, int head_req, int stop_on_redirect) {
+    Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.no_body = head_req;
+    ps.stop_on_redirect = stop_on_redirect;
+    char small[READ_CHUNK], *chunk = k->fd >= 0 ? malloc(FILE_CHUNK) : NULL;
+    size_t cap = chunk ? FILE_CHUNK : sizeof(small);
+    if (!chunk) chunk = small;
+    int n, rc = 0, spliced = 0;
+    size_t used;
+    if (c->rb.len) {
+        timing_first(&r->tm);
+        rc = parser_feed(&ps, r, k, c->rb.data, c->rb.len, &used);
+        memmove(c->rb.data, c->rb.data + used, c->rb.len - used);
+        c->rb.len -= used;
+    }
+    while (rc == 0 && !k->stopped && (n = conn_read(c, chunk, cap)) > 0) {
+        timing_first(&r->tm);
+        rc = parser_feed(&ps, r, k, chunk, n, &used);
+        if (used < (size_t)n) buf_add(&c->rb, chunk + used, n - used);
+        if (rc == 0 && !spliced && can_splice(c, &ps, r, k)) {
+            spliced = 1;
+            int sr = splice_body(c, &ps, r, k);
+            if (sr < 0) rc = -1;
+            else if (sr == 0) { rc = ps.state == P_DONE; break; }
+        }
+    }
+    if (chunk != small) free(chunk);
+    timing_end(&r->tm);
+    r->complete = ps.state == P_DONE || (ps.state == P_UNTIL_CLOSE && rc == 0 && !k->stopped);
+    r->reusable = ps.state == P_DONE && rc >= 0 && !ps.cut && !k->stopped && !c->rb.oom && keep_alive(r);
+    if (ps.inflating) inflateEnd(&ps.z);
+    return rc < 0 ? -1 : 0;
+}
+
+/* ── HTTP/2 ── */
+/*
+ * اگر سرور در ALPN "h2" را انتخاب کند، اتصال TLS در session باز می‌ماند و هر
+ * درخواست یک stream روی آن است؛ session:batch ده‌ها stream را هم‌زمان می‌فرستد.
+ * ورودی همان متن HTTP/1.1 ساخته‌شده در build_request است که به HEADERS/DATA
+ * ترجمه می‌شود، و پاسخ در همان Response/Parser پر می‌شود. host:portی که h2 را
+ * نپذیرد در session علامت می‌خورد و از آن به بعد مستقیم با HTTP/1.1 می‌رود.
+ */
+#define H2_MAX_STREAMS 100
+#define H2_RECV_WINDOW (16 << 20)
+
+typedef struct {
+    uint32_t id;
+    int started, done, got_head, head_req;
+    int refused;             /* سرور پردازشش نکرد (GOAWAY / REFUSED_STREAM)؛ قابل تکرار */
+    Response *r;
+    Sink *k;
+    Parser ps;
+    const char *req;         /* متن HTTP/1.1 درخواست */
+    size_t req_len;
+    const char *body;
+    size_t body_len, body_off;
+    long window;
+    size_t unacked;
+} H2Stream;
+
+struct H2Conn {
+    Conn c;
+    char host[256];
+    int port, dead, closed;
+    H2Hpack dec;
+    uint32_t next_id;
+    long window, peer_initial;
+    uint32_t peer_frame, peer_streams;
+    size_t unacked;
+    Buf in, out, block;      /* block: HEADERS + CONTINUATION تا END_HEADERS */
+    uint32_t block_stream;
+    int block_end_stream;
+};
+
+static void h2_frame(H2Conn *h, int type, int flags, uint32_t stream, const void *p, size_t n) {
+    unsigned char fh[H2_FRAME_HEAD];
+    h2_put_head(fh, n, type, flags, stream);
+    buf_add(&h->out, (const char*)fh, sizeof(fh));
+    if (n) buf_add(&h->out, p, n);
+}
+
+static void h2_window_update(H2Conn *h, uint32_t stream, size_t inc) {
+    unsigned char w[4];
+    h2_put32(w, inc);
+    h2_frame(h, H2_WINDOW_UPDATE, 0, stream, w, 4);
+}
+
+static void h2_rst(H2Conn *h, uint32_t stream, uint32_t code) {
+    unsigned char w[4];
+    h2_put32(w, code);
+    h2_frame(h, H2_RST_STREAM, 0, stream, w, 4);
+}
+
+static int h2_flush(H2Conn *h) {
+    if (h->out.oom || (h->out.len && conn_write(&h->c, h->out.data, h->out.len) < 0)) { h->dead = 1; return -1; }
+    h->out.len = 0;
+    return 0;
+}
+
+static void h2_conn_close(H2Conn *h) {
+    if (!h) return;
+    if (!h->dead) {
+        unsigned char g[8];
+        h2_put32(g, 0); h2_put32(g + 4, H2_NO_ERROR);
+        h->out.len = 0;
+        h2_frame(h, H2_GOAWAY, 0, 0, g, 8);
+        h2_flush(h);
+    }
+    conn_close(&h->c);
+    h2_hpack_free(&h->dec);
+    buf_free(&h->in); buf_free(&h->out); buf_free(&h->block);
+    free(h);
+}
+
+/* NULL با *no_h2 = 1 یعنی اتصال برقرار شد ولی سرور h2 را انتخاب نکرد */
+static H2Conn *h2_connect(const char *host, int port, int timeout, int *no_h2) {
+    Conn c;
+    if (conn_open(&c, host, port, 1, timeout, 1) < 0) return NULL;
+    if (!c.h2) { conn_close(&c); *no_h2 = 1; return NULL; }
+    H2Conn *h = calloc(1, sizeof(H2Conn));
+    if (!h) { conn_close(&c); return NULL; }
+    h->c = c;
+    snprintf(h->host, sizeof(h->host), "%s", host);
+    h->port = port;
+    h2_hpack_init(&h->dec);
+    buf_init(&h->in); buf_init(&h->out); buf_init(&h->block);
+    h->next_id = 1;
+    h->window = h->peer_initial = H2_DEFAULT_WINDOW;
+    h->peer_frame = H2_DEFAULT_FRAME;
+    h->peer_streams = H2_MAX_STREAMS;
+
+    unsigned char set[12];
+    set[0] = 0; set[1] = H2_SET_ENABLE_PUSH; h2_put32(set + 2, 0);
+    set[6] = 0; set[7] = H2_SET_INITIAL_WINDOW_SIZE; h2_put32(set + 8, H2_RECV_WINDOW);
+    buf_add(&h->out, H2_PREFACE, H2_PREFACE_LEN);
+    h2_frame(h, H2_SETTINGS, 0, 0, set, sizeof(set));
+    h2_window_update(h, 0, H2_RECV_WINDOW - H2_DEFAULT_WINDOW);
+    if (h2_flush(h) < 0) { h2_conn_close(h); return NULL; }
+    return h;
+}
+
+static H2Stream *h2_find(H2Stream *st, int n, uint32_t id) {
+    for (int i = 0; i < n; i++) if (st[i].started && st[i].id == id) return &st[i];
+    return NULL;
+}
+
+static void h2_fail(H2Stream *st, const char *msg) {
+    if (!st->k->err[0]) snprintf(st->k->err, sizeof(st->k->err), "%s", msg);
+    st->done = 1;
+    timing_end(&st->r->tm);
+}
+
+static void h2_end(H2Stream *st) {
+    st->done = 1;
+    timing_end(&st->r->tm);
+    st->r->complete = st->ps.state == P_DONE || st->ps.state == P_UNTIL_CLOSE;
+}
+
+static void h2_add_header(Buf *b, const char *name, size_t nl, const char *value, size_t vl) {
+    if (buf_reserve(b, nl + vl + 16) < 0) return;
+    b->len += h2_hpack_encode((unsigned char*)b->data + b->len, name, nl, value, vl);
+}
+
+/* هدرهای مخصوص اتصال در HTTP/2 ممنوع‌اند؛ Host به :authority می‌رود */
+static int h2_skip_header(const char *name, size_t nl) {
+    static const char *const drop[] = { "host", "connection", "keep-alive", "proxy-connection",
+                                        "transfer-encoding", "upgrade", "te", NULL };
+    for (int i = 0; drop[i]; i++)
+        if (strlen(drop[i]) == nl && !strncasecmp(drop[i], name, nl)) return 1;
+    return 0;
+}
+
+/* درخواست HTTP/1.1 ساخته‌شده → HEADERS (+ CONTINUATION) */
+static int h2_start(H2Conn *h, H2Stream *st) {
+    const char *p = st->req, *hend = memmem(p, st->req_len, "\r\n\r\n", 4);
+    const char *sp1 = hend ? memchr(p, ' ', hend - p) : NULL;
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', hend - sp1 - 1) : NULL;
+    if (!sp2) { h2_fail(st, "bad request"); return 0; }
+    st->head_req = sp1 - p == 4 && !memcmp(p, "HEAD", 4);
+    st->body = hend + 4;
+    st->body_len = st->req_len - (st->body - p);
+    st->body_off = 0;
+    timing_sent(&st->r->tm);
+
+    const char *authority = h->host;
+    size_t alen = strlen(h->host);
+    const char *line = memchr(p, '\n', hend - p) + 1;
+    for (const char *l = line; l < hend; ) {
+        const char *eol = memchr(l, '\r', hend + 2 - l), *colon = memchr(l, ':', eol - l);
+        if (colon && colon - l == 4 && !strncasecmp(l, "host", 4)) {
+            authority = colon + 1;
+            while (*authority == ' ') authority++;
+            alen = eol - authority;
+        }
+        l = eol + 2;
+    }
+
+    Buf blk; buf_init(&blk);
+    h2_add_header(&blk, ":method", 7, p, sp1 - p);
+    h2_add_header(&blk, ":scheme", 7, "https", 5);
+    h2_add_header(&blk, ":authority", 10, authority, alen);
+    h2_add_header(&blk, ":path", 5, sp1 + 1, sp2 - sp1 - 1);
+    for (const char *l = line; l < hend; ) {
+        const char *eol = memchr(l, '\r', hend + 2 - l), *colon = memchr(l, ':', eol - l);
+        if (colon && !h2_skip_header(l, colon - l)) {
+            const char *v = colon + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) v++;
+            h2_add_header(&blk, l, colon - l, v, eol - v);
+        }
+        l = eol + 2;
+    }
+    if (blk.oom) { buf_free(&blk); h2_fail(st, "memory"); return 0; }
+
+    st->id = h->next_id;
+    h->next_id += 2;
+    st->window = h->peer_initial;
+    st->started = 1;
+    for (size_t off = 0; off < blk.len || off == 0; ) {
+        size_t take = blk.len - off < h->peer_frame ? blk.len - off : h->peer_frame;
+        int last = off + take == blk.len;
+        int flags = last ? H2_END_HEADERS : 0;
+        if (off == 0 && !st->body_len) flags |= H2_END_STREAM;
+        h2_frame(h, off ? H2_CONTINUATION : H2_HEADERS, flags, st->id, blk.data + off, take);
+        off += take;
+        if (last) break;
+    }
+    buf_free(&blk);
+    return 0;
+}
+
+/* بدنه‌ها تا جایی که پنجره‌ی اتصال و stream اجازه می‌دهد */
+static void h2_send_bodies(H2Conn *h, H2Stream *st, int n) {
+    for (int i = 0; i < n && h->window > 0; i++) {
+        H2Stream *s = &st[i];
+        while (s->started && !s->done && s->body_off < s->body_len && h->window > 0 && s->window > 0) {
+            size_t take = s->body_len - s->body_off;
+            if (take > h->peer_frame) take = h->peer_frame;
+            if ((long)take > h->window) take = h->window;
+            if ((long)take > s->window) take = s->window;
+            s->body_off += take;
+            h2_frame(h, H2_DATA, s->body_off == s->body_len ? H2_END_STREAM : 0, s->id,
+                     s->body + s->body_off - take, take);
+            h->window -= take; s->window -= take;
+        }
+    }
+}
+
+static int h2_on_header(void *ud, const char *name, size_t nl, const char *value, size_t vl) {
+    H2Stream *st = ud;
+    if (!st || st->got_head || st->done) return 0;      /* stream ناشناخته یا trailer */
+    Buf *hd = &st->r->head;
+    if (nl == 7 && !memcmp(name, ":status", 7)) {
+        hd->len = 0;
+        buf_addf(hd, "HTTP/2 %.*s\r\n", (int)vl, value);
+    } else if (nl && name[0] != ':') {
+        buf_add(hd, name, nl); buf_add(hd, ": ", 2);
+        buf_add(hd, value, vl); buf_add(hd, "\r\n", 2);
+    }
+    return hd->oom ? -1 : 0;
+}
+
+static int h2_headers_done(H2Conn *h, H2Stream *st, int end_stream) {
+    if (h2_hpack_decode(&h->dec, (const unsigned char*)h->block.data, h->block.len, h2_on_header, st) < 0) return -1;
+    h->block.len = 0;
+    h->block_stream = 0;
+    if (!st || st->done) return 0;
+    if (!st->got_head) {
+        Response *r = st->r;
+        if (!r->head.len) { h2_fail(st, "malformed response"); return 0; }
+        buf_add(&r->head, "\r\n", 2);
+        if (r->head.oom || parse_head(r, r->head.len) < 0) { h2_fail(st, "memory"); return 0; }
+        if (r->status >= 100 && r->status < 200) { r->head.len = 0; r->nhdr = 0; return 0; }
+        st->got_head = r->head_done = 1;
+        st->ps.no_body = st->head_req;
+        if (st->ps.stop_on_redirect && is_redirect(r->status)) st->ps.state = P_DONE;
+        else if (parser_begin_body(&st->ps, r) < 0) { h2_fail(st, "memory"); return 0; }
+    }
+    if (end_stream) h2_end(st);
+    return 0;
+}
+
+/* یک قاب دریافتی؛ -1 خطای اتصال */
+static int h2_on_frame(H2Conn *h, const H2Frame *f, const unsigned char *p, H2Stream *st, int n) {
+    size_t len = f->len;
+    H2Stream *s = f->stream ? h2_find(st, n, f->stream) : NULL;
+    if (s && (f->type == H2_DATA || f->type == H2_HEADERS)) timing_first(&s->r->tm);
+    if (h->block_stream && f->type != H2_CONTINUATION) return -1;
+    if ((f->type == H2_DATA || f->type == H2_HEADERS) && (f->flags & H2_PADDED)) {
+        if (!len || p[0] >= len) return -1;
+        len -= 1 + p[0];
+        p++;
+    }
+    switch (f->type) {
+    case H2_DATA:
+        h->unacked += f->len;
+        if (s && s->got_head && !s->done) {
+            s->unacked += f->len;
+            if (parser_feed(&s->ps, s->r, s->k, (const char*)p, len, NULL) < 0) {
+                h2_fail(s, "body decode failed");
+                h2_rst(h, s->id, H2_CANCEL);
+            } else if (s->k->stopped) {
+                s->done = 1;
+                h2_rst(h, s->id, H2_CANCEL);
+            } else if (f->flags & H2_END_STREAM) h2_end(s);
+            else if (s->unacked >= H2_RECV_WINDOW / 2) { h2_window_update(h, s->id, s->unacked); s->unacked = 0; }
+        }
+        if (h->unacked >= H2_RECV_WINDOW / 2) { h2_window_update(h, 0, h->unacked); h->unacked = 0; }
+        break;
+    case H2_HEADERS:
+        if (f->flags & H2_PRIORITY_F) { if (len < 5) return -1; p += 5; len -= 5; }
+        /* fallthrough */
+    case H2_CONTINUATION:
+        if (f->type == H2_CONTINUATION && f->stream != h->block_stream) return -1;
+        if (f->type == H2_HEADERS) { h->block_stream = f->stream; h->block_end_stream = f->flags & H2_END_STREAM; }
+        buf_add(&h->block, (const char*)p, len);
+        if (h->block.oom) return -1;
+        if (f->flags & H2_END_HEADERS) return h2_headers_done(h, s, h->block_end_stream);
+        break;
+    case H2_RST_STREAM:
+        if (len != 4) return -1;
+        if (s && !s->done) {
+            uint32_t code = h2_get32(p);
+            if (code == H2_REFUSED_STREAM && !s->got_head) { s->refused = 1; s->done = 1; }
+            else if (code == H2_NO_ERROR && s->got_head) h2_end(s);
+            else { char m[48]; snprintf(m, sizeof(m), "stream reset (%u)", code); h2_fail(s, m); }
+        }
+        break;
+    case H2_SETTINGS:
+        if (f->flags & H2_ACK) break;
+        if (len % 6) return -1;
+        for (size_t i = 0; i < len; i += 6) {
+            int id = p[i] << 8 | p[i + 1];
+            uint32_t v = h2_get32(p + i + 2);
+            if (id == H2_SET_INITIAL_WINDOW_SIZE) {
+                if (v > 0x7fffffff) return -1;
+                for (int j = 0; j < n; j++) if (st[j].started) st[j].window += (long)v - h->peer_initial;
+                h->peer_initial = v;
+            } else if (id == H2_SET_MAX_FRAME_SIZE) {
+                if (v < H2_DEFAULT_FRAME || v > 0xffffff) return -1;
+                h->peer_frame = v;
+            } else if (id == H2_SET_MAX_CONCURRENT_STREAMS) h->peer_streams = v;
+        }
+        h2_frame(h, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        break;
+    case H2_PING:
+        if (len != 8) return -1;
+        if (!(f->flags & H2_ACK)) h2_frame(h, H2_PING, H2_ACK, 0, p, 8);
+        break;
+    case H2_GOAWAY: {
+        if (len < 8) return -1;
+        uint32_t last = h2_get32(p) & 0x7fffffff;
+        h->dead = 1;
+        for (int j = 0; j < n; j++)
+            if (st[j].started && !st[j].done && st[j].id > last) { st[j].refused = 1; st[j].done = 1; }
+        break;
+    }
+    case H2_WINDOW_UPDATE:
+        if (len != 4) return -1;
+        if (!f->stream) h->window += h2_get32(p) & 0x7fffffff;
+        else if (s) s->window += h2_get32(p) & 0x7fffffff;
+        break;
+    case H2_PUSH_PROMISE:
+        return -1;                                   /* push را غیرفعال کرده‌ایم */
+    }
+    return 0;
+}
+
+/* نوشتن قاب‌های در صف، یک بار خواندن از سوکت و پردازش قاب‌های کامل */
+static int h2_pump(H2Conn *h, H2Stream *st, int n) {
+    if (h2_flush(h) < 0) return -1;
+    char chunk[READ_CHUNK];
+    errno = 0;
+    int got = conn_read(&h->c, chunk, sizeof(chunk));
+    if (got <= 0) {
+        h->dead = 1;
+        h->closed = errno != EAGAIN && errno != EWOULDBLOCK;
+        return -1;
     }
+    buf_add(&h->in, chunk, got);
+    if (h->in.oom) { h->dead = 1; return -1; }
+    size_t off = 0;
+    while (h->in.len - off >= H2_FRAME_HEAD) {
+        H2Frame f;
+        h2_get_head((const unsigned char*)h->in.data + off, &f);
+        if (f.len > H2_DEFAULT_FRAME) { h->dead = 1; return -1; }
+        if (h->in.len - off < H2_FRAME_HEAD + f.len) break;
+        if (h2_on_frame(h, &f, (const unsigned char*)h->in.data + off + H2_FRAME_HEAD, st, n) < 0) {
+            unsigned char g[8];
+            h2_put32(g, 0); h2_put32(g + 4, H2_PROTOCOL_ERROR);
+            h2_frame(h, H2_GOAWAY, 0, 0, g, 8);
+            h2_flush(h);
+            h->dead = 1;
+            return -1;
+        }
+        off += H2_FRAME_HEAD + f.len;
+    }
+    memmove(h->in.data, h->in.data + off, h->in.len - off);
+    h->in.len -= off;
+    return h2_flush(h);
+}
 
-    strcat(req, "\r\n");
-    if (body) strcat(req, body);
-    *req_len = strlen(req);
-    return req;
+/* همه‌ی streamها را تا پایان روی یک اتصال اجرا می‌کند */
+static void h2_run(H2Conn *h, H2Stream *st, int n) {
+    uint32_t limit = h->peer_streams < H2_MAX_STREAMS ? h->peer_streams : H2_MAX_STREAMS;
+    for (;;) {
+        int active = 0, waiting = 0;
+        for (int i = 0; i < n; i++) active += st[i].started && !st[i].done;
+        for (int i = 0; i < n && !h->dead && (uint32_t)active < limit; i++)
+            if (!st[i].started && !st[i].done) { h2_start(h, &st[i]); active += !st[i].done; }
+        h2_send_bodies(h, st, n);
+        for (int i = 0; i < n; i++) waiting += !st[i].done;
+        if (!waiting || (!active && h->dead)) break;
+        if (h2_pump(h, st, n) < 0) break;
+        limit = h->peer_streams < H2_MAX_STREAMS ? h->peer_streams : H2_MAX_STREAMS;
+        if (!limit) limit = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        H2Stream *s = &st[i];
+        if (s->done) continue;
+        /* اتصال قبل از رسیدن پاسخ بسته شد (مثلاً اتصال بیکار session)؛ قابل تکرار */
+        if (!s->started || (h->closed && !s->got_head)) { s->refused = 1; s->done = 1; }
+        else h2_fail(s, h->closed ? "connection closed" : "timeout");
+    }
+}
+
+static void h2_stream_init(H2Stream *st, const char *req, size_t len, Response *r, Sink *k) {
+    memset(st, 0, sizeof(*st));
+    st->req = req; st->req_len = len;
+    st->r = r; st->k = k;
+}
+
+static void h2_stream_free(H2Stream *st) {
+    if (st->ps.inflating) inflateEnd(&st->ps.z);
+    st->ps.inflating = 0;
+}
+
+static int h1_only(const Session *s, const char *key) {
+    for (int i = 0; i < H1_ONLY_SLOTS; i++) if (!strcmp(s->h1_only[i], key)) return 1;
+    return 0;
+}
+
+/*
+ * streamها را روی اتصال h2 session به host:port اجرا می‌کند. 1 یعنی سرور h2
+ * ندارد و باید HTTP/1.1 استفاده شود، -1 اتصال برقرار نشد، 0 اجرا شد (نتیجه‌ی
+ * هر stream در Response/Sink خودش).
+ */
+static int h2_exchange(Session *s, const char *host, int port, H2Stream *st, int n, int timeout) {
+    char key[264];
+    snprintf(key, sizeof(key), "%s:%d", host, port);
+    if (!s || !s->http2 || h1_only(s, key)) return 1;
+    for (int i = 0; i < n; i++) timing_start(&st[i].r->tm);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        H2Conn *h = s->h2;
+        int fresh = !h || h->dead || h->port != port || strcmp(h->host, host);
+        if (h && (h->dead || h->port != port || strcmp(h->host, host))) { h2_conn_close(h); s->h2 = h = NULL; }
+        if (!h) {
+            int no_h2 = 0;
+            if (!(h = h2_connect(host, port, timeout, &no_h2))) {
+                if (!no_h2) return -1;
+                snprintf(s->h1_only[s->h1_next], sizeof(s->h1_only[0]), "%s", key);
+                s->h1_next = (s->h1_next + 1) % H1_ONLY_SLOTS;
+                return 1;
+            }
+            s->h2 = h;
+        } else {
+            struct timeval tv = { timeout, 0 };
+            setsockopt(h->c.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        }
+        /* streamهای بعدی همان اتصال تازه را دوباره استفاده می‌کنند */
+        for (int i = 0; i < n; i++) timing_conn(&st[i].r->tm, &h->c, !fresh || i > 0);
+        h2_run(h, st, n);
+        int again = 0;
+        for (int i = 0; i < n; i++) {
+            if (!st[i].refused) continue;
+            int stop = st[i].ps.stop_on_redirect;
+            h2_stream_free(&st[i]);
+            h2_stream_init(&st[i], st[i].req, st[i].req_len, st[i].r, st[i].k);
+            st[i].ps.stop_on_redirect = stop;
+            response_reset(st[i].r);
+            again = 1;
+        }
+        if (!again) return 0;
+    }
+    for (int i = 0; i < n; i++) if (!st[i].done) h2_fail(&st[i], "connection refused stream");
+    return 0;
 }
 
 /* ── Send & Receive (با ریدایرکت واقعی) ── */
-static int send_recv(const char *host, int port, int is_ssl, const char *req, size_t req_len,
-                     char *response, size_t max_resp, int timeout, int follow_redirects) {
+/* GET ساده؛ from >= 0 یعنی Range: bytes=from-to (to < 0: تا انتها) */
+static void build_get(Buf *req, const URL *url, long long from, long long to, int keep_alive) {
+    buf_addf(req, "GET %s HTTP/1.1\r\nHost: %s", url->path, url->host);
+    if ((url->is_ssl && url->port != 443) || (!url->is_ssl && url->port != 80)) buf_addf(req, ":%d", url->port);
+    buf_adds(req, keep_alive ? "\r\nConnection: keep-alive\r\n" : "\r\nConnection: close\r\n");
+    if (from >= 0 && to >= 0) buf_addf(req, "Range: bytes=%lld-%lld\r\n", from, to);
+    else if (from >= 0) buf_addf(req, "Range: bytes=%lld-\r\n", from);
+    buf_add(req, "\r\n", 2);
+}
+
+/* اگر پاسخ ریدایرکت است، مقصد بعدی و درخواست GET آن را می‌سازد؛ 1 یعنی ادامه */
+static int redirect_next(const Response *r, const char *host, int port, int is_ssl, URL *url, Buf *req,
+                         int keep_alive) {
+    if (!is_redirect(r->status)) return 0;
+    size_t loc_len;
+    const char *lv = resp_header(r, "Location", &loc_len);
+    if (!lv) return 0;
+    char loc[1024];
+    snprintf(loc, sizeof(loc), "%.*s", (int)loc_len, lv);
+    if (loc[0] == '/') {
+        memset(url, 0, sizeof(*url));
+        snprintf(url->host, sizeof(url->host), "%s", host);
+        snprintf(url->path, sizeof(url->path), "%s", loc);
+        url->port = port; url->is_ssl = is_ssl;
+    } else parse_url(loc, url);
+    req->len = 0;
+    build_get(req, url, -1, -1, keep_alive);
+    return req->oom ? -1 : 1;
+}
+
+static int send_recv(Session *s, const char *host, int port, int is_ssl, const Buf *req,
+                     Response *r, Sink *k, int timeout, int follow_redirects) {
     char current_host[256];
-    strncpy(current_host, host, 255);
+    snprintf(current_host, sizeof(current_host), "%s", host);
     int current_port = port;
     int current_ssl = is_ssl;
-    char current_req[MAX_BUF];
-    strncpy(current_req, req, MAX_BUF - 1);
-    size_t current_len = req_len;
+    const char *data = req->data;
+    size_t len = req->len;
+    Buf redirect_req; buf_init(&redirect_req);
+    int ret = 0;
 
     for (int redirect = 0; redirect < MAX_REDIRECTS; redirect++) {
-        int sock = sock_connect_timeout(current_host, current_port, timeout);
-        if (sock < 0) return -1;
-
-        if (current_ssl) {
-            init_ssl();
-            SSL *ssl = SSL_new(ssl_ctx);
-            SSL_set_fd(ssl, sock);
-            if (SSL_connect(ssl) <= 0) { SSL_free(ssl); close(sock); return -1; }
-            SSL_write(ssl, current_req, current_len);
-            int total = 0, n;
-            while (total < (int)max_resp - 1 && (n = SSL_read(ssl, response + total, max_resp - total - 1)) > 0) total += n;
-            response[total] = '\0';
-            SSL_shutdown(ssl); SSL_free(ssl);
-        } else {
-            send(sock, current_req, current_len, 0);
-            int total = 0, n;
-            while (total < (int)max_resp - 1 && (n = recv(sock, response + total, max_resp - total - 1, 0)) > 0) total += n;
-            response[total] = '\0';
-        }
-        close(sock);
-
-        if (!follow_redirects) return 0;
-
-        int status = 0;
-        sscanf(response, "HTTP/%*s %d", &status);
-        if (status == 301 || status == 302 || status == 307 || status == 308) {
-            char *loc = strcasestr(response, "\nLocation: ");
-            if (!loc) loc = strcasestr(response, "\r\nLocation: ");
-            if (loc) {
-                loc += (loc[0] == '\r' ? 2 : 1) + 10;
-                char *end = strstr(loc, "\r\n");
-                if (!end) end = strstr(loc, "\n");
-                if (end) *end = '\0';
-
-                URL url;
-                parse_url(loc, &url);
-                strncpy(current_host, url.host, 255);
-                current_port = url.port;
-                current_ssl = url.is_ssl;
-                snprintf(current_req, MAX_BUF, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", url.path, url.host);
-                current_len = strlen(current_req);
-                continue;
+        response_reset(r);
+        int rc = 1;
+        if (s && current_ssl) {
+            H2Stream st;
+            h2_stream_init(&st, data, len, r, k);
+            st.ps.stop_on_redirect = follow_redirects;
+            rc = h2_exchange(s, current_host, current_port, &st, 1, timeout);
+            h2_stream_free(&st);
+            if (rc == 0 && (!st.got_head || k->err[0])) rc = -1;
+        }
+        if (rc > 0) {
+            Conn c;
+            timing_start(&r->tm);
+            if (conn_open(&c, current_host, current_port, current_ssl, timeout, 0) < 0) { ret = -1; break; }
+            timing_conn(&r->tm, &c, 0);
+            int head_req = !strncmp(data, "HEAD ", 5);
+            rc = -1;
+            if (conn_write(&c, data, len) == 0) {
+                timing_sent(&r->tm);
+                rc = read_response(&c, r, k, head_req, follow_redirects);
             }
+            conn_close(&c);
         }
-        break;
+        if (rc < 0) { ret = -1; break; }
+
+        if (!follow_redirects) break;
+        URL url;
+        int next = redirect_next(r, current_host, current_port, current_ssl, &url, &redirect_req, 0);
+        if (next < 0) { ret = -1; break; }
+        if (!next) break;
+        snprintf(current_host, sizeof(current_host), "%s", url.host);
+        current_port = url.port;
+        current_ssl = url.is_ssl;
+        data = redirect_req.data; len = redirect_req.len;
     }
-    return 0;
+    buf_free(&redirect_req);
+    return ret;
 }
 
 /* ── Parse Response ── */
-static void parse_response(lua_State *L, const char *raw) {
+static double timing_total(const Timing *t) { return (t->end ? t->end : mono_now()) - t->start; }
+
+static void push_timing(lua_State *L, const Timing *t) {
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, t->dns); lua_setfield(L, -2, "dns");
+    lua_pushnumber(L, t->connect); lua_setfield(L, -2, "connect");
+    lua_pushnumber(L, t->tls); lua_setfield(L, -2, "tls");
+    lua_pushnumber(L, t->ttfb); lua_setfield(L, -2, "ttfb");
+    lua_pushnumber(L, t->transfer); lua_setfield(L, -2, "transfer");
+    lua_pushnumber(L, timing_total(t)); lua_setfield(L, -2, "total");
+    lua_pushboolean(L, t->reused); lua_setfield(L, -2, "reused");
+}
+
+static void parse_response(lua_State *L, const Response *r, int streamed) {
     lua_newtable(L);
-    const char *body = strstr(raw, "\r\n\r\n");
-    if (!body) body = strstr(raw, "\n\n");
+    const char *raw = buf_str(&r->head);
 
-    if (body) {
-        if (body[0] == '\r') body += 4; else body += 2;
-        int status = 0;
+    if (r->head_done) {
         char reason[128] = "";
-        sscanf(raw, "HTTP/%*s %d %127[^\r\n]", &status, reason);
-        lua_pushinteger(L, status); lua_setfield(L, -2, "status_code");
+        sscanf(raw, "HTTP/%*s %*d %127[^\r\n]", reason);
+        lua_pushinteger(L, r->status); lua_setfield(L, -2, "status_code");
         lua_pushstring(L, reason); lua_setfield(L, -2, "reason");
-        lua_pushboolean(L, status >= 200 && status < 300); lua_setfield(L, -2, "ok");
-        lua_pushstring(L, body); lua_setfield(L, -2, "text");
-
-        lua_newtable(L);
-        const char *hs = strstr(raw, "\r\n");
-        if (hs) {
-            hs += 2;
-            const char *he = strstr(raw, "\r\n\r\n");
-            while (hs && he && hs < he) {
-                const char *colon = strchr(hs, ':');
-                if (colon && colon < he) {
-                    char key[128] = "";
-                    strncpy(key, hs, colon - hs);
-                    const char *val = colon + 1;
-                    while (*val == ' ') val++;
-                    const char *crlf = strstr(val, "\r\n");
-                    if (!crlf) crlf = he;
-                    char value[4096] = "";
-                    strncpy(value, val, crlf - val);
-                    lua_pushstring(L, value); lua_setfield(L, -2, key);
-                    hs = crlf + 2;
-                } else break;
-            }
+        lua_pushboolean(L, r->status >= 200 && r->status < 300); lua_setfield(L, -2, "ok");
+        lua_pushinteger(L, (lua_Integer)r->body_len); lua_setfield(L, -2, "bytes");
+        if (!streamed) { lua_pushlstring(L, buf_str(&r->body), r->body.len); lua_setfield(L, -2, "text"); }
+
+        lua_createtable(L, 0, r->nhdr);
+        for (int i = 0; i < r->nhdr; i++) {
+            const Span *h = &r->hdr[i];
+            lua_pushlstring(L, raw + h->name, h->name_len);
+            lua_pushlstring(L, raw + h->value, h->value_len);
+            lua_settable(L, -3);
         }
         lua_setfield(L, -2, "headers");
 
-        lua_getfield(L, -1, "headers");
-        lua_getfield(L, -1, "Content-Type");
-        const char *ct = lua_tostring(L, -1);
-        const char *enc = "utf-8";
-        if (ct) { char *cs = strstr(ct, "charset="); if (cs) enc = cs + 8; }
-        lua_pushstring(L, enc); lua_setfield(L, -3, "encoding");
-        lua_pop(L, 2);
+        size_t ct_len = 0;
+        const char *ct = resp_header(r, "Content-Type", &ct_len);
+        const char *cs = ct ? memmem(ct, ct_len, "charset=", 8) : NULL;
+        if (cs) lua_pushlstring(L, cs + 8, ct_len - (cs + 8 - ct));
+        else lua_pushstring(L, "utf-8");
+        lua_setfield(L, -2, "encoding");
+        if (!r->complete) { lua_pushboolean(L, 1); lua_setfield(L, -2, "incomplete"); }
+        if (r->tm.start) { push_timing(L, &r->tm); lua_setfield(L, -2, "timing"); }
 
-        if (ct && strstr(ct, "application/json")) {
-            lua_getglobal(L, "json");
-            if (lua_istable(L, -1)) {
-                lua_getfield(L, -1, "decode");
-                lua_pushstring(L, body);
-                if (lua_pcall(L, 1, 1, 0) == LUA_OK) lua_setfield(L, -3, "json");
-                else lua_pop(L, 1);
-            } else lua_pop(L, 1);
-        }
+        if (!streamed && ct && memmem(ct, ct_len, "json", 4) &&
+            json_decode(L, buf_str(&r->body), r->body.len, NULL, 0) == 0)
+            lua_setfield(L, -2, "json");
     } else {
         lua_pushinteger(L, 0); lua_setfield(L, -2, "status_code");
-        lua_pushstring(L, raw); lua_setfield(L, -2, "text");
+        lua_pushlstring(L, raw, r->head.len); lua_setfield(L, -2, "text");
         lua_pushboolean(L, 0); lua_setfield(L, -2, "ok");
     }
 }
 
+/* درخواست ناموفق در batch / run */
+static void push_failure(lua_State *L, const char *err) {
+    lua_newtable(L);
+    lua_pushinteger(L, 0); lua_setfield(L, -2, "status_code");
+    lua_pushboolean(L, 0); lua_setfield(L, -2, "ok");
+    lua_pushstring(L, err && err[0] ? err : "Connection failed"); lua_setfield(L, -2, "error");
+}
+
+/* ── Session Stats ── */
+static void stat_add(StatHist *h, double v) {
+    int i = v > 1e-4 ? (int)(log2(v / 1e-4) * 4) : 0;
+    if (i >= STAT_BUCKETS) i = STAT_BUCKETS - 1;
+    h->hist[i]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static double stat_quantile(const StatHist *h, double q) {
+    if (!h->n) return 0;
+    unsigned long long want = (unsigned long long)(q * h->n + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += h->hist[i];
+        if (seen >= want) {
+            double v = 1e-4 * exp2((i + 0.5) / 4);     /* میانه‌ی هندسی خانه */
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* در نخ اصلی، برای هر پاسخی که به Lua برمی‌گردد */
+static void session_record(Session *s, const Response *r, int ok) {
+    if (!s) return;
+    SessStats *st = &s->stats;
+    st->requests++;
+    if (!ok) { st->errors++; return; }
+    st->bytes += r->body_len;
+    const Timing *t = &r->tm;
+    if (!t->start) return;
+    stat_add(&st->phase[ST_TOTAL], timing_total(t));
+    stat_add(&st->phase[ST_TTFB], t->ttfb);
+    stat_add(&st->phase[ST_TRANSFER], t->transfer);
+    if (t->reused) { st->reused++; return; }
+    stat_add(&st->phase[ST_DNS], t->dns);
+    stat_add(&st->phase[ST_CONNECT], t->connect);
+    stat_add(&st->phase[ST_TLS], t->tls);
+}
+
 /* ── Execute ── */
+/*
+ * opts.stream = function(chunk) ... end  → بدنه تکه‌تکه به تابع داده می‌شود
+ * opts.output = "path"                     → بدنه مستقیم در فایل نوشته می‌شود
+ * در هر دو حالت res.text تنظیم نمی‌شود و res.bytes طول بدنه است.
+ */
 static int execute(lua_State *L, const char *method, const char *url_str, Session *s, int opts_idx) {
     URL url;
     parse_url(url_str, &url);
-    size_t req_len;
-    char *req = build_request(method, url_str, s, opts_idx, L, &req_len);
+    int has_opts = opts_idx > 0 && lua_istable(L, opts_idx);
     int timeout = s ? s->timeout : 30;
-    int follow = 1;
-    if (opts_idx > 0 && lua_istable(L, opts_idx)) {
+    int follow = s ? s->follow_redirects : 1;
+    const char *output = NULL;
+    Sink k;
+    sink_init(&k, L);
+    if (has_opts) {
         lua_getfield(L, opts_idx, "timeout"); if (lua_isnumber(L, -1)) timeout = lua_tointeger(L, -1); lua_pop(L, 1);
         lua_getfield(L, opts_idx, "allow_redirects"); if (lua_isboolean(L, -1)) follow = lua_toboolean(L, -1); lua_pop(L, 1);
+        lua_getfield(L, opts_idx, "output"); if (lua_isstring(L, -1)) output = lua_tostring(L, -1); lua_pop(L, 1);
+        lua_getfield(L, opts_idx, "stream");
+        if (lua_isfunction(L, -1)) k.callback = lua_gettop(L);  /* تا پایان روی استک می‌ماند */
+        else lua_pop(L, 1);
     }
-    char *response = malloc(MAX_BUF);
-    if (!response) return luaL_error(L, "memory");
-    int ret = send_recv(url.host, url.port, url.is_ssl, req, req_len, response, MAX_BUF, timeout, follow);
-    if (ret < 0) { free(response); lua_pushnil(L); lua_pushstring(L, "Connection failed"); return 2; }
-    parse_response(L, response);
-    free(response);
+    if (output && (k.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        lua_pushnil(L); lua_pushstring(L, "Cannot open output file"); return 2;
+    }
+
+    Buf req; buf_init(&req);
+    char err[128];
+    int rc = build_request(method, url_str, s, opts_idx, L, &req, 0, err, sizeof(err));
+    if (rc < 0) {
+        buf_free(&req);
+        if (k.fd >= 0) close(k.fd);
+        if (rc == -1) return luaL_error(L, "memory");
+        lua_pushnil(L); lua_pushstring(L, err); return 2;
+    }
+    Response r;
+    response_init(&r);
+    int ret = send_recv(s, url.host, url.port, url.is_ssl, &req, &r, &k, timeout, follow);
+    buf_free(&req);
+    if (k.fd >= 0) close(k.fd);
+    session_record(s, &r, ret == 0);
+    if (ret < 0) {
+        response_free(&r);
+        lua_pushnil(L); lua_pushstring(L, k.err[0] ? k.err : "Connection failed");
+        return 2;
+    }
+    parse_response(L, &r, sink_active(&k));
+    response_free(&r);
     return 1;
 }
 
@@ -436,34 +1584,246 @@ static int l_request(lua_State *L) {
 #define SH(n,m) static int l_##n(lua_State *L) { lua_pushstring(L,m); lua_insert(L,1); return l_request(L); }
 SH(get,"GET") SH(post,"POST") SH(put,"PUT") SH(delete,"DELETE") SH(patch,"PATCH") SH(head,"HEAD") SH(options,"OPTIONS")
 
+/* ── Download / Upload ── */
+typedef struct {
+    URL url;
+    int fd, timeout, ok;
+    int ignored;           /* سرور به Range جواب 2xx غیر 206 داد */
+    long long from, to;
+    char err[256];
+} Segment;
+
+#define SEGMENT_ATTEMPTS 3
+#define SEGMENT_BACKOFF_US 200000
+
+/*
+ * یک بازه با Range. قطع اتصال و 5xx تا SEGMENT_ATTEMPTS بار با backoff از همان
+ * off دوباره؛ هر پاسخ دیگری جز 206 بدون نوشتن چیزی در فایل شکست است.
+ */
+static void *segment_worker(void *arg) {
+    Segment *g = arg;
+    Sink k;
+    sink_init(&k, NULL);
+    k.fd = g->fd;
+    k.off = g->from;
+    for (int attempt = 0; attempt < SEGMENT_ATTEMPTS && k.off <= g->to; attempt++) {
+        if (attempt) usleep(SEGMENT_BACKOFF_US << (attempt - 1));
+        Buf req; buf_init(&req);
+        build_get(&req, &g->url, k.off, g->to, 0);
+        Response r;
+        response_init(&r);
+        k.err[0] = 0;
+        k.segment = 1;
+        int ret = req.oom ? -1 : send_recv(NULL, g->url.host, g->url.port, g->url.is_ssl, &req, &r, &k, g->timeout, 0);
+        int status = r.status;
+        buf_free(&req);
+        response_free(&r);
+        if (status == 206 && k.err[0]) { snprintf(g->err, sizeof(g->err), "%s", k.err); return NULL; }
+        if (status && status != 206 && status < 500) {
+            g->ignored = status >= 200 && status < 300;
+            snprintf(g->err, sizeof(g->err), "HTTP %d", status);
+            return NULL;
+        }
+        if (status >= 500) snprintf(g->err, sizeof(g->err), "HTTP %d", status);
+        else if (ret < 0 && status != 206) snprintf(g->err, sizeof(g->err), "Connection failed");
+    }
+    g->ok = k.off > g->to;
+    if (g->ok) g->err[0] = 0;
+    else if (!g->err[0]) snprintf(g->err, sizeof(g->err), "segment incomplete");
+    return NULL;
+}
+
+/*
+ * اندازه‌ی کل فایل و آدرس نهایی (بعد از ریدایرکت‌ها) با یک Range: bytes=0-0؛
+ * -1 اگر سرور Range را پشتیبانی نکند.
+ */
+static long long probe_size(URL *url, int timeout) {
+    Buf req; buf_init(&req);
+    build_get(&req, url, 0, 0, 0);
+    Response r;
+    response_init(&r);
+    Sink k;
+    sink_init(&k, NULL);
+    long long total = -1;
+    for (int hop = 0; hop < MAX_REDIRECTS; hop++) {
+        if (send_recv(NULL, url->host, url->port, url->is_ssl, &req, &r, &k, timeout, 0) < 0) break;
+        URL next;
+        if (redirect_next(&r, url->host, url->port, url->is_ssl, &next, &req, 0) == 1) {
+            *url = next;
+            req.len = 0;
+            build_get(&req, url, 0, 0, 0);
+            continue;
+        }
+        size_t n;
+        const char *cr = r.status == 206 ? resp_header(&r, "Content-Range", &n) : NULL;
+        const char *slash = cr ? memchr(cr, '/', n) : NULL;
+        if (slash && slash + 1 < cr + n && isdigit((unsigned char)slash[1])) total = strtoll(slash + 1, NULL, 10);
+        break;
+    }
+    buf_free(&req);
+    response_free(&r);
+    return total;
+}
+
+/* 0 موفق، -1 خطا، -2 اگر سرور Range را وسط کار نادیده گرفت (باید یک GET کامل شود) */
+static int download_segments(const URL *url, int fd, long long total, int nseg, int timeout, char *err, size_t errlen) {
+    Segment g[MAX_SEGMENTS];
+    pthread_t th[MAX_SEGMENTS];
+    int started[MAX_SEGMENTS] = { 0 };
+    if (ftruncate(fd, total) < 0) { snprintf(err, errlen, "Cannot resize output file"); return -1; }
+    long long per = (total + nseg - 1) / nseg;
+    for (int i = 0; i < nseg; i++) {
+        memset(&g[i], 0, sizeof(g[i]));
+        g[i].url = *url; g[i].fd = fd; g[i].timeout = timeout;
+        g[i].from = i * per;
+        g[i].to = (i + 1) * per - 1 < total - 1 ? (i + 1) * per - 1 : total - 1;
+        if (g[i].from > g[i].to) { g[i].ok = 1; continue; }
+        started[i] = pthread_create(&th[i], NULL, segment_worker, &g[i]) == 0;
+        if (!started[i]) segment_worker(&g[i]);
+    }
+    int ok = 1, ignored = 0;
+    for (int i = 0; i < nseg; i++) {
+        if (started[i]) pthread_join(th[i], NULL);
+        ignored |= g[i].ignored;
+        if (!g[i].ok && ok) { ok = 0; snprintf(err, errlen, "%s", g[i].err); }
+    }
+    return ok ? 0 : ignored ? -2 : -1;
+}
+
+/*
+ * httpx.download(url, path [, timeout | opts]) → true | false, err
+ * بدنه بدون عبور از حافظه‌ی Lua به فایل می‌رود (splice روی HTTP).
+ * opts.timeout
+ * opts.resume   = true → ادامه از اندازه‌ی فعلی فایل با Range (اگر سرور 200 بدهد از اول)
+ * opts.segments = n    → n بازه‌ی موازی روی n اتصال، اگر سرور Range را بپذیرد (وگرنه یک GET کامل)
+ */
 static int l_download(lua_State *L) {
     const char *url_str = luaL_checkstring(L, 1);
     const char *path = luaL_checkstring(L, 2);
-    int timeout = luaL_optinteger(L, 3, 60);
+    int timeout = 60, resume = 0, nseg = 1;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "timeout"); if (lua_isnumber(L, -1)) timeout = lua_tointeger(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "resume"); resume = lua_toboolean(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "segments"); if (lua_isnumber(L, -1)) nseg = lua_tointeger(L, -1); lua_pop(L, 1);
+    } else timeout = luaL_optinteger(L, 3, 60);
+    if (nseg < 1) nseg = 1;
+    if (nseg > MAX_SEGMENTS) nseg = MAX_SEGMENTS;
+    URL url; parse_url(url_str, &url);
+    if (url.is_ssl) init_ssl();
+
+    Sink k;
+    sink_init(&k, NULL);
+    if ((k.fd = open(path, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC) | O_CLOEXEC, 0644)) < 0) {
+        lua_pushboolean(L, 0); lua_pushstring(L, "Cannot open output file"); return 2;
+    }
+    char err[256] = "";
+    int ok = 0;
+    if (!resume && nseg > 1) {
+        long long total = probe_size(&url, timeout);
+        if (total >= 0) {
+            int rc = download_segments(&url, k.fd, total, total < (long long)nseg * FILE_CHUNK ? 1 : nseg,
+                                       timeout, err, sizeof(err));
+            if (rc != -2 || ftruncate(k.fd, 0) < 0) {
+                close(k.fd);
+                if (rc == 0) { lua_pushboolean(L, 1); return 1; }
+                lua_pushboolean(L, 0); lua_pushstring(L, err); return 2;
+            }
+            err[0] = 0;                                  /* Range نادیده گرفته شد: یک GET کامل */
+        }
+    }
+
+    struct stat st;
+    if (resume && fstat(k.fd, &st) == 0 && st.st_size > 0) { k.off = st.st_size; k.resume = 1; }
+    Buf req; buf_init(&req);
+    build_get(&req, &url, k.resume ? (long long)k.off : -1, -1, 0);
+    Response r;
+    response_init(&r);
+    int ret = req.oom ? -1 : send_recv(NULL, url.host, url.port, url.is_ssl, &req, &r, &k, timeout, 1);
+    if (ret < 0) snprintf(err, sizeof(err), "%s", k.err[0] ? k.err : "Connection failed");
+    else if (r.status == 416 && k.off > 0) ok = 1;                       /* از قبل کامل بود */
+    else if (r.status < 200 || r.status >= 300) snprintf(err, sizeof(err), "HTTP %d", r.status);
+    else if (!r.complete) snprintf(err, sizeof(err), "incomplete");
+    else ok = 1;
+    close(k.fd);
+    buf_free(&req);
+    response_free(&r);
+    lua_pushboolean(L, ok);
+    if (ok) return 1;
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/*
+ * httpx.upload(url, path [, opts]) → res | nil, err
+ * فایل بدون بارگذاری در حافظه فرستاده می‌شود: sendfile روی HTTP و
+ * SSL_write با بافر بزرگ روی HTTPS. opts مثل request (headers، auth، params،
+ * timeout) به‌علاوه‌ی method (پیش‌فرض PUT) و content_type.
+ */
+static int l_upload(lua_State *L) {
+    const char *url_str = luaL_checkstring(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    int opts_idx = lua_istable(L, 3) ? 3 : 0;
+    const char *method = "PUT", *ctype = "application/octet-stream";
+    int timeout = 60;
+    if (opts_idx) {
+        lua_getfield(L, 3, "method"); if (lua_isstring(L, -1)) method = lua_tostring(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "content_type"); if (lua_isstring(L, -1)) ctype = lua_tostring(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "timeout"); if (lua_isnumber(L, -1)) timeout = lua_tointeger(L, -1); lua_pop(L, 1);
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        lua_pushnil(L); lua_pushstring(L, "Cannot open input file"); return 2;
+    }
     URL url; parse_url(url_str, &url);
-    char req[2048];
-    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", url.path, url.host);
-    char *resp = malloc(MAX_BUF);
-    if (!resp) return luaL_error(L, "memory");
-    if (send_recv(url.host, url.port, url.is_ssl, req, strlen(req), resp, MAX_BUF, timeout, 1) < 0) {
-        free(resp); lua_pushboolean(L, 0); return 1;
-    }
-    const char *body = strstr(resp, "\r\n\r\n");
-    if (!body) body = resp;
-    else { if (body[0]=='\r') body+=4; else body+=2; }
-    FILE *f = fopen(path, "wb");
-    if (!f) { free(resp); lua_pushboolean(L, 0); return 1; }
-    fwrite(body, 1, strlen(body), f);
-    fclose(f);
-    free(resp);
-    lua_pushboolean(L, 1); return 1;
+    Buf req; buf_init(&req);
+    char err[128];
+    int rc = build_request(method, url_str, NULL, opts_idx, L, &req, 0, err, sizeof(err));
+    if (rc < 0) {
+        close(fd); buf_free(&req);
+        if (rc == -1) return luaL_error(L, "memory");
+        lua_pushnil(L); lua_pushstring(L, err); return 2;
+    }
+    /* build_request هدرها را با یک خط خالی بسته؛ طول و نوع فایل قبل از آن */
+    const char *end = memmem(buf_str(&req), req.len, "\r\n\r\n", 4);
+    req.len = end ? (size_t)(end - req.data) + 2 : req.len;
+    if (!strcasestr(buf_str(&req), "\nContent-Type:")) buf_addf(&req, "Content-Type: %s\r\n", ctype);
+    buf_addf(&req, "Content-Length: %lld\r\n\r\n", (long long)st.st_size);
+
+    Response r;
+    response_init(&r);
+    Sink k;
+    sink_init(&k, L);
+    Conn c;
+    int ret = -1;
+    timing_start(&r.tm);
+    if (!req.oom && conn_open(&c, url.host, url.port, url.is_ssl, timeout, 0) == 0) {
+        timing_conn(&r.tm, &c, 0);
+        if (conn_write(&c, req.data, req.len) == 0 && conn_sendfile(&c, fd, 0, st.st_size) == 0) {
+            timing_sent(&r.tm);
+            if (read_response(&c, &r, &k, 0, 0) == 0) ret = 0;
+        }
+        conn_close(&c);
+    }
+    close(fd);
+    buf_free(&req);
+    if (ret < 0) {
+        response_free(&r);
+        lua_pushnil(L); lua_pushstring(L, k.err[0] ? k.err : "Connection failed");
+        return 2;
+    }
+    parse_response(L, &r, 0);
+    response_free(&r);
+    return 1;
 }
 
 /* ── Session ── */
 static int l_session_new(lua_State *L) {
     Session *s = lua_newuserdata(L, sizeof(Session));
     memset(s, 0, sizeof(Session));
-    s->timeout = 30; s->follow_redirects = 1; s->max_redirects = 10; s->verify_ssl = 1;
+    s->timeout = 30; s->follow_redirects = 1; s->max_redirects = 10; s->verify_ssl = 1; s->http2 = 1;
+    s->max_per_host = 4; s->pipeline = 1; s->retries = 2;
     strcpy(s->user_agent, "Byte-HttpX/6.1");
     luaL_getmetatable(L, "httpx_sess"); lua_setmetatable(L, -2); return 1;
 }
@@ -476,6 +1836,12 @@ static int l_session_set(lua_State *L) {
     else if (!strcmp(k,"timeout")) s->timeout=luaL_checkinteger(L,3);
     else if (!strcmp(k,"follow_redirects")) s->follow_redirects=lua_toboolean(L,3);
     else if (!strcmp(k,"verify_ssl")) s->verify_ssl=lua_toboolean(L,3);
+    else if (!strcmp(k,"http2")) { s->http2=lua_toboolean(L,3); if (!s->http2) { h2_conn_close(s->h2); s->h2=NULL; } }
+    else if (!strcmp(k,"rate")) s->rate=luaL_checknumber(L,3);
+    else if (!strcmp(k,"burst")) s->burst=luaL_checkinteger(L,3);
+    else if (!strcmp(k,"max_per_host")) s->max_per_host=luaL_checkinteger(L,3);
+    else if (!strcmp(k,"pipeline")) s->pipeline=luaL_checkinteger(L,3);
+    else if (!strcmp(k,"retries")) s->retries=luaL_checkinteger(L,3);
     else if (!strcmp(k,"user_agent")) strncpy(s->user_agent,luaL_checkstring(L,3),255);
     else if (!strcmp(k,"auth")) {
         if (lua_istable(L,3)) {
@@ -490,11 +1856,565 @@ static int l_session_req(lua_State *L) {
     return execute(L, luaL_checkstring(L,2), luaL_checkstring(L,3),
                    luaL_checkudata(L,1,"httpx_sess"), lua_istable(L,4)?4:0);
 }
+#define SSH(n,m) static int l_session_##n(lua_State *L) { lua_pushstring(L,m); lua_insert(L,2); return l_session_req(L); }
+SSH(get,"GET") SSH(post,"POST") SSH(put,"PUT") SSH(delete,"DELETE") SSH(patch,"PATCH") SSH(head,"HEAD") SSH(options,"OPTIONS")
+
+/*
+ * s:batch({ {"GET", url}, {"POST", url, {json = {...}}}, ... })
+ * درخواست‌های https به یک host هم‌زمان به‌صورت streamهای HTTP/2 روی یک اتصال
+ * می‌روند؛ بقیه (یا اگر سرور h2 ندارد) یکی‌یکی با HTTP/1.1. خروجی آرایه‌ای از
+ * پاسخ‌ها به همان ترتیب؛ درخواست ناموفق: { ok = false, status_code = 0, error = ... }
+ */
+typedef struct { URL url; Buf req; Response r; Sink k; int state; } BatchItem;
+enum { B_PENDING, B_H1, B_DONE, B_FAILED };
+
+static int l_session_batch(lua_State *L) {
+    Session *s = luaL_checkudata(L, 1, "httpx_sess");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int n = (int)lua_rawlen(L, 2);
+    BatchItem *it = calloc(n ? n : 1, sizeof(BatchItem));
+    H2Stream *st = calloc(n ? n : 1, sizeof(H2Stream));
+    int *idx = calloc(n ? n : 1, sizeof(int));
+    if (!it || !st || !idx) { free(it); free(st); free(idx); return luaL_error(L, "memory"); }
+
+    for (int i = 0; i < n; i++) {
+        BatchItem *b = &it[i];
+        buf_init(&b->req);
+        response_init(&b->r);
+        sink_init(&b->k, L);
+        lua_rawgeti(L, 2, i + 1);
+        int t = lua_gettop(L);
+        lua_rawgeti(L, t, 1); lua_rawgeti(L, t, 2); lua_rawgeti(L, t, 3);
+        const char *method = lua_tostring(L, t + 1), *url = lua_tostring(L, t + 2);
+        if (!lua_istable(L, t) || !method || !url) {
+            snprintf(b->k.err, sizeof(b->k.err), "invalid request");
+            b->state = B_FAILED;
+        } else {
+            parse_url(url, &b->url);
+            int rc = build_request(method, url, s, lua_istable(L, t + 3) ? t + 3 : 0, L, &b->req, 0,
+                                   b->k.err, sizeof(b->k.err));
+            if (rc < 0) {
+                if (rc == -1) snprintf(b->k.err, sizeof(b->k.err), "memory");
+                b->state = B_FAILED;
+            }
+        }
+        lua_settop(L, t - 1);
+    }
+
+    Buf rreq; buf_init(&rreq);
+    for (int i = 0; i < n; i++) {
+        BatchItem *b = &it[i];
+        if (b->state != B_PENDING) continue;
+        if (!b->url.is_ssl) { b->state = B_H1; continue; }
+        int g = 0;
+        for (int j = i; j < n; j++) {
+            if (it[j].state != B_PENDING || !it[j].url.is_ssl || it[j].url.port != b->url.port ||
+                strcmp(it[j].url.host, b->url.host)) continue;
+            h2_stream_init(&st[g], it[j].req.data, it[j].req.len, &it[j].r, &it[j].k);
+            st[g].ps.stop_on_redirect = s->follow_redirects;
+            idx[g++] = j;
+        }
+        int rc = h2_exchange(s, b->url.host, b->url.port, st, g, s->timeout);
+        for (int x = 0; x < g; x++) {
+            BatchItem *e = &it[idx[x]];
+            h2_stream_free(&st[x]);
+            if (rc > 0) { e->state = B_H1; continue; }
+            if (rc < 0 || !st[x].got_head || e->k.err[0]) {
+                if (!e->k.err[0]) snprintf(e->k.err, sizeof(e->k.err), "Connection failed");
+                e->state = B_FAILED;
+                continue;
+            }
+            e->state = B_DONE;
+            URL next;
+            int more = s->follow_redirects ? redirect_next(&e->r, e->url.host, e->url.port, 1, &next, &rreq, 0) : 0;
+            if (more && (more < 0 || send_recv(s, next.host, next.port, next.is_ssl, &rreq, &e->r, &e->k,
+                                               s->timeout, 1) < 0)) {
+                if (!e->k.err[0]) snprintf(e->k.err, sizeof(e->k.err), "Connection failed");
+                e->state = B_FAILED;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        BatchItem *b = &it[i];
+        if (b->state == B_H1)
+            b->state = send_recv(s, b->url.host, b->url.port, b->url.is_ssl, &b->req, &b->r, &b->k,
+                                 s->timeout, s->follow_redirects) < 0 ? B_FAILED : B_DONE;
+    }
+    buf_free(&rreq);
+
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        BatchItem *b = &it[i];
+        session_record(s, &b->r, b->state == B_DONE);
+        if (b->state == B_DONE) parse_response(L, &b->r, 0);
+        else push_failure(L, b->k.err);
+        lua_rawseti(L, -2, i + 1);
+        buf_free(&b->req);
+        response_free(&b->r);
+    }
+    free(it); free(st); free(idx);
+    return 1;
+}
+
+/* ── Scheduler ── */
+/*
+ * id = s:enqueue(method, url [, opts])     (در حین s:run هم مجاز است)
+ * s:run([function(id, res) ... end])        → بدون callback: جدول { [id] = res }
+ *
+ * هر host صف، token bucket (s:set("rate"/"burst")) و حداکثر max_per_host کارگر
+ * خودش را دارد. هر کارگر یک اتصال keep-alive نگه می‌دارد و تا pipeline درخواست
+ * idempotent را پشت‌سرهم می‌فرستد و پاسخ‌ها را به ترتیب می‌خواند. خطای اتصال،
+ * بدنه‌ی ناقص و 429/502/503/504 در متدهای idempotent تا retries بار با backoff
+ * نمایی (یا Retry-After) دوباره صف می‌شوند. opts.stream / opts.output اینجا
+ * پشتیبانی نمی‌شود؛ بدنه در res.text است.
+ */
+#define SCHED_MAX_PIPELINE 64
+#define SCHED_BACKOFF 0.2
+#define SCHED_MAX_WAIT 60.0
+
+typedef struct SchedJob {
+    struct SchedJob *next;
+    lua_Integer id;
+    int attempts, redirects, idempotent, head_req, ok;
+    double not_before;
+    URL url;
+    Buf req;
+    Response r;
+    Sink k;
+} SchedJob;
+
+typedef struct SchedHost {
+    struct SchedHost *next;
+    Sched *sc;
+    char host[256];
+    int port, is_ssl;
+    SchedJob *head, *tail;
+    int queued, workers;
+    double tokens, last;
+} SchedHost;
+
+struct Sched {
+    pthread_mutex_t mu;
+    pthread_cond_t work, done;
+    SchedHost *hosts;
+    SchedJob *done_head, *done_tail;
+    int pending;           /* صف‌شده یا در حال اجرا، هنوز به done نرسیده */
+    int workers, running, stopping;
+    lua_Integer next_id;
+    double rate;
+    int burst, max_per_host, pipeline, retries, timeout, follow, max_redirects;
+};
+
+static int idempotent_method(const char *m) {
+    return !strcmp(m, "GET") || !strcmp(m, "HEAD") || !strcmp(m, "PUT") ||
+           !strcmp(m, "DELETE") || !strcmp(m, "OPTIONS") || !strcmp(m, "TRACE");
+}
+
+static void sched_job_free(SchedJob *j) {
+    buf_free(&j->req);
+    response_free(&j->r);
+    free(j);
+}
+
+static Sched *sched_get(Session *s) {
+    if (s->sched) return s->sched;
+    Sched *sc = calloc(1, sizeof(Sched));
+    if (!sc) return NULL;
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&sc->mu, NULL);
+    pthread_cond_init(&sc->work, &ca);
+    pthread_cond_init(&sc->done, &ca);
+    pthread_condattr_destroy(&ca);
+    return s->sched = sc;
+}
+
+/* همه‌ی توابع sched_* زیر با قفل sc->mu صدا زده می‌شوند */
+static SchedHost *sched_host(Sched *sc, const char *host, int port, int is_ssl) {
+    for (SchedHost *h = sc->hosts; h; h = h->next)
+        if (h->port == port && h->is_ssl == is_ssl && !strcmp(h->host, host)) return h;
+    SchedHost *h = calloc(1, sizeof(SchedHost));
+    if (!h) return NULL;
+    h->sc = sc;
+    snprintf(h->host, sizeof(h->host), "%s", host);
+    h->port = port; h->is_ssl = is_ssl;
+    h->tokens = -1;        /* در اولین استفاده پر می‌شود */
+    h->next = sc->hosts; sc->hosts = h;
+    return h;
+}
+
+static void sched_finish(Sched *sc, SchedJob *j) {
+    sc->pending--;
+    if (sc->stopping) { sched_job_free(j); return; }
+    j->next = NULL;
+    if (sc->done_tail) sc->done_tail->next = j; else sc->done_head = j;
+    sc->done_tail = j;
+    pthread_cond_signal(&sc->done);
+}
+
+static void sched_fail(Sched *sc, SchedJob *j, const char *msg) {
+    if (!j->k.err[0]) snprintf(j->k.err, sizeof(j->k.err), "%s", msg);
+    j->ok = 0;
+    sched_finish(sc, j);
+}
+
+static void *sched_worker(void *arg);
+
+static void sched_spawn(Sched *sc, SchedHost *h) {
+    while (sc->running && !sc->stopping && h->workers < sc->max_per_host && h->workers < h->queued) {
+        pthread_t t;
+        pthread_attr_t a;
+        pthread_attr_init(&a);
+        pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&t, &a, sched_worker, h);
+        pthread_attr_destroy(&a);
+        if (rc != 0) break;
+        h->workers++; sc->workers++;
+    }
+    if (h->queued && !h->workers && sc->running && !sc->stopping) {
+        /* حتی یک کارگر هم ساخته نشد */
+        while (h->head) {
+            SchedJob *j = h->head;
+            h->head = j->next; h->queued--;
+            sched_fail(sc, j, "Cannot start worker thread");
+        }
+        h->tail = NULL;
+    }
+}
+
+static void sched_push(Sched *sc, SchedHost *h, SchedJob *j, int front) {
+    if (front) { j->next = h->head; h->head = j; if (!h->tail) h->tail = j; }
+    else { j->next = NULL; if (h->tail) h->tail->next = j; else h->head = j; h->tail = j; }
+    h->queued++;
+    sched_spawn(sc, h);
+    pthread_cond_broadcast(&sc->work);
+}
+
+static void sched_wait(Sched *sc, double secs) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double t = ts.tv_sec + ts.tv_nsec / 1e9 + secs;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&sc->work, &sc->mu, &ts);
+}
+
+/* آماده‌بودن job سر صف: 0 یعنی حالا، وگرنه چند ثانیه بعد (backoff یا token) */
+static double sched_ready_in(Sched *sc, SchedHost *h, double now) {
+    double wait = h->head->not_before - now;
+    if (sc->rate > 0) {
+        double cap = sc->burst > 0 ? sc->burst : (sc->rate > 1 ? sc->rate : 1);
+        if (h->tokens < 0) h->tokens = cap;
+        else h->tokens += (now - h->last) * sc->rate;
+        if (h->tokens > cap) h->tokens = cap;
+        h->last = now;
+        if (h->tokens < 1 && (1 - h->tokens) / sc->rate > wait) wait = (1 - h->tokens) / sc->rate;
+    }
+    return wait > 0 ? wait : 0;
+}
+
+/*
+ * یک دسته را روی اتصال کارگر می‌فرستد و پاسخ‌ها را به ترتیب می‌خواند (بدون قفل).
+ * res[i]: 0 پاسخ رسید، -1 خطا، 1 فرستاده/خوانده نشد (بدون جریمه دوباره صف می‌شود).
+ * درخواست غیر idempotent از لحظه‌ی نوشتن -1 است: شاید به سرور رسیده باشد و تکرارش
+ * مجاز نیست (RFC 7230 §6.3.1)؛ برای همین روی اتصال بسته‌شده فرستاده نمی‌شود.
+ */
+static void sched_exchange(Sched *sc, SchedHost *h, Conn *c, SchedJob **b, int n, int *res) {
+    for (int i = 0; i < n; i++) {
+        res[i] = 1;
+        response_reset(&b[i]->r);
+        sink_init(&b[i]->k, NULL);
+        timing_start(&b[i]->r.tm);
+    }
+    int reused = c->fd >= 0;
+    if (reused && !b[0]->idempotent && conn_stale(c)) { conn_close(c); reused = 0; }
+    if (!reused && conn_open(c, h->host, h->port, h->is_ssl, sc->timeout, 0) < 0) {
+        snprintf(b[0]->k.err, sizeof(b[0]->k.err), "Connection failed");
+        res[0] = -1;
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!b[i]->idempotent) res[i] = -1;
+        if (conn_write(c, b[i]->req.data, b[i]->req.len) < 0) {
+            /* اتصال keep-alive قدیمی را سرور بسته؛ با اتصال تازه دوباره */
+            if (!reused) res[0] = -1;
+            conn_close(c);
+            return;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        timing_conn(&b[i]->r.tm, c, reused || i > 0);
+        timing_sent(&b[i]->r.tm);
+    }
+    for (int i = 0; i < n; i++) {
+        SchedJob *j = b[i];
+        int rc = read_response(c, &j->r, &j->k, j->head_req, sc->follow);
+        if (rc < 0 || !j->r.complete) {
+            if (!(reused && i == 0 && j->r.head.len == 0)) res[i] = -1;
+            conn_close(c);
+            return;
+        }
+        res[i] = 0;
+        if (!j->r.reusable) { conn_close(c); return; }
+    }
+}
+
+static int sched_retryable(const SchedJob *j, int res) {
+    if (res < 0) return 1;
+    int st = j->r.status;
+    return st == 429 || st == 502 || st == 503 || st == 504;
+}
+
+static void sched_done(Sched *sc, SchedHost *h, SchedJob *j, int res, unsigned *seed) {
+    if (sched_retryable(j, res) && j->idempotent && j->attempts < sc->retries && !sc->stopping) {
+        double delay = SCHED_BACKOFF * (1 << j->attempts) + SCHED_BACKOFF * (rand_r(seed) % 1000) / 1000.0;
+        size_t n;
+        const char *ra = res == 0 ? resp_header(&j->r, "Retry-After", &n) : NULL;
+        if (ra && isdigit((unsigned char)*ra)) delay = strtod(ra, NULL);
+        if (delay > SCHED_MAX_WAIT) delay = SCHED_MAX_WAIT;
+        j->attempts++;
+        j->not_before = mono_now() + delay;
+        memset(&j->r.tm, 0, sizeof(j->r.tm));     /* زمان‌بندی مال تلاش آخر است */
+        sched_push(sc, h, j, 0);
+        return;
+    }
+    if (res < 0) { sched_fail(sc, j, "Connection failed"); return; }
+    URL next;
+    int more = sc->follow && j->redirects < sc->max_redirects && !sc->stopping
+             ? redirect_next(&j->r, h->host, h->port, h->is_ssl, &next, &j->req, 1) : 0;
+    if (more < 0) { sched_fail(sc, j, "memory"); return; }
+    if (more) {
+        SchedHost *to = sched_host(sc, next.host, next.port, next.is_ssl);
+        if (!to) { sched_fail(sc, j, "memory"); return; }
+        j->url = next;
+        j->redirects++;
+        j->idempotent = 1; j->head_req = 0;
+        j->attempts = 0; j->not_before = 0;
+        sched_push(sc, to, j, 0);
+        return;
+    }
+    j->ok = 1;
+    sched_finish(sc, j);
+}
+
+static void *sched_worker(void *arg) {
+    SchedHost *h = arg;
+    Sched *sc = h->sc;
+    Conn c = { .fd = -1 };
+    SchedJob *b[SCHED_MAX_PIPELINE];
+    int res[SCHED_MAX_PIPELINE];
+    unsigned seed = (unsigned)time(NULL) ^ (unsigned)(uintptr_t)&c;
+
+    pthread_mutex_lock(&sc->mu);
+    while (!sc->stopping && h->head) {
+        double now = mono_now(), wait = sched_ready_in(sc, h, now);
+        if (wait > 0) { sched_wait(sc, wait); continue; }
+
+        int n = 0;
+        while (h->head && n < sc->pipeline && (sc->rate <= 0 || h->tokens >= 1)) {
+            SchedJob *j = h->head;
+            /* درخواست غیر idempotent تنها می‌رود؛ pipeline فقط برای idempotentها */
+            if (n && (!j->idempotent || !b[0]->idempotent || j->not_before > now)) break;
+            h->head = j->next;
+            if (!h->head) h->tail = NULL;
+            h->queued--;
+            if (sc->rate > 0) h->tokens -= 1;
+            b[n++] = j;
+        }
+        pthread_mutex_unlock(&sc->mu);
+        sched_exchange(sc, h, &c, b, n, res);
+        pthread_mutex_lock(&sc->mu);
+
+        for (int i = 0; i < n; i++)
+            if (res[i] <= 0) sched_done(sc, h, b[i], res[i], &seed);
+        for (int i = n - 1; i >= 0; i--)
+            if (res[i] > 0) sched_push(sc, h, b[i], 1);
+    }
+    h->workers--; sc->workers--;
+    pthread_cond_broadcast(&sc->done);
+    pthread_mutex_unlock(&sc->mu);
+    conn_close(&c);
+    return NULL;
+}
+
+/* صف را خالی می‌کند و منتظر تمام شدن کارگرها می‌ماند */
+static void sched_stop(Sched *sc) {
+    pthread_mutex_lock(&sc->mu);
+    sc->stopping = 1;
+    for (SchedHost *h = sc->hosts; h; h = h->next) {
+        while (h->head) {
+            SchedJob *j = h->head;
+            h->head = j->next;
+            sc->pending--;
+            sched_job_free(j);
+        }
+        h->tail = NULL; h->queued = 0;
+    }
+    while (sc->done_head) {
+        SchedJob *j = sc->done_head;
+        sc->done_head = j->next;
+        sched_job_free(j);
+    }
+    sc->done_tail = NULL;
+    pthread_cond_broadcast(&sc->work);
+    while (sc->workers) pthread_cond_wait(&sc->done, &sc->mu);
+    sc->stopping = sc->running = 0;
+    pthread_mutex_unlock(&sc->mu);
+}
+
+static int l_session_enqueue(lua_State *L) {
+    Session *s = luaL_checkudata(L, 1, "httpx_sess");
+    const char *method = luaL_checkstring(L, 2);
+    const char *url = luaL_checkstring(L, 3);
+    Sched *sc = sched_get(s);
+    SchedJob *j = sc ? calloc(1, sizeof(SchedJob)) : NULL;
+    if (!j) return luaL_error(L, "memory");
+    buf_init(&j->req);
+    response_init(&j->r);
+    sink_init(&j->k, NULL);
+    parse_url(url, &j->url);
+    j->idempotent = idempotent_method(method);
+    j->head_req = !strcmp(method, "HEAD");
+    char err[128];
+    int rc = build_request(method, url, s, lua_istable(L, 4) ? 4 : 0, L, &j->req, 1, err, sizeof(err));
+    if (rc < 0) {
+        sched_job_free(j);
+        if (rc == -1) return luaL_error(L, "memory");
+        lua_pushnil(L); lua_pushstring(L, err); return 2;
+    }
+
+    pthread_mutex_lock(&sc->mu);
+    SchedHost *h = sched_host(sc, j->url.host, j->url.port, j->url.is_ssl);
+    if (!h) { pthread_mutex_unlock(&sc->mu); sched_job_free(j); return luaL_error(L, "memory"); }
+    j->id = ++sc->next_id;
+    sc->pending++;
+    sched_push(sc, h, j, 0);
+    pthread_mutex_unlock(&sc->mu);
+    lua_pushinteger(L, j->id);
+    return 1;
+}
+
+static int l_session_run(lua_State *L) {
+    Session *s = luaL_checkudata(L, 1, "httpx_sess");
+    int cb = lua_isfunction(L, 2);
+    lua_settop(L, 2);
+    if (!cb) lua_newtable(L);
+    Sched *sc = s->sched;
+    if (!sc) return cb ? 0 : 1;
+    init_ssl();  /* پیش از ساختن نخ‌ها */
+
+    pthread_mutex_lock(&sc->mu);
+    if (sc->running) { pthread_mutex_unlock(&sc->mu); return luaL_error(L, "session is already running"); }
+    sc->running = 1;
+    sc->rate = s->rate;
+    sc->burst = s->burst;
+    sc->max_per_host = s->max_per_host > 0 ? s->max_per_host : 1;
+    sc->pipeline = s->pipeline < 1 ? 1 : s->pipeline > SCHED_MAX_PIPELINE ? SCHED_MAX_PIPELINE : s->pipeline;
+    sc->retries = s->retries;
+    sc->timeout = s->timeout;
+    sc->follow = s->follow_redirects;
+    sc->max_redirects = s->max_redirects;
+    for (SchedHost *h = sc->hosts; h; h = h->next) sched_spawn(sc, h);
+
+    for (;;) {
+        while (!sc->done_head && (sc->pending || sc->workers)) pthread_cond_wait(&sc->done, &sc->mu);
+        SchedJob *j = sc->done_head;
+        if (!j) break;
+        sc->done_head = j->next;
+        if (!sc->done_head) sc->done_tail = NULL;
+        pthread_mutex_unlock(&sc->mu);
+
+        if (cb) lua_pushvalue(L, 2);
+        lua_pushinteger(L, j->id);
+        session_record(s, &j->r, j->ok);
+        if (j->ok) parse_response(L, &j->r, 0);
+        else push_failure(L, j->k.err);
+        sched_job_free(j);
+        if (cb) {
+            if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+                sched_stop(sc);
+                return lua_error(L);
+            }
+        } else lua_settable(L, 3);
+        pthread_mutex_lock(&sc->mu);
+    }
+    sc->running = 0;
+    pthread_mutex_unlock(&sc->mu);
+    return cb ? 0 : 1;
+}
+
+/*
+ * s:stats([reset]) → { requests, errors, bytes, connections, reused, reuse_ratio,
+ *                      latency = {count, mean, p50, p99, max}, dns, connect, tls, ttfb, transfer }
+ * مدت‌ها به ثانیه؛ dns/connect/tls فقط برای اتصال‌های تازه. reset = true بعد از خواندن صفر می‌کند.
+ */
+static int l_session_stats(lua_State *L) {
+    Session *s = luaL_checkudata(L, 1, "httpx_sess");
+    static const char *const names[ST_PHASES] = { "latency", "dns", "connect", "tls", "ttfb", "transfer" };
+    const SessStats *st = &s->stats;
+    unsigned long long timed = st->phase[ST_TOTAL].n;
+    lua_createtable(L, 0, 12);
+    lua_pushinteger(L, (lua_Integer)st->requests); lua_setfield(L, -2, "requests");
+    lua_pushinteger(L, (lua_Integer)st->errors); lua_setfield(L, -2, "errors");
+    lua_pushinteger(L, (lua_Integer)st->bytes); lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)(timed - st->reused)); lua_setfield(L, -2, "connections");
+    lua_pushinteger(L, (lua_Integer)st->reused); lua_setfield(L, -2, "reused");
+    lua_pushnumber(L, timed ? (double)st->reused / timed : 0); lua_setfield(L, -2, "reuse_ratio");
+    for (int i = 0; i < ST_PHASES; i++) {
+        const StatHist *h = &st->phase[i];
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, (lua_Integer)h->n); lua_setfield(L, -2, "count");
+        lua_pushnumber(L, h->n ? h->sum / h->n : 0); lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, stat_quantile(h, 0.50)); lua_setfield(L, -2, "p50");
+        lua_pushnumber(L, stat_quantile(h, 0.99)); lua_setfield(L, -2, "p99");
+        lua_pushnumber(L, h->max); lua_setfield(L, -2, "max");
+        lua_setfield(L, -2, names[i]);
+    }
+    if (lua_toboolean(L, 2)) memset(&s->stats, 0, sizeof(s->stats));
+    return 1;
+}
+
+/* زمان‌بند را متوقف می‌کند (کارگرها تمام می‌شوند) و همه‌چیز session را آزاد می‌کند */
+static void session_release(Session *s) {
+    Sched *sc = s->sched;
+    if (sc) {
+        sched_stop(sc);
+        while (sc->hosts) { SchedHost *h = sc->hosts; sc->hosts = h->next; free(h); }
+        pthread_mutex_destroy(&sc->mu);
+        pthread_cond_destroy(&sc->work);
+        pthread_cond_destroy(&sc->done);
+        free(sc);
+        s->sched = NULL;
+    }
+    h2_conn_close(s->h2); s->h2 = NULL;
+}
+
+/* وسط run (مثلاً از callback) خطاست و هیچ چیزی بسته نمی‌شود */
+static int l_session_close(lua_State *L) {
+    Session *s = luaL_checkudata(L,1,"httpx_sess");
+    if (s->sched) {
+        pthread_mutex_lock(&s->sched->mu);
+        int running = s->sched->running;
+        pthread_mutex_unlock(&s->sched->mu);
+        if (running) return luaL_error(L, "cannot close session during run");
+    }
+    session_release(s);
+    return 0;
+}
+
+/* __gc خطا نمی‌دهد: run رهاشده (coroutine یا خطای Lua وسط کار) متوقف و منتظر کارگرها می‌شود */
+static int l_session_gc(lua_State *L) {
+    session_release(luaL_checkudata(L,1,"httpx_sess"));
+    return 0;
+}
 
 static const luaL_Reg sm[] = {
-    {"set",l_session_set},{"request",l_session_req},{"get",l_session_req},{"post",l_session_req},
-    {"put",l_session_req},{"delete",l_session_req},{"patch",l_session_req},{"head",l_session_req},
-    {"options",l_session_req},{NULL,NULL}
+    {"set",l_session_set},{"request",l_session_req},{"get",l_session_get},{"post",l_session_post},
+    {"put",l_session_put},{"delete",l_session_delete},{"patch",l_session_patch},{"head",l_session_head},
+    {"options",l_session_options},{"batch",l_session_batch},
+    {"enqueue",l_session_enqueue},{"run",l_session_run},{"stats",l_session_stats},{"close",l_session_close},{"__gc",l_session_gc},
+    {NULL,NULL}
 };
 
 int luaopen_httpx(lua_State *L) {
@@ -511,6 +2431,7 @@ int luaopen_httpx(lua_State *L) {
     lua_pushcfunction(L,l_head); lua_setfield(L,-2,"head");
     lua_pushcfunction(L,l_options); lua_setfield(L,-2,"options");
     lua_pushcfunction(L,l_download); lua_setfield(L,-2,"download");
+    lua_pushcfunction(L,l_upload); lua_setfield(L,-2,"upload");
     lua_pushcfunction(L,l_session_new); lua_setfield(L,-2,"session");
     return 1;
 }
@@ -0,0 +1,57 @@
+/*
+ * json.c – کتابخانه‌ی JSON بومی Byte
+ * هسته‌ی کدگذار/کدگشا در json.h است که httpx هم مستقیم از آن استفاده می‌کند.
+ *
+ * کامپایل:
+ *   gcc -shared -fPIC -I../../../src -o ../json.so json.c -O2
+ *
+ * json.encode(value)  → رشته | nil, خطا
+ * json.decode(text)   → مقدار | nil, خطا
+ * json.null           → مقدار null در جدول‌ها (برای نگه داشتن جای خالی در آرایه)
+ */
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "json.h"
+
+// ==================== توابع ====================
+
+static int l_encode(lua_State *L) {
+    luaL_checkany(L, 1);
+    JBuf b;
+    jbuf_init(&b);
+    char err[128];
+    if (json_encode(L, 1, &b, err, sizeof(err)) < 0) {
+        jbuf_free(&b);
+        lua_pushnil(L); lua_pushstring(L, err);
+        return 2;
+    }
+    lua_pushlstring(L, b.data ? b.data : "", b.len);
+    jbuf_free(&b);
+    return 1;
+}
+
+static int l_decode(lua_State *L) {
+    size_t n;
+    const char *s = luaL_checklstring(L, 1, &n);
+    char err[128];
+    if (json_decode(L, s, n, err, sizeof(err)) < 0) {
+        lua_pushnil(L); lua_pushstring(L, err);
+        return 2;
+    }
+    return 1;
+}
+
+static const struct luaL_Reg json_lib[] = {
+    {"encode", l_encode},
+    {"decode", l_decode},
+    {NULL, NULL}
+};
+
+int luaopen_json(lua_State *L) {
+    luaL_newlib(L, json_lib);
+    lua_pushlightuserdata(L, NULL);
+    lua_setfield(L, -2, "null");
+    return 1;
+}
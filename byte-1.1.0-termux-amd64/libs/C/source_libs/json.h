@@ -0,0 +1,447 @@
+/*
+ * json.h – کدگذار/کدگشای JSON برای Lua
+ * مشترک بین json.so و httpx (که مستقیم صدایش می‌زند، بدون نیاز به global json)
+ *
+ * کدگشا: پیمایش بازگشتی که جدول‌های Lua را مستقیم می‌سازد؛ رشته‌های بدون
+ *   escape بدون کپی میانی push می‌شوند و جستجوی " و \ و کاراکترهای کنترلی
+ *   در رشته‌ها و رد کردن فاصله‌ها با SSE2 (x86) یا NEON (arm64) ۱۶ بایت‌۱۶ بایت است.
+ * کدگذار: مستقیم در یک بافر رشد‌یابنده؛ رشته‌ی Lua میانی ساخته نمی‌شود.
+ *   (luaL_Buffer با پیمایش lua_next سازگار نیست چون استک باید بین فراخوانی‌های
+ *   بافر متوازن بماند.)
+ *
+ * null به json_null (lightuserdata NULL) تبدیل می‌شود تا آرایه‌ها سوراخ نشوند.
+ * جدول با کلیدهای 1..n پیوسته آرایه است، بقیه object؛ جدول خالی {} است.
+ */
+#ifndef BYTE_JSON_H
+#define BYTE_JSON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JSON_NEON 1
+#endif
+
+#define JSON_MAX_DEPTH 1000
+
+/* ── بافر خروجی ── */
+typedef struct { char *data; size_t len, cap; int oom; } JBuf;
+
+static inline void jbuf_init(JBuf *b) { b->data = NULL; b->len = b->cap = 0; b->oom = 0; }
+static inline void jbuf_free(JBuf *b) { free(b->data); jbuf_init(b); }
+
+static int jbuf_reserve(JBuf *b, size_t extra) {
+    if (b->oom) return -1;
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) cap *= 2;
+    char *p = realloc(b->data, cap);
+    if (!p) { b->oom = 1; return -1; }
+    b->data = p; b->cap = cap;
+    return 0;
+}
+
+static void jbuf_add(JBuf *b, const char *s, size_t n) {
+    if (jbuf_reserve(b, n) < 0) return;
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void jbuf_addc(JBuf *b, char c) {
+    if (b->len < b->cap || jbuf_reserve(b, 1) == 0) b->data[b->len++] = c;
+}
+
+/* ── اسکنر ── */
+/* اولین " یا \ یا کاراکتر کنترلی (< 0x20) از p؛ end اگر نبود */
+static const char *json_scan_str(const char *p, const char *end) {
+#if defined(JSON_SSE2)
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), ctl = _mm_set1_epi8(0x1f);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#elif defined(JSON_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"'), bslash = vdupq_n_u8('\\'), ctl = vdupq_n_u8(0x20);
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)p);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)), vcltq_u8(v, ctl));
+        if (vmaxvq_u8(m)) break;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+#define JSON_WS(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+static const char *json_skip_ws(const char *p, const char *end) {
+    while (p < end && JSON_WS(*p)) {
+        char c = *p++;
+#if defined(JSON_SSE2)
+        /* تورفتگی بعد از هر خط در JSON مرتب‌شده */
+        if (c != '\n') continue;
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+            int mask = ~_mm_movemask_epi8(ws) & 0xffff;
+            if (mask) return p + __builtin_ctz(mask);
+            p += 16;
+        }
+#else
+        (void)c;
+#endif
+    }
+    return p;
+}
+
+/* ── کدگشا ── */
+typedef struct {
+    lua_State *L;
+    const char *p, *end, *start;
+    int depth;
+    JBuf tmp;                /* رشته‌های دارای escape */
+    char err[128];
+} JDec;
+
+static int json_fail(JDec *d, const char *msg) {
+    if (!d->err[0]) snprintf(d->err, sizeof(d->err), "%s at offset %ld", msg, (long)(d->p - d->start));
+    return -1;
+}
+
+static int json_hex4(const char *p, unsigned *out) {
+    unsigned v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static void json_utf8(JBuf *b, unsigned cp) {
+    char u[4];
+    if (cp < 0x80) { jbuf_addc(b, cp); return; }
+    if (cp < 0x800) { u[0] = 0xc0 | cp >> 6; u[1] = 0x80 | (cp & 0x3f); jbuf_add(b, u, 2); return; }
+    if (cp < 0x10000) { u[0] = 0xe0 | cp >> 12; u[1] = 0x80 | (cp >> 6 & 0x3f); u[2] = 0x80 | (cp & 0x3f); jbuf_add(b, u, 3); return; }
+    u[0] = 0xf0 | cp >> 18; u[1] = 0x80 | (cp >> 12 & 0x3f); u[2] = 0x80 | (cp >> 6 & 0x3f); u[3] = 0x80 | (cp & 0x3f);
+    jbuf_add(b, u, 4);
+}
+
+/* رشته از بعد از " ابتدایی؛ نتیجه روی استک */
+static int json_string(JDec *d) {
+    const char *s = d->p, *q = json_scan_str(s, d->end);
+    if (q < d->end && *q == '"') {                      /* بدون escape: مستقیم */
+        lua_pushlstring(d->L, s, q - s);
+        d->p = q + 1;
+        return 0;
+    }
+    JBuf *b = &d->tmp;
+    b->len = 0;
+    for (;;) {
+        jbuf_add(b, s, q - s);
+        d->p = q;
+        if (q >= d->end) return json_fail(d, "unterminated string");
+        if (*q == '"') break;
+        if ((unsigned char)*q < 0x20) return json_fail(d, "control character in string");
+        if (d->end - q < 2) return json_fail(d, "unterminated string");
+        char c = q[1];
+        q += 2;
+        switch (c) {
+        case '"': case '\\': case '/': jbuf_addc(b, c); break;
+        case 'b': jbuf_addc(b, '\b'); break;
+        case 'f': jbuf_addc(b, '\f'); break;
+        case 'n': jbuf_addc(b, '\n'); break;
+        case 'r': jbuf_addc(b, '\r'); break;
+        case 't': jbuf_addc(b, '\t'); break;
+        case 'u': {
+            unsigned cp, lo;
+            if (d->end - q < 4 || json_hex4(q, &cp) < 0) return json_fail(d, "bad \\u escape");
+            q += 4;
+            if (cp >= 0xd800 && cp < 0xdc00 && d->end - q >= 6 && q[0] == '\\' && q[1] == 'u' &&
+                json_hex4(q + 2, &lo) == 0 && lo >= 0xdc00 && lo < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                q += 6;
+            }
+            json_utf8(b, cp);
+            break;
+        }
+        default: return json_fail(d, "bad escape");
+        }
+        s = q;
+        q = json_scan_str(s, d->end);
+    }
+    if (b->oom) return json_fail(d, "out of memory");
+    lua_pushlstring(d->L, b->data ? b->data : "", b->len);
+    d->p = q + 1;
+    return 0;
+}
+
+static int json_number(JDec *d) {
+    const char *p = d->p, *end = d->end;
+    int is_float = 0;
+    if (p < end && *p == '-') p++;
+    if (p >= end || *p < '0' || *p > '9') return json_fail(d, "bad number");
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    if (p < end && *p == '.') { is_float = 1; p++; while (p < end && *p >= '0' && *p <= '9') p++; }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        is_float = 1; p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    char num[64], *ep;
+    size_t n = p - d->p;
+    if (n >= sizeof(num)) is_float = 1;
+    if (!is_float) {
+        memcpy(num, d->p, n); num[n] = '\0';
+        errno = 0;
+        long long v = strtoll(num, &ep, 10);
+        if (errno != ERANGE) { lua_pushinteger(d->L, (lua_Integer)v); d->p = p; return 0; }
+    }
+    /* اعشاری یا خارج از محدوده‌ی integer */
+    char *big = n < sizeof(num) ? num : malloc(n + 1);
+    if (!big) return json_fail(d, "out of memory");
+    memcpy(big, d->p, n); big[n] = '\0';
+    lua_pushnumber(d->L, (lua_Number)strtod(big, &ep));
+    if (big != num) free(big);
+    d->p = p;
+    return 0;
+}
+
+static int json_value(JDec *d);
+
+static int json_literal(JDec *d, const char *word, size_t n) {
+    if ((size_t)(d->end - d->p) < n || memcmp(d->p, word, n)) return json_fail(d, "unexpected token");
+    d->p += n;
+    return 0;
+}
+
+static int json_array(JDec *d) {
+    lua_State *L = d->L;
+    lua_newtable(L);
+    d->p = json_skip_ws(d->p + 1, d->end);
+    if (d->p < d->end && *d->p == ']') { d->p++; return 0; }
+    for (lua_Integer i = 1; ; i++) {
+        if (json_value(d) < 0) return -1;
+        lua_rawseti(L, -2, i);
+        d->p = json_skip_ws(d->p, d->end);
+        if (d->p >= d->end) return json_fail(d, "unterminated array");
+        if (*d->p == ']') { d->p++; return 0; }
+        if (*d->p != ',') return json_fail(d, "expected ',' or ']'");
+        d->p++;
+    }
+}
+
+static int json_object(JDec *d) {
+    lua_State *L = d->L;
+    lua_newtable(L);
+    d->p = json_skip_ws(d->p + 1, d->end);
+    if (d->p < d->end && *d->p == '}') { d->p++; return 0; }
+    for (;;) {
+        if (d->p >= d->end || *d->p != '"') return json_fail(d, "expected string key");
+        d->p++;
+        if (json_string(d) < 0) return -1;
+        d->p = json_skip_ws(d->p, d->end);
+        if (d->p >= d->end || *d->p != ':') return json_fail(d, "expected ':'");
+        d->p++;
+        if (json_value(d) < 0) return -1;
+        lua_rawset(L, -3);
+        d->p = json_skip_ws(d->p, d->end);
+        if (d->p >= d->end) return json_fail(d, "unterminated object");
+        if (*d->p == '}') { d->p++; return 0; }
+        if (*d->p != ',') return json_fail(d, "expected ',' or '}'");
+        d->p = json_skip_ws(d->p + 1, d->end);
+    }
+}
+
+static int json_value(JDec *d) {
+    d->p = json_skip_ws(d->p, d->end);
+    if (d->p >= d->end) return json_fail(d, "unexpected end");
+    if (!lua_checkstack(d->L, 3)) return json_fail(d, "stack overflow");
+    int rc;
+    switch (*d->p) {
+    case '{':
+    case '[':
+        if (++d->depth > JSON_MAX_DEPTH) return json_fail(d, "nested too deep");
+        rc = *d->p == '{' ? json_object(d) : json_array(d);
+        d->depth--;
+        return rc;
+    case '"': d->p++; return json_string(d);
+    case 't': if (json_literal(d, "true", 4) < 0) return -1; lua_pushboolean(d->L, 1); return 0;
+    case 'f': if (json_literal(d, "false", 5) < 0) return -1; lua_pushboolean(d->L, 0); return 0;
+    case 'n': if (json_literal(d, "null", 4) < 0) return -1; lua_pushlightuserdata(d->L, NULL); return 0;
+    default: return json_number(d);
+    }
+}
+
+/*
+ * s[0..n) را باز می‌کند و مقدار را روی استک می‌گذارد. 0 موفق؛ -1 خطا (استک
+ * دست‌نخورده و پیام در err).
+ */
+static inline int json_decode(lua_State *L, const char *s, size_t n, char *err, size_t errlen) {
+    JDec d;
+    memset(&d, 0, sizeof(d));
+    d.L = L; d.p = d.start = s; d.end = s + n;
+    jbuf_init(&d.tmp);
+    int top = lua_gettop(L);
+    int rc = json_value(&d);
+    if (rc == 0) {
+        d.p = json_skip_ws(d.p, d.end);
+        if (d.p != d.end) rc = json_fail(&d, "trailing garbage");
+    }
+    jbuf_free(&d.tmp);
+    if (rc < 0) {
+        lua_settop(L, top);
+        if (err) snprintf(err, errlen, "%s", d.err);
+        return -1;
+    }
+    return 0;
+}
+
+/* ── کدگذار ── */
+static void json_add_string(JBuf *b, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = s + n;
+    jbuf_addc(b, '"');
+    while (s < end) {
+        const char *q = json_scan_str(s, end);
+        jbuf_add(b, s, q - s);
+        if (q >= end) break;
+        unsigned char c = *q;
+        switch (c) {
+        case '"': jbuf_add(b, "\\\"", 2); break;
+        case '\\': jbuf_add(b, "\\\\", 2); break;
+        case '\n': jbuf_add(b, "\\n", 2); break;
+        case '\r': jbuf_add(b, "\\r", 2); break;
+        case '\t': jbuf_add(b, "\\t", 2); break;
+        case '\b': jbuf_add(b, "\\b", 2); break;
+        case '\f': jbuf_add(b, "\\f", 2); break;
+        default: {
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            jbuf_add(b, u, 6);
+        }
+        }
+        s = q + 1;
+    }
+    jbuf_addc(b, '"');
+}
+
+/* طول آرایه اگر کلیدها دقیقاً 1..n باشند، وگرنه -1 */
+static lua_Integer json_array_len(lua_State *L, int idx) {
+    lua_Integer n = 0, max = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1) { lua_pop(L, 1); return -1; }
+        lua_Integer k = lua_tointeger(L, -1);
+        if (k > max) max = k;
+        n++;
+    }
+    return n && n == max ? n : -1;
+}
+
+static int json_enc(lua_State *L, int idx, JBuf *b, int depth, char *err, size_t errlen) {
+    char num[64];
+    int len;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL: jbuf_add(b, "null", 4); return 0;
+    case LUA_TBOOLEAN: if (lua_toboolean(L, idx)) jbuf_add(b, "true", 4); else jbuf_add(b, "false", 5); return 0;
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(L, idx) == NULL) { jbuf_add(b, "null", 4); return 0; }
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) len = snprintf(num, sizeof(num), LUA_INTEGER_FMT, lua_tointeger(L, idx));
+        else {
+            lua_Number v = lua_tonumber(L, idx);
+            if (isnan(v) || isinf(v)) { snprintf(err, errlen, "cannot encode NaN or Infinity"); return -1; }
+            len = snprintf(num, sizeof(num), "%.17g", (double)v);
+            /* 0.1 باید 0.1 بماند نه 0.10000000000000001 */
+            char shorter[64];
+            int sl = snprintf(shorter, sizeof(shorter), "%.15g", (double)v);
+            if (strtod(shorter, NULL) == (double)v) { memcpy(num, shorter, sl + 1); len = sl; }
+        }
+        jbuf_add(b, num, len);
+        return 0;
+    case LUA_TSTRING: {
+        size_t n;
+        const char *s = lua_tolstring(L, idx, &n);
+        json_add_string(b, s, n);
+        return 0;
+    }
+    case LUA_TTABLE: {
+        if (depth > JSON_MAX_DEPTH) { snprintf(err, errlen, "nested too deep (cycle?)"); return -1; }
+        if (!lua_checkstack(L, 4)) { snprintf(err, errlen, "stack overflow"); return -1; }
+        idx = lua_absindex(L, idx);
+        lua_Integer n = json_array_len(L, idx);
+        if (n > 0) {
+            jbuf_addc(b, '[');
+            for (lua_Integer i = 1; i <= n; i++) {
+                if (i > 1) jbuf_addc(b, ',');
+                lua_rawgeti(L, idx, i);
+                int rc = json_enc(L, -1, b, depth + 1, err, errlen);
+                lua_pop(L, 1);
+                if (rc < 0) return -1;
+            }
+            jbuf_addc(b, ']');
+            return 0;
+        }
+        int first = 1;
+        jbuf_addc(b, '{');
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            int kt = lua_type(L, -2);
+            if (kt != LUA_TSTRING && kt != LUA_TNUMBER) {
+                lua_pop(L, 2);
+                snprintf(err, errlen, "object key must be a string or number");
+                return -1;
+            }
+            if (!first) jbuf_addc(b, ',');
+            first = 0;
+            if (kt == LUA_TSTRING) {
+                size_t kl;
+                const char *k = lua_tolstring(L, -2, &kl);
+                json_add_string(b, k, kl);
+            } else {
+                lua_pushvalue(L, -2);            /* کپی تا lua_next گیج نشود */
+                size_t kl;
+                const char *k = lua_tolstring(L, -1, &kl);
+                json_add_string(b, k, kl);
+                lua_pop(L, 1);
+            }
+            jbuf_addc(b, ':');
+            if (json_enc(L, -1, b, depth + 1, err, errlen) < 0) { lua_pop(L, 2); return -1; }
+            lua_pop(L, 1);
+        }
+        jbuf_addc(b, '}');
+        return 0;
+    }
+    }
+    snprintf(err, errlen, "cannot encode %s", luaL_typename(L, idx));
+    return -1;
+}
+
+/* مقدار idx را به انتهای b اضافه می‌کند؛ 0 موفق، -1 خطا (پیام در err) */
+static inline int json_encode(lua_State *L, int idx, JBuf *b, char *err, size_t errlen) {
+    if (json_enc(L, lua_absindex(L, idx), b, 0, err, errlen) < 0) return -1;
+    if (b->oom) { snprintf(err, errlen, "out of memory"); return -1; }
+    return 0;
+}
+
+#endif
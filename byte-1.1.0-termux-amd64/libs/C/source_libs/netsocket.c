@@ -1,9 +1,10 @@
 /*
  * netsocket.c – Complete Network Library for Byte (v5.0.1)
  * تمام قابلیت‌های TCP/UDP/SSL/HTTP/DNS + Raw Socket + ARP Spoofing
- * کامپایل: gcc -shared -fPIC -o netsocket.so source_libs/netsocket.c -I../../src -lssl -lcrypto
+ * کامپایل: gcc -shared -fPIC -o netsocket.so source_libs/netsocket.c -I../../src -lssl -lcrypto -lpthread
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,8 +24,22 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define NS_URING 1
+#endif
+#endif
 
-#include <linux/if_packet.h>
 #include <netpacket/packet.h>
 
 #ifndef ETH_P_ALL
@@ -44,8 +59,12 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "resolver.h"
+#include "eyeballs.h"
+
 #define MAX_BUF 65536
 #define DEFAULT_TIMEOUT 10
+#define RBUF_SIZE 65536      /* بافر دریافت هر tcp_t */
 
 /* ========== Utility ========== */
 static void push_error(lua_State *L, const char *msg) { lua_pushnil(L); lua_pushstring(L, msg); }
@@ -74,6 +93,44 @@ static int wait_connect(int fd, int sec) {
     return 0;
 }
 
+/* DNS از کش مشترک (resolver.h)؛ همه‌ی آدرس‌های family (AF_UNSPEC: هر دو) با پورت در out */
+static int resolve_all(const char *host, int port, int family, int timeout, ResAddrs *out) {
+    if (resolver_lookup(host, family, (timeout > 0 ? timeout : DEFAULT_TIMEOUT) * 1000, out) < 0) return -1;
+    resolver_set_port(out, port);
+    return 0;
+}
+
+/* اولین آدرس (ترتیب RFC 6724) در out؛ طول آن برگردانده می‌شود، یا -1 */
+static int resolve_addr(const char *host, int port, int family, int timeout, struct sockaddr_storage *out) {
+    ResAddrs ra;
+    if (resolve_all(host, port, family, timeout, &ra) < 0) return -1;
+    *out = ra.addr[0];
+    return (int)ra.len[0];
+}
+
+/* خانواده‌ی سوکت bind‌شده؛ AF_UNSPEC اگر معلوم نیست */
+static int sock_family(int fd) {
+    struct sockaddr_storage ss; socklen_t len = sizeof(ss);
+    return fd >= 0 && getsockname(fd, (struct sockaddr*)&ss, &len) == 0 ? ss.ss_family : AF_UNSPEC;
+}
+
+/* اتصال مسدودکننده‌ی ساده برای توابع یک‌خطی (http، headers، download)؛ -2 یعنی خطای DNS */
+static int connect_host(const char *host, int port, int timeout) {
+    ResAddrs ra;
+    if (resolve_all(host, port, AF_UNSPEC, timeout, &ra) < 0) return -2;
+    int fd = he_connect(&ra, timeout * 1000);
+    if (fd >= 0) set_sock_timeout(fd, timeout);
+    return fd;
+}
+
+/* ip و پورت هر دو خانواده */
+static int push_sockaddr(lua_State *L, const struct sockaddr_storage *ss) {
+    char ip[INET6_ADDRSTRLEN] = "";
+    resolver_ntop(ss, ip, sizeof(ip));
+    lua_pushstring(L, ip); lua_pushinteger(L, resolver_port(ss));
+    return 2;
+}
+
 static void set_blocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
@@ -82,67 +139,1288 @@ static void set_blocking(int fd) {
     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 }
 
+/* ========== Reactor (epoll + coroutine) ==========
+ * netsocket.spawn(fn, ...) یک task (coroutine) می‌سازد و netsocket.loop() آن‌ها را اجرا
+ * می‌کند. هر عملیات سوکت داخل یک task که باید منتظر بماند، fd را در epoll ثبت و
+ * coroutine را با lua_yieldk می‌خواباند؛ با آماده شدن fd (یا پایان timeout) از همان‌جا
+ * ادامه می‌دهد. بیرون از loop همان عملیات‌ها مثل قبل blocking هستند. */
+#define REACTOR_KEY "netsocket.reactor"
+#define REACTOR_EVENTS 256
+
+enum { R_START, R_CONT, R_WAKE_TRUE, R_WAKE_FALSE };
+typedef struct { int ref; int mode; } ready_t;
+typedef struct { int ref; unsigned gen; int polled; int op; } waiter_t; /* ref == LUA_NOREF: خانه‌ی آزاد؛ polled: POLL_ADD در ring؛ op: بافر عملیات ring + 1 */
+typedef struct { double at; int slot; unsigned gen; } timer_t_;
+
+/* ---- io_uring (اختیاری) ----
+ * اگر kernel اجازه بدهد، loop با یک io_uring_enter هم SQEهای جمع‌شده را ارسال می‌کند و
+ * هم منتظر CQEها می‌ماند. accept/recv/send روی TCP بدون SSL خودِ عملیات را به صورت SQE
+ * (ACCEPT، READ_FIXED یا RECV، SEND) می‌فرستند، نه readiness: task تا CQE می‌خوابد و
+ * داده در یک بافر pool است که با IORING_REGISTER_BUFFERS ثبت شده. pool مال ring است، نه
+ * tcp_t، تا عملیاتی که بعد از timeout یا close هنوز در kernel است در حافظه‌ی آزادشده
+ * ننویسد؛ بافر فقط با رسیدن CQE آن پس داده می‌شود. timeout عملیات را با ASYNC_CANCEL لغو
+ * و منتظر همان CQE می‌ماند، پس داده‌ای که هم‌زمان رسیده گم نمی‌شود. SSL، UDP، sendfile و
+ * وقتی بافر آزاد نمانده، همان POLL_ADD (readiness) و مسیرهای recv/send قبلی‌اند.
+ * NETSOCKET_BACKEND=epoll آن را خاموش می‌کند؛ اگر setup شکست بخورد (kernel قدیمی،
+ * seccomp اندروید) epoll می‌ماند. */
+#define URING_ENTRIES 4096
+#define URING_IGNORE ((uint64_t)-1)       /* user_data بی‌صاحب: timeout و poll_remove */
+#define URING_OP ((uint64_t)1 << 62)      /* user_data عملیات کامل: URING_OP | شماره‌ی بافر */
+#define URING_BUFS 128
+#define URING_BUF_SIZE 16384              /* 2MB ثبت‌شده؛ از RLIMIT_MEMLOCK حساب می‌شود */
+
+#ifdef NS_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes; struct io_uring_cqe *cqes;
+    void *ring_map, *sqe_map; size_t ring_len, sqe_len;
+    unsigned entries, pending;               /* pending: SQEهای نوشته‌شده و هنوز ارسال‌نشده */
+    struct __kernel_timespec ts;             /* TIMEOUT تا ارسال شدن باید زنده بماند */
+    char *pool;                              /* NULL: عملیات کامل نه، فقط POLL_ADD */
+    int fixed;                               /* pool ثبت شد: READ_FIXED، وگرنه RECV روی همان حافظه */
+    int bfree[URING_BUFS], nbfree;
+    struct { int slot; unsigned gen; int kind; void *io; } bown[URING_BUFS];   /* صاحب هر بافر در پرواز */
+} uring_t;
+
+static void uring_free(uring_t *u) {
+    if (!u) return;
+    if (u->sqe_map) munmap(u->sqe_map, u->sqe_len);
+    if (u->ring_map) munmap(u->ring_map, u->ring_len);
+    if (u->fd >= 0) close(u->fd);   /* ثبت بافرها هم با بسته شدن ring تمام می‌شود */
+    if (u->pool) munmap(u->pool, (size_t)URING_BUFS * URING_BUF_SIZE);
+    free(u);
+}
+
+static uring_t *uring_new(void) {
+    const char *be = getenv("NETSOCKET_BACKEND");
+    if (be && strcmp(be, "io_uring") != 0) return NULL;
+    struct io_uring_params p; memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return NULL;
+    uring_t *u = calloc(1, sizeof(uring_t));
+    if (!u) { close(fd); return NULL; }
+    u->fd = fd;
+    /* SINGLE_MMAP (5.4) و NODROP (5.5)؛ POLL_ADD و TIMEOUT هم از همین نسخه‌ها هستند */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) { uring_free(u); return NULL; }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    u->ring_map = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->ring_map == MAP_FAILED) { u->ring_map = NULL; uring_free(u); return NULL; }
+    u->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqe_map = mmap(NULL, u->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqe_map == MAP_FAILED) { u->sqe_map = NULL; uring_free(u); return NULL; }
+    char *m = u->ring_map;
+    u->sq_head = (unsigned*)(m + p.sq_off.head); u->sq_tail = (unsigned*)(m + p.sq_off.tail); u->sq_mask = (unsigned*)(m + p.sq_off.ring_mask);
+    u->cq_head = (unsigned*)(m + p.cq_off.head); u->cq_tail = (unsigned*)(m + p.cq_off.tail); u->cq_mask = (unsigned*)(m + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(m + p.cq_off.cqes);
+    u->sqes = u->sqe_map;
+    u->entries = p.sq_entries;
+    unsigned *array = (unsigned*)(m + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;   /* خانه‌ی i صف همیشه SQE شماره‌ی i */
+    /* FAST_POLL (5.7): recv/accept آماده‌نشده poll داخلی می‌گیرد نه یک رشته‌ی io-wq.
+     * ثبت pool اگر RLIMIT_MEMLOCK اجازه ندهد شکست می‌خورد؛ آن‌وقت RECV معمولی. */
+    if (p.features & IORING_FEAT_FAST_POLL) {
+        size_t len = (size_t)URING_BUFS * URING_BUF_SIZE;
+        char *pool = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool != MAP_FAILED) {
+            struct iovec iov[URING_BUFS];
+            for (int i = 0; i < URING_BUFS; i++) { iov[i].iov_base = pool + (size_t)i * URING_BUF_SIZE; iov[i].iov_len = URING_BUF_SIZE; u->bfree[i] = URING_BUFS - 1 - i; }
+            u->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) == 0;
+            u->pool = pool; u->nbfree = URING_BUFS;
+        }
+    }
+    return u;
+}
+
+/* SQEهای pending را ارسال و (با wait) دست‌کم یک CQE صبر می‌کند */
+static int uring_enter(uring_t *u, int wait) {
+    for (;;) {
+        int rc = (int)syscall(__NR_io_uring_enter, u->fd, u->pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0) { u->pending -= (unsigned)rc < u->pending ? (unsigned)rc : u->pending; return 0; }
+        if (errno == EINTR) { if (wait) return 0; continue; }
+        if (errno == EBUSY || errno == EAGAIN) { if (!wait) return 0; wait = 1; continue; }
+        return -1;
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        uring_enter(u, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) return NULL;
+    }
+    struct io_uring_sqe *e = &u->sqes[tail & *u->sq_mask];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+static void uring_commit(uring_t *u) { __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE); u->pending++; }
+
+static int uring_poll(uring_t *u, int fd, int events, uint64_t ud) {
+    struct io_uring_sqe *e = uring_sqe(u);
+    if (!e) return -1;
+    e->opcode = IORING_OP_POLL_ADD; e->fd = fd; e->user_data = ud;
+    e->poll32_events = ((events & EPOLLIN) ? POLLIN : 0) | ((events & EPOLLOUT) ? POLLOUT : 0);
+#if __BYTE_ORDER == __BIG_ENDIAN
+    e->poll32_events = e->poll32_events << 16 | e->poll32_events >> 16;   /* kernel: word-reversed */
+#endif
+    uring_commit(u);
+    return 0;
+}
+
+/* poll (POLL_REMOVE) یا عملیات (ASYNC_CANCEL) انتظاری که با timeout تمام شد؛ وگرنه ring
+ * تا آماده شدن fd ارجاعش را نگه می‌دارد. 0 اگر SQE نبود */
+static int uring_cancel(uring_t *u, int opcode, uint64_t ud) {
+    struct io_uring_sqe *e = uring_sqe(u);
+    if (!e) return 0;
+    e->opcode = opcode; e->fd = -1; e->addr = ud; e->user_data = URING_IGNORE;
+    uring_commit(u);
+    return 1;
+}
+#else
+typedef struct uring_s uring_t;
+static void uring_free(uring_t *u) { (void)u; }
+static uring_t *uring_new(void) { return NULL; }
+#endif
+
+typedef struct {
+    int epfd;
+    uring_t *ring;                                              /* NULL: backend epoll */
+    lua_State *current; int current_ref; int parked;
+    int live;                                                   /* taskهای تمام‌نشده */
+    ready_t *ready; int rhead, nready, rcap;                     /* صف FIFO */
+    waiter_t *w; int nw, wcap, wfree;                           /* wfree: اولین خانه‌ی آزاد یا -1 */
+    timer_t_ *heap; int nheap, hcap;
+    unsigned gen;
+} reactor_t;
+
+static double now_mono(void) { struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); return ts.tv_sec + ts.tv_nsec / 1e9; }
+
+static int reactor_gc(lua_State *L) {
+    reactor_t *r = lua_touserdata(L, 1);
+    if (r->epfd >= 0) close(r->epfd);
+    uring_free(r->ring);
+    free(r->ready); free(r->w); free(r->heap);
+    r->epfd = -1; r->ring = NULL; r->ready = NULL; r->w = NULL; r->heap = NULL;
+    return 0;
+}
+
+static reactor_t *reactor_get(lua_State *L, int create) {
+    lua_getfield(L, LUA_REGISTRYINDEX, REACTOR_KEY);
+    reactor_t *r = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (r || !create) return r;
+    r = lua_newuserdata(L, sizeof(reactor_t));
+    memset(r, 0, sizeof(*r));
+    r->wfree = -1; r->current_ref = LUA_NOREF;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) luaL_error(L, "epoll_create1 failed");
+    r->ring = uring_new();
+    lua_newtable(L); lua_pushcfunction(L, reactor_gc); lua_setfield(L, -2, "__gc"); lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, REACTOR_KEY);
+    return r;
+}
+
+/* آیا L همان task است که loop الان اجرا می‌کند؟ */
+static int reactor_here(lua_State *L) { reactor_t *r = reactor_get(L, 0); return r && r->current == L; }
+
+static void *grow(lua_State *L, void *p, int *cap, int need, size_t sz) {
+    if (need <= *cap) return p;
+    int nc = *cap ? *cap * 2 : 64; while (nc < need) nc *= 2;
+    void *np = realloc(p, nc * sz);
+    if (!np) luaL_error(L, "memory");
+    *cap = nc;
+    return np;
+}
+
+static void ready_push(lua_State *L, reactor_t *r, int ref, int mode) {
+    if (r->rhead && r->rhead + r->nready == r->rcap) { memmove(r->ready, r->ready + r->rhead, r->nready * sizeof(ready_t)); r->rhead = 0; }
+    r->ready = grow(L, r->ready, &r->rcap, r->rhead + r->nready + 1, sizeof(ready_t));
+    r->ready[r->rhead + r->nready++] = (ready_t){ ref, mode };
+}
+
+static void timer_push(lua_State *L, reactor_t *r, double at, int slot, unsigned gen) {
+    r->heap = grow(L, r->heap, &r->hcap, r->nheap + 1, sizeof(timer_t_));
+    int i = r->nheap++;
+    while (i > 0 && r->heap[(i - 1) / 2].at > at) { r->heap[i] = r->heap[(i - 1) / 2]; i = (i - 1) / 2; }
+    r->heap[i] = (timer_t_){ at, slot, gen };
+}
+
+static void timer_pop(reactor_t *r) {
+    timer_t_ last = r->heap[--r->nheap];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= r->nheap) break;
+        if (c + 1 < r->nheap && r->heap[c + 1].at < r->heap[c].at) c++;
+        if (r->heap[c].at >= last.at) break;
+        r->heap[i] = r->heap[c]; i = c;
+    }
+    if (r->nheap) r->heap[i] = last;
+}
+
+/* خانه‌ی انتظار برای task جاری؛ gen تازه در آن است */
+static int waiter_new(lua_State *L, reactor_t *r) {
+    int slot = r->wfree;
+    if (slot >= 0) r->wfree = (int)r->w[slot].gen;
+    else { r->w = grow(L, r->w, &r->wcap, r->nw + 1, sizeof(waiter_t)); slot = r->nw++; }
+    r->w[slot] = (waiter_t){ r->current_ref, ++r->gen, 0, 0 };
+    return slot;
+}
+
+static void waiter_free(reactor_t *r, int slot) { r->w[slot].ref = LUA_NOREF; r->w[slot].gen = (unsigned)r->wfree; r->wfree = slot; }
+
+static int waiter_live(reactor_t *r, int slot, unsigned gen) { return slot >= 0 && slot < r->nw && r->w[slot].ref != LUA_NOREF && r->w[slot].gen == gen; }
+
+/* task خوابیده در slot را با نتیجه‌ی ok بیدار می‌کند (اگر هنوز همان انتظار است) */
+static void waiter_wake(lua_State *L, reactor_t *r, int slot, unsigned gen, int ok) {
+    if (!waiter_live(r, slot, gen)) return;
+    ready_push(L, r, r->w[slot].ref, ok ? R_WAKE_TRUE : R_WAKE_FALSE);
+    waiter_free(r, slot);   /* در خانه‌ی آزاد gen پیوند free list است */
+}
+
+/*
+ * fd آماده نیست. داخل task: در epoll (و برای timeout در heap) ثبت می‌شود و coroutine
+ * yield می‌کند؛ ادامه در k با یک boolean روی استک (true آماده، false timeout). بیرون از
+ * loop: روی سوکت non-blocking با poll صبر می‌کند و 1/0 برمی‌گرداند؛ سوکت blocking یعنی
+ * SO_RCVTIMEO تمام شده (0). fd < 0 فقط timeout (sleep).
+ */
+static int io_wait(lua_State *L, int fd, int events, double timeout, int nb, lua_KContext ctx, lua_KFunction k) {
+    reactor_t *r = reactor_get(L, 0);
+    if (r && r->current == L) {
+        if (fd < 0 && timeout <= 0) {           /* sleep(0): فقط نوبت را به بقیه می‌دهد */
+            ready_push(L, r, r->current_ref, R_WAKE_TRUE);
+            r->parked = 1;
+            return lua_yieldk(L, 0, ctx, k);
+        }
+        int slot = waiter_new(L, r);
+        unsigned gen = r->gen;
+#ifdef NS_URING
+        if (fd >= 0 && r->ring) {
+            if (uring_poll(r->ring, fd, events, (uint64_t)slot | (uint64_t)gen << 32) < 0) { waiter_free(r, slot); return 0; }
+            r->w[slot].polled = 1;
+            fd = -1;
+        }
+#endif
+        if (fd >= 0) {
+            struct epoll_event ev; ev.events = events | EPOLLONESHOT; ev.data.u64 = (uint64_t)slot | (uint64_t)gen << 32;
+            if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && (errno != ENOENT || epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)) { waiter_free(r, slot); return 0; }
+        }
+        if (timeout > 0) timer_push(L, r, now_mono() + timeout, slot, gen);
+        r->parked = 1;
+        return lua_yieldk(L, 0, ctx, k);
+    }
+    if (fd < 0) { if (timeout > 0) { struct timespec ts = { (time_t)timeout, (long)((timeout - (time_t)timeout) * 1e9) }; while (nanosleep(&ts, &ts) < 0 && errno == EINTR); } return 1; }
+    if (!nb) return 0;
+    struct pollfd p = { fd, (short)((events & EPOLLOUT) ? POLLOUT : POLLIN), 0 };
+    int rc;
+    do rc = poll(&p, 1, timeout > 0 ? (int)(timeout * 1000) : -1); while (rc < 0 && errno == EINTR);
+    return rc > 0;
+}
+
+/* ادامه‌ی بعد از io_wait: boolean بالای استک را برمی‌دارد */
+static int io_resumed(lua_State *L) { int ok = lua_toboolean(L, -1); lua_pop(L, 1); return ok; }
+
+#ifdef NS_URING
+/* ---- عملیات کامل روی ring ----
+ * نتیجه‌ی CQE در یک uring_io_t (داخل tcp_t) تحویل می‌شود: done، res (بایت، fd یا -errno)
+ * و بافر pool که تا uring_release مال همان tcp_t است. */
+enum { URING_RECV = 1, URING_SEND, URING_ACCEPT };
+typedef struct { int want, done, res, buf; const char *wp; size_t len; } uring_io_t;
+
+static char *uring_buf(uring_t *u, int b) { return u->pool + (size_t)b * URING_BUF_SIZE; }
+static void uring_release(uring_t *u, uring_io_t *io) { io->done = 0; u->bfree[u->nbfree++] = io->buf; }
+
+/*
+ * kind را روی fd با یک بافر pool می‌فرستد و task را تا CQE آن می‌خواباند (ادامه در k با
+ * true، یا false اگر timeout لغوش کرد). send داده‌ی src را اول در بافر کپی می‌کند؛ len به
+ * URING_BUF_SIZE محدود است. فقط اگر بافر یا SQE نبود برمی‌گردد (0) تا فراخوان همان
+ * مسیر readiness را برود.
+ */
+static int uring_op(lua_State *L, reactor_t *r, uring_io_t *io, int kind, int fd, const char *src, size_t len,
+                    double timeout, lua_KContext ctx, lua_KFunction k) {
+    uring_t *u = r->ring;
+    if (!u->nbfree) return 0;
+    int slot = waiter_new(L, r);
+    unsigned gen = r->gen;
+    struct io_uring_sqe *e = uring_sqe(u);
+    if (!e) { waiter_free(r, slot); return 0; }
+    int b = u->bfree[--u->nbfree];
+    char *buf = uring_buf(u, b);
+    if (len > URING_BUF_SIZE) len = URING_BUF_SIZE;
+    e->fd = fd; e->user_data = URING_OP | (uint64_t)b;
+    if (kind == URING_RECV) {
+        e->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV; e->buf_index = (uint16_t)b;
+        e->addr = (uint64_t)(uintptr_t)buf; e->len = (unsigned)len;
+    } else if (kind == URING_SEND) {
+        memcpy(buf, src, len);
+        e->opcode = IORING_OP_SEND; e->addr = (uint64_t)(uintptr_t)buf; e->len = (unsigned)len; e->msg_flags = MSG_NOSIGNAL;
+    } else {   /* آدرس طرف مقابل در ابتدای بافر، طولش بعد از آن */
+        socklen_t *alen = (socklen_t*)(buf + sizeof(struct sockaddr_storage));
+        *alen = sizeof(struct sockaddr_storage);
+        e->opcode = IORING_OP_ACCEPT; e->addr = (uint64_t)(uintptr_t)buf; e->addr2 = (uint64_t)(uintptr_t)alen;
+        e->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    uring_commit(u);
+    r->w[slot].op = b + 1;
+    u->bown[b].slot = slot; u->bown[b].gen = gen; u->bown[b].kind = kind; u->bown[b].io = io;
+    io->done = 0;
+    if (timeout > 0) timer_push(L, r, now_mono() + timeout, slot, gen);
+    r->parked = 1;
+    return lua_yieldk(L, 0, ctx, k);
+}
+
+/* CQE عملیات بافر b. اگر task هنوز منتظر است نتیجه و بافر به io او می‌رسد؛ لغوشده
+ * (-ECANCELED) یعنی timeout. بی‌صاحب: بافر آزاد و fd پذیرفته‌شده بسته می‌شود. */
+static void uring_op_done(lua_State *L, reactor_t *r, int b, int res) {
+    uring_t *u = r->ring;
+    int slot = u->bown[b].slot; unsigned gen = u->bown[b].gen;
+    int live = waiter_live(r, slot, gen);
+    if (live && res != -ECANCELED) {
+        uring_io_t *io = u->bown[b].io;
+        io->res = res; io->buf = b; io->done = 1;
+        waiter_wake(L, r, slot, gen, 1);
+        return;
+    }
+    if (u->bown[b].kind == URING_ACCEPT && res >= 0) close(res);
+    u->bfree[u->nbfree++] = b;
+    if (live) waiter_wake(L, r, slot, gen, 0);
+}
+#endif
+
+static int l_spawn(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    reactor_t *r = reactor_get(L, 1);
+    int n = lua_gettop(L);
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, -1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_rotate(L, 1, 1);                 /* thread زیر fn و آرگومان‌ها */
+    lua_xmove(L, co, n);
+    ready_push(L, r, ref, R_START);
+    r->live++;
+    return 1;
+}
+
+static int sleep_k(lua_State *L, int status, lua_KContext ctx) { (void)status; (void)ctx; lua_settop(L, 0); return 0; }
+static int l_sleep(lua_State *L) {
+    double sec = luaL_checknumber(L, 1);
+    lua_settop(L, 1);
+    io_wait(L, -1, 0, sec, 0, 0, sleep_k);
+    return 0;
+}
+
+/* loop([fn, ...]): تا تمام شدن همه‌ی taskها اجرا می‌کند؛ خطای یک task از loop بیرون می‌آید */
+#ifdef NS_URING
+/* معادل epoll_wait: SQEها را می‌فرستد، تا timeout میلی‌ثانیه (-1 بی‌نهایت، 0 فقط نگاه)
+ * منتظر می‌ماند و CQEها را به waiterها می‌رساند. TIMEOUT با off=1 با اولین CQE دیگر
+ * خودش تمام می‌شود، پس timeoutهای قدیمی در ring نمی‌مانند. */
+static int reactor_uring_wait(lua_State *L, reactor_t *r, int timeout) {
+    uring_t *u = r->ring;
+    int wait = timeout != 0;
+    if (timeout > 0) {
+        struct io_uring_sqe *e = uring_sqe(u);
+        if (e) {
+            u->ts.tv_sec = timeout / 1000; u->ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            e->opcode = IORING_OP_TIMEOUT; e->fd = -1; e->addr = (uint64_t)(uintptr_t)&u->ts; e->len = 1; e->off = 1;
+            e->user_data = URING_IGNORE;
+            uring_commit(u);
+        } else wait = 0;
+    }
+    if (uring_enter(u, wait) < 0) return -1;
+    unsigned head = *u->cq_head, tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *c = &u->cqes[head & *u->cq_mask];
+        /* خطای poll (مثلاً fd بسته) هم بیدار می‌کند تا خود عملیات خطا را ببیند */
+        if (c->user_data == URING_IGNORE) continue;
+        if (c->user_data & URING_OP) uring_op_done(L, r, (int)(c->user_data & 0xffffu), c->res);
+        else waiter_wake(L, r, (int)(c->user_data & 0xffffffffu), (unsigned)(c->user_data >> 32), 1);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+/* netsocket.backend() → "io_uring" | "epoll" */
+static int l_backend(lua_State *L) { reactor_t *r = reactor_get(L, 1); lua_pushstring(L, r->ring ? "io_uring" : "epoll"); return 1; }
+
+static int l_loop(lua_State *L) {
+    reactor_t *r = reactor_get(L, 1);
+    if (r->current) return luaL_error(L, "loop() called from inside a task");
+    if (lua_isfunction(L, 1)) { l_spawn(L); lua_settop(L, 0); }
+    struct epoll_event ev[REACTOR_EVENTS];
+    while (r->live > 0) {
+        for (int batch = r->nready; batch > 0 && r->nready; batch--) {
+            ready_t rd = r->ready[r->rhead++]; r->nready--;
+            if (!r->nready) r->rhead = 0;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, rd.ref);
+            lua_State *co = lua_tothread(L, -1);
+            lua_pop(L, 1);
+            int narg = 0, nres;
+            if (rd.mode == R_START) narg = lua_gettop(co) - 1;
+            else if (rd.mode != R_CONT) { lua_pushboolean(co, rd.mode == R_WAKE_TRUE); narg = 1; }
+            r->current = co; r->current_ref = rd.ref; r->parked = 0;
+            int st = lua_resume(co, L, narg, &nres);
+            r->current = NULL; r->current_ref = LUA_NOREF;
+            if (st == LUA_YIELD) {
+                lua_pop(co, nres);
+                if (!r->parked) ready_push(L, r, rd.ref, R_CONT);   /* coroutine.yield() معمولی: نوبت بعدی */
+                continue;
+            }
+            r->live--;
+            if (st != LUA_OK) {
+                luaL_traceback(L, co, lua_tostring(co, -1), 0);
+                luaL_unref(L, LUA_REGISTRYINDEX, rd.ref);
+                return lua_error(L);
+            }
+            luaL_unref(L, LUA_REGISTRYINDEX, rd.ref);
+        }
+        if (!r->live) break;
+        int timeout = -1;
+        if (r->nready) timeout = 0;
+        else if (r->nheap) { double d = r->heap[0].at - now_mono(); timeout = d > 0 ? (int)(d * 1000) + 1 : 0; }
+#ifdef NS_URING
+        if (r->ring) {
+            if (reactor_uring_wait(L, r, timeout) < 0) return luaL_error(L, "io_uring_enter failed");
+        } else
+#endif
+        {
+            int n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, timeout);
+            if (n < 0 && errno != EINTR) return luaL_error(L, "epoll_wait failed");
+            for (int i = 0; i < n; i++) waiter_wake(L, r, (int)(ev[i].data.u64 & 0xffffffffu), (unsigned)(ev[i].data.u64 >> 32), 1);
+        }
+        double now = now_mono();
+        while (r->nheap && r->heap[0].at <= now) {
+            timer_t_ tm = r->heap[0];
+            timer_pop(r);
+#ifdef NS_URING
+            if (r->ring && waiter_live(r, tm.slot, tm.gen)) {
+                /* عملیات کامل: CQE لغو (یا نتیجه‌ای که زودتر رسید) task را بیدار می‌کند */
+                if (r->w[tm.slot].op && uring_cancel(r->ring, IORING_OP_ASYNC_CANCEL, URING_OP | (uint64_t)(r->w[tm.slot].op - 1))) continue;
+                if (r->w[tm.slot].polled) uring_cancel(r->ring, IORING_OP_POLL_REMOVE, (uint64_t)tm.slot | (uint64_t)tm.gen << 32);
+            }
+#endif
+            waiter_wake(L, r, tm.slot, tm.gen, 0);
+        }
+    }
+    return 0;
+}
+
+/* ---- DNS داخل loop ----
+ * داخل task جستجو با resolver_start شروع می‌شود و task روی eventfd آن می‌خوابد تا بقیه‌ی
+ * taskها معطل DNS نمانند. انتظار در userdata "netsocket.dns" در اندیس slot است تا بعد
+ * از yield ادامه یابد و اگر task رها شود __gc آن را لغو کند. بیرون از loop همان
+ * resolve_all مسدودکننده. k با status خودش دوباره ns_resolve را صدا می‌زند؛ در پایان
+ * (0 یا -1) استک تا slot - 1 کوتاه شده است. */
+typedef struct { ResWait *w; double deadline; } dns_wait_t;
+
+static int dns_gc(lua_State *L) {
+    dns_wait_t *d = lua_touserdata(L, 1);
+    if (d->w) { resolver_cancel(d->w); d->w = NULL; }
+    return 0;
+}
+
+static int ns_resolve(lua_State *L, int slot, int status, const char *host, int port, int family, int timeout,
+                      ResAddrs *out, lua_KContext ctx, lua_KFunction k) {
+    dns_wait_t *d;
+    if (status != LUA_YIELD) {
+        if (!reactor_here(L)) return resolve_all(host, port, family, timeout, out);
+        ResWait *w;
+        int rc = resolver_start(host, family, out, &w);
+        if (rc <= 0) { if (rc == 0) resolver_set_port(out, port); return rc; }
+        lua_settop(L, slot - 1);
+        d = lua_newuserdata(L, sizeof(dns_wait_t));
+        d->w = w; d->deadline = now_mono() + (timeout > 0 ? timeout : DEFAULT_TIMEOUT);
+        luaL_setmetatable(L, "netsocket.dns");
+    } else {
+        io_resumed(L);   /* آماده یا timer: resolver_result و مهلت تصمیم می‌گیرند */
+        d = luaL_checkudata(L, slot, "netsocket.dns");
+    }
+    for (;;) {
+        int rc = resolver_result(d->w, out);
+        if (rc <= 0) {
+            d->w = NULL;
+            lua_settop(L, slot - 1);
+            if (rc == 0) resolver_set_port(out, port);
+            return rc;
+        }
+        double left = d->deadline - now_mono();
+        if (left <= 0 || !io_wait(L, d->w->fd, EPOLLIN, left, 1, ctx, k)) {
+            resolver_cancel(d->w); d->w = NULL;
+            lua_settop(L, slot - 1);
+            return -1;
+        }
+    }
+}
+
 /* ========== TCP ========== */
-typedef struct { int fd; int timeout; int blocking; int is_server; SSL *ssl; SSL_CTX *ctx; } tcp_t;
+typedef struct {
+    int fd; int timeout; int blocking; int is_server; SSL *ssl; SSL_CTX *ctx;
+    char *rbuf; size_t rpos, rlen, rcap;   /* داده‌ی خوانده‌شده و هنوز تحویل‌نشده: rbuf[rpos .. rpos+rlen) */
+    int nb;                                /* fd غیر blocking است (داخل loop استفاده شده) */
+#ifdef NS_URING
+    uring_t *ring;                         /* همین task با io_uring و بدون SSL: عملیات کامل در ring */
+    uring_io_t rio, wio;                   /* recv/accept و send جدا، تا یک task بخواند و دیگری بفرستد */
+    int more;                              /* آخرین recv بافر را پر کرد: اول recv مستقیم */
+#endif
+} tcp_t;
 
-static int tcp_connect(lua_State *L) {
+enum { IO_ERR = -1, IO_WANT_READ = -2, IO_WANT_WRITE = -3 };
+
+/* داخل task، fd را non-blocking می‌کند تا انتظارها به reactor برسند */
+static void tcp_prepare(lua_State *L, tcp_t *t) {
+    reactor_t *r = reactor_get(L, 0);
+    int here = r && r->current == L;
+    if (!t->nb && t->fd >= 0 && here) { set_nonblocking(t->fd); t->nb = 1; }
+#ifdef NS_URING
+    t->ring = here && r->ring && r->ring->pool && !t->ssl ? r->ring : NULL;
+#endif
+}
+
+/* >0 تعداد، 0 بسته شد، IO_ERR، IO_WANT_READ/WRITE (non-blocking یا SO_RCVTIMEO) */
+static int tcp_io(tcp_t *t, int n, int is_read) {
+    if (n > 0) return n;
+    if (t->ssl) {
+        int e = SSL_get_error(t->ssl, n);
+        return e == SSL_ERROR_WANT_READ ? IO_WANT_READ : e == SSL_ERROR_WANT_WRITE ? IO_WANT_WRITE : e == SSL_ERROR_ZERO_RETURN ? 0 : IO_ERR;
+    }
+    if (n == 0 && is_read) return 0;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? (is_read ? IO_WANT_READ : IO_WANT_WRITE) : IO_ERR;
+}
+#ifdef NS_URING
+/* نتیجه‌ی CQE تحویل‌شده به شکل tcp_io؛ داده‌ی recv در p (حداکثر n) کپی و بافر پس داده می‌شود */
+static int tcp_uring_take(tcp_t *t, char *p, size_t n, int is_read) {
+    uring_io_t *io = is_read ? &t->rio : &t->wio;
+    int res = io->res;
+    if (res > 0 && p) memcpy(p, uring_buf(t->ring, io->buf), (size_t)res < n ? (size_t)res : n);
+    if (is_read) t->more = res > 0 && (size_t)res >= (io->len < URING_BUF_SIZE ? io->len : URING_BUF_SIZE);
+    uring_release(t->ring, io);
+    if (res >= 0) return res;
+    errno = -res;
+    return tcp_io(t, -1, is_read);
+}
+#endif
+
+/*
+ * با t->ring، recv به جای recv مستقیم IO_WANT_READ می‌دهد و tcp_wait آن را به صورت SQE
+ * می‌فرستد؛ بعد از بیدار شدن همین تابع نتیجه را برمی‌دارد. اگر آخرین recv بافر را پر کرد
+ * (داده‌ی بیشتری در راه است) یا send، اول مستقیم امتحان می‌شود و فقط EAGAIN به ring می‌رود.
+ */
+static int tcp_rawread(tcp_t *t, char *p, size_t n) {
+#ifdef NS_URING
+    if (t->ring && t->rio.done) return tcp_uring_take(t, p, n, 1);
+    if (t->ring && !t->more && t->ring->nbfree) { t->rio.want = IO_WANT_READ; t->rio.len = n; return IO_WANT_READ; }
+#endif
+    int r; do r = t->ssl ? SSL_read(t->ssl, p, (int)n) : (int)recv(t->fd, p, n, 0); while (r < 0 && !t->ssl && errno == EINTR);
+    r = tcp_io(t, r, 1);
+#ifdef NS_URING
+    if (t->ring && r == IO_WANT_READ) { t->more = 0; t->rio.want = IO_WANT_READ; t->rio.len = n; }
+#endif
+    return r;
+}
+static int tcp_rawwrite(tcp_t *t, const char *p, size_t n) {
+#ifdef NS_URING
+    if (t->ring && t->wio.done) return tcp_uring_take(t, NULL, 0, 0);
+#endif
+    int r; do r = t->ssl ? SSL_write(t->ssl, p, (int)n) : (int)send(t->fd, p, n, MSG_NOSIGNAL); while (r < 0 && !t->ssl && errno == EINTR);
+    r = n == 0 ? 0 : tcp_io(t, r, 0);
+#ifdef NS_URING
+    if (t->ring && r == IO_WANT_WRITE) { t->wio.want = IO_WANT_WRITE; t->wio.wp = p; t->wio.len = n; }
+#endif
+    return r;
+}
+
+/* منتظر آماده شدن برای want (یا با ring، کامل شدن recv/send)؛ 0 یعنی timeout */
+static int tcp_wait(lua_State *L, tcp_t *t, int want, lua_KContext ctx, lua_KFunction k) {
+#ifdef NS_URING
+    uring_io_t *io = want == IO_WANT_READ ? &t->rio : &t->wio;
+    if (t->ring && io->want == want) {
+        io->want = 0;
+        uring_op(L, reactor_get(L, 0), io, want == IO_WANT_READ ? URING_RECV : URING_SEND, t->fd, io->wp, io->len, t->timeout, ctx, k);
+    }
+    io->want = 0;
+#endif
+    return io_wait(L, t->fd, want == IO_WANT_WRITE ? EPOLLOUT : EPOLLIN, t->timeout, t->nb, ctx, k);
+}
+
+/* ---------- بافر دریافت ----------
+ * receive و receiveuntil از rbuf سرو می‌شوند و فقط وقتی لازم است با یک recv/SSL_read
+ * بزرگ پر می‌شود؛ چیزی تا کامل شدن مصرف نمی‌شود، پس خواندن بعد از yield از همان‌جا ادامه
+ * می‌یابد. rbuf برای خط‌های بلندتر از RBUF_SIZE بزرگ می‌شود. */
+static int tcp_fill(tcp_t *t) {
+    if (t->rpos && t->rcap - t->rpos - t->rlen < t->rcap / 2) { memmove(t->rbuf, t->rbuf + t->rpos, t->rlen); t->rpos = 0; }
+    if (t->rpos + t->rlen == t->rcap) {
+        size_t cap = t->rcap ? t->rcap * 2 : RBUF_SIZE;
+        char *p = realloc(t->rbuf, cap);
+        if (!p) return IO_ERR;
+        t->rbuf = p; t->rcap = cap;
+    }
+    int n = tcp_rawread(t, t->rbuf + t->rpos + t->rlen, t->rcap - t->rpos - t->rlen);
+    if (n > 0) t->rlen += n;
+    return n;
+}
+
+static void tcp_consume(tcp_t *t, size_t n) {
+    t->rpos += n; t->rlen -= n;
+    if (t->rlen) return;
+    t->rpos = 0;
+    if (t->rcap > 4 * RBUF_SIZE) { free(t->rbuf); t->rbuf = NULL; t->rcap = 0; }
+}
+
+/* محل delim در rbuf از from به بعد، یا -1 */
+static long tcp_find(const tcp_t *t, size_t from, const char *delim, size_t dl) {
+    if (t->rlen < dl || from > t->rlen - dl) return -1;
+    const char *p = t->rbuf + t->rpos;
+    const char *hit = dl == 1 ? memchr(p + from, delim[0], t->rlen - from) : memmem(p + from, t->rlen - from, delim, dl);
+    return hit ? hit - p : -1;
+}
+
+/* ---- connect ----
+ * همه‌ی آدرس‌های host (IPv6 و IPv4) با Happy Eyeballs (eyeballs.h) مسابقه می‌دهند. وضعیت
+ * مسابقه userdata روی استک است (اندیس 5، مهلت در 6) تا بعد از yield ادامه یابد و اگر
+ * task رها شود __gc تلاش‌های نیمه‌باز را ببندد. داخل loop فقط روی he->ep صبر می‌شود. */
+static int eyeballs_gc(lua_State *L) { he_free(lua_touserdata(L, 1)); return 0; }
+
+static int tcp_connect_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    HeConn *he = luaL_checkudata(L, 5, "netsocket.eyeballs");
+    double deadline = lua_tonumber(L, 6);
+    int in_loop = reactor_here(L), to = luaL_optinteger(L, 4, t->timeout);
+    if (status == LUA_YIELD) io_resumed(L);   /* آماده یا timer: در هر دو حالت he_step تصمیم می‌گیرد */
+    for (;;) {
+        int fd = he_step(he);
+        if (fd >= 0) {
+            if (t->fd >= 0) close(t->fd);
+            t->fd = fd; t->is_server = 0; t->rpos = t->rlen = 0; t->nb = in_loop;
+            if (!in_loop) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK); if (to > 0) set_sock_timeout(fd, to); }
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+        if (fd == HE_FAIL) { push_error(L, "connect error"); return 2; }
+        double wait = he_timeout(he);   /* -1: تلاشی نمانده، فقط منتظر تلاش‌های جاری */
+        if (wait == 0) continue;
+        if (deadline) {
+            double left = deadline - now_mono();
+            if (left <= 0) { he_free(he); push_error(L, "timeout"); return 2; }
+            if (wait < 0 || left < wait) wait = left;
+        }
+        io_wait(L, he->ep, EPOLLIN, wait > 0 ? wait : 0, 1, ctx, tcp_connect_k);
+    }
+}
+
+static int tcp_connect_dns_k(lua_State *L, int status, lua_KContext ctx) {
     tcp_t *t = luaL_checkudata(L, 1, "tcp");
-    const char *host = luaL_checkstring(L, 2);
-    int port = luaL_checkinteger(L, 3);
     int to = luaL_optinteger(L, 4, t->timeout);
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
-    char ps[8]; snprintf(ps, sizeof(ps), "%d", port);
-    if (getaddrinfo(host, ps, &hints, &res)) { push_error(L, "dns error"); return 2; }
-    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (fd < 0) { freeaddrinfo(res); push_error(L, "socket error"); return 2; }
-    if (to > 0) set_sock_timeout(fd, to);
-    set_nonblocking(fd);
-    int ret = connect(fd, res->ai_addr, res->ai_addrlen);
-    if (ret < 0 && errno != EINPROGRESS) { close(fd); freeaddrinfo(res); push_error(L, "connect error"); return 2; }
-    if (errno == EINPROGRESS && wait_connect(fd, to) < 0) { close(fd); freeaddrinfo(res); push_error(L, "timeout"); return 2; }
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
-    freeaddrinfo(res);
-    if (t->fd >= 0) close(t->fd);
-    t->fd = fd; t->is_server = 0;
+    ResAddrs ra;
+    if (ns_resolve(L, 5, status, lua_tostring(L, 2), (int)lua_tointeger(L, 3), AF_UNSPEC, to, &ra, ctx, tcp_connect_dns_k) < 0) {
+        push_error(L, "dns error"); return 2;
+    }
+    HeConn *he = lua_newuserdata(L, sizeof(HeConn));
+    he->ep = -1; he->addrs.n = 0;
+    luaL_setmetatable(L, "netsocket.eyeballs");
+    if (he_init(he, &ra) < 0) { push_error(L, "socket error"); return 2; }
+    lua_pushnumber(L, to > 0 ? now_mono() + to : 0);
+    return tcp_connect_k(L, LUA_OK, 0);
+}
+
+static int tcp_connect(lua_State *L) {
+    luaL_checkudata(L, 1, "tcp");
+    luaL_checkstring(L, 2);
+    luaL_checkinteger(L, 3);
+    lua_settop(L, 4);
+    return tcp_connect_dns_k(L, LUA_OK, 0);
+}
+
+static int tcp_send_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    size_t len; const char *data = luaL_checklstring(L, 2, &len);
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    tcp_prepare(L, t);
+    for (;;) {
+        int n = tcp_rawwrite(t, data, len);
+        if (n >= 0) { lua_pushinteger(L, n); return 1; }
+        if (n == IO_ERR) { push_error(L, "send error"); return 2; }
+        if (!tcp_wait(L, t, n, ctx, tcp_send_k)) { push_error(L, "timeout"); return 2; }
+    }
+}
+static int tcp_send(lua_State *L) { lua_settop(L, 2); return tcp_send_k(L, LUA_OK, 0); }
+
+/* ctx: تعداد بایت فرستاده‌شده تا قبل از yield */
+static int tcp_sendall_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    size_t len; const char *data = luaL_checklstring(L, 2, &len);
+    size_t sent = (size_t)ctx;
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    tcp_prepare(L, t);
+    while (sent < len) {
+        int n = tcp_rawwrite(t, data + sent, len - sent);
+        if (n > 0) { sent += n; continue; }
+        if (n == IO_ERR || n == 0) { push_error(L, "sendall error"); return 2; }
+        if (!tcp_wait(L, t, n, (lua_KContext)sent, tcp_sendall_k)) { push_error(L, "timeout"); return 2; }
+    }
     lua_pushboolean(L, 1);
     return 1;
 }
+static int tcp_sendall(lua_State *L) { lua_settop(L, 2); return tcp_sendall_k(L, LUA_OK, 0); }
 
-static int tcp_send(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); size_t len; const char *data=luaL_checklstring(L,2,&len); int n=t->ssl?SSL_write(t->ssl,data,len):send(t->fd,data,len,0); if(n<0){push_error(L,"send error");return 2;} lua_pushinteger(L,n); return 1; }
-static int tcp_sendall(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); size_t len; const char *data=luaL_checklstring(L,2,&len); size_t sent=0; while(sent<len){int n=t->ssl?SSL_write(t->ssl,data+sent,len-sent):send(t->fd,data+sent,len-sent,0); if(n<=0){push_error(L,"sendall error");return 2;} sent+=n;} lua_pushboolean(L,1); return 1; }
-static int tcp_recv(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *pat=luaL_optstring(L,2,"*l"); char buf[MAX_BUF]; int n; if(!strcmp(pat,"*a")){luaL_Buffer B; luaL_buffinit(L,&B); while(1){n=t->ssl?SSL_read(t->ssl,buf,sizeof(buf)):recv(t->fd,buf,sizeof(buf),0); if(n<=0)break; luaL_addlstring(&B,buf,n);} luaL_pushresult(&B); return 1;} else if(!strcmp(pat,"*l")){luaL_Buffer B; luaL_buffinit(L,&B); char c; while(1){n=t->ssl?SSL_read(t->ssl,&c,1):recv(t->fd,&c,1,0); if(n<=0)break; if(c=='\n')break; if(c!='\r')luaL_addchar(&B,c);} luaL_pushresult(&B); return 1;} else {int size=atoi(pat); if(size<=0)size=1; n=t->ssl?SSL_read(t->ssl,buf,size):recv(t->fd,buf,size,0); if(n<=0){push_error(L,"recv error");return 2;} lua_pushlstring(L,buf,n); return 1;} }
-static int tcp_close(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); if(t->ssl){SSL_shutdown(t->ssl);SSL_free(t->ssl);t->ssl=NULL;} if(t->ctx){SSL_CTX_free(t->ctx);t->ctx=NULL;} if(t->fd>=0){close(t->fd);t->fd=-1;} return 0; }
-static int tcp_bind(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *host=luaL_optstring(L,2,"0.0.0.0"); int port=luaL_checkinteger(L,3); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; hints.ai_socktype=SOCK_STREAM; hints.ai_flags=AI_PASSIVE; char ps[8]; snprintf(ps,sizeof(ps),"%d",port); if(getaddrinfo(host,ps,&hints,&res)){push_error(L,"bind error");return 2;} int fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol); if(fd<0){freeaddrinfo(res);push_error(L,"socket error");return 2;} int opt=1; setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt)); if(bind(fd,res->ai_addr,res->ai_addrlen)<0){close(fd);freeaddrinfo(res);push_error(L,"bind failed");return 2;} freeaddrinfo(res); if(t->fd>=0)close(t->fd); t->fd=fd; t->is_server=1; lua_pushboolean(L,1); return 1; }
-static int tcp_listen(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); int backlog=luaL_optinteger(L,2,5); if(listen(t->fd,backlog)<0){push_error(L,"listen error");return 2;} set_blocking(t->fd); t->blocking=1; t->timeout=0; lua_pushboolean(L,1); return 1; }
-static int tcp_accept(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); struct sockaddr_in addr; socklen_t len=sizeof(addr); int old_flags=fcntl(t->fd,F_GETFL,0); fcntl(t->fd,F_SETFL,old_flags&~O_NONBLOCK); int fd=accept(t->fd,(struct sockaddr*)&addr,&len); if(fd<0){fcntl(t->fd,F_SETFL,old_flags); push_error(L,"accept error");return 2;} fcntl(t->fd,F_SETFL,old_flags); tcp_t *nt=lua_newuserdata(L,sizeof(tcp_t)); memset(nt,0,sizeof(tcp_t)); nt->fd=fd; nt->timeout=t->timeout; nt->blocking=t->blocking; nt->is_server=0; luaL_getmetatable(L,"tcp"); lua_setmetatable(L,-2); lua_pushstring(L,inet_ntoa(addr.sin_addr)); return 2; }
+/*
+ * receive("*l")  خط بدون \r\n؛ در پایان اتصال باقی‌مانده، یا nil,"closed" اگر چیزی نماند
+ * receive("*a")  تا بسته شدن اتصال
+ * receive(n)     حداکثر n بایت (هرچه در بافر هست، وگرنه یک بار خواندن)
+ */
+static int tcp_recv_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    const char *pat = luaL_optstring(L, 2, "*l");
+    int timed_out = status == LUA_YIELD && !io_resumed(L);
+    int mode = !strcmp(pat, "*a") ? 'a' : !strcmp(pat, "*l") ? 'l' : 'n';
+    int size = mode == 'n' ? atoi(pat) : 0; if (mode == 'n' && size <= 0) size = 1;
+    size_t scanned = 0;
+    tcp_prepare(L, t);
+    for (;;) {
+        int rc = 0;
+        if (mode == 'l') {
+            long at = tcp_find(t, scanned, "\n", 1);
+            if (at >= 0) {
+                lua_pushlstring(L, t->rbuf + t->rpos, at > 0 && t->rbuf[t->rpos + at - 1] == '\r' ? at - 1 : at);
+                tcp_consume(t, at + 1);
+                return 1;
+            }
+            scanned = t->rlen;
+        } else if (mode == 'n' && t->rlen) {
+            size_t n = t->rlen < (size_t)size ? t->rlen : (size_t)size;
+            lua_pushlstring(L, t->rbuf + t->rpos, n);
+            tcp_consume(t, n);
+            return 1;
+        }
+        if (!timed_out) {
+            rc = tcp_fill(t);
+            if (rc > 0) continue;
+            if (rc < IO_ERR && tcp_wait(L, t, rc, ctx, tcp_recv_k)) continue;
+        }
+        /* بسته شد، خطا یا timeout */
+        int wanted = timed_out || rc < IO_ERR;
+        if (mode == 'a' || (mode == 'l' && t->rlen && !wanted)) {
+            lua_pushlstring(L, t->rbuf ? t->rbuf + t->rpos : "", t->rlen);
+            tcp_consume(t, t->rlen);
+            return 1;
+        }
+        push_error(L, wanted ? "timeout" : mode == 'l' && rc == 0 ? "closed" : "recv error");
+        return 2;
+    }
+}
+static int tcp_recv(lua_State *L) { lua_settop(L, 2); return tcp_recv_k(L, LUA_OK, 0); }
+
+/* receiveuntil(delim): داده تا delim (مثلاً "\r\n.\r\n")؛ nil,"closed",partial اگر پیش از آن بسته شد */
+static int tcp_recvuntil_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    size_t dl; const char *delim = luaL_checklstring(L, 2, &dl);
+    luaL_argcheck(L, dl > 0, 2, "empty delimiter");
+    int timed_out = status == LUA_YIELD && !io_resumed(L);
+    size_t scanned = 0;
+    tcp_prepare(L, t);
+    for (;;) {
+        long at = tcp_find(t, scanned, delim, dl);
+        if (at >= 0) { lua_pushlstring(L, t->rbuf + t->rpos, at); tcp_consume(t, at + dl); return 1; }
+        scanned = t->rlen >= dl ? t->rlen - dl + 1 : 0;
+        int rc = 0;
+        if (!timed_out) {
+            rc = tcp_fill(t);
+            if (rc > 0) continue;
+            if (rc < IO_ERR && tcp_wait(L, t, rc, ctx, tcp_recvuntil_k)) continue;
+        }
+        if (timed_out || rc < IO_ERR) { push_error(L, "timeout"); return 2; }   /* داده در بافر می‌ماند */
+        push_error(L, "closed");
+        lua_pushlstring(L, t->rbuf ? t->rbuf + t->rpos : "", t->rlen);
+        tcp_consume(t, t->rlen);
+        return 3;
+    }
+}
+static int tcp_recvuntil(lua_State *L) { lua_settop(L, 2); return tcp_recvuntil_k(L, LUA_OK, 0); }
+static int tcp_close(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); if(t->ssl){SSL_shutdown(t->ssl);SSL_free(t->ssl);t->ssl=NULL;} if(t->ctx){SSL_CTX_free(t->ctx);t->ctx=NULL;} if(t->fd>=0){close(t->fd);t->fd=-1;} free(t->rbuf); t->rbuf=NULL; t->rpos=t->rlen=t->rcap=0; t->nb=0; return 0; }
+static int tcp_bind(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *host=luaL_optstring(L,2,"0.0.0.0"); int port=luaL_checkinteger(L,3); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_UNSPEC; hints.ai_socktype=SOCK_STREAM; hints.ai_flags=AI_PASSIVE; char ps[8]; snprintf(ps,sizeof(ps),"%d",port); if(getaddrinfo(host,ps,&hints,&res)){push_error(L,"bind error");return 2;} int fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol); if(fd<0){freeaddrinfo(res);push_error(L,"socket error");return 2;} int opt=1; setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt)); if(bind(fd,res->ai_addr,res->ai_addrlen)<0){close(fd);freeaddrinfo(res);push_error(L,"bind failed");return 2;} freeaddrinfo(res); if(t->fd>=0)close(t->fd); t->fd=fd; t->is_server=1; lua_pushboolean(L,1); return 1; }
+static int tcp_listen(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); int backlog=luaL_optinteger(L,2,SOMAXCONN); if(listen(t->fd,backlog)<0){push_error(L,"listen error");return 2;} set_blocking(t->fd); t->blocking=1; t->timeout=0; lua_pushboolean(L,1); return 1; }
+static int tcp_accept_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    tcp_prepare(L, t);
+    struct sockaddr_storage addr; socklen_t len = sizeof(addr);
+    int fd;
+    if (t->nb) {
+        /* داخل loop: سوکت جدید هم از اول non-blocking است */
+        int fl = reactor_here(L) ? SOCK_NONBLOCK : 0;
+        fd = -1;
+#ifdef NS_URING
+        if (t->ring && t->rio.done) {   /* ACCEPT از ring: آدرس در ابتدای بافر */
+            memcpy(&addr, uring_buf(t->ring, t->rio.buf), sizeof(addr));
+            fd = t->rio.res;
+            uring_release(t->ring, &t->rio);
+            if (fd < 0 && -fd != EAGAIN && -fd != EINTR && -fd != ECONNABORTED) { push_error(L, "accept error"); return 2; }
+        }
+#endif
+        while (fd < 0 && (fd = accept4(t->fd, (struct sockaddr*)&addr, &len, fl | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { push_error(L, "accept error"); return 2; }
+#ifdef NS_URING
+            if (t->ring) uring_op(L, reactor_get(L, 0), &t->rio, URING_ACCEPT, t->fd, NULL, 0, t->timeout, ctx, tcp_accept_k);
+#endif
+            if (!io_wait(L, t->fd, EPOLLIN, t->timeout, 1, ctx, tcp_accept_k)) { push_error(L, "timeout"); return 2; }
+        }
+    } else {
+        /* listen سوکت را blocking کرده؛ بدون fcntl در هر accept */
+        while ((fd = accept4(t->fd, (struct sockaddr*)&addr, &len, SOCK_CLOEXEC)) < 0 && (errno == EINTR || errno == ECONNABORTED));
+        if (fd < 0) { push_error(L, errno == EAGAIN || errno == EWOULDBLOCK ? "timeout" : "accept error"); return 2; }
+    }
+    tcp_t *nt=lua_newuserdata(L,sizeof(tcp_t)); memset(nt,0,sizeof(tcp_t)); nt->fd=fd; nt->timeout=t->timeout; nt->blocking=t->blocking; nt->is_server=0; nt->nb=t->nb && reactor_here(L); luaL_getmetatable(L,"tcp"); lua_setmetatable(L,-2); char ip[INET6_ADDRSTRLEN]=""; lua_pushstring(L,resolver_ntop(&addr,ip,sizeof(ip))?ip:""); return 2;
+}
+static int tcp_accept(lua_State *L) { lua_settop(L, 1); return tcp_accept_k(L, LUA_OK, 0); }
 static int tcp_settimeout(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); t->timeout=luaL_checkinteger(L,2); set_sock_timeout(t->fd,t->timeout); return 0; }
-static int tcp_starttls(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); SSL_library_init(); SSL_load_error_strings(); SSL_CTX *ctx=SSL_CTX_new(t->is_server?TLS_server_method():TLS_client_method()); SSL *ssl=SSL_new(ctx); SSL_set_fd(ssl,t->fd); int ret=t->is_server?SSL_accept(ssl):SSL_connect(ssl); if(ret!=1){SSL_free(ssl);SSL_CTX_free(ctx); push_error(L,"tls error");return 2;} t->ssl=ssl; t->ctx=ctx; lua_pushboolean(L,1); return 1; }
-static int tcp_getpeername(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); struct sockaddr_in addr; socklen_t len=sizeof(addr); if(getpeername(t->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} lua_pushstring(L,inet_ntoa(addr.sin_addr)); lua_pushinteger(L,ntohs(addr.sin_port)); return 2; }
-static int tcp_getsockname(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); struct sockaddr_in addr; socklen_t len=sizeof(addr); if(getsockname(t->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} lua_pushstring(L,inet_ntoa(addr.sin_addr)); lua_pushinteger(L,ntohs(addr.sin_port)); return 2; }
+/* ctx = 1: handshake قبلاً شروع شده و بعد از yield ادامه دارد */
+static int tcp_starttls_k(lua_State *L, int status, lua_KContext ctx) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    int timed_out = status == LUA_YIELD && !io_resumed(L);
+    tcp_prepare(L, t);
+    if (!ctx) {
+        SSL_library_init(); SSL_load_error_strings();
+        if (t->ssl) { SSL_free(t->ssl); t->ssl = NULL; }
+        if (t->ctx) { SSL_CTX_free(t->ctx); t->ctx = NULL; }
+        t->ctx = SSL_CTX_new(t->is_server ? TLS_server_method() : TLS_client_method());
+#ifdef SSL_OP_ENABLE_KTLS
+        if (t->ctx) SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS);   /* برای sendfile؛ اگر kernel نداشته باشد بی‌اثر است */
+#endif
+        t->ssl = t->ctx ? SSL_new(t->ctx) : NULL;
+        if (t->ssl) { SSL_set_fd(t->ssl, t->fd); if (t->is_server) SSL_set_accept_state(t->ssl); else SSL_set_connect_state(t->ssl); }
+    }
+    while (!timed_out && t->ssl) {
+        int ret = SSL_do_handshake(t->ssl);
+        if (ret == 1) { lua_pushboolean(L, 1); return 1; }
+        int e = SSL_get_error(t->ssl, ret);
+        if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) break;
+        if (!tcp_wait(L, t, e == SSL_ERROR_WANT_WRITE ? IO_WANT_WRITE : IO_WANT_READ, 1, tcp_starttls_k)) timed_out = 1;
+    }
+    if (t->ssl) { SSL_free(t->ssl); t->ssl = NULL; }
+    if (t->ctx) { SSL_CTX_free(t->ctx); t->ctx = NULL; }
+    push_error(L, timed_out ? "timeout" : "tls error");
+    return 2;
+}
+static int tcp_starttls(lua_State *L) { lua_settop(L, 1); return tcp_starttls_k(L, LUA_OK, 0); }
+static int tcp_getpeername(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); struct sockaddr_storage addr; socklen_t len=sizeof(addr); if(getpeername(t->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} return push_sockaddr(L,&addr); }
+static int tcp_getsockname(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); struct sockaddr_storage addr; socklen_t len=sizeof(addr); if(getsockname(t->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} return push_sockaddr(L,&addr); }
 static int tcp_setoption(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *opt=luaL_checkstring(L,2); int val=luaL_checkinteger(L,3); int level=SOL_SOCKET,optname=0; if(!strcmp(opt,"reuseaddr"))optname=SO_REUSEADDR; else if(!strcmp(opt,"keepalive"))optname=SO_KEEPALIVE; else if(!strcmp(opt,"nodelay")){level=IPPROTO_TCP;optname=TCP_NODELAY;} else {push_error(L,"unknown");return 2;} if(setsockopt(t->fd,level,optname,&val,sizeof(val))<0){push_error(L,"error");return 2;} lua_pushboolean(L,1); return 1; }
 static int tcp_getoption(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *opt=luaL_checkstring(L,2); int level=SOL_SOCKET,optname=0; if(!strcmp(opt,"reuseaddr"))optname=SO_REUSEADDR; else if(!strcmp(opt,"keepalive"))optname=SO_KEEPALIVE; else if(!strcmp(opt,"nodelay")){level=IPPROTO_TCP;optname=TCP_NODELAY;} else {push_error(L,"unknown");return 2;} int val; socklen_t len=sizeof(val); if(getsockopt(t->fd,level,optname,&val,&len)<0){push_error(L,"error");return 2;} lua_pushinteger(L,val); return 1; }
 static int tcp_shutdown(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); shutdown(t->fd,luaL_optinteger(L,2,2)); return 0; }
 static int tcp_gettimeout(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); lua_pushinteger(L,t->timeout); return 1; }
 static int tcp_setblocking(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); t->blocking=lua_toboolean(L,2); if(t->blocking)set_sock_timeout(t->fd,0); else if(t->timeout>0)set_sock_timeout(t->fd,t->timeout); return 0; }
-static int tcp_sendfile(lua_State *L) { tcp_t *t=luaL_checkudata(L,1,"tcp"); const char *fp=luaL_checkstring(L,2); FILE *f=fopen(fp,"rb"); if(!f){push_error(L,"file error");return 2;} char buf[8192]; size_t n; while((n=fread(buf,1,sizeof(buf),f))>0){int s=t->ssl?SSL_write(t->ssl,buf,n):send(t->fd,buf,n,0); if(s<=0){fclose(f);push_error(L,"sendfile error");return 2;} if((size_t)s<n)fseek(f,(long)(s-n),SEEK_CUR);} fclose(f); lua_pushboolean(L,1); return 1; }
+/* ---------- sendfile ----------
+ * t:sendfile(path [, offset [, count]]) → تعداد بایت | nil, خطا
+ * سوکت ساده: sendfile(2) مستقیم از page cache، بدون کپی در user space. TLS: اگر kTLS
+ * فعال شده باشد SSL_sendfile، وگرنه تکه‌های بزرگ pread + SSL_write. وضعیت (fd فایل، offset،
+ * تکه‌ی نیمه‌نوشته) در یک userdata روی استک است تا بعد از yield ادامه یابد و اگر task رها
+ * شود __gc فایل را ببندد. */
+#define SENDFILE_CHUNK (256 * 1024)
+typedef struct { int fd; off_t off, end; char *buf; size_t bpos, blen; } sendfile_t;
+
+static void sendfile_close(sendfile_t *f) {
+    if (f->fd >= 0) close(f->fd);
+    free(f->buf); f->fd = -1; f->buf = NULL;
+}
+static int sendfile_gc(lua_State *L) { sendfile_close(lua_touserdata(L, 1)); return 0; }
+
+static int tcp_sendfile_k(lua_State *L, int status, lua_KContext ctx) {
+    (void)ctx;
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    sendfile_t *f = luaL_checkudata(L, 5, "netsocket.sendfile");
+    off_t start = (off_t)lua_tointeger(L, 6);
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    tcp_prepare(L, t);
+    for (;;) {
+        int n;
+        if (t->ssl && f->bpos < f->blen) {
+            n = tcp_rawwrite(t, f->buf + f->bpos, f->blen - f->bpos);
+            if (n > 0) { f->bpos += n; continue; }
+        } else if (f->off >= f->end) {
+            break;
+        } else if (!t->ssl) {
+            size_t want = f->end - f->off > (1 << 30) ? (1 << 30) : (size_t)(f->end - f->off);
+            ssize_t r = sendfile(t->fd, f->fd, &f->off, want);
+            if (r > 0) continue;
+            if (r == 0) { push_error(L, "file truncated"); return 2; }
+            if (errno == EINTR) continue;
+            n = errno == EAGAIN || errno == EWOULDBLOCK ? IO_WANT_WRITE : IO_ERR;
+        }
+#if !defined(OPENSSL_NO_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+        else if (BIO_get_ktls_send(SSL_get_wbio(t->ssl))) {
+            size_t want = f->end - f->off > (1 << 30) ? (1 << 30) : (size_t)(f->end - f->off);
+            ossl_ssize_t r = SSL_sendfile(t->ssl, f->fd, f->off, want, 0);
+            if (r > 0) { f->off += r; continue; }
+            n = tcp_io(t, (int)r, 0);
+        }
+#endif
+        else {
+            if (!f->buf && !(f->buf = malloc(SENDFILE_CHUNK))) { push_error(L, "memory"); return 2; }
+            size_t want = f->end - f->off > SENDFILE_CHUNK ? SENDFILE_CHUNK : (size_t)(f->end - f->off);
+            ssize_t r = pread(f->fd, f->buf, want, f->off);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { push_error(L, r == 0 ? "file truncated" : "file error"); return 2; }
+            f->off += r; f->bpos = 0; f->blen = (size_t)r;
+            continue;
+        }
+        if (n == IO_ERR || n == 0) { push_error(L, "sendfile error"); return 2; }
+        if (!tcp_wait(L, t, n, 0, tcp_sendfile_k)) { push_error(L, "timeout"); return 2; }
+    }
+    sendfile_close(f);
+    lua_pushinteger(L, (lua_Integer)(f->end - start));
+    return 1;
+}
+
+static int tcp_sendfile(lua_State *L) {
+    tcp_t *t = luaL_checkudata(L, 1, "tcp");
+    const char *path = luaL_checkstring(L, 2);
+    lua_Integer offset = luaL_optinteger(L, 3, 0), count = luaL_optinteger(L, 4, -1);
+    (void)t;
+    lua_settop(L, 4);
+    sendfile_t *f = lua_newuserdata(L, sizeof(sendfile_t));
+    memset(f, 0, sizeof(*f)); f->fd = -1;
+    luaL_setmetatable(L, "netsocket.sendfile");
+    if ((f->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) { push_error(L, "file error"); return 2; }
+    struct stat st;
+    if (fstat(f->fd, &st) < 0 || offset < 0 || offset > st.st_size) { sendfile_close(f); push_error(L, "file error"); return 2; }
+    f->off = offset;
+    f->end = count < 0 || offset + count > st.st_size ? st.st_size : offset + count;
+    lua_pushinteger(L, offset);
+    return tcp_sendfile_k(L, LUA_OK, 0);
+}
 static int tcp_gc(lua_State *L) { tcp_close(L); return 0; }
 
 /* ========== UDP ========== */
-typedef struct { int fd; int timeout; int blocking; } udp_t;
-static int udp_bind(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); const char *host=luaL_optstring(L,2,"0.0.0.0"); int port=luaL_checkinteger(L,3); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; hints.ai_socktype=SOCK_DGRAM; hints.ai_flags=AI_PASSIVE; char ps[8]; snprintf(ps,sizeof(ps),"%d",port); if(getaddrinfo(host,ps,&hints,&res)){push_error(L,"bind error");return 2;} int fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol); if(fd<0){freeaddrinfo(res);push_error(L,"socket error");return 2;} if(bind(fd,res->ai_addr,res->ai_addrlen)<0){close(fd);freeaddrinfo(res);push_error(L,"bind failed");return 2;} freeaddrinfo(res); u->fd=fd; lua_pushboolean(L,1); return 1; }
-static int udp_sendto(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); size_t len; const char *data=luaL_checklstring(L,2,&len); const char *host=luaL_checkstring(L,3); int port=luaL_checkinteger(L,4); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; hints.ai_socktype=SOCK_DGRAM; char ps[8]; snprintf(ps,sizeof(ps),"%d",port); if(getaddrinfo(host,ps,&hints,&res)){push_error(L,"dns error");return 2;} int n=sendto(u->fd,data,len,0,res->ai_addr,res->ai_addrlen); freeaddrinfo(res); if(n<0){push_error(L,"sendto error");return 2;} lua_pushinteger(L,n); return 1; }
-static int udp_recvfrom(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); int size=luaL_optinteger(L,2,1024); char *buf=malloc(size); struct sockaddr_in addr; socklen_t len=sizeof(addr); int n=recvfrom(u->fd,buf,size,0,(struct sockaddr*)&addr,&len); if(n<0){free(buf);push_error(L,"recvfrom error");return 2;} lua_pushlstring(L,buf,n); lua_pushstring(L,inet_ntoa(addr.sin_addr)); lua_pushinteger(L,ntohs(addr.sin_port)); free(buf); return 3; }
-static int udp_close(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); if(u->fd>=0){close(u->fd);u->fd=-1;} return 0; }
+typedef struct {
+    int fd; int timeout; int blocking; int nb;
+    char *mbuf; size_t mcap;               /* بافر ثابت recvmany: mmsghdr، iovec، آدرس‌ها و داده */
+} udp_t;
+static void udp_prepare(lua_State *L, udp_t *u) { if (!u->nb && u->fd >= 0 && reactor_here(L)) { set_nonblocking(u->fd); u->nb = 1; } }
+
+/* ---- آدرس از پیش resolve‌شده ----
+ * netsocket.addr(host, port) یک sockaddr می‌سازد تا ارسال‌های پشت سر هم (sendto،
+ * sendmany) برای هر datagram دوباره resolve نکنند؛ recvmany هم فرستنده‌ها را به همین
+ * شکل برمی‌گرداند تا جواب مستقیم به آن‌ها برود. */
+typedef struct { socklen_t len; struct sockaddr_storage ss; } ns_addr_t;
+
+static ns_addr_t *push_addr(lua_State *L, const struct sockaddr *sa, socklen_t len) {
+    ns_addr_t *a = lua_newuserdata(L, sizeof(ns_addr_t));
+    if (len > sizeof(a->ss)) len = sizeof(a->ss);
+    memcpy(&a->ss, sa, len); a->len = len;
+    luaL_getmetatable(L, "sockaddr"); lua_setmetatable(L, -2);
+    return a;
+}
+
+static int addr_port(const ns_addr_t *a) { return resolver_port(&a->ss); }
+static const char *addr_ip(const ns_addr_t *a, char *buf, size_t n) { return resolver_ntop(&a->ss, buf, n); }
+
+/* netsocket.addr(host, port [, family]): بدون family اولین آدرس هر خانواده‌ای */
+static int l_addr_k(lua_State *L, int status, lua_KContext ctx) {
+    ResAddrs ra;
+    if (ns_resolve(L, 4, status, lua_tostring(L, 1), (int)lua_tointeger(L, 2), (int)lua_tointeger(L, 3), DEFAULT_TIMEOUT, &ra, ctx, l_addr_k) < 0) {
+        push_error(L, "dns error"); return 2;
+    }
+    push_addr(L, (struct sockaddr*)&ra.addr[0], ra.len[0]);
+    return 1;
+}
+static int l_addr(lua_State *L) {
+    luaL_checkstring(L, 1); luaL_checkinteger(L, 2);
+    lua_Integer family = luaL_optinteger(L, 3, AF_UNSPEC);
+    lua_settop(L, 2); lua_pushinteger(L, family);
+    return l_addr_k(L, LUA_OK, 0);
+}
+static int addr_tostring(lua_State *L) {
+    ns_addr_t *a = luaL_checkudata(L, 1, "sockaddr"); char ip[INET6_ADDRSTRLEN] = "?";
+    addr_ip(a, ip, sizeof(ip));
+    lua_pushfstring(L, a->ss.ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d", ip, addr_port(a));
+    return 1;
+}
+/* a:ip(), a:port() */
+static int addr_getip(lua_State *L) { ns_addr_t *a = luaL_checkudata(L, 1, "sockaddr"); char ip[INET6_ADDRSTRLEN]; if (!addr_ip(a, ip, sizeof(ip))) return 0; lua_pushstring(L, ip); return 1; }
+static int addr_getport(lua_State *L) { ns_addr_t *a = luaL_checkudata(L, 1, "sockaddr"); lua_pushinteger(L, addr_port(a)); return 1; }
+static int addr_eq(lua_State *L) {
+    ns_addr_t *a = luaL_checkudata(L, 1, "sockaddr"), *b = luaL_checkudata(L, 2, "sockaddr");
+    lua_pushboolean(L, a->len == b->len && !memcmp(&a->ss, &b->ss, a->len));
+    return 1;
+}
+static int udp_bind(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); const char *host=luaL_optstring(L,2,"0.0.0.0"); int port=luaL_checkinteger(L,3); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_UNSPEC; hints.ai_socktype=SOCK_DGRAM; hints.ai_flags=AI_PASSIVE; char ps[8]; snprintf(ps,sizeof(ps),"%d",port); if(getaddrinfo(host,ps,&hints,&res)){push_error(L,"bind error");return 2;} int fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol); if(fd<0){freeaddrinfo(res);push_error(L,"socket error");return 2;} if(bind(fd,res->ai_addr,res->ai_addrlen)<0){close(fd);freeaddrinfo(res);push_error(L,"bind failed");return 2;} freeaddrinfo(res); u->fd=fd; lua_pushboolean(L,1); return 1; }
+/* u:sendto(data, host, port) یا u:sendto(data, addr); host اول به addr تبدیل می‌شود */
+static int udp_sendto_k(lua_State *L, int status, lua_KContext ctx) {
+    udp_t *u=luaL_checkudata(L,1,"udp"); size_t len; const char *data=luaL_checklstring(L,2,&len);
+    ns_addr_t *to = luaL_checkudata(L, 3, "sockaddr");
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    udp_prepare(L, u);
+    const struct sockaddr *sa = (struct sockaddr*)&to->ss; socklen_t salen = to->len;
+    int n;
+    while ((n = sendto(u->fd,data,len,0,sa,salen)) < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+        if (!io_wait(L, u->fd, EPOLLOUT, u->timeout, u->nb, ctx, udp_sendto_k)) { push_error(L, "timeout"); return 2; }
+    }
+    if(n<0){push_error(L,"sendto error");return 2;} lua_pushinteger(L,n); return 1;
+}
+/* با host: آدرسی از خانواده‌ی خود سوکت */
+static int udp_sendto_dns_k(lua_State *L, int status, lua_KContext ctx) {
+    udp_t *u = luaL_checkudata(L, 1, "udp");
+    ResAddrs ra;
+    if (ns_resolve(L, 5, status, lua_tostring(L, 3), (int)lua_tointeger(L, 4), sock_family(u->fd), u->timeout, &ra, ctx, udp_sendto_dns_k) < 0) {
+        push_error(L, "dns error"); return 2;
+    }
+    lua_settop(L, 2);
+    push_addr(L, (struct sockaddr*)&ra.addr[0], ra.len[0]);
+    return udp_sendto_k(L, LUA_OK, 0);
+}
+static int udp_sendto(lua_State *L) {
+    lua_settop(L, 4);
+    if (luaL_testudata(L, 3, "sockaddr")) return udp_sendto_k(L, LUA_OK, 0);
+    luaL_checkudata(L, 1, "udp"); luaL_checkstring(L, 2); luaL_checkstring(L, 3); luaL_checkinteger(L, 4);
+    return udp_sendto_dns_k(L, LUA_OK, 0);
+}
+static int udp_recvfrom_k(lua_State *L, int status, lua_KContext ctx) {
+    udp_t *u=luaL_checkudata(L,1,"udp"); int size=luaL_optinteger(L,2,1024);
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    udp_prepare(L, u);
+    luaL_Buffer B; char *buf=luaL_buffinitsize(L,&B,size); struct sockaddr_storage addr; socklen_t len=sizeof(addr); int n;
+    while ((n = recvfrom(u->fd,buf,size,0,(struct sockaddr*)&addr,&len)) < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+        if (!u->nb) break;
+        lua_pop(L, 1);   /* بافر Lua نباید از yield عبور کند */
+        if (!io_wait(L, u->fd, EPOLLIN, u->timeout, u->nb, ctx, udp_recvfrom_k)) { push_error(L, "timeout"); return 2; }
+        buf=luaL_buffinitsize(L,&B,size); len=sizeof(addr);
+    }
+    if(n<0){push_error(L,"recvfrom error");return 2;}
+    luaL_pushresultsize(&B,n); return 1 + push_sockaddr(L,&addr);
+}
+static int udp_recvfrom(lua_State *L) { lua_settop(L, 2); return udp_recvfrom_k(L, LUA_OK, 0); }
+
+/* ---- دسته‌ای: sendmmsg / recvmmsg ---- */
+#define UDP_BATCH 64          /* پیام در هر sendmmsg */
+#define UDP_RECV_MAX 1024     /* سقف n در recvmany */
+
+/* u:sendmany(list [, addr]) → تعداد ارسال‌شده | nil, خطا, تعداد
+ * هر عضو list یا رشته است (به addr) یا {data, addr}. ctx = تعداد ارسال‌شده تا اینجا. */
+static int udp_sendmany_k(lua_State *L, int status, lua_KContext ctx) {
+    udp_t *u = luaL_checkudata(L, 1, "udp");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    ns_addr_t *def = luaL_testudata(L, 3, "sockaddr");
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); lua_pushinteger(L, (lua_Integer)ctx); return 3; }
+    udp_prepare(L, u);
+    lua_Integer total = (lua_Integer)luaL_len(L, 2), done = (lua_Integer)ctx;
+    struct mmsghdr msgs[UDP_BATCH]; struct iovec iov[UDP_BATCH];
+    while (done < total) {
+        int k = 0;
+        for (; k < UDP_BATCH && done + k < total; k++) {
+            /* رشته‌ها در خود list (یا زیرجدول‌هایش) زنده می‌مانند */
+            ns_addr_t *to = def; size_t len; const char *data;
+            if (lua_rawgeti(L, 2, done + k + 1) == LUA_TTABLE) {
+                lua_rawgeti(L, -1, 1); data = lua_tolstring(L, -1, &len); lua_pop(L, 1);
+                lua_rawgeti(L, -1, 2); if (luaL_testudata(L, -1, "sockaddr")) to = lua_touserdata(L, -1); lua_pop(L, 1);
+            } else data = lua_tolstring(L, -1, &len);
+            lua_pop(L, 1);
+            if (!data) return luaL_error(L, "sendmany: item %d is not a string", (int)(done + k + 1));
+            if (!to) return luaL_error(L, "sendmany: item %d has no address", (int)(done + k + 1));
+            iov[k].iov_base = (void*)data; iov[k].iov_len = len;
+            memset(&msgs[k], 0, sizeof(msgs[k]));
+            msgs[k].msg_hdr.msg_name = &to->ss; msgs[k].msg_hdr.msg_namelen = to->len;
+            msgs[k].msg_hdr.msg_iov = &iov[k]; msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+        int n = sendmmsg(u->fd, msgs, k, 0);
+        if (n > 0) { done += n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!io_wait(L, u->fd, EPOLLOUT, u->timeout, u->nb, (lua_KContext)done, udp_sendmany_k)) { push_error(L, "timeout"); lua_pushinteger(L, done); return 3; }
+            continue;
+        }
+        push_error(L, "sendto error"); lua_pushinteger(L, done); return 3;
+    }
+    lua_pushinteger(L, done);
+    return 1;
+}
+static int udp_sendmany(lua_State *L) { lua_settop(L, 3); return udp_sendmany_k(L, LUA_OK, 0); }
+
+/* u:recvmany([n [, size]]) → datas, addrs, truncated | nil, خطا
+ * تا رسیدن دست‌کم یک datagram صبر می‌کند و بعد هرچه (تا n) در صف هست برمی‌دارد.
+ * datagram بزرگ‌تر از size بریده می‌شود؛ truncated[i] طول واقعی آن‌هاست (بقیه nil). */
+static int udp_recvmany_k(lua_State *L, int status, lua_KContext ctx) {
+    (void)ctx;
+    udp_t *u = luaL_checkudata(L, 1, "udp");
+    int n = luaL_optinteger(L, 2, UDP_BATCH), size = luaL_optinteger(L, 3, 1500);
+    luaL_argcheck(L, n >= 1 && n <= UDP_RECV_MAX, 2, "1..1024");
+    luaL_argcheck(L, size >= 1, 3, "size");
+    if (status == LUA_YIELD && !io_resumed(L)) { push_error(L, "timeout"); return 2; }
+    udp_prepare(L, u);
+    size_t per = sizeof(struct mmsghdr) + sizeof(struct iovec) + sizeof(struct sockaddr_storage);
+    size_t need = (size_t)n * (per + (size_t)size);
+    if (need > u->mcap) {
+        char *nb = realloc(u->mbuf, need);
+        if (!nb) return luaL_error(L, "memory");
+        u->mbuf = nb; u->mcap = need;
+    }
+    struct mmsghdr *msgs = (struct mmsghdr*)u->mbuf;
+    struct iovec *iov = (struct iovec*)(msgs + n);
+    struct sockaddr_storage *from = (struct sockaddr_storage*)(iov + n);
+    char *data = (char*)(from + n);
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = data + (size_t)i * size; iov[i].iov_len = size;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &from[i]; msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int got;
+    /* MSG_TRUNC: msg_len طول واقعی datagram است، نه مقدار کپی‌شده */
+    while ((got = recvmmsg(u->fd, msgs, n, MSG_TRUNC | (u->nb ? 0 : MSG_WAITFORONE), NULL)) < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) { push_error(L, "recvfrom error"); return 2; }
+        if (!u->nb) { push_error(L, "timeout"); return 2; }
+        if (!io_wait(L, u->fd, EPOLLIN, u->timeout, u->nb, 0, udp_recvmany_k)) { push_error(L, "timeout"); return 2; }
+    }
+    lua_createtable(L, got, 0); lua_createtable(L, got, 0); lua_newtable(L);
+    for (int i = 0; i < got; i++) {
+        size_t len = msgs[i].msg_len < (unsigned)size ? msgs[i].msg_len : (size_t)size;
+        lua_pushlstring(L, iov[i].iov_base, len); lua_rawseti(L, -4, i + 1);
+        push_addr(L, (struct sockaddr*)&from[i], msgs[i].msg_hdr.msg_namelen); lua_rawseti(L, -3, i + 1);
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) { lua_pushinteger(L, msgs[i].msg_len); lua_rawseti(L, -2, i + 1); }
+    }
+    return 3;
+}
+static int udp_recvmany(lua_State *L) { lua_settop(L, 3); return udp_recvmany_k(L, LUA_OK, 0); }
+
+static int udp_close(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); if(u->fd>=0){close(u->fd);u->fd=-1;} u->nb=0; free(u->mbuf); u->mbuf=NULL; u->mcap=0; return 0; }
 static int udp_settimeout(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); u->timeout=luaL_checkinteger(L,2); set_sock_timeout(u->fd,u->timeout); return 0; }
-static int udp_getsockname(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); struct sockaddr_in addr; socklen_t len=sizeof(addr); if(getsockname(u->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} lua_pushstring(L,inet_ntoa(addr.sin_addr)); lua_pushinteger(L,ntohs(addr.sin_port)); return 2; }
+static int udp_getsockname(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); struct sockaddr_storage addr; socklen_t len=sizeof(addr); if(getsockname(u->fd,(struct sockaddr*)&addr,&len)<0){push_error(L,"error");return 2;} return push_sockaddr(L,&addr); }
 static int udp_setoption(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); const char *opt=luaL_checkstring(L,2); int val=luaL_checkinteger(L,3); int optname=0; if(!strcmp(opt,"reuseaddr"))optname=SO_REUSEADDR; else if(!strcmp(opt,"broadcast"))optname=SO_BROADCAST; else {push_error(L,"unknown");return 2;} if(setsockopt(u->fd,SOL_SOCKET,optname,&val,sizeof(val))<0){push_error(L,"error");return 2;} lua_pushboolean(L,1); return 1; }
 static int udp_getoption(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); const char *opt=luaL_checkstring(L,2); int optname=0; if(!strcmp(opt,"reuseaddr"))optname=SO_REUSEADDR; else if(!strcmp(opt,"broadcast"))optname=SO_BROADCAST; else {push_error(L,"unknown");return 2;} int val; socklen_t len=sizeof(val); if(getsockopt(u->fd,SOL_SOCKET,optname,&val,&len)<0){push_error(L,"error");return 2;} lua_pushinteger(L,val); return 1; }
 static int udp_gettimeout(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); lua_pushinteger(L,u->timeout); return 1; }
 static int udp_setblocking(lua_State *L) { udp_t *u=luaL_checkudata(L,1,"udp"); u->blocking=lua_toboolean(L,2); if(u->blocking)set_sock_timeout(u->fd,0); else if(u->timeout>0)set_sock_timeout(u->fd,u->timeout); return 0; }
 static int udp_gc(lua_State *L) { return udp_close(L); }
 
+/* ========== Server ==========
+ * netsocket.serve(host, port, handler [, {workers=N, backlog=, timeout=}])
+ * هر worker (با workers > 1 یک فرایند fork‌شده، با همان توابع Lua) listener خودش را با
+ * SO_REUSEPORT باز می‌کند تا kernel اتصال‌ها را بین هسته‌ها پخش کند، و در loop خودش با
+ * accept4(SOCK_NONBLOCK) برای هر اتصال یک task می‌سازد: handler(client, ip). خطای
+ * handler فقط همان اتصال را می‌بندد. والد فقط ناظر است و SIGINT/SIGTERM را به workerها
+ * می‌رساند؛ serve وقتی همه‌ی workerها تمام شدند برمی‌گردد. */
+static const char serve_acceptor[] =
+    "local spawn, sleep, report, srv, handler = ...\n"
+    "while true do\n"
+    "  local c, ip = srv:accept()\n"
+    "  if c then\n"
+    "    spawn(function()\n"
+    "      local ok, err = pcall(handler, c, ip)\n"
+    "      if not ok then report(err) end\n"
+    "      c:close()\n"
+    "    end)\n"
+    "  elseif ip ~= 'timeout' then sleep(0.05) end\n"   /* مثلاً EMFILE: کمی صبر */
+    "end\n";
+
+static int serve_report(lua_State *L) { fprintf(stderr, "netsocket.serve: %s\n", luaL_tolstring(L, 1, NULL)); return 0; }
+
+static int serve_socket(const struct sockaddr_storage *addr, socklen_t len, int backlog) {
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(fd, (const struct sockaddr*)addr, len) < 0 || listen(fd, backlog) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+/* بعد از fork: epoll و ring والد نباید مشترک بمانند */
+static void reactor_after_fork(lua_State *L) {
+    reactor_t *r = reactor_get(L, 0);
+    if (!r) return;
+    if (r->epfd >= 0) close(r->epfd);
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    uring_free(r->ring); r->ring = uring_new();
+    r->nready = r->rhead = r->nw = r->nheap = r->live = 0; r->wfree = -1;
+}
+
+/* l_loop و 6 آرگومانش (acceptor و ورودی‌هایش) را روی استک می‌گذارد */
+static int serve_prepare(lua_State *L, const struct sockaddr_storage *addr, socklen_t len, int backlog, int timeout, int handler) {
+    int fd = serve_socket(addr, len, backlog);
+    if (fd < 0) return -1;
+    lua_pushcfunction(L, l_loop);
+    if (luaL_loadbuffer(L, serve_acceptor, sizeof(serve_acceptor) - 1, "=netsocket.serve") != LUA_OK) { close(fd); return -1; }
+    lua_pushcfunction(L, l_spawn); lua_pushcfunction(L, l_sleep); lua_pushcfunction(L, serve_report);
+    tcp_t *t = lua_newuserdata(L, sizeof(tcp_t)); memset(t, 0, sizeof(tcp_t));
+    t->fd = fd; t->is_server = 1; t->nb = 1; t->timeout = timeout;
+    luaL_getmetatable(L, "tcp"); lua_setmetatable(L, -2);
+    lua_pushvalue(L, handler);
+    return 0;
+}
+
+static volatile sig_atomic_t serve_stop = 0;
+static void serve_on_signal(int sig) { serve_stop = sig; }
+
+static int l_serve(lua_State *L) {
+    const char *host = luaL_optstring(L, 1, "0.0.0.0");
+    int port = luaL_checkinteger(L, 2);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    int workers = 1, backlog = SOMAXCONN, timeout = 0;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "workers"); workers = luaL_optinteger(L, -1, 1); lua_pop(L, 1);
+        lua_getfield(L, 4, "backlog"); backlog = luaL_optinteger(L, -1, SOMAXCONN); lua_pop(L, 1);
+        lua_getfield(L, 4, "timeout"); timeout = luaL_optinteger(L, -1, 0); lua_pop(L, 1);
+    }
+    reactor_t *r = reactor_get(L, 0);
+    if (r && r->current) return luaL_error(L, "serve() cannot run inside a loop task");
+    struct sockaddr_storage addr;
+    int alen = resolve_addr(host, port, AF_UNSPEC, DEFAULT_TIMEOUT, &addr);
+    if (alen < 0) { push_error(L, "dns error"); return 2; }
+    /* یک bind آزمایشی تا خطا (پورت اشغال، دسترسی) در همین فرایند برگردد */
+    int probe = serve_socket(&addr, alen, backlog);
+    if (probe < 0) { push_error(L, "bind failed"); return 2; }
+    close(probe);
+
+    if (workers <= 1) {
+        if (serve_prepare(L, &addr, alen, backlog, timeout, 3) < 0) { push_error(L, "bind failed"); return 2; }
+        lua_call(L, 6, 0);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    if (!pids) return luaL_error(L, "memory");
+    struct sigaction sa, old_int, old_term;
+    memset(&sa, 0, sizeof(sa)); sa.sa_handler = serve_on_signal; sigemptyset(&sa.sa_mask);
+    serve_stop = 0;
+    sigaction(SIGINT, &sa, &old_int); sigaction(SIGTERM, &sa, &old_term);
+    int alive = 0, failed = 0;
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            sigaction(SIGINT, &old_int, NULL); sigaction(SIGTERM, &old_term, NULL);
+            reactor_after_fork(L);
+            if (serve_prepare(L, &addr, alen, backlog, timeout, 3) < 0) { fprintf(stderr, "netsocket.serve: bind failed\n"); _exit(1); }
+            if (lua_pcall(L, 6, 0, 0) != LUA_OK) { fprintf(stderr, "netsocket.serve: %s\n", lua_tostring(L, -1)); _exit(1); }
+            _exit(0);
+        }
+        if (pid < 0) { failed = 1; break; }
+        pids[i] = pid; alive++;
+    }
+    int forwarded = 0;
+    while (alive > 0) {
+        if ((serve_stop || failed) && !forwarded) {
+            for (int i = 0; i < workers; i++) if (pids[i] > 0) kill(pids[i], SIGTERM);
+            forwarded = 1;
+        }
+        int st;
+        pid_t pid = waitpid(-1, &st, 0);
+        if (pid < 0) { if (errno == EINTR) continue; break; }
+        for (int i = 0; i < workers; i++) if (pids[i] == pid) { pids[i] = 0; alive--; if (!WIFEXITED(st) || WEXITSTATUS(st)) failed = failed || !serve_stop; }
+    }
+    sigaction(SIGINT, &old_int, NULL); sigaction(SIGTERM, &old_term, NULL);
+    free(pids);
+    if (failed) { push_error(L, "worker failed"); return 2; }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /* ========== Raw Socket ========== */
 static int l_raw_socket(lua_State *L) {
     int family = luaL_optinteger(L, 1, AF_PACKET);
@@ -189,21 +1467,39 @@ static int l_arp_spoof(lua_State *L) {
 }
 
 /* ========== توابع سراسری ========== */
-static int l_dns(lua_State *L) { const char *h=luaL_checkstring(L,1); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; if(getaddrinfo(h,NULL,&hints,&res)){push_error(L,"dns error");return 2;} char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&((struct sockaddr_in*)res->ai_addr)->sin_addr,ip,sizeof(ip)); freeaddrinfo(res); lua_pushstring(L,ip); return 1; }
-static int l_dns_all(lua_State *L) { const char *h=luaL_checkstring(L,1); struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; if(getaddrinfo(h,NULL,&hints,&res)){push_error(L,"dns error");return 2;} lua_newtable(L); int i=1; for(struct addrinfo *r=res;r;r=r->ai_next){char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&((struct sockaddr_in*)r->ai_addr)->sin_addr,ip,sizeof(ip)); lua_pushstring(L,ip); lua_rawseti(L,-2,i++);} freeaddrinfo(res); return 1; }
-static int l_reverse_dns(lua_State *L) { const char *ip=luaL_checkstring(L,1); struct sockaddr_in sa; sa.sin_family=AF_INET; inet_pton(AF_INET,ip,&sa.sin_addr); char host[NI_MAXHOST]; if(getnameinfo((struct sockaddr*)&sa,sizeof(sa),host,sizeof(host),NULL,0,0)!=0){push_error(L,"reverse dns error");return 2;} lua_pushstring(L,host); return 1; }
-static int l_scan(lua_State *L) { const char *h=luaL_checkstring(L,1); luaL_checktype(L,2,LUA_TTABLE); lua_newtable(L); int idx=1,port; lua_pushnil(L); while(lua_next(L,2)){port=lua_tointeger(L,-1); int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0){lua_pop(L,1);continue;} struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port); inet_pton(AF_INET,h,&addr.sin_addr); set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,sizeof(addr)); if(ret<0&&errno!=EINPROGRESS){close(fd);lua_pop(L,1);continue;} if(errno==EINPROGRESS&&wait_connect(fd,1)<0){close(fd);lua_pop(L,1);continue;} lua_pushinteger(L,port); lua_rawseti(L,-3,idx++); close(fd); lua_pop(L,1);} return 1; }
-static int l_scan_range(lua_State *L) { const char *h=luaL_checkstring(L,1); int s=luaL_checkinteger(L,2),e=luaL_checkinteger(L,3); lua_newtable(L); int idx=1; for(int p=s;p<=e;p++){int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0)continue; struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(p); inet_pton(AF_INET,h,&addr.sin_addr); set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,sizeof(addr)); if(ret<0&&errno!=EINPROGRESS){close(fd);continue;} if(errno==EINPROGRESS&&wait_connect(fd,1)<0){close(fd);continue;} lua_pushinteger(L,p); lua_rawseti(L,-2,idx++); close(fd);} return 1; }
-static int l_http(lua_State *L) { const char *url=luaL_checkstring(L,1); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0){push_error(L,"socket error");return 2;} struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port); struct hostent *he=gethostbyname(host); if(!he){close(fd);push_error(L,"dns error");return 2;} memcpy(&addr.sin_addr,he->h_addr_list[0],he->h_length); set_sock_timeout(fd,5); if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0){close(fd);push_error(L,"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); char buf[MAX_BUF]; int n=recv(fd,buf,sizeof(buf)-1,0); close(fd); if(n<=0){push_error(L,"no response");return 2;} buf[n]='\0'; char *body=strstr(buf,"\r\n\r\n"); body=body?body+4:""; int code=0; sscanf(buf,"HTTP/1.%*d %d",&code); lua_pushstring(L,body); lua_pushinteger(L,code); return 2; }
-static int l_headers(lua_State *L) { const char *url=luaL_checkstring(L,1); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0){push_error(L,"socket error");return 2;} struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port); struct hostent *he=gethostbyname(host); if(!he){close(fd);push_error(L,"dns error");return 2;} memcpy(&addr.sin_addr,he->h_addr_list[0],he->h_length); set_sock_timeout(fd,5); if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0){close(fd);push_error(L,"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"HEAD /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); char buf[8192]; int n=recv(fd,buf,sizeof(buf)-1,0); close(fd); if(n<=0){push_error(L,"no response");return 2;} buf[n]='\0'; lua_newtable(L); char *line=strtok(buf,"\r\n"); while(line){char *colon=strchr(line,':'); if(colon){*colon='\0'; lua_pushstring(L,line); while(*(++colon)==' '); lua_pushstring(L,colon); lua_settable(L,-3);} line=strtok(NULL,"\r\n");} return 1; }
-static int l_download(lua_State *L) { const char *url=luaL_checkstring(L,1),*sp=luaL_checkstring(L,2); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0){push_error(L,"socket error");return 2;} struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port); struct hostent *he=gethostbyname(host); if(!he){close(fd);push_error(L,"dns error");return 2;} memcpy(&addr.sin_addr,he->h_addr_list[0],he->h_length); set_sock_timeout(fd,10); if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0){close(fd);push_error(L,"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); FILE *fp=fopen(sp,"wb"); if(!fp){close(fd);push_error(L,"file error");return 2;} char buf[8192]; int n,hd=0; while((n=recv(fd,buf,sizeof(buf),0))>0){if(!hd){char *end=strstr(buf,"\r\n\r\n"); if(end){hd=1; int hl=end-buf+4; fwrite(end+4,1,n-hl,fp);}} else fwrite(buf,1,n,fp);} fclose(fp); close(fd); lua_pushboolean(L,1); return 1; }
+/* dns(host [, family]) → اولین IP؛ dns_all → آرایه‌ی همه (ctx 1). داخل loop yield می‌کند */
+static int l_dns_k(lua_State *L, int status, lua_KContext ctx) {
+    ResAddrs ra;
+    if (ns_resolve(L, 3, status, lua_tostring(L, 1), 0, (int)lua_tointeger(L, 2), DEFAULT_TIMEOUT, &ra, ctx, l_dns_k) < 0) { push_error(L, "dns error"); return 2; }
+    if (ctx) lua_createtable(L, ra.n, 0);
+    for (int i = 0; i < (ctx ? ra.n : 1); i++) {
+        char ip[INET6_ADDRSTRLEN]; resolver_ntop(&ra.addr[i], ip, sizeof(ip)); lua_pushstring(L, ip);
+        if (ctx) lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+static int dns_start(lua_State *L, lua_KContext all) {
+    luaL_checkstring(L, 1);
+    lua_Integer family = luaL_optinteger(L, 2, AF_UNSPEC);
+    lua_settop(L, 1); lua_pushinteger(L, family);
+    return l_dns_k(L, LUA_OK, all);
+}
+static int l_dns(lua_State *L) { return dns_start(L, 0); }
+static int l_dns_all(lua_State *L) { return dns_start(L, 1); }
+static int l_dns_flush(lua_State *L) { (void)L; resolver_flush(); return 0; }
+static int l_reverse_dns(lua_State *L) { const char *ip=luaL_checkstring(L,1); struct sockaddr_storage sa; memset(&sa,0,sizeof(sa)); socklen_t sl; if(inet_pton(AF_INET6,ip,&((struct sockaddr_in6*)&sa)->sin6_addr)==1){sa.ss_family=AF_INET6; sl=sizeof(struct sockaddr_in6);} else if(inet_pton(AF_INET,ip,&((struct sockaddr_in*)&sa)->sin_addr)==1){sa.ss_family=AF_INET; sl=sizeof(struct sockaddr_in);} else {push_error(L,"invalid ip");return 2;} char host[NI_MAXHOST]; if(getnameinfo((struct sockaddr*)&sa,sl,host,sizeof(host),NULL,0,0)!=0){push_error(L,"reverse dns error");return 2;} lua_pushstring(L,host); return 1; }
+static int l_scan(lua_State *L) { const char *h=luaL_checkstring(L,1); luaL_checktype(L,2,LUA_TTABLE); struct sockaddr_storage addr; int alen=resolve_addr(h,0,AF_UNSPEC,DEFAULT_TIMEOUT,&addr); if(alen<0){push_error(L,"dns error");return 2;} lua_newtable(L); int idx=1,port; lua_pushnil(L); while(lua_next(L,2)){port=lua_tointeger(L,-1); int fd=socket(addr.ss_family,SOCK_STREAM,0); if(fd<0){lua_pop(L,1);continue;} ((struct sockaddr_in*)&addr)->sin_port=htons(port); set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,alen); if(ret<0&&errno!=EINPROGRESS){close(fd);lua_pop(L,1);continue;} if(errno==EINPROGRESS&&wait_connect(fd,1)<0){close(fd);lua_pop(L,1);continue;} lua_pushinteger(L,port); lua_rawseti(L,-3,idx++); close(fd); lua_pop(L,1);} return 1; }
+static int l_scan_range(lua_State *L) { const char *h=luaL_checkstring(L,1); int s=luaL_checkinteger(L,2),e=luaL_checkinteger(L,3); struct sockaddr_storage addr; int alen=resolve_addr(h,0,AF_UNSPEC,DEFAULT_TIMEOUT,&addr); if(alen<0){push_error(L,"dns error");return 2;} lua_newtable(L); int idx=1; for(int p=s;p<=e;p++){int fd=socket(addr.ss_family,SOCK_STREAM,0); if(fd<0)continue; ((struct sockaddr_in*)&addr)->sin_port=htons(p); set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,alen); if(ret<0&&errno!=EINPROGRESS){close(fd);continue;} if(errno==EINPROGRESS&&wait_connect(fd,1)<0){close(fd);continue;} lua_pushinteger(L,p); lua_rawseti(L,-2,idx++); close(fd);} return 1; }
+static int l_http(lua_State *L) { const char *url=luaL_checkstring(L,1); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=connect_host(host,port,5); if(fd<0){push_error(L,fd==-2?"dns error":"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); char buf[MAX_BUF]; int n=recv(fd,buf,sizeof(buf)-1,0); close(fd); if(n<=0){push_error(L,"no response");return 2;} buf[n]='\0'; char *body=strstr(buf,"\r\n\r\n"); body=body?body+4:""; int code=0; sscanf(buf,"HTTP/1.%*d %d",&code); lua_pushstring(L,body); lua_pushinteger(L,code); return 2; }
+static int l_headers(lua_State *L) { const char *url=luaL_checkstring(L,1); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=connect_host(host,port,5); if(fd<0){push_error(L,fd==-2?"dns error":"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"HEAD /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); char buf[8192]; int n=recv(fd,buf,sizeof(buf)-1,0); close(fd); if(n<=0){push_error(L,"no response");return 2;} buf[n]='\0'; lua_newtable(L); char *line=strtok(buf,"\r\n"); while(line){char *colon=strchr(line,':'); if(colon){*colon='\0'; lua_pushstring(L,line); while(*(++colon)==' '); lua_pushstring(L,colon); lua_settable(L,-3);} line=strtok(NULL,"\r\n");} return 1; }
+static int l_download(lua_State *L) { const char *url=luaL_checkstring(L,1),*sp=luaL_checkstring(L,2); char host[256]={0},path[1024]="/"; int port=80; sscanf(url,"http://%255[^:/]:%d/%1023[^\n]",host,&port,path); if(!host[0]) sscanf(url,"http://%255[^/]/%1023[^\n]",host,path); int fd=connect_host(host,port,10); if(fd<0){push_error(L,fd==-2?"dns error":"connect error");return 2;} char req[1024]; snprintf(req,sizeof(req),"GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n",path,host); send(fd,req,strlen(req),0); FILE *fp=fopen(sp,"wb"); if(!fp){close(fd);push_error(L,"file error");return 2;} char buf[8192]; int n,hd=0; while((n=recv(fd,buf,sizeof(buf),0))>0){if(!hd){char *end=strstr(buf,"\r\n\r\n"); if(end){hd=1; int hl=end-buf+4; fwrite(end+4,1,n-hl,fp);}} else fwrite(buf,1,n,fp);} fclose(fp); close(fd); lua_pushboolean(L,1); return 1; }
 static int l_ping(lua_State *L) { const char *h=luaL_checkstring(L,1); int c=luaL_optinteger(L,2,1); char cmd[256]; snprintf(cmd,sizeof(cmd),"ping -c %d -W 2 %s 2>&1",c,h); FILE *fp=popen(cmd,"r"); if(!fp){push_error(L,"ping error");return 2;} char buf[MAX_BUF]; int n=fread(buf,1,sizeof(buf)-1,fp); pclose(fp); buf[n]='\0'; lua_pushstring(L,buf); return 1; }
 static int l_ifconfig(lua_State *L) { struct ifaddrs *ifa,*ifp; if(getifaddrs(&ifp)==-1){push_error(L,"error");return 2;} lua_newtable(L); int i=1; for(ifa=ifp;ifa;ifa=ifa->ifa_next){if(!ifa->ifa_addr||ifa->ifa_addr->sa_family!=AF_INET)continue; lua_newtable(L); lua_pushstring(L,ifa->ifa_name); lua_setfield(L,-2,"name"); char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&((struct sockaddr_in*)ifa->ifa_addr)->sin_addr,ip,sizeof(ip)); lua_pushstring(L,ip); lua_setfield(L,-2,"ip"); if(ifa->ifa_netmask){inet_ntop(AF_INET,&((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr,ip,sizeof(ip)); lua_pushstring(L,ip); lua_setfield(L,-2,"netmask");} lua_rawseti(L,-2,i++);} freeifaddrs(ifp); return 1; }
 static int l_local_ip(lua_State *L) { struct ifaddrs *ifa,*ifp; if(getifaddrs(&ifp)==-1){push_error(L,"error");return 2;} for(ifa=ifp;ifa;ifa=ifa->ifa_next){if(!ifa->ifa_addr||ifa->ifa_addr->sa_family!=AF_INET)continue; if(!strcmp(ifa->ifa_name,"lo"))continue; char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&((struct sockaddr_in*)ifa->ifa_addr)->sin_addr,ip,sizeof(ip)); freeifaddrs(ifp); lua_pushstring(L,ip); return 1;} freeifaddrs(ifp); push_error(L,"no IP"); return 2; }
-static int l_is_ip(lua_State *L) { const char *s=luaL_checkstring(L,1); struct sockaddr_in sa; lua_pushboolean(L,inet_pton(AF_INET,s,&sa.sin_addr)==1); return 1; }
-static int l_is_port_open(lua_State *L) { const char *h=luaL_checkstring(L,1); int p=luaL_checkinteger(L,2); int fd=socket(AF_INET,SOCK_STREAM,0); if(fd<0){lua_pushboolean(L,0);return 1;} struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(p); inet_pton(AF_INET,h,&addr.sin_addr); set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,sizeof(addr)); if(ret<0&&errno!=EINPROGRESS){close(fd);lua_pushboolean(L,0);return 1;} if(errno==EINPROGRESS&&wait_connect(fd,2)<0){close(fd);lua_pushboolean(L,0);return 1;} close(fd); lua_pushboolean(L,1); return 1; }
+static int l_is_ip(lua_State *L) { const char *s=luaL_checkstring(L,1); struct in6_addr a; lua_pushboolean(L,inet_pton(AF_INET,s,&a)==1||inet_pton(AF_INET6,s,&a)==1); return 1; }
+static int l_is_port_open(lua_State *L) { const char *h=luaL_checkstring(L,1); int p=luaL_checkinteger(L,2); struct sockaddr_storage addr; int alen=resolve_addr(h,p,AF_UNSPEC,DEFAULT_TIMEOUT,&addr); if(alen<0){lua_pushboolean(L,0);return 1;} int fd=socket(addr.ss_family,SOCK_STREAM,0); if(fd<0){lua_pushboolean(L,0);return 1;} set_nonblocking(fd); int ret=connect(fd,(struct sockaddr*)&addr,alen); if(ret<0&&errno!=EINPROGRESS){close(fd);lua_pushboolean(L,0);return 1;} if(errno==EINPROGRESS&&wait_connect(fd,2)<0){close(fd);lua_pushboolean(L,0);return 1;} close(fd); lua_pushboolean(L,1); return 1; }
 static int l_gethostname(lua_State *L) { char h[256]; if(gethostname(h,sizeof(h))!=0){push_error(L,"error");return 2;} lua_pushstring(L,h); return 1; }
-static int l_getfqdn(lua_State *L) { const char *n=luaL_optstring(L,1,NULL); if(!n){char h[256]; if(gethostname(h,sizeof(h))!=0){push_error(L,"error");return 2;} n=h;} struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_INET; hints.ai_flags=AI_CANONNAME; if(getaddrinfo(n,NULL,&hints,&res)!=0){push_error(L,"error");return 2;} lua_pushstring(L,res->ai_canonname?res->ai_canonname:n); freeaddrinfo(res); return 1; }
+static int l_getfqdn(lua_State *L) { const char *n=luaL_optstring(L,1,NULL); if(!n){char h[256]; if(gethostname(h,sizeof(h))!=0){push_error(L,"error");return 2;} n=h;} struct addrinfo hints,*res; memset(&hints,0,sizeof(hints)); hints.ai_family=AF_UNSPEC; hints.ai_flags=AI_CANONNAME; if(getaddrinfo(n,NULL,&hints,&res)!=0){push_error(L,"error");return 2;} lua_pushstring(L,res->ai_canonname?res->ai_canonname:n); freeaddrinfo(res); return 1; }
 static int l_getprotobyname(lua_State *L) { const char *n=luaL_checkstring(L,1); struct protoent *pe=getprotobyname(n); if(!pe){push_error(L,"not found");return 2;} lua_pushinteger(L,pe->p_proto); return 1; }
 static int l_getservbyname(lua_State *L) { const char *s=luaL_checkstring(L,1),*p=luaL_optstring(L,2,"tcp"); struct servent *se=getservbyname(s,p); if(!se){push_error(L,"not found");return 2;} lua_pushinteger(L,ntohs(se->s_port)); return 1; }
 static int l_getservbyport(lua_State *L) { int p=luaL_checkinteger(L,1); const char *pr=luaL_optstring(L,2,"tcp"); struct servent *se=getservbyport(htons(p),pr); if(!se){push_error(L,"not found");return 2;} lua_pushstring(L,se->s_name); return 1; }
@@ -226,7 +1522,7 @@ static int udp_constructor(lua_State *L) { udp_t *u=lua_newuserdata(L,sizeof(udp
 
 /* ========== رجیستر ========== */
 static const luaL_Reg lib[] = {
-    {"dns",l_dns},{"dns_all",l_dns_all},{"reverse_dns",l_reverse_dns},
+    {"dns",l_dns},{"dns_all",l_dns_all},{"dns_flush",l_dns_flush},{"reverse_dns",l_reverse_dns},
     {"scan",l_scan},{"scan_range",l_scan_range},
     {"http",l_http},{"headers",l_headers},{"download",l_download},
     {"ping",l_ping},{"ifconfig",l_ifconfig},{"local_ip",l_local_ip},
@@ -239,6 +1535,8 @@ static const luaL_Reg lib[] = {
     {"htonl",l_htonl},{"htons",l_htons},{"ntohl",l_ntohl},{"ntohs",l_ntohs},
     {"if_nameindex",l_if_nameindex},{"if_nametoindex",l_if_nametoindex},
     {"if_indextoname",l_if_indextoname},
+    {"addr",l_addr},
+    {"spawn",l_spawn},{"loop",l_loop},{"sleep",l_sleep},{"serve",l_serve},{"backend",l_backend},
     {"raw_socket",l_raw_socket},{"raw_recv",l_raw_recv},{"raw_send",l_raw_send},
     {"raw_close",l_raw_close},{"raw_bind",l_raw_bind},
     {"arp_spoof",l_arp_spoof},
@@ -252,6 +1550,7 @@ int luaopen_netsocket(lua_State *L) {
     lua_pushcfunction(L,tcp_send); lua_setfield(L,-2,"send");
     lua_pushcfunction(L,tcp_sendall); lua_setfield(L,-2,"sendall");
     lua_pushcfunction(L,tcp_recv); lua_setfield(L,-2,"receive");
+    lua_pushcfunction(L,tcp_recvuntil); lua_setfield(L,-2,"receiveuntil");
     lua_pushcfunction(L,tcp_close); lua_setfield(L,-2,"close");
     lua_pushcfunction(L,tcp_bind); lua_setfield(L,-2,"bind");
     lua_pushcfunction(L,tcp_listen); lua_setfield(L,-2,"listen");
@@ -269,10 +1568,24 @@ int luaopen_netsocket(lua_State *L) {
     lua_pushcfunction(L,tcp_gc); lua_setfield(L,-2,"__gc");
     lua_pop(L,1);
 
+    luaL_newmetatable(L,"netsocket.sendfile");
+    lua_pushcfunction(L,sendfile_gc); lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,"netsocket.eyeballs");
+    lua_pushcfunction(L,eyeballs_gc); lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,"netsocket.dns");
+    lua_pushcfunction(L,dns_gc); lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
     luaL_newmetatable(L,"udp"); lua_pushvalue(L,-1); lua_setfield(L,-2,"__index");
     lua_pushcfunction(L,udp_bind); lua_setfield(L,-2,"bind");
     lua_pushcfunction(L,udp_sendto); lua_setfield(L,-2,"sendto");
     lua_pushcfunction(L,udp_recvfrom); lua_setfield(L,-2,"receivefrom");
+    lua_pushcfunction(L,udp_sendmany); lua_setfield(L,-2,"sendmany");
+    lua_pushcfunction(L,udp_recvmany); lua_setfield(L,-2,"recvmany");
     lua_pushcfunction(L,udp_close); lua_setfield(L,-2,"close");
     lua_pushcfunction(L,udp_settimeout); lua_setfield(L,-2,"settimeout");
     lua_pushcfunction(L,udp_getsockname); lua_setfield(L,-2,"getsockname");
@@ -283,6 +1596,13 @@ int luaopen_netsocket(lua_State *L) {
     lua_pushcfunction(L,udp_gc); lua_setfield(L,-2,"__gc");
     lua_pop(L,1);
 
+    luaL_newmetatable(L,"sockaddr"); lua_pushvalue(L,-1); lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,addr_getip); lua_setfield(L,-2,"ip");
+    lua_pushcfunction(L,addr_getport); lua_setfield(L,-2,"port");
+    lua_pushcfunction(L,addr_tostring); lua_setfield(L,-2,"__tostring");
+    lua_pushcfunction(L,addr_eq); lua_setfield(L,-2,"__eq");
+    lua_pop(L,1);
+
     luaL_newlib(L, lib);
     lua_pushcfunction(L, tcp_constructor); lua_setfield(L, -2, "tcp");
     lua_pushcfunction(L, udp_constructor); lua_setfield(L, -2, "udp");
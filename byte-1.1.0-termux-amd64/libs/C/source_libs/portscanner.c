@@ -1,4 +1,5 @@
-// gcc -shared -fPIC -I../../../src -o ../portscanner.so portscanner.c \ L../../../src -llua -lm
+// gcc -shared -fPIC -I../../../src -o ../portscanner.so portscanner.c \ L../../../src -llua -lm -lpthread -lssl -lcrypto
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,12 +10,23 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <strings.h>
 
 #include "../../../src/lua.h"
 #include "../../../src/lauxlib.h"
 #include "../../../src/lualib.h"
 
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "resolver.h"
+
 #define DEFAULT_TIMEOUT 1
+#define DEFAULT_WINDOW  1024     /* connectهای هم‌زمان */
+#define MIN_TIMEOUT     0.05     /* کف timeout تطبیقی (ثانیه) */
 
 /*
 =====================================================
@@ -24,9 +36,13 @@ TCP CONNECT SCAN (اصلاح‌شده)
 
 static int connect_scan(const char *host, int port, int timeout) {
     int sock;
-    struct sockaddr_in addr;
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Resolve host (cached, see resolver.h); IPv4 or IPv6
+    ResAddrs ra;
+    if (resolver_lookup(host, AF_UNSPEC, timeout * 1000, &ra) < 0) return 0;
+    resolver_set_port(&ra, port);
+
+    sock = socket(ra.addr[0].ss_family, SOCK_STREAM, 0);
     if (sock < 0) return 0;
 
     // Set non-blocking
@@ -37,27 +53,8 @@ static int connect_scan(const char *host, int port, int timeout) {
     }
     fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-
-    // Resolve host
-    struct hostent *he = gethostbyname(host);
-    if (!he) {
-        close(sock);
-        return 0;
-    }
-
-    struct in_addr **addr_list = (struct in_addr **)he->h_addr_list;
-    if (!addr_list[0]) {
-        close(sock);
-        return 0;
-    }
-
-    addr.sin_addr = *addr_list[0];
-
     // Connect (non-blocking)
-    int result = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+    int result = connect(sock, (struct sockaddr*)&ra.addr[0], ra.len[0]);
 
     if (result < 0) {
         if (errno != EINPROGRESS) {
@@ -201,7 +198,201 @@ static const char* detect_service(int port) {
 
 /*
 =====================================================
-portscanner.scan(host, start_port, end_port, timeout?)
+CONNECT ENGINE (epoll)
+=====================================================
+یک پنجره از connectهای non-blocking هم‌زمان در epoll؛ هر probe مهلت خودش را دارد.
+مهلت هر host از RTT اندازه‌گیری‌شده (SYN→SYN/ACK یا RST، مثل RFC 6298:
+srtt + 4·rttvar) به دست می‌آید و بین MIN_TIMEOUT و timeout کاربر می‌ماند؛ probeی که با
+مهلت کوتاه‌شده بی‌جواب ماند یک بار با timeout کامل دوباره فرستاده می‌شود. کارها بین
+hostها نوبتی پخش می‌شوند و هر host سقف in-flight خودش را دارد.
+*/
+
+enum { PS_OPEN, PS_CLOSED, PS_FILTERED };
+static const char *const ps_state_name[] = { "open", "closed", "filtered" };
+
+typedef struct {
+    struct sockaddr_storage addr; socklen_t alen;
+    char ip[INET6_ADDRSTRLEN];
+    double srtt, rttvar;        /* ثانیه؛ srtt == 0 یعنی هنوز نمونه‌ای نیست */
+    int next;                   /* اندیس پورت بعدی */
+    int inflight;
+} ScanHost;
+
+typedef struct { int fd, host, port, retry; double start, deadline; } Probe;
+typedef struct { int host, port; } Retry;
+
+typedef struct Scanner Scanner;
+typedef void (*ScanResultFn)(Scanner *s, int host, int port, int state, double rtt);
+
+struct Scanner {
+    int epfd;
+    ScanHost *hosts; int nhosts;
+    const int *ports; int nports;
+    Probe *probes; int *freelist; int nfree, window, inflight;
+    int host_cap;               /* سقف in-flight هر host */
+    double timeout;
+    Retry *retry; int nretry, rcap;
+    int rr;                     /* نوبت host بعدی */
+    int active;                 /* hostهایی که هنوز پورت نفرستاده دارند */
+    int stop;                   /* on_result خواست اسکن تمام شود */
+    ScanResultFn on_result; void *ud;
+};
+
+static double scan_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double scan_host_timeout(const Scanner *s, const ScanHost *h) {
+    if (h->srtt <= 0) return s->timeout;
+    double t = h->srtt + 4 * h->rttvar;
+    return t < MIN_TIMEOUT ? MIN_TIMEOUT : t > s->timeout ? s->timeout : t;
+}
+
+static void scan_rtt_sample(ScanHost *h, double rtt) {
+    if (h->srtt <= 0) { h->srtt = rtt; h->rttvar = rtt / 2; return; }
+    double d = h->srtt - rtt;
+    h->rttvar = 0.75 * h->rttvar + 0.25 * (d < 0 ? -d : d);
+    h->srtt = 0.875 * h->srtt + 0.125 * rtt;
+}
+
+/* فضای probeها: window از RLIMIT_NOFILE بیشتر نمی‌شود */
+static int scan_init(Scanner *s, int window) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)window + 64 > rl.rlim_cur)
+        window = rl.rlim_cur > 128 ? (int)rl.rlim_cur - 64 : 64;
+    if (window < 1) window = 1;
+    s->window = window;
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    s->probes = malloc(sizeof(Probe) * window);
+    s->freelist = malloc(sizeof(int) * window);
+    if (s->epfd < 0 || !s->probes || !s->freelist) return -1;
+    for (int i = 0; i < window; i++) { s->freelist[i] = window - 1 - i; s->probes[i].fd = -1; }
+    s->nfree = window;
+    if (s->host_cap <= 0 || s->host_cap > window) s->host_cap = window;
+    s->active = s->nports > 0 ? s->nhosts : 0;
+    return 0;
+}
+
+static void scan_free(Scanner *s) {
+    for (int i = 0; s->probes && i < s->window; i++) if (s->probes[i].fd >= 0) close(s->probes[i].fd);
+    if (s->epfd >= 0) close(s->epfd);
+    free(s->probes); free(s->freelist); free(s->retry);
+    s->epfd = -1; s->probes = NULL; s->freelist = NULL; s->retry = NULL;
+}
+
+static void scan_requeue(Scanner *s, int host, int port) {
+    if (s->nretry == s->rcap) {
+        int nc = s->rcap ? s->rcap * 2 : 64;
+        Retry *r = realloc(s->retry, sizeof(Retry) * nc);
+        if (!r) { s->on_result(s, host, port, PS_FILTERED, 0); return; }
+        s->retry = r; s->rcap = nc;
+    }
+    s->retry[s->nretry++] = (Retry){ host, port };
+}
+
+/* probe تمام شد: fd بسته، نتیجه تحویل (یا برای تلاش دوباره در صف) */
+static void scan_finish(Scanner *s, int slot, int state, double now) {
+    Probe *p = &s->probes[slot];
+    ScanHost *h = &s->hosts[p->host];
+    double rtt = now - p->start;
+    close(p->fd); p->fd = -1;
+    s->freelist[s->nfree++] = slot; s->inflight--; h->inflight--;
+    if (state != PS_FILTERED) scan_rtt_sample(h, rtt);
+    else if (!p->retry && p->deadline - p->start < s->timeout - 1e-6) { scan_requeue(s, p->host, -1 - p->port); return; }
+    s->on_result(s, p->host, p->port, state, state == PS_FILTERED ? 0 : rtt);
+}
+
+/* کار بعدی: اول تلاش‌های دوباره، بعد پورت بعدی hostها به نوبت. port < 0 یعنی retry */
+static int scan_next(Scanner *s, int *host, int *port) {
+    for (int i = 0; i < s->nretry; i++) {
+        if (s->hosts[s->retry[i].host].inflight >= s->host_cap) continue;
+        *host = s->retry[i].host; *port = s->retry[i].port;
+        s->retry[i] = s->retry[--s->nretry];
+        return 1;
+    }
+    for (int k = 0; s->active && k < s->nhosts; k++) {
+        int hi = (s->rr + k) % s->nhosts;
+        ScanHost *h = &s->hosts[hi];
+        if (h->next >= s->nports || h->inflight >= s->host_cap) continue;
+        *host = hi; *port = s->ports[h->next++];
+        if (h->next == s->nports) s->active--;
+        s->rr = (hi + 1) % s->nhosts;
+        return 1;
+    }
+    return 0;
+}
+
+/* 1 در جریان، 0 نتیجه همان لحظه معلوم شد، -1 fd تمام شد (کار به صف برمی‌گردد) */
+static int scan_start(Scanner *s, int host, int port, double now) {
+    int retry = port < 0;
+    if (retry) port = -1 - port;
+    ScanHost *h = &s->hosts[host];
+    int fd = socket(h->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        if (s->inflight && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) { scan_requeue(s, host, retry ? -1 - port : port); return -1; }
+        s->on_result(s, host, port, PS_FILTERED, 0);
+        return 0;
+    }
+    struct linger lg = { 1, 0 };            /* بستن با RST: بدون TIME_WAIT برای هزاران پورت */
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    struct sockaddr_storage a = h->addr;
+    ((struct sockaddr_in *)&a)->sin_port = htons(port);   /* sin_port و sin6_port هم‌جا هستند */
+    int slot = s->freelist[--s->nfree];
+    Probe *p = &s->probes[slot];
+    *p = (Probe){ fd, host, port, retry, now, now + (retry ? s->timeout : scan_host_timeout(s, h)) };
+    s->inflight++; h->inflight++;
+    if (connect(fd, (struct sockaddr *)&a, h->alen) == 0) { scan_finish(s, slot, PS_OPEN, now); return 0; }
+    if (errno != EINPROGRESS) { scan_finish(s, slot, errno == ECONNREFUSED ? PS_CLOSED : PS_FILTERED, now); return 0; }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = (uint32_t)slot };
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) { scan_finish(s, slot, PS_FILTERED, now); return 0; }
+    return 1;
+}
+
+static void scan_run(Scanner *s) {
+    struct epoll_event ev[256];
+    while (!s->stop) {
+        double now = scan_now();
+        int host, port;
+        while (!s->stop && s->nfree > 0 && scan_next(s, &host, &port))
+            if (scan_start(s, host, port, now) < 0) break;
+        if (s->inflight == 0) break;       /* با inflight صفر سقف host مانع نیست، پس کاری نمانده */
+        /* مهلت‌های تمام‌شده؛ هم‌زمان نزدیک‌ترین deadline بعدی برای epoll_wait */
+        double next = now + 1;
+        int expired = 0;
+        for (int i = 0; i < s->window && !s->stop; i++) {
+            Probe *p = &s->probes[i];
+            if (p->fd < 0) continue;
+            if (p->deadline <= now) { scan_finish(s, i, PS_FILTERED, now); expired++; }
+            else if (p->deadline < next) next = p->deadline;
+        }
+        if (expired) continue;             /* خانه‌های آزادشده را قبل از انتظار پر کن */
+        int n = epoll_wait(s->epfd, ev, 256, (int)((next - now) * 1000) + 1);
+        now = scan_now();
+        for (int i = 0; i < n && !s->stop; i++) {
+            int slot = (int)ev[i].data.u32;
+            int err = 0; socklen_t len = sizeof(err);
+            getsockopt(s->probes[slot].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            scan_finish(s, slot, err == 0 ? PS_OPEN : err == ECONNREFUSED ? PS_CLOSED : PS_FILTERED, now);
+        }
+    }
+}
+
+/* نتیجه‌ها به ترتیب پورت در آرایه‌ی یک host (برای scan) */
+typedef struct { unsigned char *state; float *rtt; int base; } ScanByPort;
+
+static void scan_store(Scanner *s, int host, int port, int state, double rtt) {
+    (void)host;
+    ScanByPort *b = s->ud;
+    b->state[port - b->base] = (unsigned char)state;
+    b->rtt[port - b->base] = (float)rtt;
+}
+
+/*
+=====================================================
+portscanner.scan(host, start_port, end_port [, timeout | opts])
+opts: timeout (ثانیه، 1)، concurrency (1024)، all (closed/filtered هم)، quiet (بدون چاپ)
 =====================================================
 */
 
@@ -209,44 +400,696 @@ static int l_scan(lua_State *L) {
     const char *host = luaL_checkstring(L, 1);
     int start = luaL_checkinteger(L, 2);
     int end = luaL_checkinteger(L, 3);
-    int timeout = luaL_optinteger(L, 4, DEFAULT_TIMEOUT);
+    double timeout = DEFAULT_TIMEOUT;
+    int window = DEFAULT_WINDOW, all = 0, quiet = 0;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "timeout"); timeout = luaL_optnumber(L, -1, DEFAULT_TIMEOUT); lua_pop(L, 1);
+        lua_getfield(L, 4, "concurrency"); window = (int)luaL_optinteger(L, -1, DEFAULT_WINDOW); lua_pop(L, 1);
+        lua_getfield(L, 4, "all"); all = lua_toboolean(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 4, "quiet"); quiet = lua_toboolean(L, -1); lua_pop(L, 1);
+    } else timeout = luaL_optnumber(L, 4, DEFAULT_TIMEOUT);
+    if (start < 1) start = 1;
+    if (end > 65535) end = 65535;
+    if (timeout <= 0) timeout = DEFAULT_TIMEOUT;
 
     lua_newtable(L);
-    int idx = 1;
+    if (end < start) return 1;
 
-    printf("\n[*] Scanning %s (ports %d-%d)...\n\n", host, start, end);
+    // Resolve host once (cached, see resolver.h)
+    ResAddrs ra;
+    if (resolver_lookup(host, AF_UNSPEC, (int)(timeout * 1000) + 1000, &ra) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "dns error");
+        return 2;
+    }
 
-    for (int port = start; port <= end; port++) {
-        if (connect_scan(host, port, timeout)) {
-            // Push index
-            lua_pushinteger(L, idx++);
+    int nports = end - start + 1;
+    int *ports = malloc(sizeof(int) * nports);
+    unsigned char *state = malloc(nports);
+    float *rtt = malloc(sizeof(float) * nports);
+    ScanHost h;
+    memset(&h, 0, sizeof(h));
+    h.addr = ra.addr[0]; h.alen = ra.len[0];
+    resolver_ntop(&h.addr, h.ip, sizeof(h.ip));
+    ScanByPort by = { state, rtt, start };
+    Scanner sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.epfd = -1; sc.hosts = &h; sc.nhosts = 1; sc.ports = ports; sc.nports = nports;
+    sc.timeout = timeout; sc.on_result = scan_store; sc.ud = &by;
+    if (!ports || !state || !rtt || scan_init(&sc, window) < 0) {
+        scan_free(&sc); free(ports); free(state); free(rtt);
+        return luaL_error(L, "memory");
+    }
+    for (int i = 0; i < nports; i++) ports[i] = start + i;
+    memset(state, PS_FILTERED, nports);
 
-            // Create result table
-            lua_newtable(L);
+    if (!quiet) printf("\n[*] Scanning %s (ports %d-%d)...\n\n", host, start, end);
+    scan_run(&sc);
+    scan_free(&sc);
+
+    int idx = 1, nopen = 0;
+    for (int i = 0; i < nports; i++) {
+        int port = start + i;
+        if (state[i] == PS_OPEN) {
+            nopen++;
+            if (!quiet) printf("  [OPEN] %d - %s\n", port, detect_service(port));
+        } else if (!all) continue;
+
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, port);                      lua_setfield(L, -2, "port");
+        lua_pushstring(L, detect_service(port));       lua_setfield(L, -2, "service");
+        lua_pushstring(L, ps_state_name[state[i]]);    lua_setfield(L, -2, "state");
+        if (state[i] != PS_FILTERED) { lua_pushnumber(L, rtt[i]); lua_setfield(L, -2, "rtt"); }
+        lua_rawseti(L, -2, idx++);
+    }
+    free(ports); free(state); free(rtt);
+
+    if (!quiet) printf("\n[*] Scan complete. %d ports open.\n", nopen);
+    return 1;
+}
+/*
+=====================================================
+portscanner.scan_hosts(targets, ports [, opts]) → summary | results, summary
+targets: "10.0.0.0/24" ، "host" یا لیستی از این‌ها
+ports:   عدد، لیست، یا رشته مثل "22,80,8000-8100"
+opts:    timeout، concurrency (سقف کل)، per_host (سقف هر host، 16)،
+         on_result = function(r) (برگرداندن false اسکن را متوقف می‌کند)،
+         ndjson = مسیر فایل (هر نتیجه یک خط JSON)، all، verbose (چاپ بازها)
+بدون on_result و ndjson نتیجه‌ها در یک جدول هم برگردانده می‌شوند.
+=====================================================
+*/
+
+#define MAX_HOSTS (1 << 20)
+
+typedef struct {
+    ScanHost *v; int n, cap;
+    int unresolved;
+} HostList;
+
+static int hosts_push(HostList *hl, const struct sockaddr *sa, socklen_t len) {
+    if (hl->n == MAX_HOSTS) return -1;
+    if (hl->n == hl->cap) {
+        int nc = hl->cap ? hl->cap * 2 : 64;
+        ScanHost *v = realloc(hl->v, sizeof(ScanHost) * nc);
+        if (!v) return -1;
+        hl->v = v; hl->cap = nc;
+    }
+    ScanHost *h = &hl->v[hl->n++];
+    memset(h, 0, sizeof(*h));
+    memcpy(&h->addr, sa, len); h->alen = len;
+    resolver_ntop(&h->addr, h->ip, sizeof(h->ip));
+    return 0;
+}
+
+/* "a.b.c.d/n" (بدون network و broadcast وقتی n < 31) یا نام/آدرس تکی (IPv4 یا IPv6) */
+static int hosts_add(HostList *hl, const char *spec, double timeout) {
+    char base[256];
+    const char *slash = strchr(spec, '/');
+    if (slash && (size_t)(slash - spec) < sizeof(base)) {
+        memcpy(base, spec, slash - spec); base[slash - spec] = 0;
+        char *endp; long bits = strtol(slash + 1, &endp, 10);
+        struct in_addr in;
+        if (*endp || bits < 0 || bits > 32 || inet_pton(AF_INET, base, &in) != 1) return -2;
+        if (bits < 12) return -3;                       /* بیش از MAX_HOSTS */
+        uint32_t mask = bits ? 0xffffffffu << (32 - bits) : 0;
+        uint32_t net = ntohl(in.s_addr) & mask, last = net | ~mask;
+        uint32_t lo = net, hi = last;
+        if (bits < 31) { lo++; hi--; }
+        for (uint64_t a = lo; a <= hi; a++) {
+            struct sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET; sin.sin_addr.s_addr = htonl((uint32_t)a);
+            if (hosts_push(hl, (struct sockaddr *)&sin, sizeof(sin)) < 0) return -3;
+        }
+        return 0;
+    }
+    ResAddrs ra;
+    if (resolver_lookup(spec, AF_UNSPEC, (int)(timeout * 1000) + 1000, &ra) < 0) { hl->unresolved++; return 0; }
+    return hosts_push(hl, (struct sockaddr *)&ra.addr[0], ra.len[0]) < 0 ? -3 : 0;
+}
+
+static int ports_push(int **v, int *n, int *cap, long p) {
+    if (p < 1 || p > 65535) return -1;
+    if (*n == *cap) {
+        int nc = *cap ? *cap * 2 : 64;
+        int *nv = realloc(*v, sizeof(int) * nc);
+        if (!nv) return -1;
+        *v = nv; *cap = nc;
+    }
+    (*v)[(*n)++] = (int)p;
+    return 0;
+}
 
-            // port
-            lua_pushstring(L, "port");
-            lua_pushinteger(L, port);
-            lua_settable(L, -3);
+/* "22,80,8000-8100" */
+static int ports_parse(const char *spec, int **v, int *n, int *cap) {
+    const char *p = spec;
+    while (*p) {
+        char *e; long a = strtol(p, &e, 10), b = a;
+        if (e == p) return -1;
+        if (*e == '-') { p = e + 1; b = strtol(p, &e, 10); if (e == p) return -1; }
+        for (long i = a; i <= b; i++) if (ports_push(v, n, cap, i) < 0) return -1;
+        p = e;
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return 0;
+}
 
-            // service
-            lua_pushstring(L, "service");
-            lua_pushstring(L, detect_service(port));
-            lua_settable(L, -3);
+typedef struct {
+    lua_State *L;
+    int cb, results;            /* اندیس روی استک یا 0 */
+    int nres;
+    FILE *nd;
+    int all, verbose;
+    long count[3];
+    int err;                    /* خطای callback روی استک مانده */
+} HostsSink;
 
-            // state
-            lua_pushstring(L, "state");
-            lua_pushstring(L, "open");
-            lua_settable(L, -3);
+static void hosts_result(Scanner *s, int host, int port, int state, double rtt) {
+    HostsSink *k = s->ud;
+    ScanHost *h = &s->hosts[host];
+    if (s->stop) return;
+    k->count[state]++;
+    if (state != PS_OPEN && !k->all) return;
+    if (k->verbose && state == PS_OPEN) printf("  [OPEN] %s:%d - %s\n", h->ip, port, detect_service(port));
+    if (k->nd) {
+        fprintf(k->nd, "{\"host\":\"%s\",\"port\":%d,\"state\":\"%s\",\"service\":\"%s\"", h->ip, port, ps_state_name[state], detect_service(port));
+        if (state != PS_FILTERED) fprintf(k->nd, ",\"rtt\":%.6f", rtt);
+        fputs("}\n", k->nd);
+    }
+    if (!k->cb && !k->results) return;
+    lua_State *L = k->L;
+    if (k->cb) lua_pushvalue(L, k->cb);
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, h->ip);                   lua_setfield(L, -2, "host");
+    lua_pushinteger(L, port);                   lua_setfield(L, -2, "port");
+    lua_pushstring(L, ps_state_name[state]);    lua_setfield(L, -2, "state");
+    lua_pushstring(L, detect_service(port));    lua_setfield(L, -2, "service");
+    if (state != PS_FILTERED) { lua_pushnumber(L, rtt); lua_setfield(L, -2, "rtt"); }
+    if (!k->cb) { lua_rawseti(L, k->results, ++k->nres); return; }
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) { k->err = 1; s->stop = 1; return; }   /* پیام خطا روی استک می‌ماند */
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) s->stop = 1;
+    lua_pop(L, 1);
+}
+
+static int l_scan_hosts(lua_State *L) {
+    double timeout = DEFAULT_TIMEOUT;
+    int window = DEFAULT_WINDOW, per_host = 16;
+    HostsSink k;
+    memset(&k, 0, sizeof(k));
+    k.L = L;
+    const char *ndpath = NULL;
+    lua_settop(L, 3);
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "timeout"); timeout = luaL_optnumber(L, -1, DEFAULT_TIMEOUT); lua_pop(L, 1);
+        lua_getfield(L, 3, "concurrency"); window = (int)luaL_optinteger(L, -1, DEFAULT_WINDOW); lua_pop(L, 1);
+        lua_getfield(L, 3, "per_host"); per_host = (int)luaL_optinteger(L, -1, 16); lua_pop(L, 1);
+        lua_getfield(L, 3, "all"); k.all = lua_toboolean(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "verbose"); k.verbose = lua_toboolean(L, -1); lua_pop(L, 1);
+        lua_getfield(L, 3, "ndjson"); ndpath = lua_tostring(L, -1); lua_pop(L, 1);   /* رشته در opts زنده می‌ماند */
+        lua_getfield(L, 3, "on_result");
+        if (lua_isfunction(L, -1)) k.cb = lua_gettop(L); else lua_pop(L, 1);
+    }
+    if (timeout <= 0) timeout = DEFAULT_TIMEOUT;
 
-            // Insert into results table
-            lua_settable(L, -3);
+    int *ports = NULL, nports = 0, pcap = 0, bad = 0;
+    if (lua_isinteger(L, 2)) bad = ports_push(&ports, &nports, &pcap, lua_tointeger(L, 2));
+    else if (lua_type(L, 2) == LUA_TSTRING) bad = ports_parse(lua_tostring(L, 2), &ports, &nports, &pcap);
+    else if (lua_istable(L, 2)) {
+        lua_Integer n = luaL_len(L, 2);
+        for (lua_Integer i = 1; i <= n && !bad; i++) { lua_rawgeti(L, 2, i); bad = ports_push(&ports, &nports, &pcap, lua_tointeger(L, -1)); lua_pop(L, 1); }
+    } else bad = -1;
+    if (bad) { free(ports); return luaL_argerror(L, 2, "ports: number, list or a \"22,80-90\" string, within 1..65535"); }
 
-            printf("  [OPEN] %d - %s\n", port, detect_service(port));
+    HostList hl;
+    memset(&hl, 0, sizeof(hl));
+    int rc = 0;
+    if (lua_type(L, 1) == LUA_TSTRING) rc = hosts_add(&hl, lua_tostring(L, 1), timeout);
+    else if (lua_istable(L, 1)) {
+        lua_Integer n = luaL_len(L, 1);
+        for (lua_Integer i = 1; i <= n && !rc; i++) {
+            lua_rawgeti(L, 1, i);
+            const char *t = lua_tostring(L, -1);
+            rc = t ? hosts_add(&hl, t, timeout) : -2;
+            lua_pop(L, 1);
         }
+    } else rc = -2;
+    if (rc) { free(ports); free(hl.v); return luaL_argerror(L, 1, rc == -3 ? "too many hosts" : "host, CIDR or list of them"); }
+
+    if (ndpath && !(k.nd = fopen(ndpath, "a"))) { free(ports); free(hl.v); lua_pushnil(L); lua_pushstring(L, "cannot open ndjson file"); return 2; }
+    if (!k.cb && !k.nd) { lua_newtable(L); k.results = lua_gettop(L); }
+
+    Scanner sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.epfd = -1; sc.hosts = hl.v; sc.nhosts = hl.n; sc.ports = ports; sc.nports = nports;
+    sc.timeout = timeout; sc.host_cap = per_host; sc.on_result = hosts_result; sc.ud = &k;
+    double t0 = scan_now();
+    if (scan_init(&sc, window) < 0) {
+        scan_free(&sc); free(ports); free(hl.v); if (k.nd) fclose(k.nd);
+        return luaL_error(L, "memory");
     }
+    if (k.verbose) printf("\n[*] Scanning %d hosts x %d ports...\n\n", hl.n, nports);
+    scan_run(&sc);
+    scan_free(&sc);
+    free(ports);
+    free(hl.v);
+    if (k.nd) fclose(k.nd);
+    if (k.err) return lua_error(L);
 
-    printf("\n[*] Scan complete. %d ports open.\n", idx - 1);
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, hl.n);                   lua_setfield(L, -2, "hosts");
+    lua_pushinteger(L, hl.unresolved);          lua_setfield(L, -2, "unresolved");
+    lua_pushinteger(L, k.count[PS_OPEN]);       lua_setfield(L, -2, "open");
+    lua_pushinteger(L, k.count[PS_CLOSED]);     lua_setfield(L, -2, "closed");
+    lua_pushinteger(L, k.count[PS_FILTERED]);   lua_setfield(L, -2, "filtered");
+    lua_pushboolean(L, sc.stop);                lua_setfield(L, -2, "stopped");
+    lua_pushnumber(L, scan_now() - t0);         lua_setfield(L, -2, "elapsed");
+    if (k.verbose) printf("\n[*] Scan complete. %ld ports open.\n", k.count[PS_OPEN]);
+    if (k.results) { lua_pushvalue(L, k.results); lua_insert(L, -2); return 2; }
+    return 1;
+}
+
+/*
+=====================================================
+portscanner.grab(targets [, opts]) → لیست نتیجه‌ها (به ترتیب ورودی)
+targets: لیست {host=, port=[, probe=]} (مثل خروجی scan_hosts) یا "host:port"
+opts:    timeout (مهلت کل هر probe، 5)، wait (صبر برای banner خودجوش، 2)،
+         concurrency (256)، probe (اجبار نوع برای همه)
+probeها: http (HEAD)، smtp (greeting + EHLO)، tls (handshake، گواهی، بعد HEAD
+یا banner)، banner (خواندن خودجوش؛ اگر ساکت ماند HEAD). همه روی همان epoll،
+بدون thread؛ TLS با OpenSSL non-blocking. DNS هم با eventfd resolver در همان
+epoll منتظر می‌ماند و جزو مهلت probe است (خطای "dns timeout").
+=====================================================
+*/
+
+#define GRAB_BUF     8192
+#define GRAB_WINDOW  256
+
+enum { PK_BANNER, PK_HTTP, PK_SMTP, PK_TLS };
+static const char *const probe_name[] = { "banner", "http", "smtp", "tls" };
+enum { G_CONNECT, G_HANDSHAKE, G_WRITE, G_READ, G_RESOLVE };
+enum { GOAL_LINE, GOAL_HEADERS, GOAL_SMTP };
+
+static int probe_for_port(int port) {
+    switch (port) {
+        case 443: case 465: case 636: case 990: case 993: case 995:
+        case 4443: case 5986: case 6443: case 8443: case 9443:
+            return PK_TLS;
+        case 25: case 587: case 2525:
+            return PK_SMTP;
+        case 80: case 2375: case 3000: case 5000: case 5984: case 7474: case 8000:
+        case 8008: case 8080: case 8081: case 8888: case 9000: case 9090: case 9200:
+            return PK_HTTP;
+        default:
+            return PK_BANNER;
+    }
+}
+
+/* بعد از TLS، روی این پورت‌ها HTTP صحبت می‌شود (بقیه: banner مثل 993/995/465) */
+static int tls_is_http(int port) { return port == 443 || port == 4443 || port == 5986 || port == 6443 || port == 8443 || port == 9443; }
+
+typedef struct {
+    int fd, idx, port, kind, phase, goal, want;
+    int smtp_stage;             /* 0 greeting، 1 جواب EHLO */
+    int head_sent, tls_done;
+    size_t mark;                /* شروع جواب فعلی در buf */
+    double start, connected, deadline, wait, quiet_until;
+    struct sockaddr_storage addr; socklen_t alen;
+    char host[256];
+    SSL *ssl;
+    ResWait *dns;               /* G_RESOLVE: جستجوی در جریان؛ eventfd آن در epoll است */
+    char out[512]; size_t olen, opos;
+    char buf[GRAB_BUF]; size_t blen;
+    const char *err;
+} Grab;
+
+static int grab_ssl_io(Grab *g, int r) {
+    int e = SSL_get_error(g->ssl, r);
+    if (e == SSL_ERROR_WANT_READ) return -1;
+    if (e == SSL_ERROR_WANT_WRITE) return -2;
+    if (e == SSL_ERROR_ZERO_RETURN) return 0;
+    return -3;
+}
+
+/* >0 بایت، 0 EOF، -1 منتظر خواندن، -2 منتظر نوشتن، -3 خطا */
+static int grab_read(Grab *g) {
+    size_t room = sizeof(g->buf) - 1 - g->blen;
+    if (!room) return 0;
+    if (g->ssl) { int r = SSL_read(g->ssl, g->buf + g->blen, (int)room); return r > 0 ? r : grab_ssl_io(g, r); }
+    ssize_t r = recv(g->fd, g->buf + g->blen, room, 0);
+    if (r >= 0) return (int)r;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -1 : -3;
+}
+
+static int grab_write(Grab *g) {
+    if (g->ssl) { int r = SSL_write(g->ssl, g->out + g->opos, (int)(g->olen - g->opos)); return r > 0 ? r : grab_ssl_io(g, r); }
+    ssize_t r = send(g->fd, g->out + g->opos, g->olen - g->opos, MSG_NOSIGNAL);
+    if (r >= 0) return (int)r;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -2 : -3;
+}
+
+static void grab_send(Grab *g, int goal, const char *fmt, const char *arg) {
+    g->olen = (size_t)snprintf(g->out, sizeof(g->out), fmt, arg);
+    if (g->olen >= sizeof(g->out)) g->olen = sizeof(g->out) - 1;
+    g->opos = 0; g->goal = goal; g->mark = g->blen; g->phase = G_WRITE;
+}
+
+static void grab_head(Grab *g) {
+    g->head_sent = 1;
+    grab_send(g, GOAL_HEADERS, "HEAD / HTTP/1.0\r\nHost: %s\r\nUser-Agent: Byte-PortScanner\r\nAccept: */*\r\n\r\n", g->host);
+}
+
+/* بعد از connect (یا handshake): اولین قدم هر نوع probe */
+static void grab_begin(Grab *g, double now) {
+    g->mark = g->blen;
+    if (g->kind == PK_HTTP || (g->kind == PK_TLS && tls_is_http(g->port))) { grab_head(g); return; }
+    g->phase = G_READ;
+    g->goal = g->kind == PK_SMTP ? GOAL_SMTP : GOAL_LINE;
+    if (g->kind != PK_SMTP && g->wait > 0) g->quiet_until = now + g->wait;
+}
+
+/* آیا جواب فعلی (از mark) کامل است؟ */
+static int grab_goal_met(Grab *g) {
+    const char *p = g->buf + g->mark; size_t n = g->blen - g->mark;
+    g->buf[g->blen] = 0;
+    if (g->goal == GOAL_LINE) return memchr(p, '\n', n) != NULL;
+    if (g->goal == GOAL_HEADERS) return strstr(p, "\r\n\r\n") || strstr(p, "\n\n");
+    /* SMTP: خط کامل آخر با "ddd " (نه "ddd-") */
+    if (n < 2 || p[n - 1] != '\n') return 0;
+    size_t b = n - 1;
+    while (b > 0 && p[b - 1] != '\n') b--;
+    return n - 1 - b >= 4 && p[b + 3] == ' ';
+}
+
+/* state machine را تا جایی که بدون انتظار ممکن است جلو می‌برد؛ 0 = تمام، وگرنه EPOLLIN/OUT */
+static int grab_step(Grab *g, SSL_CTX *ctx, double now) {
+    for (;;) {
+        switch (g->phase) {
+        case G_CONNECT: {
+            int err = 0; socklen_t len = sizeof(err);
+            getsockopt(g->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) { g->err = err == ECONNREFUSED ? "refused" : "connect failed"; return 0; }
+            g->connected = now;
+            if (g->kind == PK_TLS) {
+                if (!ctx || !(g->ssl = SSL_new(ctx))) { g->err = "tls error"; return 0; }
+                SSL_set_fd(g->ssl, g->fd);
+                struct in_addr ia;
+                if (inet_pton(AF_INET, g->host, &ia) != 1 && !strchr(g->host, ':')) SSL_set_tlsext_host_name(g->ssl, g->host);
+                SSL_set_connect_state(g->ssl);
+                g->phase = G_HANDSHAKE;
+            } else grab_begin(g, now);
+            break;
+        }
+        case G_HANDSHAKE: {
+            int r = SSL_do_handshake(g->ssl);
+            if (r == 1) { g->tls_done = 1; grab_begin(g, now); break; }
+            int e = grab_ssl_io(g, r);
+            if (e == -1) return EPOLLIN;
+            if (e == -2) return EPOLLOUT;
+            g->err = "tls handshake failed";
+            return 0;
+        }
+        case G_WRITE: {
+            int r = grab_write(g);
+            if (r > 0) { g->opos += r; if (g->opos == g->olen) g->phase = G_READ; break; }
+            if (r == -1) return EPOLLIN;
+            if (r == -2) return EPOLLOUT;
+            g->err = "send failed";
+            return 0;
+        }
+        case G_READ: {
+            int r = grab_read(g);
+            if (r == -1) return EPOLLIN;
+            if (r == -2) return EPOLLOUT;
+            if (r <= 0) { if (r < 0 && g->blen == 0) g->err = "recv failed"; return 0; }
+            g->blen += r;
+            if (!grab_goal_met(g)) break;
+            if (g->goal == GOAL_SMTP && g->smtp_stage == 0) {
+                g->smtp_stage = 1;
+                grab_send(g, GOAL_SMTP, "EHLO %s\r\n", "byte-portscanner.local");
+                break;
+            }
+            return 0;
+        }
+        }
+    }
+}
+
+/* فقط کاراکترهای قابل چاپ، بدون \r\n انتها */
+static void push_clean(lua_State *L, const char *p, size_t n) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (n && (p[n - 1] == '\n' || p[n - 1] == '\r' || p[n - 1] == ' ')) n--;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)p[i];
+        luaL_addchar(&b, (c >= 0x20 && c < 0x7f) || c == '\t' ? (char)c : '.');
+    }
+    luaL_pushresult(&b);
+}
+
+static void push_asn1_time(lua_State *L, const ASN1_TIME *t) {
+    BIO *bio = BIO_new(BIO_s_mem());
+    if (!bio) { lua_pushnil(L); return; }
+    ASN1_TIME_print(bio, t);
+    char *p; long n = BIO_get_mem_data(bio, &p);
+    lua_pushlstring(L, p, (size_t)n);
+    BIO_free(bio);
+}
+
+static void push_tls_info(lua_State *L, SSL *ssl) {
+    lua_createtable(L, 0, 7);
+    lua_pushstring(L, SSL_get_version(ssl));        lua_setfield(L, -2, "version");
+    lua_pushstring(L, SSL_get_cipher_name(ssl));    lua_setfield(L, -2, "cipher");
+    X509 *cert = SSL_get_peer_certificate(ssl);
+    if (!cert) return;
+    char name[512];
+    X509_NAME_oneline(X509_get_subject_name(cert), name, sizeof(name)); lua_pushstring(L, name); lua_setfield(L, -2, "subject");
+    X509_NAME_oneline(X509_get_issuer_name(cert), name, sizeof(name));  lua_pushstring(L, name); lua_setfield(L, -2, "issuer");
+    push_asn1_time(L, X509_get0_notBefore(cert)); lua_setfield(L, -2, "not_before");
+    push_asn1_time(L, X509_get0_notAfter(cert));  lua_setfield(L, -2, "not_after");
+    GENERAL_NAMES *sans = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+    if (sans) {
+        lua_newtable(L);
+        int k = 0;
+        for (int i = 0; i < sk_GENERAL_NAME_num(sans); i++) {
+            const GENERAL_NAME *gn = sk_GENERAL_NAME_value(sans, i);
+            if (gn->type == GEN_DNS) {
+                lua_pushlstring(L, (const char *)ASN1_STRING_get0_data(gn->d.dNSName), ASN1_STRING_length(gn->d.dNSName));
+                lua_rawseti(L, -2, ++k);
+            } else if (gn->type == GEN_IPADD) {
+                char ip[INET6_ADDRSTRLEN]; int len = ASN1_STRING_length(gn->d.iPAddress);
+                if (inet_ntop(len == 16 ? AF_INET6 : AF_INET, ASN1_STRING_get0_data(gn->d.iPAddress), ip, sizeof(ip))) { lua_pushstring(L, ip); lua_rawseti(L, -2, ++k); }
+            }
+        }
+        lua_setfield(L, -2, "san");
+        GENERAL_NAMES_free(sans);
+    }
+    X509_free(cert);
+}
+
+/* جواب HTTP: status و هدر Server */
+static void push_http_fields(lua_State *L, const char *p) {
+    int code;
+    if (sscanf(p, "HTTP/%*d.%*d %d", &code) == 1) { lua_pushinteger(L, code); lua_setfield(L, -2, "status"); }
+    for (const char *l = strchr(p, '\n'); l && l[1]; l = strchr(l + 1, '\n')) {
+        if (strncasecmp(l + 1, "Server:", 7)) continue;
+        const char *v = l + 8; while (*v == ' ') v++;
+        const char *e = v; while (*e && *e != '\r' && *e != '\n') e++;
+        push_clean(L, v, e - v); lua_setfield(L, -2, "product");
+        break;
+    }
+}
+
+/* نتیجه‌ی یک probe را در results[idx] می‌گذارد */
+static void grab_result(lua_State *L, int results, Grab *g) {
+    lua_createtable(L, 0, 10);
+    lua_pushstring(L, g->host);                 lua_setfield(L, -2, "host");
+    lua_pushinteger(L, g->port);                lua_setfield(L, -2, "port");
+    char ip[INET6_ADDRSTRLEN];
+    if (g->addr.ss_family) { lua_pushstring(L, resolver_ntop(&g->addr, ip, sizeof(ip))); lua_setfield(L, -2, "ip"); }
+    lua_pushstring(L, probe_name[g->kind]);     lua_setfield(L, -2, "probe");
+    lua_pushstring(L, detect_service(g->port)); lua_setfield(L, -2, "service");
+    if (g->connected > 0) { lua_pushnumber(L, g->connected - g->start); lua_setfield(L, -2, "rtt"); }
+    if (g->ssl && g->tls_done) { push_tls_info(L, g->ssl); lua_setfield(L, -2, "tls"); }
+    if (g->blen) {
+        g->buf[g->blen] = 0;
+        const char *nl = memchr(g->buf, '\n', g->blen);
+        push_clean(L, g->buf, nl ? (size_t)(nl - g->buf) : g->blen); lua_setfield(L, -2, "banner");
+        lua_pushlstring(L, g->buf, g->blen);    lua_setfield(L, -2, "raw");
+        if (!strncmp(g->buf, "SSH-", 4)) {
+            const char *v = strchr(g->buf + 4, '-');
+            if (v) { const char *e = v + 1; while (*e > ' ') e++; push_clean(L, v + 1, e - v - 1); lua_setfield(L, -2, "product"); }
+        }
+        if (g->head_sent) push_http_fields(L, g->buf + g->mark);
+        if (g->kind == PK_SMTP && g->smtp_stage == 1 && g->mark < g->blen) {
+            lua_newtable(L);
+            int k = 0;
+            for (char *l = g->buf + g->mark; *l; ) {
+                char *e = strchr(l, '\n'); if (!e) break;
+                if (e - l > 4 && !strncmp(l, "250", 3)) {
+                    char *w = l + 4, *we = w; while (we < e && *we > ' ') we++;
+                    if (l != g->buf + g->mark) { lua_pushlstring(L, w, we - w); lua_rawseti(L, -2, ++k); }   /* خط اول سلام است */
+                }
+                l = e + 1;
+            }
+            lua_setfield(L, -2, "extensions");
+        }
+    }
+    if (g->err || !g->blen) { lua_pushstring(L, g->err ? g->err : "no response"); lua_setfield(L, -2, "error"); }
+    lua_rawseti(L, results, g->idx);
+}
+
+static void grab_close(Grab *g) {
+    if (g->dns) { resolver_cancel(g->dns); g->dns = NULL; }
+    if (g->ssl) { SSL_free(g->ssl); g->ssl = NULL; }
+    if (g->fd >= 0) { close(g->fd); g->fd = -1; }
+}
+
+/* ورودی i را به host/port/kind تبدیل می‌کند؛ -1 یعنی نامعتبر */
+static int grab_target(lua_State *L, int i, Grab *g, int force) {
+    const char *host = NULL; int port = 0, kind = force;
+    g->idx = i;
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        const char *t = lua_tostring(L, -1), *c = strrchr(t, ':');
+        if (!c || (size_t)(c - t) >= sizeof(g->host)) return -1;
+        memcpy(g->host, t, c - t); g->host[c - t] = 0;
+        host = g->host; port = atoi(c + 1);
+    } else if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "host"); host = lua_tostring(L, -1);
+        if (host) snprintf(g->host, sizeof(g->host), "%s", host);
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "port"); port = (int)lua_tointeger(L, -1); lua_pop(L, 1);
+        lua_getfield(L, -1, "probe");
+        const char *pn = lua_tostring(L, -1);
+        for (int k = 0; pn && k < 4; k++) if (!strcmp(pn, probe_name[k])) kind = k;
+        lua_pop(L, 1);
+    }
+    if (!host || port < 1 || port > 65535) return -1;
+    g->port = port;
+    g->kind = kind >= 0 ? kind : probe_for_port(port);
+    return 0;
+}
+
+/* خانه‌ی i مشغول است: در حال DNS یا روی سوکت */
+static int grab_busy(const Grab *g) { return g->fd >= 0 || g->dns; }
+
+/* connect غیرمسدود به اولین آدرس و ثبت در epoll؛ -1 با g->err */
+static int grab_connect(Grab *g, int epfd, int i, const ResAddrs *ra) {
+    g->addr = ra->addr[0]; g->alen = ra->len[0];
+    ((struct sockaddr_in *)&g->addr)->sin_port = htons(g->port);
+    g->fd = socket(g->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g->fd < 0) { g->err = "socket failed"; return -1; }
+    g->phase = G_CONNECT;
+    int rc = connect(g->fd, (struct sockaddr *)&g->addr, g->alen);
+    if (rc < 0 && errno != EINPROGRESS) { g->err = errno == ECONNREFUSED ? "refused" : "connect failed"; grab_close(g); return -1; }
+    g->want = EPOLLOUT;
+    struct epoll_event e = { .events = EPOLLOUT, .data.u32 = (uint32_t)i };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, g->fd, &e);
+    return 0;
+}
+
+static int l_grab(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    double timeout = 5, wait = 2;
+    int window = GRAB_WINDOW, force = -1;
+    lua_settop(L, 2);
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "timeout"); timeout = luaL_optnumber(L, -1, 5); lua_pop(L, 1);
+        lua_getfield(L, 2, "wait"); wait = luaL_optnumber(L, -1, 2); lua_pop(L, 1);
+        lua_getfield(L, 2, "concurrency"); window = (int)luaL_optinteger(L, -1, GRAB_WINDOW); lua_pop(L, 1);
+        lua_getfield(L, 2, "probe");
+        const char *pn = lua_tostring(L, -1);
+        for (int k = 0; pn && k < 4; k++) if (!strcmp(pn, probe_name[k])) force = k;
+        if (pn && force < 0) return luaL_argerror(L, 2, "probe: banner, http, smtp or tls");
+        lua_pop(L, 1);
+    }
+    if (window < 1) window = 1;
+    int n = (int)luaL_len(L, 1);
+    lua_createtable(L, n, 0);
+    int results = lua_gettop(L);
+    if (n == 0) return 1;
+    if (window > n) window = n;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx) SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);   /* فهرست‌برداری است، نه اعتماد */
+    Grab *gs = calloc(window, sizeof(Grab));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!gs || epfd < 0) { free(gs); if (epfd >= 0) close(epfd); if (ctx) SSL_CTX_free(ctx); return luaL_error(L, "memory"); }
+    for (int i = 0; i < window; i++) gs[i].fd = -1;
+
+    int next = 1, live = 0;
+    struct epoll_event ev[256];
+    while (next <= n || live) {
+        double now = scan_now();
+        /* خانه‌های خالی را با ورودی‌های بعدی پر کن */
+        for (int i = 0; i < window && next <= n; i++) {
+            Grab *g = &gs[i];
+            if (grab_busy(g)) continue;
+            memset(g, 0, sizeof(*g)); g->fd = -1;
+            lua_rawgeti(L, 1, next);
+            int bad = grab_target(L, next, g, force);
+            lua_pop(L, 1);
+            next++;
+            if (bad) { g->err = "bad target"; grab_result(L, results, g); i--; continue; }
+            g->start = now; g->deadline = now + timeout; g->wait = wait;
+            /* DNS هم رویدادی در همین epoll است تا یک نام کند بقیه‌ی خانه‌ها را نگه ندارد */
+            ResAddrs ra;
+            int rc = resolver_start(g->host, AF_UNSPEC, &ra, &g->dns);
+            if (rc < 0) { g->err = "dns error"; grab_result(L, results, g); i--; continue; }
+            if (rc == 0) {
+                if (grab_connect(g, epfd, i, &ra) < 0) { grab_result(L, results, g); i--; continue; }
+            } else {
+                g->phase = G_RESOLVE;
+                struct epoll_event e = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+                epoll_ctl(epfd, EPOLL_CTL_ADD, g->dns->fd, &e);
+            }
+            live++;
+        }
+        if (!live) continue;
+        /* مهلت‌ها: کل probe، و سکوت banner که به HEAD می‌رسد */
+        double wake = now + 1;
+        for (int i = 0; i < window; i++) {
+            Grab *g = &gs[i];
+            if (!grab_busy(g)) continue;
+            if (now >= g->deadline) {
+                if (!g->blen) g->err = g->phase == G_RESOLVE ? "dns timeout" : g->phase == G_CONNECT ? "timeout" : g->phase == G_HANDSHAKE ? "tls timeout" : "no response";
+                grab_result(L, results, g); grab_close(g); live--;
+                continue;
+            }
+            if (g->phase == G_READ && g->goal == GOAL_LINE && !g->blen && !g->head_sent && g->quiet_until > 0 && now >= g->quiet_until) {
+                grab_head(g);                   /* ساکت ماند: شاید HTTP باشد */
+                struct epoll_event e = { .events = EPOLLOUT, .data.u32 = (uint32_t)i };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, g->fd, &e); g->want = EPOLLOUT;
+            }
+            if (g->deadline < wake) wake = g->deadline;
+            if (g->phase == G_READ && !g->head_sent && g->quiet_until > now && g->quiet_until < wake) wake = g->quiet_until;
+        }
+        if (!live) continue;
+        int k = epoll_wait(epfd, ev, 256, (int)((wake - now) * 1000) + 1);
+        now = scan_now();
+        for (int j = 0; j < k; j++) {
+            Grab *g = &gs[ev[j].data.u32];
+            if (g->phase == G_RESOLVE && g->dns) {
+                ResAddrs ra;
+                int rc = resolver_result(g->dns, &ra);   /* eventfd را می‌بندد و از epoll هم خارج می‌شود */
+                if (rc > 0) continue;
+                g->dns = NULL;
+                if (rc < 0) g->err = "dns error";
+                if (rc < 0 || grab_connect(g, epfd, (int)ev[j].data.u32, &ra) < 0) { grab_result(L, results, g); live--; }
+                continue;
+            }
+            if (g->fd < 0) continue;
+            int want = grab_step(g, ctx, now);
+            if (!want) { grab_result(L, results, g); grab_close(g); live--; continue; }
+            if (want != g->want) {
+                struct epoll_event e = { .events = (uint32_t)want, .data.u32 = ev[j].data.u32 };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, g->fd, &e); g->want = want;
+            }
+        }
+    }
+    close(epfd);
+    free(gs);
+    if (ctx) SSL_CTX_free(ctx);
     return 1;
 }
 
@@ -287,19 +1130,14 @@ portscanner.resolve(host)
 static int l_resolve(lua_State *L) {
     const char *host = luaL_checkstring(L, 1);
 
-    struct hostent *he = gethostbyname(host);
-    if (!he) {
+    ResAddrs ra;
+    if (resolver_lookup(host, AF_UNSPEC, 5000, &ra) < 0) {
         lua_pushnil(L);
         return 1;
     }
 
-    struct in_addr **addr_list = (struct in_addr **)he->h_addr_list;
-    if (addr_list[0]) {
-        lua_pushstring(L, inet_ntoa(*addr_list[0]));
-        return 1;
-    }
-
-    lua_pushnil(L);
+    char ip[INET6_ADDRSTRLEN];
+    lua_pushstring(L, resolver_ntop(&ra.addr[0], ip, sizeof(ip)));
     return 1;
 }
 
@@ -325,6 +1163,8 @@ FUNCTION TABLE
 
 static const luaL_Reg portscannerlib[] = {
     {"scan",    l_scan},
+    {"scan_hosts", l_scan_hosts},
+    {"grab",    l_grab},
     {"isopen",  l_isopen},
     {"service", l_service},
     {"resolve", l_resolve},
@@ -0,0 +1,526 @@
+/*
+ * resolver.h – کش DNS مشترک برای httpx / netsocket / portscanner
+ * IPv4 و IPv6، با رعایت TTL، و جستجوی غیرمسدودکننده روی یک worker pool کوچک
+ *
+ * فقط هدر است و هر .so کش مستقل خودش را دارد. getaddrinfo_a روی Termux
+ * (bionic) وجود ندارد، برای همین جستجو روی چند thread اجرا می‌شود و
+ * فراخواننده فقط تا timeout خودش منتظر می‌ماند. loopهای رویدادی به جای انتظار
+ * مسدودکننده resolver_start را صدا می‌زنند و روی یک eventfd صبر می‌کنند.
+ *
+ * روی glibc (2.34 به بعد) اول /etc/hosts و بعد یک res_search برای هر نوع رکورد
+ * (A و/یا AAAA)؛ آدرس‌ها و TTL از همان پاسخ‌ها خوانده می‌شوند. جاهای دیگر
+ * getaddrinfo با TTL پیش‌فرض.
+ *
+ * نیاز به _GNU_SOURCE (برای dladdr) پیش از اولین include.
+ * لینک: -lpthread (روی glibc قدیمی‌تر از 2.34: -ldl)
+ */
+#ifndef BYTE_RESOLVER_H
+#define BYTE_RESOLVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 34)
+#include <resolv.h>
+#define RES_HAVE_QUERY 1
+#endif
+#endif
+
+#define RES_MAX_ADDRS    8
+#define RES_BUCKETS      256
+#define RES_MAX_ENTRIES  1024
+#define RES_WORKERS      4
+#define RES_DEFAULT_TTL  60
+#define RES_MIN_TTL      5
+#define RES_MAX_TTL      3600
+#define RES_NEG_TTL      5
+
+typedef struct {
+    int n;
+    struct sockaddr_storage addr[RES_MAX_ADDRS];
+    socklen_t len[RES_MAX_ADDRS];
+} ResAddrs;
+
+enum { RES_PENDING, RES_READY, RES_FAILED };
+
+struct ResEntry;
+
+/* یک انتظار غیرمسدودکننده (resolver_start)؛ با پایان جستجو نتیجه کپی و fd خواندنی می‌شود */
+typedef struct ResWait {
+    struct ResWait *next;
+    struct ResEntry *e;          /* NULL وقتی تمام شد */
+    int fd;                      /* eventfd */
+    int state;
+    ResAddrs addrs;
+} ResWait;
+
+typedef struct ResEntry {
+    struct ResEntry *next;       /* زنجیره‌ی bucket */
+    struct ResEntry *qnext;      /* صف workerها */
+    ResWait *waiters;
+    char host[256];
+    int family;
+    int state;
+    double expires, used;
+    ResAddrs addrs;
+} ResEntry;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t done;         /* پایان هر جستجو (broadcast) */
+    pthread_cond_t work;         /* کار جدید در صف */
+    ResEntry *bucket[RES_BUCKETS];
+    ResEntry *qhead, *qtail;
+    int count, workers, atfork;
+} res_cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                { NULL }, NULL, NULL, 0, 0, 0 };
+
+static double res_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned res_hash(const char *host, int family) {
+    unsigned h = 5381 + family;
+    while (*host) h = h * 33 + (unsigned char)(*host++ | 0x20);
+    return h % RES_BUCKETS;
+}
+
+/* آدرس عددی نیازی به DNS و کش ندارد */
+static int res_literal(const char *host, int family, ResAddrs *out) {
+    memset(out, 0, sizeof(*out));
+    if (family != AF_INET6) {
+        struct sockaddr_in *sa = (struct sockaddr_in*)&out->addr[0];
+        if (inet_pton(AF_INET, host, &sa->sin_addr) == 1) {
+            sa->sin_family = AF_INET; out->len[0] = sizeof(*sa); out->n = 1;
+            return 1;
+        }
+    }
+    if (family != AF_INET) {
+        const char *h = host;
+        char tmp[64];
+        size_t hl = strlen(host);
+        if (h[0] == '[' && hl < sizeof(tmp) && host[hl - 1] == ']') {
+            memcpy(tmp, host + 1, hl - 2); tmp[hl - 2] = '\0'; h = tmp;
+        }
+        struct sockaddr_in6 *sa = (struct sockaddr_in6*)&out->addr[0];
+        if (inet_pton(AF_INET6, h, &sa->sin6_addr) == 1) {
+            sa->sin6_family = AF_INET6; out->len[0] = sizeof(*sa); out->n = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifndef RES_HAVE_QUERY
+static int res_getaddrinfo(const char *host, int family, ResAddrs *out) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    if (family == AF_UNSPEC) hints.ai_flags = AI_ADDRCONFIG;
+    memset(out, 0, sizeof(*out));
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    for (struct addrinfo *r = res; r && out->n < RES_MAX_ADDRS; r = r->ai_next) {
+        if (r->ai_family != AF_INET && r->ai_family != AF_INET6) continue;
+        memcpy(&out->addr[out->n], r->ai_addr, r->ai_addrlen);
+        out->len[out->n++] = r->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    return out->n ? 0 : -1;
+}
+#else
+static int res_clamp_ttl(int ttl) {
+    if (ttl < 0) return RES_DEFAULT_TTL;
+    return ttl < RES_MIN_TTL ? RES_MIN_TTL : ttl > RES_MAX_TTL ? RES_MAX_TTL : ttl;
+}
+
+static void res_add(ResAddrs *out, const ResAddrs *one) {
+    if (out->n >= RES_MAX_ADDRS) return;
+    out->addr[out->n] = one->addr[0];
+    out->len[out->n++] = one->len[0];
+}
+
+/* مثل "hosts: files dns" پیش‌فرض nsswitch: نام‌های /etc/hosts به DNS نمی‌روند */
+static int res_hosts_file(const char *host, int family, ResAddrs *out) {
+    memset(out, 0, sizeof(*out));
+    FILE *f = fopen("/etc/hosts", "re");
+    if (!f) return -1;
+    char line[512];
+    while (out->n < RES_MAX_ADDRS && fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#'), *save;
+        if (hash) *hash = '\0';
+        char *addr = strtok_r(line, " \t\r\n", &save);
+        for (char *name; addr && (name = strtok_r(NULL, " \t\r\n", &save)); ) {
+            if (strcasecmp(name, host)) continue;
+            ResAddrs one;
+            if (res_literal(addr, family, &one)) res_add(out, &one);
+            break;
+        }
+    }
+    fclose(f);
+    return out->n ? 0 : -1;
+}
+
+static const unsigned char *res_skip_name(const unsigned char *p, const unsigned char *end) {
+    while (p < end) {
+        if (*p == 0) return p + 1;
+        if ((*p & 0xC0) == 0xC0) return p + 2;
+        p += *p + 1;
+    }
+    return NULL;
+}
+
+/*
+ * رکوردهای type (1 = A، 28 = AAAA) پاسخ خام DNS به out اضافه می‌شوند؛
+ * کمترین TTL همان رکوردها و CNAMEهای زنجیره، یا -1.
+ */
+static int res_parse_answer(const unsigned char *m, int len, int type, ResAddrs *out) {
+    if (len < 12) return -1;
+    const unsigned char *p = m + 12, *end = m + len;
+    int qd = m[4] << 8 | m[5], an = m[6] << 8 | m[7], ttl = -1;
+    while (qd-- > 0 && p) { p = res_skip_name(p, end); if (p) p += 4; }
+    while (an-- > 0 && p) {
+        p = res_skip_name(p, end);
+        if (!p || p + 10 > end) break;
+        int rtype = p[0] << 8 | p[1], rdlen = p[8] << 8 | p[9];
+        int t = (int)((unsigned)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+        const unsigned char *rd = p + 10;
+        if (rd + rdlen > end) break;
+        p = rd + rdlen;
+        if (rtype != type && rtype != 5) continue;
+        if (t >= 0 && (ttl < 0 || t < ttl)) ttl = t;
+        if (out->n >= RES_MAX_ADDRS) continue;
+        if (rtype == 1 && rdlen == 4) {
+            struct sockaddr_in *sa = (struct sockaddr_in*)&out->addr[out->n];
+            memset(sa, 0, sizeof(*sa));
+            sa->sin_family = AF_INET;
+            memcpy(&sa->sin_addr, rd, 4);
+            out->len[out->n++] = sizeof(*sa);
+        } else if (rtype == 28 && rdlen == 16) {
+            struct sockaddr_in6 *sa = (struct sockaddr_in6*)&out->addr[out->n];
+            memset(sa, 0, sizeof(*sa));
+            sa->sin6_family = AF_INET6;
+            memcpy(&sa->sin6_addr, rd, 16);
+            out->len[out->n++] = sizeof(*sa);
+        }
+    }
+    return ttl;
+}
+
+/* یک res_search برای هر نوع؛ *ttl کمترین TTL بین پاسخ‌هایی که آدرس داشتند */
+static int res_dns(const char *host, int family, ResAddrs *out, int *ttl) {
+    unsigned char answer[4096];
+    ResAddrs got[2];
+    int t[2] = { -1, -1 };
+    static const int types[2] = { 28, 1 };
+    memset(got, 0, sizeof(got));
+    for (int i = 0; i < 2; i++) {
+        if (family == (types[i] == 1 ? AF_INET6 : AF_INET)) continue;
+        int n = res_search(host, 1, types[i], answer, sizeof(answer));
+        if (n > (int)sizeof(answer)) n = sizeof(answer);
+        if (n > 0) t[i] = res_parse_answer(answer, n, types[i], &got[i]);
+    }
+    /* یکی‌درمیان تا سقف RES_MAX_ADDRS برای هر دو خانواده جا داشته باشد */
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; out->n < RES_MAX_ADDRS && (i < got[0].n || i < got[1].n); i++)
+        for (int f = 0; f < 2; f++)
+            if (i < got[f].n && out->n < RES_MAX_ADDRS) {
+                out->addr[out->n] = got[f].addr[i];
+                out->len[out->n++] = got[f].len[i];
+            }
+    *ttl = -1;
+    for (int f = 0; f < 2; f++)
+        if (got[f].n && t[f] >= 0 && (*ttl < 0 || t[f] < *ttl)) *ttl = t[f];
+    return out->n ? 0 : -1;
+}
+#endif
+
+/* 0 و *ttl (ثانیه) برای کش؛ -1 اگر نام پیدا نشد */
+static int res_resolve(const char *host, int family, ResAddrs *out, int *ttl) {
+#ifdef RES_HAVE_QUERY
+    if (res_hosts_file(host, family, out) == 0) { *ttl = RES_DEFAULT_TTL; return 0; }
+    int t;
+    if (res_dns(host, family, out, &t) == 0) { *ttl = res_clamp_ttl(t); return 0; }
+#else
+    if (res_getaddrinfo(host, family, out) == 0) { *ttl = RES_DEFAULT_TTL; return 0; }
+#endif
+    *ttl = RES_NEG_TTL;
+    return -1;
+}
+
+static void res_wake(ResEntry *e) {
+    uint64_t one = 1;
+    for (ResWait *w = e->waiters; w; w = w->next) {
+        w->state = e->state;
+        w->addrs = e->addrs;
+        w->e = NULL;
+        if (write(w->fd, &one, sizeof(one)) < 0) { /* شمارنده پر است: همین حالا خواندنی است */ }
+    }
+    e->waiters = NULL;
+}
+
+static void res_finish(ResEntry *e, const ResAddrs *a, int ok, int ttl) {
+    if (ok) e->addrs = *a;
+    e->state = ok ? RES_READY : RES_FAILED;
+    e->expires = res_now() + ttl;
+    res_wake(e);
+    pthread_cond_broadcast(&res_cache.done);
+}
+
+static void *res_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&res_cache.mu);
+    for (;;) {
+        while (!res_cache.qhead) pthread_cond_wait(&res_cache.work, &res_cache.mu);
+        ResEntry *e = res_cache.qhead;
+        res_cache.qhead = e->qnext;
+        if (!res_cache.qhead) res_cache.qtail = NULL;
+        char host[256];
+        int family = e->family;
+        memcpy(host, e->host, sizeof(host));
+        pthread_mutex_unlock(&res_cache.mu);
+
+        ResAddrs a;
+        int ttl, ok = res_resolve(host, family, &a, &ttl) == 0;
+
+        pthread_mutex_lock(&res_cache.mu);
+        res_finish(e, &a, ok, ttl);
+    }
+    return NULL;
+}
+
+/* بعد از fork در فرزند هیچ workerی وجود ندارد */
+static void res_atfork_child(void) {
+    pthread_mutex_init(&res_cache.mu, NULL);
+    pthread_cond_init(&res_cache.done, NULL);
+    pthread_cond_init(&res_cache.work, NULL);
+    res_cache.workers = 0;
+    res_cache.qhead = res_cache.qtail = NULL;
+    for (int i = 0; i < RES_BUCKETS; i++)
+        for (ResEntry *e = res_cache.bucket[i]; e; e = e->next)
+            if (e->state == RES_PENDING) { e->state = RES_FAILED; e->expires = 0; res_wake(e); }
+}
+
+/*
+ * workerها تا پایان پروسه زنده‌اند؛ اگر lua_close ماژول را dlclose کند، کد
+ * آن‌ها از حافظه حذف می‌شود. با RTLD_NODELETE ماژول بارگذاری‌شده می‌ماند.
+ */
+static void res_pin_module(void) {
+    Dl_info info;
+    if (dladdr((void*)res_worker, &info) && info.dli_fname)
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+}
+
+static void res_start_workers(void) {
+    if (!res_cache.atfork) { pthread_atfork(NULL, NULL, res_atfork_child); res_pin_module(); res_cache.atfork = 1; }
+    while (res_cache.workers < RES_WORKERS) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, res_worker, NULL) != 0) break;
+        pthread_detach(t);
+        res_cache.workers++;
+    }
+}
+
+static void res_unlink(ResEntry **pp) {
+    ResEntry *e = *pp;
+    *pp = e->next;
+    free(e);
+    res_cache.count--;
+}
+
+/* جا باز کردن: اول منقضی‌ها، بعد کم‌استفاده‌ترین (هیچ‌وقت pending) */
+static void res_evict(double now) {
+    for (int i = 0; i < RES_BUCKETS; i++)
+        for (ResEntry **pp = &res_cache.bucket[i]; *pp; )
+            if ((*pp)->state != RES_PENDING && (*pp)->expires <= now) res_unlink(pp);
+            else pp = &(*pp)->next;
+    if (res_cache.count < RES_MAX_ENTRIES) return;
+    ResEntry **victim = NULL;
+    for (int i = 0; i < RES_BUCKETS; i++)
+        for (ResEntry **pp = &res_cache.bucket[i]; *pp; pp = &(*pp)->next)
+            if ((*pp)->state != RES_PENDING && (!victim || (*pp)->used < (*victim)->used)) victim = pp;
+    if (victim) res_unlink(victim);
+}
+
+static void res_enqueue(ResEntry *e) {
+    e->state = RES_PENDING;
+    e->qnext = NULL;
+    if (res_cache.qtail) res_cache.qtail->qnext = e; else res_cache.qhead = e;
+    res_cache.qtail = e;
+    pthread_cond_signal(&res_cache.work);
+}
+
+/* e را از صف برمی‌دارد؛ 0 اگر در صف نبود (کسی در حال جستجوی آن است) */
+static int res_dequeue(ResEntry *e) {
+    ResEntry *prev = NULL;
+    for (ResEntry *q = res_cache.qhead; q; prev = q, q = q->qnext) {
+        if (q != e) continue;
+        if (prev) prev->qnext = q->qnext; else res_cache.qhead = q->qnext;
+        if (res_cache.qtail == q) res_cache.qtail = prev;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * زیر قفل: ورودی host را پیدا (یا ساخته و صف) می‌کند و workerها را راه می‌اندازد.
+ * NULL اگر حافظه نبود.
+ */
+static ResEntry *res_acquire(const char *host, int family) {
+    double now = res_now();
+    unsigned h = res_hash(host, family);
+    ResEntry *e = res_cache.bucket[h];
+    while (e && (e->family != family || strcasecmp(e->host, host))) e = e->next;
+    if (!e) {
+        if (res_cache.count >= RES_MAX_ENTRIES) res_evict(now);
+        e = calloc(1, sizeof(ResEntry));
+        if (!e) return NULL;
+        strcpy(e->host, host);
+        e->family = family;
+        e->next = res_cache.bucket[h];
+        res_cache.bucket[h] = e;
+        res_cache.count++;
+        res_enqueue(e);
+    } else if (e->state != RES_PENDING && e->expires <= now) {
+        res_enqueue(e);
+    }
+    e->used = now;
+
+    if (e->state == RES_PENDING) {
+        res_start_workers();
+        if (!res_cache.workers && res_dequeue(e)) {
+            /* thread ساخته نشد: همین‌جا و مسدودکننده؛ بقیه‌ی صف مال فراخوان‌های دیگر است */
+            pthread_mutex_unlock(&res_cache.mu);
+            ResAddrs a;
+            int ttl, ok = res_resolve(host, family, &a, &ttl) == 0;
+            pthread_mutex_lock(&res_cache.mu);
+            res_finish(e, &a, ok, ttl);
+        }
+    }
+    return e;
+}
+
+/*
+ * host را به حداکثر RES_MAX_ADDRS آدرس تبدیل می‌کند (family: AF_INET، AF_INET6
+ * یا AF_UNSPEC). درخواست‌های هم‌زمان برای یک host یکی می‌شوند. 0 موفق، -1 خطا
+ * یا timeout. پورت آدرس‌ها صفر است؛ resolver_set_port را ببینید.
+ */
+static inline int resolver_lookup(const char *host, int family, int timeout_ms, ResAddrs *out) {
+    if (res_literal(host, family, out)) return 0;
+    if (!host[0] || strlen(host) >= sizeof(((ResEntry*)0)->host)) return -1;
+
+    pthread_mutex_lock(&res_cache.mu);
+    ResEntry *e = res_acquire(host, family);
+    if (!e) { int ttl; pthread_mutex_unlock(&res_cache.mu); return res_resolve(host, family, out, &ttl); }
+    if (e->state == RES_PENDING) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        if (timeout_ms <= 0) timeout_ms = 30000;
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+        while (e->state == RES_PENDING)
+            if (pthread_cond_timedwait(&res_cache.done, &res_cache.mu, &until) == ETIMEDOUT) break;
+    }
+
+    int rc = -1;
+    if (e->state == RES_READY) { *out = e->addrs; rc = 0; }
+    pthread_mutex_unlock(&res_cache.mu);
+    return rc;
+}
+
+/*
+ * نسخه‌ی غیرمسدودکننده‌ی resolver_lookup برای loopهای رویدادی. 0 (out پر شد) یا -1
+ * اگر جواب همین حالا معلوم است؛ وگرنه 1 و *wp: روی (*wp)->fd برای خواندن صبر کن و
+ * resolver_result را صدا بزن. timeout با فراخواننده است (resolver_cancel).
+ */
+static inline int resolver_start(const char *host, int family, ResAddrs *out, ResWait **wp) {
+    *wp = NULL;
+    if (res_literal(host, family, out)) return 0;
+    if (!host[0] || strlen(host) >= sizeof(((ResEntry*)0)->host)) return -1;
+    ResWait *w = calloc(1, sizeof(ResWait));
+    if (!w) return -1;
+    w->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->fd < 0) { free(w); return -1; }
+
+    pthread_mutex_lock(&res_cache.mu);
+    ResEntry *e = res_acquire(host, family);
+    int rc = 1;
+    if (!e) rc = -1;
+    else if (e->state == RES_READY) { *out = e->addrs; rc = 0; }
+    else if (e->state == RES_FAILED) rc = -1;
+    else { w->e = e; w->state = RES_PENDING; w->next = e->waiters; e->waiters = w; }
+    pthread_mutex_unlock(&res_cache.mu);
+
+    if (rc != 1) { close(w->fd); free(w); return rc; }
+    *wp = w;
+    return 1;
+}
+
+/* بعد از خواندنی شدن w->fd: 0 یا -1 و w آزاد می‌شود؛ 1 اگر هنوز در جریان است */
+static inline int resolver_result(ResWait *w, ResAddrs *out) {
+    uint64_t v;
+    if (read(w->fd, &v, sizeof(v)) < 0) { /* EAGAIN: بیدار شدن بی‌دلیل */ }
+    pthread_mutex_lock(&res_cache.mu);
+    int state = w->state;
+    pthread_mutex_unlock(&res_cache.mu);
+    if (state == RES_PENDING) return 1;
+    if (state == RES_READY) *out = w->addrs;
+    close(w->fd);
+    free(w);
+    return state == RES_READY ? 0 : -1;
+}
+
+/* انتظار را رها می‌کند (timeout یا task رهاشده)؛ جستجو برای بقیه ادامه دارد */
+static inline void resolver_cancel(ResWait *w) {
+    pthread_mutex_lock(&res_cache.mu);
+    if (w->e)
+        for (ResWait **pp = &w->e->waiters; *pp; pp = &(*pp)->next)
+            if (*pp == w) { *pp = w->next; break; }
+    pthread_mutex_unlock(&res_cache.mu);
+    close(w->fd);
+    free(w);
+}
+
+static inline void resolver_flush(void) {
+    pthread_mutex_lock(&res_cache.mu);
+    for (int i = 0; i < RES_BUCKETS; i++)
+        for (ResEntry **pp = &res_cache.bucket[i]; *pp; )
+            if ((*pp)->state != RES_PENDING) res_unlink(pp);
+            else pp = &(*pp)->next;
+    pthread_mutex_unlock(&res_cache.mu);
+}
+
+static inline void resolver_set_port(ResAddrs *a, int port) {
+    for (int i = 0; i < a->n; i++) {
+        if (a->addr[i].ss_family == AF_INET) ((struct sockaddr_in*)&a->addr[i])->sin_port = htons(port);
+        else ((struct sockaddr_in6*)&a->addr[i])->sin6_port = htons(port);
+    }
+}
+
+static inline int resolver_port(const struct sockaddr_storage *sa) {
+    return ntohs(sa->ss_family == AF_INET6 ? ((const struct sockaddr_in6*)sa)->sin6_port : ((const struct sockaddr_in*)sa)->sin_port);
+}
+
+static inline const char *resolver_ntop(const struct sockaddr_storage *sa, char *buf, size_t len) {
+    if (sa->ss_family == AF_INET6) return inet_ntop(AF_INET6, &((const struct sockaddr_in6*)sa)->sin6_addr, buf, len);
+    return inet_ntop(AF_INET, &((const struct sockaddr_in*)sa)->sin_addr, buf, len);
+}
+
+#endif